@@ -17,6 +17,9 @@
 #include <linux/bpf.h>
 #include <linux/perf_event.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <cstring>
 #include <exception>
@@ -26,6 +29,7 @@
 #include <sstream>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -103,6 +107,7 @@ StatusTuple BPF::init_usdt(const USDT& usdt) {
 
 void BPF::init_fail_reset() {
   usdt_.clear();
+  usdt_pids_.clear();
   all_bpf_program_ = "";
 }
 
@@ -118,6 +123,11 @@ StatusTuple BPF::init(const std::string& bpf_program,
     }
   }
 
+  return load_program(bpf_program, cflags);
+};
+
+StatusTuple BPF::load_program(const std::string& bpf_program,
+                              const std::vector<std::string>& cflags) {
   std::vector<const char*> flags;
   for (const auto& c: cflags)
     flags.push_back(c.c_str());
@@ -131,37 +141,141 @@ StatusTuple BPF::init(const std::string& bpf_program,
   }
 
   return StatusTuple::OK();
-};
+}
+
+std::vector<StatusTuple> BPF::init_parallel(const std::vector<InitArgs>& args,
+                                            unsigned max_threads) {
+  std::vector<StatusTuple> results(args.size(), StatusTuple::OK());
+
+  // USDT probes are set up first, one program after the other, it is the
+  // compiles that take time
+  std::vector<size_t> pending;
+  for (size_t i = 0; i < args.size(); i++) {
+    BPF* bpf = args[i].bpf;
+    bpf->usdt_.reserve(args[i].usdt.size());
+    for (const auto& u : args[i].usdt) {
+      results[i] = bpf->init_usdt(u);
+      if (!results[i].ok()) {
+        bpf->init_fail_reset();
+        break;
+      }
+    }
+    if (results[i].ok())
+      pending.push_back(i);
+  }
+
+  if (max_threads == 0)
+    max_threads = std::max(std::thread::hardware_concurrency(), 1U);
+  size_t nthreads = std::min<size_t>(max_threads, pending.size());
+
+  // Every program is compiled and loaded by exactly one thread, each into
+  // its own module and LLVM context
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < pending.size(); i = next++) {
+      const InitArgs& a = args[pending[i]];
+      results[pending[i]] = a.bpf->load_program(a.program, a.cflags);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < nthreads; i++)
+    threads.emplace_back(worker);
+  worker();
+  for (auto& thread : threads)
+    thread.join();
+
+  return results;
+}
 
 BPF::~BPF() {
-  auto res = detach_all();
+  // Also undoes the semaphore increments of the pids, which detach_all()
+  // doesn't know about
+  auto res = detach_usdt_all();
+  if (!res.ok())
+    std::cerr << "Failed to detach all USDTs on destruction: " << std::endl
+              << res.msg() << std::endl;
+  res = detach_all();
   if (!res.ok())
     std::cerr << "Failed to detach all probes on destruction: " << std::endl
               << res.msg() << std::endl;
   bcc_free_buildsymcache(bsymcache_);
   bsymcache_ = NULL;
+  if (stats_fd_ >= 0)
+    close(stats_fd_);
 }
 
 StatusTuple BPF::detach_all() {
   bool has_error = false;
   std::string error_msg;
 
+  auto start = std::chrono::steady_clock::now();
+  size_t num_probes = kprobes_.size() + uprobes_.size();
+
+  // Close all the probes first, then remove their tracefs events with one
+  // pass over [k,u]probe_events each. Removing them one at a time re-reads
+  // the whole file and takes the kernel's probe mutex for every probe.
+  std::vector<const char*> kprobe_events, uprobe_events;
   for (auto& it : kprobes_) {
-    auto res = detach_kprobe_event(it.first, it.second);
+    bpf_close_perf_event_fd(it.second.perf_event_fd);
+    auto res = unload_func(it.second.func);
     if (!res.ok()) {
       error_msg += "Failed to detach kprobe event " + it.first + ": ";
       error_msg += res.msg() + "\n";
       has_error = true;
     }
+    kprobe_events.push_back(it.first.c_str());
+  }
+
+  // Kernel functions attached through the per-function fallback were closed
+  // along with kprobes_ above, only the links are left.
+  for (auto& it : kprobe_multi_) {
+    if (it.second.link_fd < 0)
+      continue;
+    close(it.second.link_fd);
+    close(it.second.prog_fd);
+    num_probes++;
   }
 
   for (auto& it : uprobes_) {
-    auto res = detach_uprobe_event(it.first, it.second);
+    bpf_close_perf_event_fd(it.second.perf_event_fd);
+    auto res = unload_func(it.second.func);
     if (!res.ok()) {
       error_msg += "Failed to detach uprobe event " + it.first + ": ";
       error_msg += res.msg() + "\n";
       has_error = true;
     }
+    uprobe_events.push_back(it.first.c_str());
+  }
+
+  // As with kprobe_multi_, the fallback uprobes are already closed
+  for (auto& it : uprobe_multi_) {
+    for (int fd : it.second.link_fds)
+      close(fd);
+    if (it.second.prog_fd >= 0)
+      close(it.second.prog_fd);
+    num_probes += it.second.link_fds.size();
+  }
+
+  if (!kprobe_events.empty() &&
+      bpf_detach_kprobes(kprobe_events.data(), kprobe_events.size()) < 0) {
+    error_msg += "Failed to remove kprobe events\n";
+    has_error = true;
+  }
+  if (!uprobe_events.empty() &&
+      bpf_detach_uprobes(uprobe_events.data(), uprobe_events.size()) < 0) {
+    error_msg += "Failed to remove uprobe events\n";
+    has_error = true;
+  }
+  kprobes_.clear();
+  kprobe_multi_.clear();
+  uprobes_.clear();
+  uprobe_multi_.clear();
+
+  if (flag_ & DEBUG_BPF) {
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    fprintf(stderr, "Detached %zu probes in %.3f ms\n", num_probes,
+            elapsed.count());
   }
 
   for (auto& it : tracepoints_) {
@@ -192,6 +306,15 @@ StatusTuple BPF::detach_all() {
     delete it.second;
   }
 
+  // The manager calls back into the batches owned by the rings, free it first
+  if (ringbuf_manager_) {
+    bpf_free_ringbuf(ringbuf_manager_);
+    ringbuf_manager_ = nullptr;
+  }
+  for (auto& it : ring_buffers_)
+    delete it.second;
+  ring_buffers_.clear();
+
   for (auto& it : perf_event_arrays_) {
     auto res = it.second->close_all_cpu();
     if (!res.ok()) {
@@ -255,6 +378,58 @@ StatusTuple BPF::attach_kprobe(const std::string& kernel_func,
   return StatusTuple::OK();
 }
 
+StatusTuple BPF::attach_kprobe_multi(
+    const std::vector<std::string>& kernel_funcs,
+    const std::string& probe_func, bpf_probe_attach_type attach_type) {
+  std::string key = attach_type_prefix(attach_type) + "_" + probe_func;
+  if (kprobe_multi_.find(key) != kprobe_multi_.end())
+    return StatusTuple(-1, "%skprobe_multi for %s already attached",
+                       attach_type_debug(attach_type).c_str(),
+                       probe_func.c_str());
+  if (kernel_funcs.empty())
+    return StatusTuple(-1, "No kernel functions to attach %s to",
+                       probe_func.c_str());
+
+  open_kprobe_multi_t p = {};
+  p.func = probe_func;
+  p.attach_type = attach_type;
+  p.link_fd = -1;
+  p.prog_fd = -1;
+
+  // The program needs its own load, a kprobe_multi link only accepts a
+  // program whose expected_attach_type is BPF_TRACE_KPROBE_MULTI, and newer
+  // kernels don't allow that one on a perf event.
+  if (load_prog(probe_func, BPF_PROG_TYPE_KPROBE, p.prog_fd, 0,
+                BPF_TRACE_KPROBE_MULTI).ok()) {
+    std::vector<const char*> syms;
+    syms.reserve(kernel_funcs.size());
+    for (const auto& f : kernel_funcs)
+      syms.push_back(f.c_str());
+    p.link_fd = bpf_attach_kprobe_multi(p.prog_fd, attach_type, syms.data(),
+                                        syms.size());
+    if (p.link_fd >= 0) {
+      kprobe_multi_[key] = std::move(p);
+      return StatusTuple::OK();
+    }
+    close(p.prog_fd);
+    p.link_fd = p.prog_fd = -1;
+  }
+
+  std::string error_msg;
+  for (const auto& f : kernel_funcs) {
+    auto res = attach_kprobe(f, probe_func, 0, attach_type);
+    if (res.ok())
+      p.fallback_funcs.push_back(f);
+    else
+      error_msg += res.msg() + "\n";
+  }
+  if (p.fallback_funcs.empty())
+    return StatusTuple(-1, error_msg);
+
+  kprobe_multi_[key] = std::move(p);
+  return StatusTuple::OK();
+}
+
 StatusTuple BPF::attach_uprobe(const std::string& binary_path,
                                const std::string& symbol,
                                const std::string& probe_func,
@@ -301,10 +476,134 @@ StatusTuple BPF::attach_uprobe(const std::string& binary_path,
   return StatusTuple::OK();
 }
 
+StatusTuple BPF::attach_uprobe_multi(const std::string& binary_path,
+                                     const std::vector<std::string>& symbols,
+                                     const std::string& probe_func,
+                                     bpf_probe_attach_type attach_type,
+                                     const std::vector<pid_t>& pids) {
+  std::string key =
+      attach_type_prefix(attach_type) + "_" + binary_path + "_" + probe_func;
+  if (uprobe_multi_.find(key) != uprobe_multi_.end())
+    return StatusTuple(-1, "%suprobe_multi for %s in %s already attached",
+                       attach_type_debug(attach_type).c_str(),
+                       probe_func.c_str(), binary_path.c_str());
+  if (symbols.empty())
+    return StatusTuple(-1, "No symbols to attach %s to", probe_func.c_str());
+
+  // binary_path can be a library name, the link goes on the file it resolves
+  // to. Symbols found in different files are attached one by one.
+  std::string module;
+  bool one_module = true;
+  std::vector<uint64_t> offsets;
+  offsets.reserve(symbols.size());
+  for (const auto& sym : symbols) {
+    std::string sym_module;
+    uint64_t offset;
+    TRY2(check_binary_symbol(binary_path, sym, 0, sym_module, offset));
+    if (module.empty())
+      module = sym_module;
+    else if (sym_module != module)
+      one_module = false;
+    offsets.push_back(offset);
+  }
+
+  open_uprobe_multi_t p = {};
+  p.func = probe_func;
+  p.binary_path = binary_path;
+  p.attach_type = attach_type;
+  if (!one_module || !load_prog(probe_func, BPF_PROG_TYPE_KPROBE, p.prog_fd, 0,
+                                BPF_TRACE_UPROBE_MULTI).ok())
+    p.prog_fd = -1;
+
+  std::vector<pid_t> targets = pids;
+  if (targets.empty())
+    targets.push_back(-1);
+
+  std::string error_msg;
+  for (pid_t pid : targets) {
+    if (p.prog_fd >= 0) {
+      int link_fd = bpf_attach_uprobe_multi(p.prog_fd, attach_type,
+                                            module.c_str(),
+                                            offsets.data(), offsets.size(),
+                                            pid);
+      if (link_fd >= 0) {
+        p.link_fds.push_back(link_fd);
+        continue;
+      }
+    }
+
+    for (const auto& sym : symbols) {
+      auto res = attach_uprobe(binary_path, sym, probe_func, 0, attach_type,
+                               pid);
+      if (res.ok())
+        p.fallback_probes.emplace_back(sym, pid);
+      else
+        error_msg += res.msg() + "\n";
+    }
+  }
+
+  if (p.link_fds.empty() && p.fallback_probes.empty()) {
+    if (p.prog_fd >= 0)
+      close(p.prog_fd);
+    return StatusTuple(-1, error_msg);
+  }
+  uprobe_multi_[key] = std::move(p);
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::detach_uprobe_multi(const std::string& binary_path,
+                                     const std::string& probe_func,
+                                     bpf_probe_attach_type attach_type) {
+  std::string key =
+      attach_type_prefix(attach_type) + "_" + binary_path + "_" + probe_func;
+
+  auto it = uprobe_multi_.find(key);
+  if (it == uprobe_multi_.end())
+    return StatusTuple(-1, "No open %suprobe_multi for %s in %s",
+                       attach_type_debug(attach_type).c_str(),
+                       probe_func.c_str(), binary_path.c_str());
+
+  auto res = detach_uprobe_multi_event(binary_path, attach_type, it->second);
+  uprobe_multi_.erase(it);
+  return res;
+}
+
 StatusTuple BPF::attach_usdt_without_validation(const USDT& u, pid_t pid) {
   auto& probe = *static_cast<::USDT::Probe*>(u.probe_.get());
-  if (!uprobe_ref_ctr_supported() && !probe.enable(u.probe_func_))
-    return StatusTuple(-1, "Unable to enable USDT %s", u.print_name().c_str());
+  // A pid other than the one the USDT was created for reuses the compiled
+  // program, only its semaphore and argument table entries are set up here.
+  bool other_pid = pid > 0 && (!probe.pid_ || *probe.pid_ != pid);
+  if (other_pid && !probe.table_args() && probe.getarg_depends_on_pid())
+    return StatusTuple(-1,
+                       "Arguments of USDT %s are read at addresses of another "
+                       "process, attach it to PID %d in table mode",
+                       u.print_name().c_str(), pid);
+  if (!uprobe_ref_ctr_supported()) {
+    bool enabled = other_pid ? (!probe.need_enable() ||
+                                probe.add_to_semaphore(pid, +1))
+                             : probe.enable(u.probe_func_);
+    if (!enabled)
+      return StatusTuple(-1, "Unable to enable USDT %s for PID %d",
+                         u.print_name().c_str(), pid);
+  }
+
+  if (probe.table_args() && probe.num_arguments() > 0) {
+    int fd = bpf_module_->table_fd("__bcc_usdt_args");
+    bool filled = fd >= 0 && (other_pid ? probe.fill_table_args(
+                                              fd, u.probe_func_, pid)
+                                        : probe.fill_table_args(
+                                              fd, u.probe_func_));
+    if (!filled) {
+      if (!uprobe_ref_ctr_supported()) {
+        if (other_pid)
+          probe.add_to_semaphore(pid, -1);
+        else
+          probe.disable();
+      }
+      return StatusTuple(-1, "Unable to store arguments of USDT %s",
+                         u.print_name().c_str());
+    }
+  }
 
   bool failed = false;
   std::string err_msg;
@@ -331,6 +630,7 @@ StatusTuple BPF::attach_usdt_without_validation(const USDT& u, pid_t pid) {
     }
     return StatusTuple(-1, err_msg);
   } else {
+    usdt_pids_[&u].insert(pid);
     return StatusTuple::OK();
   }
 }
@@ -507,6 +807,21 @@ StatusTuple BPF::detach_kprobe(const std::string& kernel_func,
   return StatusTuple::OK();
 }
 
+StatusTuple BPF::detach_kprobe_multi(const std::string& probe_func,
+                                     bpf_probe_attach_type attach_type) {
+  std::string key = attach_type_prefix(attach_type) + "_" + probe_func;
+
+  auto it = kprobe_multi_.find(key);
+  if (it == kprobe_multi_.end())
+    return StatusTuple(-1, "No open %skprobe_multi for %s",
+                       attach_type_debug(attach_type).c_str(),
+                       probe_func.c_str());
+
+  auto res = detach_kprobe_multi_event(attach_type, it->second);
+  kprobe_multi_.erase(it);
+  return res;
+}
+
 StatusTuple BPF::detach_uprobe(const std::string& binary_path,
                                const std::string& symbol, uint64_t symbol_addr,
                                bpf_probe_attach_type attach_type, pid_t pid,
@@ -530,6 +845,7 @@ StatusTuple BPF::detach_uprobe(const std::string& binary_path,
 
 StatusTuple BPF::detach_usdt_without_validation(const USDT& u, pid_t pid) {
   auto& probe = *static_cast<::USDT::Probe*>(u.probe_.get());
+  usdt_pids_[&u].erase(pid);
   bool failed = false;
   std::string err_msg;
   for (const auto& loc : probe.locations_) {
@@ -543,9 +859,21 @@ StatusTuple BPF::detach_usdt_without_validation(const USDT& u, pid_t pid) {
     }
   }
 
-  if (!uprobe_ref_ctr_supported() && !probe.disable()) {
-    failed = true;
-    err_msg += "Unable to disable USDT " + u.print_name();
+  bool other_pid = pid > 0 && (!probe.pid_ || *probe.pid_ != pid);
+  if (!uprobe_ref_ctr_supported()) {
+    bool disabled = other_pid ? (!probe.need_enable() ||
+                                 probe.add_to_semaphore(pid, -1))
+                              : probe.disable();
+    if (!disabled) {
+      failed = true;
+      err_msg += "Unable to disable USDT " + u.print_name();
+    }
+  }
+
+  if (other_pid && probe.table_args()) {
+    int fd = bpf_module_->table_fd("__bcc_usdt_args");
+    if (fd >= 0)
+      probe.clear_table_args(fd, u.probe_func_, pid);
   }
 
   if (failed)
@@ -565,13 +893,22 @@ StatusTuple BPF::detach_usdt(const USDT& usdt, pid_t pid) {
 }
 
 StatusTuple BPF::detach_usdt_all() {
+  std::string err_msg;
   for (const auto& u : usdt_) {
-    auto ret = detach_usdt_without_validation(u, -1);
-    if (!ret.ok()) {
-      return ret;
+    auto it = usdt_pids_.find(&u);
+    if (it == usdt_pids_.end())
+      continue;
+    std::set<pid_t> pids = it->second;
+    for (pid_t pid : pids) {
+      auto ret = detach_usdt_without_validation(u, pid);
+      if (!ret.ok())
+        err_msg += ret.msg() + "\n";
     }
   }
+  usdt_pids_.clear();
 
+  if (!err_msg.empty())
+    return StatusTuple(-1, err_msg);
   return StatusTuple::OK();
 }
 
@@ -651,6 +988,25 @@ StatusTuple BPF::open_perf_buffer(const std::string& name,
   return StatusTuple::OK();
 }
 
+StatusTuple BPF::open_perf_buffer(const std::string& name, bcc_batch_cb cb,
+                                  const bcc_batch_opts& batch_opts,
+                                  perf_reader_lost_cb lost_cb, void* cb_cookie,
+                                  int page_cnt) {
+  if (perf_buffers_.find(name) == perf_buffers_.end()) {
+    TableStorage::iterator it;
+    if (!bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+      return StatusTuple(-1,
+                         "open_perf_buffer: unable to find table_storage %s",
+                         name.c_str());
+    perf_buffers_[name] = new BPFPerfBuffer(it->second);
+  }
+  if ((page_cnt & (page_cnt - 1)) != 0)
+    return StatusTuple(-1, "open_perf_buffer page_cnt must be a power of two");
+  auto table = perf_buffers_[name];
+  TRY2(table->open_all_cpu(cb, lost_cb, cb_cookie, page_cnt, 1, batch_opts));
+  return StatusTuple::OK();
+}
+
 StatusTuple BPF::close_perf_buffer(const std::string& name) {
   auto it = perf_buffers_.find(name);
   if (it == perf_buffers_.end())
@@ -671,6 +1027,63 @@ int BPF::poll_perf_buffer(const std::string& name, int timeout_ms) {
   return it->second->poll(timeout_ms);
 }
 
+StatusTuple BPF::open_ring_buffer(const std::string& name,
+                                  ring_buffer_sample_fn cb, void* cb_cookie) {
+  auto table = get_ring_buffer(name);
+  if (!table)
+    return StatusTuple(-1, "open_ring_buffer: unable to find table_storage %s",
+                       name.c_str());
+  TRY2(table->open(ringbuf_manager_, cb, cb_cookie));
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::open_ring_buffer(const std::string& name, bcc_batch_cb cb,
+                                  const bcc_batch_opts& batch_opts,
+                                  void* cb_cookie) {
+  auto table = get_ring_buffer(name);
+  if (!table)
+    return StatusTuple(-1, "open_ring_buffer: unable to find table_storage %s",
+                       name.c_str());
+  TRY2(table->open(ringbuf_manager_, cb, batch_opts, cb_cookie));
+  return StatusTuple::OK();
+}
+
+BPFRingBuffer* BPF::get_ring_buffer(const std::string& name) {
+  auto it = ring_buffers_.find(name);
+  if (it != ring_buffers_.end())
+    return it->second;
+
+  TableStorage::iterator ts_it;
+  if (!bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}),
+                                         ts_it) ||
+      ts_it->second.type != BPF_MAP_TYPE_RINGBUF)
+    return nullptr;
+  auto table = new BPFRingBuffer(ts_it->second);
+  ring_buffers_[name] = table;
+  return table;
+}
+
+int BPF::poll_ring_buffers(int timeout_ms) {
+  if (!ringbuf_manager_)
+    return -1;
+  // Wake up in time to deliver pending batches
+  for (auto& it : ring_buffers_)
+    timeout_ms = it.second->poll_timeout(timeout_ms);
+  int cnt = bpf_poll_ringbuf(ringbuf_manager_, timeout_ms);
+  for (auto& it : ring_buffers_)
+    it.second->flush(false);
+  return cnt;
+}
+
+int BPF::consume_ring_buffers() {
+  if (!ringbuf_manager_)
+    return -1;
+  int cnt = bpf_consume_ringbuf(ringbuf_manager_);
+  for (auto& it : ring_buffers_)
+    it.second->flush(true);
+  return cnt;
+}
+
 StatusTuple BPF::load_func(const std::string& func_name, bpf_prog_type type,
                            int& fd, unsigned flags, bpf_attach_type expected_attach_type) {
   if (funcs_.find(func_name) != funcs_.end()) {
@@ -678,6 +1091,14 @@ StatusTuple BPF::load_func(const std::string& func_name, bpf_prog_type type,
     return StatusTuple::OK();
   }
 
+  TRY2(load_prog(func_name, type, fd, flags, expected_attach_type));
+  funcs_[func_name] = fd;
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::load_prog(const std::string& func_name, bpf_prog_type type,
+                           int& fd, unsigned flags,
+                           bpf_attach_type expected_attach_type) {
   uint8_t* func_start = bpf_module_->function_start(func_name);
   if (!func_start)
     return StatusTuple(-1, "Can't find start of function %s",
@@ -702,7 +1123,6 @@ StatusTuple BPF::load_func(const std::string& func_name, bpf_prog_type type,
       func_name, fd, reinterpret_cast<struct bpf_insn*>(func_start), func_size);
   if (ret < 0)
     fprintf(stderr, "WARNING: cannot get prog tag, ignore saving source with program tag\n");
-  funcs_[func_name] = fd;
   return StatusTuple::OK();
 }
 
@@ -817,6 +1237,14 @@ BPFXskmapTable BPF::get_xskmap_table(const std::string& name) {
   return BPFXskmapTable({});
 }
 
+BPFHistogramTable BPF::get_histogram_table(const std::string& name,
+                                         BPFHistogramTable::Scale scale) {
+  TableStorage::iterator it;
+  if (bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+    return BPFHistogramTable(it->second, scale);
+  return BPFHistogramTable({}, scale);
+}
+
 BPFStackTable BPF::get_stack_table(const std::string& name, bool use_debug_file,
                                    bool check_debug_file_crc) {
   TableStorage::iterator it;
@@ -888,6 +1316,25 @@ StatusTuple BPF::detach_kprobe_event(const std::string& event,
   return StatusTuple::OK();
 }
 
+StatusTuple BPF::detach_kprobe_multi_event(bpf_probe_attach_type attach_type,
+                                           open_kprobe_multi_t& attr) {
+  if (attr.link_fd >= 0) {
+    close(attr.link_fd);
+    close(attr.prog_fd);
+    return StatusTuple::OK();
+  }
+
+  std::string error_msg;
+  for (const auto& f : attr.fallback_funcs) {
+    auto res = detach_kprobe(f, attach_type);
+    if (!res.ok())
+      error_msg += res.msg() + "\n";
+  }
+  if (!error_msg.empty())
+    return StatusTuple(-1, error_msg);
+  return StatusTuple::OK();
+}
+
 StatusTuple BPF::detach_uprobe_event(const std::string& event,
                                      open_probe_t& attr) {
   bpf_close_perf_event_fd(attr.perf_event_fd);
@@ -897,6 +1344,25 @@ StatusTuple BPF::detach_uprobe_event(const std::string& event,
   return StatusTuple::OK();
 }
 
+StatusTuple BPF::detach_uprobe_multi_event(const std::string& binary_path,
+                                           bpf_probe_attach_type attach_type,
+                                           open_uprobe_multi_t& attr) {
+  for (int fd : attr.link_fds)
+    close(fd);
+  if (attr.prog_fd >= 0)
+    close(attr.prog_fd);
+
+  std::string error_msg;
+  for (const auto& it : attr.fallback_probes) {
+    auto res = detach_uprobe(binary_path, it.first, 0, attach_type, it.second);
+    if (!res.ok())
+      error_msg += res.msg() + "\n";
+  }
+  if (!error_msg.empty())
+    return StatusTuple(-1, error_msg);
+  return StatusTuple::OK();
+}
+
 StatusTuple BPF::detach_tracepoint_event(const std::string& tracepoint,
                                          open_probe_t& attr) {
   bpf_close_perf_event_fd(attr.perf_event_fd);
@@ -934,8 +1400,211 @@ StatusTuple BPF::detach_perf_event_all_cpu(open_probe_t& attr) {
   return StatusTuple::OK();
 }
 
+StatusTuple BPF::enable_stats() {
+  if (stats_fd_ >= 0)
+    return StatusTuple::OK();
+
+  int fd = bpf_enable_run_time_stats();
+  if (fd < 0)
+    return StatusTuple(-1,
+                       "Unable to enable BPF run time stats: %s, "
+                       "try sysctl kernel.bpf_stats_enabled=1",
+                       strerror(-fd));
+  stats_fd_ = fd;
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::disable_stats() {
+  if (stats_fd_ >= 0) {
+    close(stats_fd_);
+    stats_fd_ = -1;
+  }
+  overhead_budget_ = 0;
+  budget_run_time_.clear();
+  return StatusTuple::OK();
+}
+
+std::map<std::string, std::vector<int>> BPF::func_prog_fds() const {
+  std::map<std::string, std::vector<int>> res;
+  for (const auto& it : funcs_)
+    res[it.first].push_back(it.second);
+  for (const auto& it : kprobe_multi_)
+    if (it.second.link_fd >= 0)
+      res[it.second.func].push_back(it.second.prog_fd);
+  for (const auto& it : uprobe_multi_)
+    if (!it.second.link_fds.empty())
+      res[it.second.func].push_back(it.second.prog_fd);
+  return res;
+}
+
+// Sums the stats of the given loads of a function
+static int sum_prog_stats(const std::vector<int>& fds, bcc_prog_stats& stats) {
+  stats = {};
+  for (int fd : fds) {
+    bcc_prog_stats s;
+    if (bpf_prog_get_stats(fd, &s) < 0)
+      return -1;
+    stats.run_cnt += s.run_cnt;
+    stats.run_time_ns += s.run_time_ns;
+    stats.recursion_misses += s.recursion_misses;
+  }
+  return 0;
+}
+
+StatusTuple BPF::get_prog_stats(const std::string& func_name,
+                                bcc_prog_stats& stats) {
+  auto fds = func_prog_fds();
+  auto it = fds.find(func_name);
+  if (it == fds.end())
+    return StatusTuple(-1, "Probe function %s not loaded", func_name.c_str());
+  if (sum_prog_stats(it->second, stats) < 0)
+    return StatusTuple(-1, "Unable to get stats of %s: %s", func_name.c_str(),
+                       strerror(errno));
+  return StatusTuple::OK();
+}
+
+std::map<std::string, bcc_prog_stats> BPF::get_all_prog_stats() {
+  std::map<std::string, bcc_prog_stats> res;
+  for (const auto& it : func_prog_fds()) {
+    bcc_prog_stats stats;
+    if (sum_prog_stats(it.second, stats) == 0)
+      res[it.first] = stats;
+  }
+  return res;
+}
+
+StatusTuple BPF::set_overhead_budget(double max_cpu) {
+  if (max_cpu <= 0)
+    return StatusTuple(-1, "Invalid overhead budget %f", max_cpu);
+  TRY2(enable_stats());
+  overhead_budget_ = max_cpu;
+  budget_checked_ns_ = 0;
+  budget_run_time_.clear();
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::check_overhead_budget(std::vector<std::string>* over_budget) {
+  if (overhead_budget_ <= 0)
+    return StatusTuple(-1, "No overhead budget set");
+
+  uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now().time_since_epoch())
+                     .count();
+  uint64_t elapsed = now - budget_checked_ns_;
+  bool first_check = budget_checked_ns_ == 0;
+  budget_checked_ns_ = now;
+
+  // Functions loaded since the previous check only start being measured now
+  std::vector<std::string> over;
+  std::map<std::string, uint64_t> run_time;
+  for (const auto& it : get_all_prog_stats()) {
+    run_time[it.first] = it.second.run_time_ns;
+    auto prev = budget_run_time_.find(it.first);
+    if (first_check || prev == budget_run_time_.end())
+      continue;
+    // The total drops when a link of the function goes away, it is measured
+    // again from here on
+    if (it.second.run_time_ns < prev->second)
+      continue;
+    if (it.second.run_time_ns - prev->second > overhead_budget_ * elapsed)
+      over.push_back(it.first);
+  }
+  budget_run_time_ = std::move(run_time);
+
+  std::string err_msg;
+  for (const auto& func : over) {
+    if (flag_ & DEBUG_BPF)
+      fprintf(stderr, "Detaching %s: over the overhead budget of %.2f%%\n",
+              func.c_str(), overhead_budget_ * 100);
+    auto res = detach_func_probes(func);
+    if (!res.ok())
+      err_msg += res.msg() + "\n";
+    budget_run_time_.erase(func);
+  }
+  if (over_budget)
+    *over_budget = std::move(over);
+
+  if (!err_msg.empty())
+    return StatusTuple(-1, err_msg);
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::detach_func_probes(const std::string& func_name) {
+  std::string err_msg;
+  // First the multi links, which also detach their fallback probes from
+  // kprobes_ and uprobes_
+  for (auto it = kprobe_multi_.begin(); it != kprobe_multi_.end();) {
+    if (it->second.func != func_name) {
+      ++it;
+      continue;
+    }
+    auto res = detach_kprobe_multi_event(it->second.attach_type, it->second);
+    if (!res.ok())
+      err_msg += res.msg() + "\n";
+    it = kprobe_multi_.erase(it);
+  }
+  for (auto it = uprobe_multi_.begin(); it != uprobe_multi_.end();) {
+    if (it->second.func != func_name) {
+      ++it;
+      continue;
+    }
+    auto res = detach_uprobe_multi_event(it->second.binary_path,
+                                         it->second.attach_type, it->second);
+    if (!res.ok())
+      err_msg += res.msg() + "\n";
+    it = uprobe_multi_.erase(it);
+  }
+
+  auto detach = [&](std::map<std::string, open_probe_t>& probes,
+                    StatusTuple (BPF::*detach_event)(const std::string&,
+                                                     open_probe_t&)) {
+    for (auto it = probes.begin(); it != probes.end();) {
+      if (it->second.func != func_name) {
+        ++it;
+        continue;
+      }
+      auto res = (this->*detach_event)(it->first, it->second);
+      if (!res.ok())
+        err_msg += res.msg() + "\n";
+      it = probes.erase(it);
+    }
+  };
+  detach(kprobes_, &BPF::detach_kprobe_event);
+  detach(uprobes_, &BPF::detach_uprobe_event);
+  detach(tracepoints_, &BPF::detach_tracepoint_event);
+  detach(raw_tracepoints_, &BPF::detach_raw_tracepoint_event);
+
+  for (auto it = perf_events_.begin(); it != perf_events_.end();) {
+    if (it->second.func != func_name) {
+      ++it;
+      continue;
+    }
+    auto res = detach_perf_event_all_cpu(it->second);
+    if (!res.ok())
+      err_msg += res.msg() + "\n";
+    it = perf_events_.erase(it);
+  }
+
+  // Also drops a function that was loaded but attached some other way
+  auto res = unload_func(func_name);
+  if (!res.ok())
+    err_msg += res.msg() + "\n";
+
+  if (!err_msg.empty())
+    return StatusTuple(-1, err_msg);
+  return StatusTuple::OK();
+}
+
 int BPF::free_bcc_memory() {
-  return bcc_free_memory();
+  return BPFModule::free_bcc_memory();
+}
+
+void BPF::release_header_cache() { BPFModule::release_header_cache(); }
+
+StatusTuple BPF::release_compiler_memory(size_t* freed) {
+  if (bpf_module_->release_compiler_memory(freed) != 0)
+    return StatusTuple(-1, "Unable to release compiler memory");
+  return StatusTuple::OK();
 }
 
 USDT::USDT(const std::string& binary_path, const std::string& provider,
@@ -946,7 +1615,8 @@ USDT::USDT(const std::string& binary_path, const std::string& provider,
       provider_(provider),
       name_(name),
       probe_func_(probe_func),
-      mod_match_inode_only_(1) {}
+      mod_match_inode_only_(1),
+      table_args_(false) {}
 
 USDT::USDT(pid_t pid, const std::string& provider, const std::string& name,
            const std::string& probe_func)
@@ -956,7 +1626,8 @@ USDT::USDT(pid_t pid, const std::string& provider, const std::string& name,
       provider_(provider),
       name_(name),
       probe_func_(probe_func),
-      mod_match_inode_only_(1) {}
+      mod_match_inode_only_(1),
+      table_args_(false) {}
 
 USDT::USDT(const std::string& binary_path, pid_t pid,
            const std::string& provider, const std::string& name,
@@ -967,7 +1638,8 @@ USDT::USDT(const std::string& binary_path, pid_t pid,
       provider_(provider),
       name_(name),
       probe_func_(probe_func),
-      mod_match_inode_only_(1) {}
+      mod_match_inode_only_(1),
+      table_args_(false) {}
 
 USDT::USDT(const USDT& usdt)
     : initialized_(false),
@@ -976,7 +1648,8 @@ USDT::USDT(const USDT& usdt)
       provider_(usdt.provider_),
       name_(usdt.name_),
       probe_func_(usdt.probe_func_),
-      mod_match_inode_only_(usdt.mod_match_inode_only_) {}
+      mod_match_inode_only_(usdt.mod_match_inode_only_),
+      table_args_(usdt.table_args_) {}
 
 USDT::USDT(USDT&& usdt) noexcept
     : initialized_(usdt.initialized_),
@@ -987,7 +1660,8 @@ USDT::USDT(USDT&& usdt) noexcept
       probe_func_(std::move(usdt.probe_func_)),
       probe_(std::move(usdt.probe_)),
       program_text_(std::move(usdt.program_text_)),
-      mod_match_inode_only_(usdt.mod_match_inode_only_) {
+      mod_match_inode_only_(usdt.mod_match_inode_only_),
+      table_args_(usdt.table_args_) {
   usdt.initialized_ = false;
 }
 
@@ -1035,6 +1709,7 @@ StatusTuple USDT::init() {
     return StatusTuple(-1, "Unable to find USDT " + print_name());
   ctx.reset(nullptr);
   auto& probe = *static_cast<::USDT::Probe*>(probe_.get());
+  probe.set_table_args(table_args_);
 
   std::ostringstream stream;
   if (!probe.usdt_getarg(stream, probe_func_))
@@ -20,6 +20,7 @@
 #include <cstdint>
 #include <memory>
 #include <ostream>
+#include <set>
 #include <string>
 
 #include "BPFTable.h"
@@ -40,6 +41,25 @@ struct open_probe_t {
   std::vector<std::pair<int, int>>* per_cpu_fd;
 };
 
+struct open_kprobe_multi_t {
+  std::string func;
+  bpf_probe_attach_type attach_type;
+  // -1 if the kernel functions were attached one kprobe at a time
+  int link_fd;
+  int prog_fd;
+  std::vector<std::string> fallback_funcs;
+};
+
+struct open_uprobe_multi_t {
+  std::string func;
+  std::string binary_path;
+  bpf_probe_attach_type attach_type;
+  std::vector<int> link_fds;
+  int prog_fd;
+  // symbol and pid of the probes attached one uprobe at a time
+  std::vector<std::pair<std::string, pid_t>> fallback_probes;
+};
+
 class BPF;
 
 class USDT {
@@ -91,6 +111,12 @@ class USDT {
   // BPF::init()
   int set_probe_matching_kludge(uint8_t kludge);
 
+  // In table mode the argument specs of each probe location are stored in the
+  // __bcc_usdt_args map when the USDT is attached, instead of being generated
+  // into the program text. The program size then no longer depends on the
+  // number of locations. Must be called before BPF::init().
+  void set_table_args(bool enable) { table_args_ = enable; }
+
  private:
   bool initialized_;
 
@@ -105,6 +131,7 @@ class USDT {
   std::string program_text_;
 
   uint8_t mod_match_inode_only_;
+  bool table_args_;
 
   friend class BPF;
 };
@@ -120,13 +147,32 @@ class BPF {
       : flag_(flag),
         bsymcache_(NULL),
         bpf_module_(new BPFModule(flag, ts, rw_engine_enabled, maps_ns,
-                    allow_rlimit)) {}
+                    allow_rlimit)),
+        ringbuf_manager_(nullptr),
+        stats_fd_(-1),
+        overhead_budget_(0),
+        budget_checked_ns_(0) {}
   StatusTuple init(const std::string& bpf_program,
                    const std::vector<std::string>& cflags = {},
                    const std::vector<USDT>& usdt = {});
 
   StatusTuple init_usdt(const USDT& usdt);
 
+  // The arguments of init() for one BPF object
+  struct InitArgs {
+    BPF* bpf;
+    std::string program;
+    std::vector<std::string> cflags;
+    std::vector<USDT> usdt;
+  };
+  // Initializes several BPF objects, compiling and loading their programs on
+  // up to max_threads threads (one per CPU by default). Returns the result of
+  // every init(), in order. Programs which use tables exported by one another
+  // have to be initialized one after the other. With LLVM older than 10
+  // only one program is compiled at a time.
+  static std::vector<StatusTuple> init_parallel(
+      const std::vector<InitArgs>& args, unsigned max_threads = 0);
+
   ~BPF();
   StatusTuple detach_all();
 
@@ -139,6 +185,18 @@ class BPF {
       const std::string& kernel_func,
       bpf_probe_attach_type attach_type = BPF_PROBE_ENTRY);
 
+  // Attach probe_func to all of kernel_funcs through a single kprobe_multi
+  // link. On kernels without kprobe_multi support, or if any of the functions
+  // can't be attached that way, fall back to one kprobe per function, which
+  // succeeds as long as one of them could be attached.
+  StatusTuple attach_kprobe_multi(
+      const std::vector<std::string>& kernel_funcs,
+      const std::string& probe_func,
+      bpf_probe_attach_type attach_type = BPF_PROBE_ENTRY);
+  StatusTuple detach_kprobe_multi(
+      const std::string& probe_func,
+      bpf_probe_attach_type attach_type = BPF_PROBE_ENTRY);
+
   StatusTuple attach_uprobe(const std::string& binary_path,
                             const std::string& symbol,
                             const std::string& probe_func,
@@ -152,6 +210,27 @@ class BPF {
                             bpf_probe_attach_type attach_type = BPF_PROBE_ENTRY,
                             pid_t pid = -1,
                             uint64_t symbol_offset = 0);
+
+  // Attach probe_func to all of symbols in binary_path through one
+  // uprobe_multi link per pid, or a single link for all processes if pids is
+  // empty. binary_path can be a library name. Falls back to one uprobe per
+  // symbol for the pids a link can't be created for, typically because the
+  // kernel lacks uprobe_multi support, and when the symbols are found in
+  // different files.
+  StatusTuple attach_uprobe_multi(
+      const std::string& binary_path, const std::vector<std::string>& symbols,
+      const std::string& probe_func,
+      bpf_probe_attach_type attach_type = BPF_PROBE_ENTRY,
+      const std::vector<pid_t>& pids = {});
+  StatusTuple detach_uprobe_multi(
+      const std::string& binary_path, const std::string& probe_func,
+      bpf_probe_attach_type attach_type = BPF_PROBE_ENTRY);
+  // A USDT initialized for a binary path can be attached to any number of its
+  // processes by passing their pids, without compiling the program again.
+  // When its arguments are read at addresses of one process, e.g. globals of
+  // a shared object, this fails unless the USDT is in table mode, see
+  // USDT::set_table_args(). detach_usdt_all() and the destructor detach
+  // every pid a USDT was attached to.
   StatusTuple attach_usdt(const USDT& usdt, pid_t pid = -1);
   StatusTuple attach_usdt_all();
   StatusTuple detach_usdt(const USDT& usdt, pid_t pid = -1);
@@ -287,6 +366,10 @@ class BPF {
 
   BPFSockhashTable get_sockhash_table(const std::string& name);
 
+  BPFHistogramTable get_histogram_table(
+      const std::string& name,
+      BPFHistogramTable::Scale scale = BPFHistogramTable::Scale::LOG2);
+
   BPFStackTable get_stack_table(const std::string& name,
                                 bool use_debug_file = true,
                                 bool check_debug_file_crc = true);
@@ -316,6 +399,14 @@ class BPF {
                                perf_reader_lost_cb lost_cb = nullptr,
                                void* cb_cookie = nullptr,
                                int page_cnt = DEFAULT_PERF_BUFFER_PAGE_CNT);
+  // Same as above, but samples are handed to cb in batches of up to
+  // batch_opts.max_records, at the latest batch_opts.max_latency_ms after they
+  // arrived.
+  StatusTuple open_perf_buffer(const std::string& name, bcc_batch_cb cb,
+                               const bcc_batch_opts& batch_opts,
+                               perf_reader_lost_cb lost_cb = nullptr,
+                               void* cb_cookie = nullptr,
+                               int page_cnt = DEFAULT_PERF_BUFFER_PAGE_CNT);
   // Close and free the Perf Buffer of given name.
   StatusTuple close_perf_buffer(const std::string& name);
   // Obtain an pointer to the opened BPFPerfBuffer instance of given name.
@@ -329,6 +420,30 @@ class BPF {
   //   number of CPUs that have new data, otherwise.
   int poll_perf_buffer(const std::string& name, int timeout_ms = -1);
 
+  // Open a Ring Buffer of given name, with cb called for every record. All
+  // Ring Buffers opened by one BPF instance share a ring buffer manager and
+  // are polled together. BPF class owns them and frees them on destruction.
+  StatusTuple open_ring_buffer(const std::string& name,
+                               ring_buffer_sample_fn cb,
+                               void* cb_cookie = nullptr);
+  // Same as above, but records are handed to cb in batches of up to
+  // batch_opts.max_records, at the latest batch_opts.max_latency_ms after they
+  // arrived.
+  StatusTuple open_ring_buffer(const std::string& name, bcc_batch_cb cb,
+                               const bcc_batch_opts& batch_opts,
+                               void* cb_cookie = nullptr);
+  // Obtain a pointer to the BPFRingBuffer instance of given name, which can
+  // be read in place with open_reader() if it was not opened with a
+  // callback. Will return nullptr if there is no such Ring Buffer table.
+  BPFRingBuffer* get_ring_buffer(const std::string& name);
+  // Poll all opened Ring Buffers with given timeout on one epoll instance.
+  // Returns the number of records consumed, or -1 on error or if no Ring
+  // Buffer is open.
+  int poll_ring_buffers(int timeout_ms = -1);
+  // Consume all opened Ring Buffers without waiting, delivering all batched
+  // records.
+  int consume_ring_buffers();
+
   StatusTuple load_func(const std::string& func_name, enum bpf_prog_type type,
                         int& fd, unsigned flags = 0, enum bpf_attach_type = (bpf_attach_type) -1);
   StatusTuple unload_func(const std::string& func_name);
@@ -339,8 +454,35 @@ class BPF {
   StatusTuple detach_func(int prog_fd, int attachable_fd,
                           enum bpf_attach_type attach_type);
 
+  // Kernel accounting of the run count and run time of all BPF programs,
+  // enabled as long as this BPF object holds the stats fd. The stats of a
+  // function add up all its loads, including those of kprobe_multi and
+  // uprobe_multi links.
+  StatusTuple enable_stats();
+  StatusTuple disable_stats();
+  StatusTuple get_prog_stats(const std::string& func_name,
+                             bcc_prog_stats& stats);
+  std::map<std::string, bcc_prog_stats> get_all_prog_stats();
+
+  // max_cpu is the share of one CPU (e.g. 0.01 for 1%) each loaded function
+  // may use. check_overhead_budget() measures the run time of every function
+  // since its previous call, and detaches all probes of the functions over
+  // the budget. Their names are returned in over_budget. Enables the stats.
+  StatusTuple set_overhead_budget(double max_cpu);
+  StatusTuple check_overhead_budget(
+      std::vector<std::string>* over_budget = nullptr);
+
   int free_bcc_memory();
 
+  // Drops the kernel headers kept in memory for the compiles of the process,
+  // release_compiler_memory() leaves them for the next program to load
+  static void release_header_cache();
+
+  // Frees the LLVM state and the source text kept after init(). Tables, their
+  // string conversions and loading functions keep working, function sources
+  // are no longer available. freed receives the resident memory given back.
+  StatusTuple release_compiler_memory(size_t* freed = nullptr);
+
  private:
   std::string get_kprobe_event(const std::string& kernel_func,
                                bpf_probe_attach_type type);
@@ -351,12 +493,21 @@ class BPF {
   StatusTuple detach_usdt_without_validation(const USDT& usdt, pid_t pid);
 
   StatusTuple detach_kprobe_event(const std::string& event, open_probe_t& attr);
+  StatusTuple detach_kprobe_multi_event(bpf_probe_attach_type attach_type,
+                                        open_kprobe_multi_t& attr);
   StatusTuple detach_uprobe_event(const std::string& event, open_probe_t& attr);
+  StatusTuple detach_uprobe_multi_event(const std::string& binary_path,
+                                        bpf_probe_attach_type attach_type,
+                                        open_uprobe_multi_t& attr);
   StatusTuple detach_tracepoint_event(const std::string& tracepoint,
                                       open_probe_t& attr);
   StatusTuple detach_raw_tracepoint_event(const std::string& tracepoint,
                                           open_probe_t& attr);
   StatusTuple detach_perf_event_all_cpu(open_probe_t& attr);
+  StatusTuple detach_func_probes(const std::string& func_name);
+  // Fds of every load of each function, the one in funcs_ and those kept by
+  // kprobe_multi and uprobe_multi links
+  std::map<std::string, std::vector<int>> func_prog_fds() const;
 
   std::string attach_type_debug(bpf_probe_attach_type type) {
     switch (type) {
@@ -393,6 +544,12 @@ class BPF {
                                   uint64_t symbol_offset = 0);
 
   void init_fail_reset();
+  StatusTuple load_program(const std::string& bpf_program,
+                           const std::vector<std::string>& cflags);
+
+  StatusTuple load_prog(const std::string& func_name, bpf_prog_type type,
+                        int& fd, unsigned flags,
+                        bpf_attach_type expected_attach_type);
 
   int flag_;
 
@@ -405,15 +562,26 @@ class BPF {
   std::map<std::string, int> funcs_;
 
   std::vector<USDT> usdt_;
+  // Pids each USDT of usdt_ is attached to, -1 for all processes
+  std::map<const USDT*, std::set<pid_t>> usdt_pids_;
   std::string all_bpf_program_;
 
   std::map<std::string, open_probe_t> kprobes_;
+  std::map<std::string, open_kprobe_multi_t> kprobe_multi_;
   std::map<std::string, open_probe_t> uprobes_;
+  std::map<std::string, open_uprobe_multi_t> uprobe_multi_;
   std::map<std::string, open_probe_t> tracepoints_;
   std::map<std::string, open_probe_t> raw_tracepoints_;
   std::map<std::string, BPFPerfBuffer*> perf_buffers_;
+  ring_buffer* ringbuf_manager_;
+  std::map<std::string, BPFRingBuffer*> ring_buffers_;
   std::map<std::string, BPFPerfEventArray*> perf_event_arrays_;
   std::map<std::pair<uint32_t, uint32_t>, open_probe_t> perf_events_;
+
+  int stats_fd_;
+  double overhead_budget_;
+  uint64_t budget_checked_ns_;
+  std::map<std::string, uint64_t> budget_run_time_;
 };
 
 }  // namespace ebpf
@@ -18,16 +18,20 @@
 #include <linux/elf.h>
 #include <linux/perf_event.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <cerrno>
 #include <cinttypes>
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <iostream>
 #include <memory>
 
 #include "BPFTable.h"
 
+#include "bcc_common.h"
 #include "bcc_exception.h"
 #include "bcc_syms.h"
 #include "common.h"
@@ -248,6 +252,246 @@ StatusTuple BPFTable::get_table_offline(
 
 size_t BPFTable::get_possible_cpu_count() { return get_possible_cpus().size(); }
 
+static const size_t HISTOGRAM_BATCH_SIZE = 4096;
+
+// Sums the per-CPU copies of a counter. Independent accumulators let the
+// compiler vectorize the loop.
+static uint64_t sum_counters(const uint64_t* values, size_t n) {
+  uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 += values[i];
+    s1 += values[i + 1];
+    s2 += values[i + 2];
+    s3 += values[i + 3];
+  }
+  for (; i < n; i++)
+    s0 += values[i];
+  return s0 + s1 + s2 + s3;
+}
+
+// Orders two sections of the same size as sequences of little-endian words
+// of word bytes, so that integer fields of the key sort by their value
+// rather than by their lowest byte.
+static bool section_less(const std::string& a, const std::string& b,
+                         size_t word) {
+  if (a.size() != b.size())
+    return a.size() < b.size();
+  for (size_t i = 0; i + word <= a.size(); i += word)
+    for (size_t j = i + word; j-- > i;)
+      if (a[j] != b[j])
+        return static_cast<uint8_t>(a[j]) < static_cast<uint8_t>(b[j]);
+  return false;
+}
+
+BPFHistogramTable::BPFHistogramTable(const TableDesc& desc, Scale scale)
+    : BPFTableBase<void, void>(desc), scale_(scale), ncpus_(1),
+      dropped_(0), max_dropped_slot_(0) {
+  switch (desc.type) {
+  case BPF_MAP_TYPE_PERCPU_ARRAY:
+  case BPF_MAP_TYPE_PERCPU_HASH:
+  case BPF_MAP_TYPE_LRU_PERCPU_HASH:
+    ncpus_ = BPFTable::get_possible_cpu_count();
+    break;
+  case BPF_MAP_TYPE_ARRAY:
+  case BPF_MAP_TYPE_HASH:
+  case BPF_MAP_TYPE_LRU_HASH:
+    break;
+  default:
+    throw std::invalid_argument("Table '" + desc.name +
+                                "' is not an array or hash table");
+  }
+  if (desc.leaf_size != sizeof(uint64_t))
+    throw std::invalid_argument("Table '" + desc.name +
+                                "' does not have u64 counters");
+
+  if (desc.key_size <= sizeof(uint64_t)) {
+    slot_offset_ = 0;
+    slot_size_ = desc.key_size;
+  } else {
+    slot_offset_ = desc.key_size - sizeof(uint64_t);
+    slot_size_ = sizeof(uint64_t);
+  }
+
+  max_slots_ = scale == Scale::LOG2 ? LOG2_MAX_SLOTS : LINEAR_MAX_SLOTS;
+  if ((desc.type == BPF_MAP_TYPE_ARRAY ||
+       desc.type == BPF_MAP_TYPE_PERCPU_ARRAY) &&
+      desc.max_entries > max_slots_)
+    max_slots_ = desc.max_entries;
+}
+
+StatusTuple BPFHistogramTable::set_slot_field(size_t offset, size_t size) {
+  if (size != 1 && size != 2 && size != 4 && size != 8)
+    return StatusTuple(-1, "Invalid slot size %zu", size);
+  if (offset + size > desc.key_size)
+    return StatusTuple(-1, "Slot at offset %zu is outside of the %zu byte key",
+                       offset, desc.key_size);
+  slot_offset_ = offset;
+  slot_size_ = size;
+  return StatusTuple::OK();
+}
+
+void BPFHistogramTable::add_entry(const uint8_t* key, const uint8_t* value,
+                                  std::map<std::string, size_t>& index,
+                                  std::vector<Histogram>& res) {
+  uint64_t slot;
+  const uint8_t* slot_ptr = key + slot_offset_;
+  switch (slot_size_) {
+  case 1:
+    slot = *slot_ptr;
+    break;
+  case 2: {
+    uint16_t v;
+    memcpy(&v, slot_ptr, sizeof(v));
+    slot = v;
+    break;
+  }
+  case 4: {
+    uint32_t v;
+    memcpy(&v, slot_ptr, sizeof(v));
+    slot = v;
+    break;
+  }
+  default:
+    memcpy(&slot, slot_ptr, sizeof(slot));
+  }
+  if (slot >= max_slots_) {
+    dropped_++;
+    max_dropped_slot_ = std::max(max_dropped_slot_, slot);
+    return;
+  }
+
+  std::string section;
+  if (desc.key_size > slot_size_) {
+    section.assign(reinterpret_cast<const char*>(key), desc.key_size);
+    std::fill(section.begin() + slot_offset_,
+              section.begin() + slot_offset_ + slot_size_, '\0');
+  }
+
+  auto it = index.find(section);
+  if (it == index.end()) {
+    it = index.emplace(section, res.size()).first;
+    res.push_back(Histogram{section, {}, 0});
+  }
+  Histogram& hist = res[it->second];
+
+  // Values are 8 byte aligned in the buffers read from the kernel
+  uint64_t count =
+      sum_counters(reinterpret_cast<const uint64_t*>(value), ncpus_);
+  if (hist.slots.size() <= slot)
+    hist.slots.resize(slot + 1);
+  hist.slots[slot] += count;
+  hist.total += count;
+}
+
+StatusTuple BPFHistogramTable::read(std::vector<Histogram>& res) {
+  std::map<std::string, size_t> index;
+  size_t value_size = ncpus_ * sizeof(uint64_t);
+  // Histograms are small, read them in a single batch where possible
+  size_t batch_size = std::max<size_t>(
+      1, std::min<size_t>(desc.max_entries, HISTOGRAM_BATCH_SIZE));
+
+  res.clear();
+  dropped_ = 0;
+  max_dropped_slot_ = 0;
+  int rc = lookup_batch(
+      false, batch_size, value_size,
+      [&](const uint8_t* keys, const uint8_t* values, uint32_t count) {
+        for (uint32_t i = 0; i < count; i++)
+          add_entry(keys + i * desc.key_size, values + i * value_size, index,
+                    res);
+      });
+  if (rc < 0)
+    return StatusTuple(-1, "Error reading histogram table %s: %s",
+                       desc.name.c_str(), std::strerror(errno));
+
+  if (rc == 1) {
+    std::vector<uint8_t> key(desc.key_size), next_key(desc.key_size);
+    std::vector<uint64_t> value(ncpus_);
+    bool more = first(key.data());
+    while (more) {
+      if (lookup(key.data(), value.data()))
+        add_entry(key.data(), reinterpret_cast<const uint8_t*>(value.data()),
+                  index, res);
+      more = next(key.data(), next_key.data());
+      key.swap(next_key);
+    }
+  }
+
+  // Without the field layout of the key, compare it in words of the largest
+  // power of two up to 8 bytes that divides the key size.
+  size_t word = sizeof(uint64_t);
+  while (desc.key_size % word)
+    word /= 2;
+  std::sort(res.begin(), res.end(),
+            [word](const Histogram& a, const Histogram& b) {
+              return section_less(a.section, b.section, word);
+            });
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFHistogramTable::read_delta(std::vector<Histogram>& res) {
+  TRY2(read(res));
+
+  std::map<std::string, std::vector<uint64_t>> cur;
+  for (auto& hist : res) {
+    std::vector<uint64_t> slots = hist.slots;
+    auto it = prev_.find(hist.section);
+    if (it != prev_.end()) {
+      const std::vector<uint64_t>& prev = it->second;
+      hist.total = 0;
+      for (size_t i = 0; i < hist.slots.size(); i++) {
+        if (i < prev.size() && hist.slots[i] >= prev[i])
+          hist.slots[i] -= prev[i];
+        hist.total += hist.slots[i];
+      }
+    }
+    cur.emplace(hist.section, std::move(slots));
+  }
+  prev_.swap(cur);
+  return StatusTuple::OK();
+}
+
+std::pair<uint64_t, uint64_t> BPFHistogramTable::slot_range(size_t slot) const {
+  if (scale_ == Scale::LINEAR)
+    return {slot, slot};
+  // bpf_log2l() puts both 0 and 1 in slot 1
+  if (slot <= 1)
+    return {0, slot};
+  uint64_t high = slot >= 64 ? UINT64_MAX : (1ULL << slot) - 1;
+  return {1ULL << (slot - 1), high};
+}
+
+std::vector<double> BPFHistogramTable::percentiles(
+    const Histogram& hist, const std::vector<double>& ps) const {
+  std::vector<double> res;
+  res.reserve(ps.size());
+  if (hist.total == 0) {
+    res.assign(ps.size(), 0);
+    return res;
+  }
+
+  size_t slot = 0;
+  uint64_t below = 0;  // counts in the slots before slot
+  for (double p : ps) {
+    double rank = std::min(std::max(p, 0.0), 100.0) / 100 * hist.total;
+    while (slot + 1 < hist.slots.size() &&
+           (hist.slots[slot] == 0 || below + hist.slots[slot] < rank)) {
+      below += hist.slots[slot];
+      slot++;
+    }
+    auto range = slot_range(slot);
+    double frac = hist.slots[slot] ? (rank - below) / hist.slots[slot] : 0;
+    frac = std::min(std::max(frac, 0.0), 1.0);
+    res.push_back(range.first + frac * (range.second - range.first));
+  }
+  return res;
+}
+
+double BPFHistogramTable::percentile(const Histogram& hist, double p) const {
+  return percentiles(hist, {p})[0];
+}
+
 BPFStackTable::BPFStackTable(const TableDesc& desc, bool use_debug_file,
                              bool check_debug_file_crc)
     : BPFTableBase<int, stacktrace_t>(desc) {
@@ -300,29 +544,56 @@ std::vector<uintptr_t> BPFStackTable::get_stack_addr(int stack_id) {
   return res;
 }
 
-std::vector<std::string> BPFStackTable::get_stack_symbol(int stack_id,
-                                                         int pid) {
-  auto addresses = get_stack_addr(stack_id);
-  std::vector<std::string> res;
-  if (addresses.empty())
-    return res;
-  res.reserve(addresses.size());
-
+void* BPFStackTable::get_symcache(int pid) {
   if (pid < 0)
     pid = -1;
   if (pid_sym_.find(pid) == pid_sym_.end())
     pid_sym_[pid] = bcc_symcache_new(pid, &symbol_option_);
-  void* cache = pid_sym_[pid];
+  return pid_sym_[pid];
+}
 
-  bcc_symbol symbol;
-  for (auto addr : addresses)
-    if (bcc_symcache_resolve(cache, addr, &symbol) != 0)
-      res.emplace_back("[UNKNOWN]");
-    else {
-      res.push_back(symbol.demangle_name);
-      bcc_symbol_free_demangle_name(&symbol);
-    }
+void BPFStackTable::load_symbols(int pid, int max_threads) {
+  bcc_symcache_load_all(get_symcache(pid), pid < 0 ? -1 : pid, max_threads);
+}
+
+void BPFStackTable::resolve_addrs(int pid, const uint64_t* addrs, size_t n,
+                                  bcc_symbol* syms) {
+  if (n > 0)
+    bcc_symcache_resolve_batch(get_symcache(pid), addrs, n, syms, 1);
+}
+
+std::vector<std::string> BPFStackTable::get_stack_symbol(int stack_id,
+                                                         int pid) {
+  auto res = get_stack_symbols({stack_id}, pid);
+  return std::move(res[0]);
+}
+
+std::vector<std::vector<std::string>> BPFStackTable::get_stack_symbols(
+    const std::vector<int>& stack_ids, int pid) {
+  std::vector<std::vector<uintptr_t>> stacks;
+  std::vector<uint64_t> addrs;
+  stacks.reserve(stack_ids.size());
+  for (int stack_id : stack_ids) {
+    stacks.push_back(get_stack_addr(stack_id));
+    addrs.insert(addrs.end(), stacks.back().begin(), stacks.back().end());
+  }
 
+  std::vector<bcc_symbol> syms(addrs.size());
+  resolve_addrs(pid, addrs.data(), addrs.size(), syms.data());
+
+  std::vector<std::vector<std::string>> res(stacks.size());
+  size_t i = 0;
+  for (size_t s = 0; s < stacks.size(); s++) {
+    res[s].reserve(stacks[s].size());
+    for (size_t j = 0; j < stacks[s].size(); j++, i++) {
+      if (!syms[i].name) {
+        res[s].emplace_back("[UNKNOWN]");
+      } else {
+        res[s].push_back(syms[i].demangle_name);
+        bcc_symbol_free_demangle_name(&syms[i]);
+      }
+    }
+  }
   return res;
 }
 
@@ -391,27 +662,22 @@ std::vector<std::string> BPFStackBuildIdTable::get_stack_symbol(int stack_id)
 }
 
 BPFPerfBuffer::BPFPerfBuffer(const TableDesc& desc)
-    : BPFTableBase<int, int>(desc), epfd_(-1) {
+    : BPFTableBase<int, int>(desc), epfd_(-1), stop_fd_(-1) {
   if (desc.type != BPF_MAP_TYPE_PERF_EVENT_ARRAY)
     throw std::invalid_argument("Table '" + desc.name +
                                 "' is not a perf buffer");
 }
 
-StatusTuple BPFPerfBuffer::open_on_cpu(perf_reader_raw_cb cb, perf_reader_lost_cb lost_cb,
-                                       void* cb_cookie, int page_cnt,
-                                       struct bcc_perf_buffer_opts& opts) {
-  if (cpu_readers_.find(opts.cpu) != cpu_readers_.end())
-    return StatusTuple(-1, "Perf buffer already open on CPU %d", opts.cpu);
-
-  auto reader = static_cast<perf_reader*>(
-      bpf_open_perf_buffer_opts(cb, lost_cb, cb_cookie, page_cnt, &opts));
-  if (reader == nullptr)
-    return StatusTuple(-1, "Unable to construct perf reader");
+StatusTuple BPFPerfBuffer::open_on_cpu(perf_reader* reader, int cpu) {
+  if (cpu_readers_.find(cpu) != cpu_readers_.end()) {
+    perf_reader_free(static_cast<void*>(reader));
+    return StatusTuple(-1, "Perf buffer already open on CPU %d", cpu);
+  }
 
   int reader_fd = perf_reader_fd(reader);
-  if (!update(&opts.cpu, &reader_fd)) {
+  if (!update(&cpu, &reader_fd)) {
     perf_reader_free(static_cast<void*>(reader));
-    return StatusTuple(-1, "Unable to open perf buffer on CPU %d: %s", opts.cpu,
+    return StatusTuple(-1, "Unable to open perf buffer on CPU %d: %s", cpu,
                        std::strerror(errno));
   }
 
@@ -424,7 +690,7 @@ StatusTuple BPFPerfBuffer::open_on_cpu(perf_reader_raw_cb cb, perf_reader_lost_c
                        std::strerror(errno));
   }
 
-  cpu_readers_[opts.cpu] = reader;
+  cpu_readers_[cpu] = reader;
   return StatusTuple::OK();
 }
 
@@ -452,7 +718,41 @@ StatusTuple BPFPerfBuffer::open_all_cpu(perf_reader_raw_cb cb,
       .cpu = i,
       .wakeup_events = wakeup_events,
     };
-    auto res = open_on_cpu(cb, lost_cb, cb_cookie, page_cnt, opts);
+    auto reader = static_cast<perf_reader*>(
+        bpf_open_perf_buffer_opts(cb, lost_cb, cb_cookie, page_cnt, &opts));
+    auto res = reader ? open_on_cpu(reader, i)
+                      : StatusTuple(-1, "Unable to construct perf reader");
+    if (!res.ok()) {
+      TRY2(close_all_cpu());
+      return res;
+    }
+  }
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFPerfBuffer::open_all_cpu(bcc_batch_cb cb,
+                                        perf_reader_lost_cb lost_cb,
+                                        void* cb_cookie, int page_cnt,
+                                        int wakeup_events,
+                                        const bcc_batch_opts& batch_opts) {
+  if (cpu_readers_.size() != 0 || epfd_ != -1)
+    return StatusTuple(-1, "Previously opened perf buffer not cleaned");
+
+  std::vector<int> cpus = get_online_cpus();
+  ep_events_.reset(new epoll_event[cpus.size()]);
+  epfd_ = epoll_create1(EPOLL_CLOEXEC);
+
+  for (int i : cpus) {
+    struct bcc_perf_buffer_opts opts = {
+      .pid = -1,
+      .cpu = i,
+      .wakeup_events = wakeup_events,
+    };
+    bcc_batch_opts cpu_batch_opts = batch_opts;
+    auto reader = static_cast<perf_reader*>(bpf_open_perf_buffer_batch(
+        cb, lost_cb, cb_cookie, page_cnt, &opts, &cpu_batch_opts));
+    auto res = reader ? open_on_cpu(reader, i)
+                      : StatusTuple(-1, "Unable to construct perf reader");
     if (!res.ok()) {
       TRY2(close_all_cpu());
       return res;
@@ -476,6 +776,12 @@ StatusTuple BPFPerfBuffer::close_all_cpu() {
   std::string errors;
   bool has_error = false;
 
+  auto stop_res = stop_consumer_threads();
+  if (!stop_res.ok()) {
+    has_error = true;
+    errors += stop_res.msg() + "\n";
+  }
+
   if (epfd_ >= 0) {
     int close_res = close(epfd_);
     epfd_ = -1;
@@ -504,23 +810,154 @@ StatusTuple BPFPerfBuffer::close_all_cpu() {
 }
 
 int BPFPerfBuffer::poll(int timeout_ms) {
-  if (epfd_ < 0)
+  if (epfd_ < 0 || !consumer_threads_.empty())
     return -1;
+  // Wake up in time to deliver pending batches
+  for (auto it : cpu_readers_)
+    timeout_ms = perf_reader_poll_timeout(it.second, timeout_ms);
   int cnt =
       epoll_wait(epfd_, ep_events_.get(), cpu_readers_.size(), timeout_ms);
   for (int i = 0; i < cnt; i++)
     perf_reader_event_read(static_cast<perf_reader*>(ep_events_[i].data.ptr));
+  for (auto it : cpu_readers_)
+    perf_reader_flush(it.second, 0);
   return cnt;
 }
 
 int BPFPerfBuffer::consume() {
-  if (epfd_ < 0)
+  if (epfd_ < 0 || !consumer_threads_.empty())
     return -1;
-  for (auto it : cpu_readers_)
+  for (auto it : cpu_readers_) {
     perf_reader_event_read(it.second);
+    perf_reader_flush(it.second, 1);
+  }
   return 0;
 }
 
+void BPFPerfBuffer::consumer_thread(int epfd,
+                                    std::vector<perf_reader*> readers) {
+  // One extra slot for the stop eventfd
+  std::vector<epoll_event> events(readers.size() + 1);
+  while (true) {
+    int timeout_ms = -1;
+    for (auto reader : readers)
+      timeout_ms = perf_reader_poll_timeout(reader, timeout_ms);
+    int cnt = epoll_wait(epfd, events.data(), events.size(), timeout_ms);
+    if (cnt < 0 && errno == EINTR)
+      continue;
+    if (cnt < 0)
+      return;
+    for (int i = 0; i < cnt; i++) {
+      // The stop eventfd is registered with a null pointer
+      if (events[i].data.ptr == nullptr)
+        return;
+      perf_reader_event_read(static_cast<perf_reader*>(events[i].data.ptr));
+    }
+    for (auto reader : readers)
+      perf_reader_flush(reader, 0);
+  }
+}
+
+StatusTuple BPFPerfBuffer::start_consumer_threads(int num_threads) {
+  if (epfd_ < 0)
+    return StatusTuple(-1, "Perf buffer is not open");
+  if (!consumer_threads_.empty())
+    return StatusTuple(-1, "Consumer threads already running");
+  if (num_threads <= 0)
+    return StatusTuple(-1, "Invalid number of consumer threads %d",
+                       num_threads);
+  if ((size_t)num_threads > cpu_readers_.size())
+    num_threads = cpu_readers_.size();
+
+  stop_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (stop_fd_ < 0)
+    return StatusTuple(-1, "Unable to create eventfd: %s",
+                       std::strerror(errno));
+
+  std::vector<std::vector<perf_reader*>> thread_readers(num_threads);
+  for (int i = 0; i < num_threads; i++) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+      int err = errno;
+      TRY2(stop_consumer_threads());
+      return StatusTuple(-1, "Unable to create epoll instance: %s",
+                         std::strerror(err));
+    }
+    consumer_epfds_.push_back(epfd);
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, stop_fd_, &event) != 0) {
+      int err = errno;
+      TRY2(stop_consumer_threads());
+      return StatusTuple(-1, "Unable to add eventfd to epoll: %s",
+                         std::strerror(err));
+    }
+  }
+
+  int i = 0;
+  for (auto it : cpu_readers_) {
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = static_cast<void*>(it.second);
+    if (epoll_ctl(consumer_epfds_[i], EPOLL_CTL_ADD, perf_reader_fd(it.second),
+                  &event) != 0) {
+      int err = errno;
+      TRY2(stop_consumer_threads());
+      return StatusTuple(-1, "Unable to add perf_reader FD to epoll: %s",
+                         std::strerror(err));
+    }
+    thread_readers[i].push_back(it.second);
+    i = (i + 1) % num_threads;
+  }
+
+  for (i = 0; i < num_threads; i++)
+    consumer_threads_.emplace_back(consumer_thread, consumer_epfds_[i],
+                                   std::move(thread_readers[i]));
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFPerfBuffer::stop_consumer_threads() {
+  std::string errors;
+
+  // The threads use the epoll fds and the readers until they exit, they are
+  // always joined before these are closed. The eventfd counter only ever
+  // gets 1 added, so the write can't fail for lack of room.
+  if (stop_fd_ >= 0 && !consumer_threads_.empty()) {
+    uint64_t val = 1;
+    ssize_t res;
+    while ((res = write(stop_fd_, &val, sizeof(val))) < 0 && errno == EINTR)
+      ;
+    if (res != sizeof(val))
+      errors += "Unable to stop consumer threads: " +
+                std::string(std::strerror(errno)) + "\n";
+  }
+  for (auto& thread : consumer_threads_)
+    thread.join();
+  consumer_threads_.clear();
+
+  for (int epfd : consumer_epfds_)
+    close(epfd);
+  consumer_epfds_.clear();
+  if (stop_fd_ >= 0) {
+    close(stop_fd_);
+    stop_fd_ = -1;
+  }
+
+  if (!errors.empty())
+    return StatusTuple(-1, errors);
+  return StatusTuple::OK();
+}
+
+std::map<int, PerfBufferCpuStats> BPFPerfBuffer::get_cpu_stats() {
+  std::map<int, PerfBufferCpuStats> stats;
+  for (auto it : cpu_readers_)
+    stats[it.first] = {perf_reader_consumed(it.second),
+                       perf_reader_lost(it.second)};
+  return stats;
+}
+
 BPFPerfBuffer::~BPFPerfBuffer() {
   auto res = close_all_cpu();
   if (!res.ok())
@@ -528,6 +965,194 @@ BPFPerfBuffer::~BPFPerfBuffer() {
               << std::endl;
 }
 
+BPFRingBuffer::BPFRingBuffer(const TableDesc& desc)
+    : BPFTableBase<int, int>(desc),
+      opened_(false),
+      batch_(nullptr),
+      epfd_(-1),
+      page_size_(getpagesize()),
+      mask_(desc.max_entries - 1),
+      consumer_pos_(nullptr),
+      producer_pos_(nullptr),
+      data_(nullptr),
+      read_pos_(0),
+      held_(false) {
+  if (desc.type != BPF_MAP_TYPE_RINGBUF)
+    throw std::invalid_argument("Table '" + desc.name +
+                                "' is not a ring buffer");
+}
+
+BPFRingBuffer::~BPFRingBuffer() {
+  auto res = close_reader();
+  if (!res.ok())
+    std::cerr << "Failed to close ring buffer reader of " << desc.name << ": "
+              << res.msg() << std::endl;
+  bcc_batch_free(batch_);
+}
+
+StatusTuple BPFRingBuffer::open(ring_buffer*& manager, ring_buffer_sample_fn cb,
+                                void* cb_cookie) {
+  if (opened_ || epfd_ >= 0)
+    return StatusTuple(-1, "Ring buffer %s already open", desc.name.c_str());
+
+  if (!manager) {
+    manager = static_cast<ring_buffer*>(bpf_new_ringbuf(desc.fd, cb, cb_cookie));
+    if (!manager)
+      return StatusTuple(-1, "Unable to create ring buffer manager for %s",
+                         desc.name.c_str());
+  } else if (bpf_add_ringbuf(manager, desc.fd, cb, cb_cookie) < 0) {
+    return StatusTuple(-1, "Unable to add ring buffer %s to manager",
+                       desc.name.c_str());
+  }
+  opened_ = true;
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFRingBuffer::open(ring_buffer*& manager, bcc_batch_cb cb,
+                                const bcc_batch_opts& batch_opts,
+                                void* cb_cookie) {
+  if (opened_ || epfd_ >= 0)
+    return StatusTuple(-1, "Ring buffer %s already open", desc.name.c_str());
+
+  bcc_batch_opts opts = batch_opts;
+  batch_ = bcc_batch_new(cb, cb_cookie, &opts);
+  if (!batch_)
+    return StatusTuple(-1, "Unable to allocate batch for ring buffer %s",
+                       desc.name.c_str());
+  auto res = open(manager, bcc_batch_ringbuf_cb, batch_);
+  if (!res.ok()) {
+    bcc_batch_free(batch_);
+    batch_ = nullptr;
+  }
+  return res;
+}
+
+int BPFRingBuffer::poll_timeout(int timeout_ms) {
+  return batch_ ? bcc_batch_poll_timeout(batch_, timeout_ms) : timeout_ms;
+}
+
+int BPFRingBuffer::flush(bool force) {
+  return batch_ ? bcc_batch_flush(batch_, force) : 0;
+}
+
+StatusTuple BPFRingBuffer::open_reader() {
+  if (opened_ || epfd_ >= 0)
+    return StatusTuple(-1, "Ring buffer %s already open", desc.name.c_str());
+  if (desc.max_entries == 0 || (desc.max_entries & mask_) != 0)
+    return StatusTuple(-1, "Invalid size %u of ring buffer %s",
+                       desc.max_entries, desc.name.c_str());
+
+  // The consumer position is the only writable page, the producer position
+  // is followed by the data pages, mapped twice so that records wrapping
+  // around the end of the ring can be read in place.
+  void* consumer = mmap(nullptr, page_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, desc.fd, 0);
+  if (consumer == MAP_FAILED)
+    return StatusTuple(-1, "Unable to map ring buffer %s: %s",
+                       desc.name.c_str(), std::strerror(errno));
+  void* producer = mmap(nullptr, page_size_ + 2 * (size_t)desc.max_entries,
+                        PROT_READ, MAP_SHARED, desc.fd, page_size_);
+  if (producer == MAP_FAILED) {
+    int err = errno;
+    munmap(consumer, page_size_);
+    return StatusTuple(-1, "Unable to map ring buffer %s: %s",
+                       desc.name.c_str(), std::strerror(err));
+  }
+  consumer_pos_ = static_cast<unsigned long*>(consumer);
+  producer_pos_ = static_cast<unsigned long*>(producer);
+  data_ = static_cast<uint8_t*>(producer) + page_size_;
+  read_pos_ = __atomic_load_n(consumer_pos_, __ATOMIC_ACQUIRE);
+  held_ = false;
+
+  epfd_ = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  if (epfd_ < 0 || epoll_ctl(epfd_, EPOLL_CTL_ADD, desc.fd, &event) != 0) {
+    int err = errno;
+    TRY2(close_reader());
+    return StatusTuple(-1, "Unable to poll ring buffer %s: %s",
+                       desc.name.c_str(), std::strerror(err));
+  }
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFRingBuffer::close_reader() {
+  bool has_error = false;
+  std::string errors;
+  if (epfd_ >= 0 && close(epfd_) != 0) {
+    has_error = true;
+    errors += std::string(std::strerror(errno)) + "\n";
+  }
+  epfd_ = -1;
+  if (consumer_pos_)
+    munmap(consumer_pos_, page_size_);
+  if (producer_pos_)
+    munmap(producer_pos_, page_size_ + 2 * (size_t)desc.max_entries);
+  consumer_pos_ = nullptr;
+  producer_pos_ = nullptr;
+  data_ = nullptr;
+
+  if (has_error)
+    return StatusTuple(-1, errors);
+  return StatusTuple::OK();
+}
+
+int BPFRingBuffer::wait(int timeout_ms) {
+  if (!data_)
+    return -1;
+  auto readable = [this]() {
+    return __atomic_load_n(producer_pos_, __ATOMIC_ACQUIRE) > read_pos_;
+  };
+  if (readable())
+    return 1;
+
+  // The ring polls as readable for as long as records returned by next() are
+  // not released, and the producer doesn't wake anyone up meanwhile, so
+  // there is nothing to block on
+  if (held_) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  struct epoll_event event;
+  int cnt = epoll_wait(epfd_, &event, 1, timeout_ms);
+  if (cnt < 0)
+    return errno == EINTR ? 0 : -1;
+  return cnt > 0 && readable() ? 1 : 0;
+}
+
+const void* BPFRingBuffer::next(size_t& size) {
+  if (!data_)
+    return nullptr;
+
+  unsigned long prod_pos = __atomic_load_n(producer_pos_, __ATOMIC_ACQUIRE);
+  while (read_pos_ < prod_pos) {
+    uint32_t* hdr = reinterpret_cast<uint32_t*>(data_ + (read_pos_ & mask_));
+    uint32_t len = __atomic_load_n(hdr, __ATOMIC_ACQUIRE);
+    // Reserved but not yet submitted, records after it have to wait
+    if (len & BPF_RINGBUF_BUSY_BIT)
+      break;
+    uint32_t rec_len = len & ~(BPF_RINGBUF_BUSY_BIT | BPF_RINGBUF_DISCARD_BIT);
+    read_pos_ += (rec_len + BPF_RINGBUF_HDR_SZ + 7) & ~7UL;
+    if (len & BPF_RINGBUF_DISCARD_BIT)
+      continue;
+    size = rec_len;
+    held_ = true;
+    return reinterpret_cast<uint8_t*>(hdr) + BPF_RINGBUF_HDR_SZ;
+  }
+  // Discarded records skipped with none held are given back right away, so
+  // that the ring doesn't keep polling as readable
+  if (!held_)
+    release();
+  return nullptr;
+}
+
+void BPFRingBuffer::release() {
+  if (consumer_pos_)
+    __atomic_store_n(consumer_pos_, read_pos_, __ATOMIC_RELEASE);
+  held_ = false;
+}
+
 BPFPerfEventArray::BPFPerfEventArray(const TableDesc& desc)
     : BPFTableBase<int, int>(desc) {
   if (desc.type != BPF_MAP_TYPE_PERF_EVENT_ARRAY)
@@ -752,3 +1377,110 @@ StatusTuple BPFSockhashTable::remove_value(const int& key) {
 }
 
 }  // namespace ebpf
+
+namespace {
+
+struct HistogramReader {
+  HistogramReader(ebpf::TableDesc&& desc,
+                  ebpf::BPFHistogramTable::Scale scale)
+      : desc(std::move(desc)), table(this->desc, scale) {}
+
+  ebpf::TableDesc desc;
+  ebpf::BPFHistogramTable table;
+  std::vector<ebpf::BPFHistogramTable::Histogram> hists;
+};
+
+}  // namespace
+
+extern "C" {
+
+void *bcc_hist_open(int map_fd, int map_type, size_t key_size,
+                    size_t leaf_size, size_t max_entries, int linear,
+                    size_t slot_offset, size_t slot_size) {
+  int fd = dup(map_fd);
+  if (fd < 0)
+    return nullptr;
+
+  ebpf::TableDesc desc("histogram", ebpf::FileDesc(fd), map_type, key_size,
+                       leaf_size, max_entries, 0);
+  try {
+    auto reader = new HistogramReader(
+        std::move(desc), linear ? ebpf::BPFHistogramTable::Scale::LINEAR
+                                : ebpf::BPFHistogramTable::Scale::LOG2);
+    auto res = reader->table.set_slot_field(slot_offset, slot_size);
+    if (!res.ok()) {
+      fprintf(stderr, "%s\n", res.msg().c_str());
+      delete reader;
+      return nullptr;
+    }
+    return reader;
+  } catch (const std::invalid_argument& e) {
+    fprintf(stderr, "%s\n", e.what());
+    return nullptr;
+  }
+}
+
+int bcc_hist_read(void *hist, int delta) {
+  auto reader = static_cast<HistogramReader *>(hist);
+  auto res = delta ? reader->table.read_delta(reader->hists)
+                   : reader->table.read(reader->hists);
+  if (!res.ok()) {
+    fprintf(stderr, "%s\n", res.msg().c_str());
+    return -1;
+  }
+  return reader->hists.size();
+}
+
+size_t bcc_hist_dropped(void *hist, uint64_t *max_slot) {
+  auto reader = static_cast<HistogramReader *>(hist);
+  if (max_slot)
+    *max_slot = reader->table.max_dropped_slot();
+  return reader->table.dropped();
+}
+
+const void *bcc_hist_section(void *hist, int i) {
+  auto reader = static_cast<HistogramReader *>(hist);
+  if (i < 0 || (size_t)i >= reader->hists.size() ||
+      reader->hists[i].section.empty())
+    return nullptr;
+  return reader->hists[i].section.data();
+}
+
+const uint64_t *bcc_hist_slots(void *hist, int i, size_t *nslots,
+                               uint64_t *total) {
+  auto reader = static_cast<HistogramReader *>(hist);
+  if (i < 0 || (size_t)i >= reader->hists.size())
+    return nullptr;
+  const auto &h = reader->hists[i];
+  *nslots = h.slots.size();
+  if (total)
+    *total = h.total;
+  return h.slots.data();
+}
+
+int bcc_hist_percentiles(void *hist, int i, const double *ps, size_t n,
+                         double *values) {
+  auto reader = static_cast<HistogramReader *>(hist);
+  if (i < 0 || (size_t)i >= reader->hists.size())
+    return -1;
+
+  // percentiles() walks the slots once for sorted percentiles
+  std::vector<std::pair<double, size_t>> sorted;
+  for (size_t j = 0; j < n; j++)
+    sorted.emplace_back(ps[j], j);
+  std::sort(sorted.begin(), sorted.end());
+  std::vector<double> sorted_ps;
+  for (const auto &p : sorted)
+    sorted_ps.push_back(p.first);
+
+  auto res = reader->table.percentiles(reader->hists[i], sorted_ps);
+  for (size_t j = 0; j < n; j++)
+    values[sorted[j].second] = res[j];
+  return 0;
+}
+
+void bcc_hist_free(void *hist) {
+  delete static_cast<HistogramReader *>(hist);
+}
+
+}
@@ -18,11 +18,14 @@
 
 #include <errno.h>
 #include <sys/epoll.h>
+#include <algorithm>
 #include <cstring>
 #include <exception>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -36,6 +39,9 @@
 
 namespace ebpf {
 
+// Kernel-internal ENOTSUPP, returned by some bpf() commands
+static const int kENOTSUPP = 524;
+
 template<class ValueType>
 class BPFQueueStackTableBase {
  public:
@@ -128,6 +134,50 @@ class BPFTableBase {
 
   bool remove(void* key) { return bpf_delete_elem(desc.fd, key) >= 0; }
 
+  // Reads the whole table batch_size entries at a time with
+  // BPF_MAP_LOOKUP_BATCH, or BPF_MAP_LOOKUP_AND_DELETE_BATCH if del is set,
+  // and calls cb with the keys and values of every batch. value_size is the
+  // size of one value as copied out by the kernel. Returns 0 on success, 1 if
+  // the kernel does not support batch operations on this table (cb has not
+  // been called then), and -1 with errno set on any other error.
+  int lookup_batch(
+      bool del, size_t batch_size, size_t value_size,
+      const std::function<void(const uint8_t*, const uint8_t*, uint32_t)>& cb) {
+    std::vector<uint8_t> keys, values;
+    __u32 in_batch = 0, out_batch = 0;
+    bool first_batch = true;
+
+    while (true) {
+      keys.resize(batch_size * desc.key_size);
+      values.resize(batch_size * value_size);
+      __u32 count = batch_size;
+      __u32* in = first_batch ? nullptr : &in_batch;
+      int ret = del ? bpf_lookup_and_delete_batch(desc.fd, in, &out_batch,
+                                                  keys.data(), values.data(),
+                                                  &count)
+                    : bpf_lookup_batch(desc.fd, in, &out_batch, keys.data(),
+                                       values.data(), &count);
+      if (ret < 0 && first_batch &&
+          (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP ||
+           errno == kENOTSUPP))
+        return 1;
+      if (ret < 0 && errno == ENOSPC && count == 0) {
+        // A single hash bucket holds more entries than the batch, retry the
+        // same position with a bigger buffer.
+        batch_size *= 2;
+        continue;
+      }
+      if (ret < 0 && errno != ENOENT)
+        return -1;
+      if (count > 0)
+        cb(keys.data(), values.data(), count);
+      if (ret < 0)
+        return 0;  // ENOENT, the whole table has been read
+      in_batch = out_batch;
+      first_batch = false;
+    }
+  }
+
   const TableDesc& desc;
 };
 
@@ -162,6 +212,18 @@ void* get_value_addr(std::vector<ValueType>& t) {
   return t.data();
 }
 
+template <class ValueType>
+void set_value_from_buf(ValueType& t, const uint8_t* buf, size_t size) {
+  memcpy(&t, buf, std::min(size, sizeof(t)));
+}
+
+template <class ValueType>
+void set_value_from_buf(std::vector<ValueType>& t, const uint8_t* buf,
+                        size_t size) {
+  t.resize(size / sizeof(ValueType));
+  memcpy(t.data(), buf, t.size() * sizeof(ValueType));
+}
+
 template<class ValueType>
 class BPFQueueStackTable : public BPFQueueStackTableBase<void> {
  public:
@@ -307,6 +369,14 @@ class BPFHashTable : public BPFTableBase<KeyType, ValueType> {
 
     StatusTuple r(0);
 
+    // Fall back to walking the table key by key if batch operations are not
+    // supported or fail midway.
+    if (batch_size_ > 0) {
+      if (read_batches(false, res) == 0)
+        return res;
+      res.clear();
+    }
+
     if (!this->first(&cur))
       return res;
 
@@ -323,12 +393,84 @@ class BPFHashTable : public BPFTableBase<KeyType, ValueType> {
   }
 
   StatusTuple clear_table_non_atomic() {
+    if (batch_size_ > 0) {
+      int rc = this->lookup_batch(true, batch_size_, batch_value_size(),
+                                  [](const uint8_t*, const uint8_t*, uint32_t) {});
+      if (rc < 0)
+        return StatusTuple(-1, "Error clearing table: %s",
+                           std::strerror(errno));
+      if (rc == 0)
+        return StatusTuple::OK();
+    }
+
     KeyType cur;
     while (this->first(&cur))
       TRY2(remove_value(cur));
 
     return StatusTuple::OK();
   }
+
+  // Reads and removes all entries of the table. With batch operations every
+  // entry is returned exactly once even if the table is concurrently updated;
+  // on kernels without them this falls back to a per-key lookup and delete,
+  // where updates racing with the walk may be lost.
+  StatusTuple get_and_clear_table(
+      std::vector<std::pair<KeyType, ValueType>>& res) {
+    res.clear();
+    if (batch_size_ > 0) {
+      int rc = read_batches(true, res);
+      if (rc < 0)
+        return StatusTuple(-1, "Error reading and clearing table: %s",
+                           std::strerror(errno));
+      if (rc == 0)
+        return StatusTuple::OK();
+    }
+
+    KeyType cur;
+    ValueType value;
+    while (this->first(&cur)) {
+      if (get_value(cur, value).ok())
+        res.emplace_back(cur, value);
+      TRY2(remove_value(cur));
+    }
+
+    return StatusTuple::OK();
+  }
+
+  // Number of entries read per BPF_MAP_*_BATCH syscall by get_table_offline(),
+  // get_and_clear_table() and clear_table_non_atomic(). 0 disables batch
+  // operations and always walks the table one key at a time.
+  void set_batch_size(size_t batch_size) { batch_size_ = batch_size; }
+  size_t get_batch_size() const { return batch_size_; }
+
+  static const size_t DEFAULT_BATCH_SIZE = 1024;
+
+ private:
+  size_t batch_value_size() {
+    if (this->desc.type == BPF_MAP_TYPE_PERCPU_HASH ||
+        this->desc.type == BPF_MAP_TYPE_LRU_PERCPU_HASH)
+      return ((this->desc.leaf_size + 7) & ~7) *
+             BPFTable::get_possible_cpu_count();
+    return this->desc.leaf_size;
+  }
+
+  int read_batches(bool del, std::vector<std::pair<KeyType, ValueType>>& res) {
+    size_t key_size = this->desc.key_size;
+    size_t value_size = batch_value_size();
+    return this->lookup_batch(
+        del, batch_size_, value_size,
+        [&](const uint8_t* keys, const uint8_t* values, uint32_t count) {
+          for (uint32_t i = 0; i < count; i++) {
+            KeyType key;
+            ValueType value;
+            memcpy(&key, keys + i * key_size, std::min(key_size, sizeof(key)));
+            set_value_from_buf(value, values + i * value_size, value_size);
+            res.emplace_back(key, value);
+          }
+        });
+  }
+
+  size_t batch_size_ = DEFAULT_BATCH_SIZE;
 };
 
 template <class KeyType, class ValueType>
@@ -365,6 +507,71 @@ class BPFPercpuHashTable
   unsigned int ncpus;
 };
 
+// Reads the u64 counters of a histogram map, as built by BPF_HISTOGRAM() with
+// bpf_log2l() slots or with linear slots, from an array or hash map and their
+// per-CPU variants. With a struct key (e.g. per-disk histograms) every
+// distinct key without its slot field is a section with its own histogram.
+class BPFHistogramTable : public BPFTableBase<void, void> {
+ public:
+  enum class Scale { LOG2, LINEAR };
+
+  struct Histogram {
+    // The key of the section with the slot field zeroed, empty for
+    // histograms without sections.
+    std::string section;
+    std::vector<uint64_t> slots;
+    uint64_t total;
+  };
+
+  explicit BPFHistogramTable(const TableDesc& desc, Scale scale = Scale::LOG2);
+
+  // Location of the slot in a struct key. By default it is the last 8 bytes
+  // of the key, or the whole key if it has no more than 8 bytes.
+  StatusTuple set_slot_field(size_t offset, size_t size);
+
+  // Reads all sections with one batch lookup where the kernel supports it,
+  // summing per-CPU counters. Sections are sorted by their key, read as
+  // little-endian integers. Entries with a slot past the last one are left
+  // out, see dropped().
+  StatusTuple read(std::vector<Histogram>& res);
+  // Same as read(), but returns the counts added since the previous call of
+  // read_delta(). Counters that went down, e.g. because the table was
+  // cleared, count from zero.
+  StatusTuple read_delta(std::vector<Histogram>& res);
+
+  // Estimated value below which p percent (0 <= p <= 100) of the counts fall,
+  // interpolated within the slot that holds it.
+  double percentile(const Histogram& hist, double p) const;
+  // Same as above for several percentiles in one pass, ps must be sorted.
+  std::vector<double> percentiles(const Histogram& hist,
+                                  const std::vector<double>& ps) const;
+
+  // Range [low, high] of values counted in slot.
+  std::pair<uint64_t, uint64_t> slot_range(size_t slot) const;
+
+  // Number of entries the last read left out because their slot was out of
+  // range, and the largest such slot.
+  size_t dropped() const { return dropped_; }
+  uint64_t max_dropped_slot() const { return max_dropped_slot_; }
+
+  static const size_t LOG2_MAX_SLOTS = 65;
+  static const size_t LINEAR_MAX_SLOTS = 1025;
+
+ private:
+  void add_entry(const uint8_t* key, const uint8_t* value,
+                 std::map<std::string, size_t>& index,
+                 std::vector<Histogram>& res);
+
+  Scale scale_;
+  size_t slot_offset_;
+  size_t slot_size_;
+  size_t max_slots_;
+  unsigned ncpus_;
+  size_t dropped_;
+  uint64_t max_dropped_slot_;
+  std::map<std::string, std::vector<uint64_t>> prev_;
+};
+
 // From src/cc/export/helpers.h
 static const int BPF_MAX_STACK_DEPTH = 127;
 struct stacktrace_t {
@@ -382,8 +589,22 @@ class BPFStackTable : public BPFTableBase<int, stacktrace_t> {
   void clear_table_non_atomic();
   std::vector<uintptr_t> get_stack_addr(int stack_id);
   std::vector<std::string> get_stack_symbol(int stack_id, int pid);
+  // Symbolizes several stacks of the same pid in one batch, the frames of
+  // missing stacks are left empty.
+  std::vector<std::vector<std::string>> get_stack_symbols(
+      const std::vector<int>& stack_ids, int pid);
+  // Loads the symbols of all modules of pid on up to max_threads threads (0
+  // for one per CPU) ahead of symbolizing its stacks.
+  void load_symbols(int pid, int max_threads = 0);
+  // Resolves n addresses of pid (-1 for the kernel) into syms in one batch.
+  // Names point into the symbol cache of pid and are valid until it is freed,
+  // demangled names must be released with bcc_symbol_free_demangle_name().
+  void resolve_addrs(int pid, const uint64_t* addrs, size_t n,
+                     bcc_symbol* syms);
 
  private:
+  void* get_symcache(int pid);
+
   bcc_symbol_option symbol_option_;
   std::map<int, void*> pid_sym_;
 };
@@ -408,6 +629,11 @@ class BPFStackBuildIdTable : public BPFTableBase<int, stacktrace_buildid_t> {
   bcc_symbol_option symbol_option_;
 };
 
+struct PerfBufferCpuStats {
+  uint64_t consumed;
+  uint64_t lost;
+};
+
 class BPFPerfBuffer : public BPFTableBase<int, int> {
  public:
   BPFPerfBuffer(const TableDesc& desc);
@@ -417,19 +643,99 @@ class BPFPerfBuffer : public BPFTableBase<int, int> {
                            void* cb_cookie, int page_cnt);
   StatusTuple open_all_cpu(perf_reader_raw_cb cb, perf_reader_lost_cb lost_cb,
                            void* cb_cookie, int page_cnt, int wakeup_events);
+  // Deliver the samples of every CPU to cb in batches, see bcc_batch_opts.
+  // Pending samples are delivered by poll() once they are due, and by
+  // consume() unconditionally.
+  StatusTuple open_all_cpu(bcc_batch_cb cb, perf_reader_lost_cb lost_cb,
+                           void* cb_cookie, int page_cnt, int wakeup_events,
+                           const bcc_batch_opts& batch_opts);
   StatusTuple close_all_cpu();
   int poll(int timeout_ms);
   int consume();
 
+  // Consume the per-CPU buffers on num_threads background threads instead of
+  // poll(), with the CPUs spread evenly over the threads and each thread
+  // waiting on its own epoll instance. The callbacks of different CPUs then
+  // run concurrently and must be thread safe. The raw data passed to them
+  // points into the ring buffer, and is only valid for the duration of the
+  // callback. poll() and consume() fail while the threads are running.
+  StatusTuple start_consumer_threads(int num_threads);
+  StatusTuple stop_consumer_threads();
+
+  std::map<int, PerfBufferCpuStats> get_cpu_stats();
+
  private:
-  StatusTuple open_on_cpu(perf_reader_raw_cb cb, perf_reader_lost_cb lost_cb,
-                          void* cb_cookie, int page_cnt, struct bcc_perf_buffer_opts& opts);
+  StatusTuple open_on_cpu(perf_reader* reader, int cpu);
   StatusTuple close_on_cpu(int cpu);
+  static void consumer_thread(int epfd, std::vector<perf_reader*> readers);
 
   std::map<int, perf_reader*> cpu_readers_;
 
   int epfd_;
   std::unique_ptr<epoll_event[]> ep_events_;
+
+  // eventfd which wakes the consumer threads up to exit
+  int stop_fd_;
+  std::vector<int> consumer_epfds_;
+  std::vector<std::thread> consumer_threads_;
+};
+
+// A BPF_RINGBUF_OUTPUT table. Records are either handed to callbacks by a
+// ring buffer manager, which polls every ring added to it on one epoll
+// instance, or read in place with next() and release(). A ring can't be read
+// both ways at once.
+class BPFRingBuffer : public BPFTableBase<int, int> {
+ public:
+  BPFRingBuffer(const TableDesc& desc);
+  ~BPFRingBuffer();
+
+  // Add the ring to manager, which is created if it is null, with cb called
+  // for every record. Records point into the ring and are only valid for the
+  // duration of the callback. The manager outlives the ring's batch and has
+  // to be freed with bpf_free_ringbuf() before the ring is destroyed.
+  StatusTuple open(ring_buffer*& manager, ring_buffer_sample_fn cb,
+                   void* cb_cookie);
+  // Same as above, but records are copied and handed to cb in batches, see
+  // bcc_batch_opts. poll_timeout() and flush() have to be called around
+  // every poll of the manager to deliver them.
+  StatusTuple open(ring_buffer*& manager, bcc_batch_cb cb,
+                   const bcc_batch_opts& batch_opts, void* cb_cookie);
+  // Returns timeout_ms, shortened to the time left until batched records are
+  // due.
+  int poll_timeout(int timeout_ms);
+  // Deliver the batched records if they are due, or unconditionally if force
+  // is set. Returns the number of records delivered.
+  int flush(bool force);
+
+  // Map the ring for reading records in place, without copies or callbacks.
+  StatusTuple open_reader();
+  StatusTuple close_reader();
+  // Wait up to timeout_ms for a record to read. Returns 1 if one is
+  // available, 0 on timeout and -1 on error. Must not be called while
+  // records returned by next() are held: it then returns 1 if a new record
+  // is already there, and fails with EBUSY otherwise.
+  int wait(int timeout_ms);
+  // Returns the next committed record and sets size, or nullptr if there is
+  // none yet. Discarded records are skipped. Records stay valid, and keep
+  // their space reserved in the ring, until release() is called, so hand
+  // them back quickly or the producer will start dropping records.
+  const void* next(size_t& size);
+  // Give the space of all records returned by next() back to the producer.
+  void release();
+
+ private:
+  bool opened_;
+  bcc_batch* batch_;
+
+  int epfd_;
+  size_t page_size_;
+  size_t mask_;
+  unsigned long* consumer_pos_;
+  unsigned long* producer_pos_;
+  uint8_t* data_;
+  unsigned long read_pos_;
+  // Records returned by next() are not released yet
+  bool held_;
 };
 
 class BPFPerfEventArray : public BPFTableBase<int, int> {
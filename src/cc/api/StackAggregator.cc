@@ -0,0 +1,289 @@
+#include <zlib.h>
+#include <map>
+#include <utility>
+
+#include "StackAggregator.h"
+
+namespace ebpf {
+
+namespace {
+
+const char* UNKNOWN_SYMBOL = "[unknown]";
+const char* KERNEL_MODULE = "[kernel.kallsyms]";
+
+// The few protobuf encodings needed by profile.proto
+class ProtoWriter {
+ public:
+  void varint(uint64_t v) {
+    while (v >= 0x80) {
+      buf_.push_back(static_cast<char>(v | 0x80));
+      v >>= 7;
+    }
+    buf_.push_back(static_cast<char>(v));
+  }
+  void uint(int field, uint64_t v) {
+    varint((uint64_t)field << 3);
+    varint(v);
+  }
+  void bytes(int field, const std::string& s) {
+    varint((uint64_t)field << 3 | 2);
+    varint(s.size());
+    buf_.append(s);
+  }
+  void packed(int field, const std::vector<uint64_t>& vs) {
+    ProtoWriter p;
+    for (uint64_t v : vs)
+      p.varint(v);
+    bytes(field, p.str());
+  }
+  void message(int field, const ProtoWriter& m) { bytes(field, m.str()); }
+
+  const std::string& str() const { return buf_; }
+
+ private:
+  std::string buf_;
+};
+
+class StringTable {
+ public:
+  StringTable() { id(""); }
+  uint64_t id(const std::string& s) {
+    auto it = ids_.find(s);
+    if (it != ids_.end())
+      return it->second;
+    ids_.emplace(s, strings_.size());
+    strings_.push_back(s);
+    return strings_.size() - 1;
+  }
+  const std::vector<std::string>& strings() const { return strings_; }
+
+ private:
+  std::unordered_map<std::string, uint64_t> ids_;
+  std::vector<std::string> strings_;
+};
+
+StatusTuple write_gzip(std::ostream& out, const std::string& data) {
+  z_stream zs = {};
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return StatusTuple(-1, "Unable to initialize gzip compression");
+
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  zs.avail_in = data.size();
+  char chunk[64 * 1024];
+  int ret;
+  do {
+    zs.next_out = reinterpret_cast<Bytef*>(chunk);
+    zs.avail_out = sizeof(chunk);
+    ret = deflate(&zs, Z_FINISH);
+    if (ret == Z_STREAM_ERROR)
+      break;
+    out.write(chunk, sizeof(chunk) - zs.avail_out);
+  } while (ret != Z_STREAM_END && out);
+  deflateEnd(&zs);
+
+  if (ret != Z_STREAM_END)
+    return StatusTuple(-1, "Unable to compress the profile");
+  if (!out)
+    return StatusTuple(-1, "Unable to write the profile");
+  return StatusTuple::OK();
+}
+
+}  // namespace
+
+StackAggregator::StackAggregator(BPFStackTable& stack_table)
+    : stack_table_(stack_table) {}
+
+void StackAggregator::add(const Sample& sample) {
+  std::string key = std::to_string(sample.pid) + ":" +
+                    std::to_string(sample.user_stack_id) + ":" +
+                    std::to_string(sample.kernel_stack_id) + ":" + sample.comm;
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    samples_[it->second].count += sample.count;
+    return;
+  }
+  index_.emplace(std::move(key), samples_.size());
+  samples_.push_back(sample);
+}
+
+void StackAggregator::clear() {
+  index_.clear();
+  samples_.clear();
+  sample_frames_.clear();
+  // Profiles only list the frames of the samples added after this
+  frames_.clear();
+  frame_ids_.clear();
+  symbols_.clear();
+}
+
+void StackAggregator::resolve() {
+  if (sample_frames_.size() == samples_.size())
+    return;
+
+  // Samples share stack ids, read every stack only once
+  std::map<std::pair<int, int>, std::vector<uint32_t>> stacks;
+  auto read_stack = [&](int pid, int stack_id) -> const std::vector<uint32_t>& {
+    auto key = std::make_pair(pid, stack_id);
+    auto it = stacks.find(key);
+    if (it != stacks.end())
+      return it->second;
+
+    std::vector<uint32_t>& ids = stacks[key];
+    for (uintptr_t addr : stack_table_.get_stack_addr(stack_id)) {
+      Frame frame = {pid, addr};
+      auto res = frame_ids_.emplace(frame, frames_.size());
+      if (res.second)
+        frames_.push_back(frame);
+      ids.push_back(res.first->second);
+    }
+    return ids;
+  };
+
+  for (size_t i = sample_frames_.size(); i < samples_.size(); i++) {
+    const Sample& sample = samples_[i];
+    std::vector<uint32_t> ids;
+    if (sample.kernel_stack_id >= 0)
+      ids = read_stack(-1, sample.kernel_stack_id);
+    if (sample.user_stack_id >= 0) {
+      const auto& user = read_stack(sample.pid, sample.user_stack_id);
+      ids.insert(ids.end(), user.begin(), user.end());
+    }
+    sample_frames_.push_back(std::move(ids));
+  }
+
+  // Symbolize the new frames in one batch per pid
+  std::map<int, std::vector<uint32_t>> by_pid;
+  for (size_t id = symbols_.size(); id < frames_.size(); id++)
+    by_pid[frames_[id].pid].push_back(id);
+  symbols_.resize(frames_.size());
+
+  std::vector<uint64_t> addrs;
+  std::vector<bcc_symbol> syms;
+  for (const auto& it : by_pid) {
+    int pid = it.first;
+    const auto& ids = it.second;
+    addrs.clear();
+    for (uint32_t id : ids)
+      addrs.push_back(frames_[id].addr);
+    syms.assign(ids.size(), bcc_symbol());
+    stack_table_.resolve_addrs(pid, addrs.data(), addrs.size(), syms.data());
+
+    for (size_t j = 0; j < ids.size(); j++) {
+      Symbol& sym = symbols_[ids[j]];
+      sym.kernel = pid < 0;
+      if (!syms[j].name) {
+        sym.name = UNKNOWN_SYMBOL;
+      } else {
+        sym.name = syms[j].demangle_name;
+        if (syms[j].module)
+          sym.module = syms[j].module;
+        bcc_symbol_free_demangle_name(&syms[j]);
+      }
+      if (sym.kernel && sym.module.empty())
+        sym.module = KERNEL_MODULE;
+    }
+  }
+}
+
+StatusTuple StackAggregator::write_folded(std::ostream& out, bool delimit) {
+  resolve();
+
+  std::string line;
+  for (size_t i = 0; i < samples_.size(); i++) {
+    const Sample& sample = samples_[i];
+    const auto& ids = sample_frames_[i];
+
+    line = sample.comm;
+    bool in_kernel = false;
+    // Frames are stored leaf first, folded stacks go from the root down
+    for (auto it = ids.rbegin(); it != ids.rend(); ++it) {
+      const Symbol& sym = symbols_[*it];
+      if (sym.kernel && !in_kernel) {
+        in_kernel = true;
+        if (delimit && sample.user_stack_id >= 0)
+          line += ";-";
+      }
+      line += ';';
+      line += sym.name;
+      if (sym.kernel)
+        line += "_[k]";
+    }
+    line += ' ';
+    line += std::to_string(sample.count);
+    line += '\n';
+    out << line;
+    if (!out)
+      return StatusTuple(-1, "Unable to write folded stacks");
+  }
+  return StatusTuple::OK();
+}
+
+StatusTuple StackAggregator::write_pprof(std::ostream& out,
+                                         const std::string& sample_type,
+                                         const std::string& sample_unit) {
+  resolve();
+
+  StringTable strings;
+  ProtoWriter profile;
+
+  ProtoWriter value_type;
+  value_type.uint(1, strings.id(sample_type));
+  value_type.uint(2, strings.id(sample_unit));
+  profile.message(1, value_type);
+
+  uint64_t pid_key = strings.id("pid"), comm_key = strings.id("comm");
+  std::vector<uint64_t> location_ids;
+  for (size_t i = 0; i < samples_.size(); i++) {
+    const Sample& sample = samples_[i];
+    location_ids.clear();
+    for (uint32_t id : sample_frames_[i])
+      location_ids.push_back(id + 1);
+
+    ProtoWriter s;
+    s.packed(1, location_ids);
+    s.packed(2, {sample.count});
+    ProtoWriter pid_label;
+    pid_label.uint(1, pid_key);
+    pid_label.uint(3, sample.pid);
+    s.message(3, pid_label);
+    if (!sample.comm.empty()) {
+      ProtoWriter comm_label;
+      comm_label.uint(1, comm_key);
+      comm_label.uint(2, strings.id(sample.comm));
+      s.message(3, comm_label);
+    }
+    profile.message(2, s);
+  }
+
+  // One location per unique frame, one function per unique symbol
+  std::map<std::pair<std::string, std::string>, uint64_t> functions;
+  for (size_t id = 0; id < frames_.size(); id++) {
+    const Symbol& sym = symbols_[id];
+    auto res = functions.emplace(std::make_pair(sym.name, sym.module),
+                                 functions.size() + 1);
+    if (res.second) {
+      ProtoWriter function;
+      function.uint(1, res.first->second);
+      function.uint(2, strings.id(sym.name));
+      function.uint(3, strings.id(sym.name));
+      function.uint(4, strings.id(sym.module));
+      profile.message(5, function);
+    }
+
+    ProtoWriter line;
+    line.uint(1, res.first->second);
+    ProtoWriter location;
+    location.uint(1, id + 1);
+    location.uint(3, frames_[id].addr);
+    location.message(4, line);
+    profile.message(4, location);
+  }
+
+  for (const auto& s : strings.strings())
+    profile.bytes(6, s);
+
+  return write_gzip(out, profile.str());
+}
+
+}  // namespace ebpf
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "BPFTable.h"
+#include "bcc_exception.h"
+
+namespace ebpf {
+
+// Aggregates the samples of a profiler (pid, user and kernel stack ids and a
+// count) and writes them as folded stacks or as a pprof profile. The frames of
+// every stack are read once and every unique (pid, address) is symbolized
+// once, in one batch per pid, however many stacks it appears in.
+class StackAggregator {
+ public:
+  struct Sample {
+    int pid;
+    int user_stack_id;
+    int kernel_stack_id;
+    uint64_t count;
+    std::string comm;
+  };
+
+  explicit StackAggregator(BPFStackTable& stack_table);
+
+  // Samples with the same pid, comm and stack ids are merged
+  void add(const Sample& sample);
+
+  // Adds every entry of a counts table, to_sample fills in the sample of a
+  // key, the count is the value of the entry.
+  template <class KeyType>
+  void add_counts(
+      BPFHashTable<KeyType, uint64_t>& counts,
+      const std::function<void(const KeyType&, Sample&)>& to_sample) {
+    for (const auto& entry : counts.get_table_offline()) {
+      Sample sample = {-1, -1, -1, entry.second, ""};
+      to_sample(entry.first, sample);
+      add(sample);
+    }
+  }
+
+  size_t size() const { return samples_.size(); }
+  void clear();
+
+  // One line per sample, "comm;user frames;kernel frames count" from the root
+  // down, kernel frames with a "_[k]" suffix. delimit puts a "-" frame between
+  // the user and the kernel stack.
+  StatusTuple write_folded(std::ostream& out, bool delimit = false);
+  // A gzip compressed profile.proto message with one sample type, the pid and
+  // comm of the samples are labels.
+  StatusTuple write_pprof(std::ostream& out,
+                          const std::string& sample_type = "samples",
+                          const std::string& sample_unit = "count");
+
+ private:
+  struct Frame {
+    int pid;
+    uint64_t addr;
+    bool operator==(const Frame& o) const {
+      return pid == o.pid && addr == o.addr;
+    }
+  };
+  struct FrameHash {
+    size_t operator()(const Frame& f) const {
+      return std::hash<uint64_t>()(f.addr ^ ((uint64_t)(uint32_t)f.pid << 48));
+    }
+  };
+  struct Symbol {
+    std::string name;
+    std::string module;
+    bool kernel;
+  };
+
+  // Reads the stacks of all samples and symbolizes their frames, the frames
+  // of a sample are indexes into symbols_ (kernel first, leaf first).
+  void resolve();
+
+  BPFStackTable& stack_table_;
+  std::unordered_map<std::string, size_t> index_;
+  std::vector<Sample> samples_;
+  std::vector<std::vector<uint32_t>> sample_frames_;
+  std::vector<Symbol> symbols_;
+  std::unordered_map<Frame, uint32_t, FrameHash> frame_ids_;
+  std::vector<Frame> frames_;
+};
+
+}  // namespace ebpf
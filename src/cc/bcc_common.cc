@@ -47,6 +47,12 @@ void bpf_module_destroy(void *program) {
   delete mod;
 }
 
+int bpf_module_release_compiler_memory(void *program, size_t *freed) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return -1;
+  return mod->release_compiler_memory(freed);
+}
+
 size_t bpf_num_functions(void *program) {
   auto mod = static_cast<ebpf::BPFModule *>(program);
   if (!mod) return 0;
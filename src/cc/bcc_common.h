@@ -32,6 +32,18 @@ void * bpf_module_create_c_from_string(const char *text, unsigned flags, const c
                                        const char *dev_name);
 bool bpf_module_rw_engine_enabled();
 void bpf_module_destroy(void *program);
+int bpf_module_release_compiler_memory(void *program, size_t *freed);
+
+// Kernel headers read by the compiles of the process are kept in memory until
+// bcc_header_cache_release() or free_bcc_memory() drops them
+struct bcc_header_cache_stats {
+  uint64_t files;   // files, and headers found missing, held
+  uint64_t bytes;   // contents of the files held
+  uint64_t hits;    // lookups served from memory
+  uint64_t misses;  // lookups which went to disk
+};
+void bcc_header_cache_get_stats(struct bcc_header_cache_stats *stats);
+void bcc_header_cache_release();
 char * bpf_module_license(void *program);
 unsigned bpf_module_kern_version(void *program);
 size_t bpf_num_functions(void *program);
@@ -66,6 +78,31 @@ int bpf_table_leaf_sscanf(void *program, size_t id, const char *buf, void *leaf)
 size_t bpf_perf_event_fields(void *program, const char *event);
 const char * bpf_perf_event_field(void *program, const char *event, size_t i);
 
+/* Reader of a log2 (linear == 0) or linear histogram map with u64 counters,
+ * see ebpf::BPFHistogramTable. The slot is slot_size bytes at slot_offset in
+ * the key, the rest of the key selects the section.
+ */
+void * bcc_hist_open(int map_fd, int map_type, size_t key_size,
+                     size_t leaf_size, size_t max_entries, int linear,
+                     size_t slot_offset, size_t slot_size);
+/* Reads the map, or the counts added since the previous delta read, and
+ * returns the number of sections or -1 on error.
+ */
+int bcc_hist_read(void *hist, int delta);
+/* Number of entries the last read left out because their slot was out of
+ * range, the largest of their slots is stored in max_slot if not NULL.
+ */
+size_t bcc_hist_dropped(void *hist, uint64_t *max_slot);
+/* Key of section i of the last read with its slot zeroed, NULL if the map
+ * has no sections.
+ */
+const void * bcc_hist_section(void *hist, int i);
+const uint64_t * bcc_hist_slots(void *hist, int i, size_t *nslots,
+                                uint64_t *total);
+int bcc_hist_percentiles(void *hist, int i, const double *ps, size_t n,
+                         double *values);
+void bcc_hist_free(void *hist);
+
 struct bpf_insn;
 int bcc_func_load(void *program, int prog_type, const char *name,
                   const struct bpf_insn *insns, int prog_len,
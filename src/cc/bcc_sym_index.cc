@@ -0,0 +1,259 @@
+#include "bcc_sym_index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "bcc_elf.h"
+#include "bcc_syms.h"
+#include "common.h"
+#include "file_desc.h"
+#include "vendor/tinyformat.hpp"
+
+namespace {
+
+const char INDEX_MAGIC[8] = {'B', 'C', 'C', 'S', 'Y', 'M', 'I', 'X'};
+const uint32_t INDEX_VERSION = 1;
+const uint64_t INDEX_ALIGN = 4096;
+
+struct IndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  char buildid[64];
+  uint64_t nsyms;
+  uint64_t starts_off;
+  uint64_t sizes_off;
+  uint64_t name_offs_off;
+  uint64_t strings_off;
+  uint64_t strings_size;
+};
+
+uint64_t align_up(uint64_t v) {
+  return (v + INDEX_ALIGN - 1) & ~(INDEX_ALIGN - 1);
+}
+
+bool write_all(int fd, const void *data, size_t size) {
+  const char *p = static_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t ret = ::write(fd, p, size);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    p += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+// Indexes are mapped and trusted as they are, another user able to write to
+// the directory could make them name the wrong symbols
+const char *index_dir() {
+  static const char *dir = []() -> const char * {
+    const char *dir = ::getenv("BCC_SYMBOL_INDEX_DIR");
+    if (!dir || !*dir || !ebpf::private_cache_dir(dir))
+      return nullptr;
+    return dir;
+  }();
+  return dir;
+}
+
+int add_symbol(const char *symname, uint64_t start, uint64_t size,
+               void *payload) {
+  auto p = static_cast<std::pair<std::vector<SymbolIndex::Symbol> *,
+                                 std::string *> *>(payload);
+  p->first->push_back({start, size, p->second->size()});
+  p->second->append(symname);
+  p->second->push_back('\0');
+  return 0;
+}
+
+}  // namespace
+
+SymbolIndex::~SymbolIndex() {
+  if (map_)
+    munmap(map_, map_size_);
+}
+
+std::unique_ptr<SymbolIndex> SymbolIndex::get(
+    const char *path, const std::string &buildid,
+    struct bcc_symbol_option *option) {
+  const char *dir = index_dir();
+  if (!dir || buildid.empty())
+    return nullptr;
+
+  // A stripped binary and its unstripped build share the build id, but not
+  // their symbols, so the file itself is part of the key. Names are resolved
+  // when building the index, lazy_symbolize doesn't change its content.
+  struct stat st;
+  if (::stat(path, &st) != 0)
+    return nullptr;
+  std::string index_path = tfm::format(
+      "%s/%s-%llx-%llx-%llx-%llx.%lx-%u-%u-%x.symidx", dir, buildid,
+      (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+      (unsigned long long)st.st_size, (unsigned long long)st.st_mtim.tv_sec,
+      (long)st.st_mtim.tv_nsec, option->use_debug_file,
+      option->check_debug_file_crc, option->use_symbol_type);
+  std::unique_ptr<SymbolIndex> index = open(index_path, buildid);
+  if (index)
+    return index;
+
+  std::vector<Symbol> syms;
+  std::string strings;
+  auto payload = std::make_pair(&syms, &strings);
+  if (bcc_elf_foreach_sym(path, add_symbol, option, &payload) < 0)
+    return nullptr;
+  if (!write(index_path, buildid, syms, strings))
+    return nullptr;
+  return open(index_path, buildid);
+}
+
+bool SymbolIndex::write(const std::string &path, const std::string &buildid,
+                        std::vector<Symbol> &syms,
+                        const std::string &strings) {
+  IndexHeader hdr = {};
+  if (buildid.size() >= sizeof(hdr.buildid) || strings.size() > UINT32_MAX)
+    return false;
+
+  std::sort(syms.begin(), syms.end(), [](const Symbol &a, const Symbol &b) {
+    return a.start < b.start;
+  });
+
+  memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+  hdr.version = INDEX_VERSION;
+  hdr.header_size = sizeof(hdr);
+  memcpy(hdr.buildid, buildid.c_str(), buildid.size());
+  hdr.nsyms = syms.size();
+  hdr.starts_off = align_up(sizeof(hdr));
+  hdr.sizes_off = align_up(hdr.starts_off + syms.size() * sizeof(uint64_t));
+  hdr.name_offs_off = align_up(hdr.sizes_off + syms.size() * sizeof(uint64_t));
+  hdr.strings_off =
+      align_up(hdr.name_offs_off + syms.size() * sizeof(uint32_t));
+  hdr.strings_size = strings.size();
+
+  std::vector<uint64_t> starts, sizes;
+  std::vector<uint32_t> name_offs;
+  starts.reserve(syms.size());
+  sizes.reserve(syms.size());
+  name_offs.reserve(syms.size());
+  for (const Symbol &sym : syms) {
+    starts.push_back(sym.start);
+    sizes.push_back(sym.size);
+    name_offs.push_back(sym.name_off);
+  }
+
+  // Write to a temporary file and rename it into place, so concurrent readers
+  // never map a partially written index.
+  std::string tmp_path = path + ".XXXXXX";
+  int fd = mkstemp(&tmp_path[0]);
+  if (fd < 0)
+    return false;
+  fchmod(fd, 0644);
+
+  // Every array starts on a page boundary, pad the end of the previous one
+  uint64_t pos = 0;
+  auto write_section = [&](uint64_t off, const void *data, uint64_t size) {
+    static const char zeros[INDEX_ALIGN] = {};
+    if (!write_all(fd, zeros, off - pos) || !write_all(fd, data, size))
+      return false;
+    pos = off + size;
+    return true;
+  };
+  bool ok = write_section(0, &hdr, sizeof(hdr)) &&
+            write_section(hdr.starts_off, starts.data(),
+                          starts.size() * sizeof(uint64_t)) &&
+            write_section(hdr.sizes_off, sizes.data(),
+                          sizes.size() * sizeof(uint64_t)) &&
+            write_section(hdr.name_offs_off, name_offs.data(),
+                          name_offs.size() * sizeof(uint32_t)) &&
+            write_section(hdr.strings_off, strings.data(), strings.size());
+  if (::close(fd) != 0)
+    ok = false;
+  if (!ok || ::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    ::unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<SymbolIndex> SymbolIndex::open(const std::string &path,
+                                               const std::string &buildid) {
+  ebpf::FileDesc fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0)
+    return nullptr;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(IndexHeader))
+    return nullptr;
+
+  void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    return nullptr;
+
+  std::unique_ptr<SymbolIndex> index(new SymbolIndex());
+  index->map_ = map;
+  index->map_size_ = st.st_size;
+
+  const IndexHeader *hdr = static_cast<const IndexHeader *>(map);
+  uint64_t size = st.st_size;
+  uint64_t n = hdr->nsyms;
+  auto section_ok = [&](uint64_t off, uint64_t len) {
+    return off % INDEX_ALIGN == 0 && off <= size && len <= size - off;
+  };
+  if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != INDEX_VERSION || hdr->header_size != sizeof(*hdr) ||
+      strncmp(hdr->buildid, buildid.c_str(), sizeof(hdr->buildid)) != 0 ||
+      n > size / sizeof(uint64_t) ||
+      !section_ok(hdr->starts_off, n * sizeof(uint64_t)) ||
+      !section_ok(hdr->sizes_off, n * sizeof(uint64_t)) ||
+      !section_ok(hdr->name_offs_off, n * sizeof(uint32_t)) ||
+      !section_ok(hdr->strings_off, hdr->strings_size))
+    return nullptr;
+
+  const char *base = static_cast<const char *>(map);
+  // Names are only handed out if they are terminated inside the pool
+  if (hdr->strings_size &&
+      base[hdr->strings_off + hdr->strings_size - 1] != '\0')
+    return nullptr;
+
+  index->nsyms_ = n;
+  index->starts_ = reinterpret_cast<const uint64_t *>(base + hdr->starts_off);
+  index->sizes_ = reinterpret_cast<const uint64_t *>(base + hdr->sizes_off);
+  index->name_offs_ =
+      reinterpret_cast<const uint32_t *>(base + hdr->name_offs_off);
+  index->strings_ = base + hdr->strings_off;
+  index->strings_size_ = hdr->strings_size;
+  return index;
+}
+
+bool SymbolIndex::find(uint64_t offset, const char **name,
+                       uint64_t *sym_offset) const {
+  const uint64_t *it = std::upper_bound(starts_, starts_ + nsyms_, offset);
+  if (it == starts_)
+    return false;
+
+  size_t i = it - starts_ - 1;
+  uint64_t limit = starts_[i];
+  for (; offset >= starts_[i]; --i) {
+    if (offset < starts_[i] + sizes_[i]) {
+      if (name_offs_[i] >= strings_size_)
+        return false;
+      *name = strings_ + name_offs_[i];
+      *sym_offset = offset - starts_[i];
+      return true;
+    }
+    if (limit > starts_[i] + sizes_[i])
+      break;
+    if (i == 0)
+      break;
+  }
+  return false;
+}
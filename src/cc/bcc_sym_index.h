@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct bcc_symbol_option;
+
+/// SymbolIndex is a read-only, pre-sorted symbol table of an ELF file stored
+/// on disk and mapped into memory, so resolving an address is a binary search
+/// over the mapping without any heap allocation, and the pages are shared by
+/// all processes using the same index.
+///
+/// The file starts with a header, followed by page aligned arrays of the
+/// symbol start addresses, their sizes and the offsets of their names in a
+/// pool of NUL terminated strings. Values are stored in host byte order.
+///
+/// Indexes are kept in the directory named by BCC_SYMBOL_INDEX_DIR, keyed by
+/// the build id and the identity of the ELF file and the symbol options, and
+/// are not used unless it is set. A directory other users can write to is
+/// refused.
+class SymbolIndex {
+ public:
+  struct Symbol {
+    uint64_t start;
+    uint64_t size;
+    uint64_t name_off;  // offset of the name in the string pool
+  };
+
+  ~SymbolIndex();
+
+  // Returns the index of the ELF file at path with the given build id,
+  // creating it if it doesn't exist yet, or nullptr if indexes are disabled
+  // or the index can't be created.
+  static std::unique_ptr<SymbolIndex> get(const char *path,
+                                          const std::string &buildid,
+                                          struct bcc_symbol_option *option);
+
+  // Writes syms, sorted by start address by this function, with the names
+  // they point to in strings atomically to path.
+  static bool write(const std::string &path, const std::string &buildid,
+                    std::vector<Symbol> &syms, const std::string &strings);
+  static std::unique_ptr<SymbolIndex> open(const std::string &path,
+                                           const std::string &buildid);
+
+  // Finds the symbol containing offset, walking back over nested symbols the
+  // way ProcSyms::Module::find_addr does.
+  bool find(uint64_t offset, const char **name, uint64_t *sym_offset) const;
+
+  uint64_t size() const { return nsyms_; }
+  uint64_t mapped_bytes() const { return map_size_; }
+
+ private:
+  SymbolIndex() = default;
+
+  void *map_ = nullptr;
+  uint64_t map_size_ = 0;
+  uint64_t nsyms_ = 0;
+  const uint64_t *starts_ = nullptr;
+  const uint64_t *sizes_ = nullptr;
+  const uint32_t *name_offs_ = nullptr;
+  const char *strings_ = nullptr;
+  uint64_t strings_size_ = 0;
+};
@@ -28,7 +28,11 @@
 #include <unistd.h>
 
 #include <cstdio>
+#include <cstdlib>
+#include <atomic>
 #include <cstring>
+#include <list>
+#include <thread>
 
 #include "bcc_elf.h"
 #include "bcc_perf_map.h"
@@ -113,59 +117,319 @@ ProcStat::ProcStat(int pid)
   refresh_root();
 }
 
-void KSyms::_add_symbol(const char *symname, const char *modname, uint64_t addr, void *p) {
-  KSyms *ks = static_cast<KSyms *>(p);
-  ks->syms_.emplace_back(symname, modname, addr);
+std::string KSyms::Table::modules_digest() {
+  // Name, size and address of every loaded module, the other fields of
+  // /proc/modules change with their use. The address is the 6th field, it
+  // can be followed by the taint flags. It reads as 0 under kptr_restrict,
+  // so a module reloaded under the same name is told apart by its sysfs
+  // directory, which is created anew with each load.
+  std::string digest;
+  FILE *modules = fopen("/proc/modules", "r");
+  if (!modules)
+    return digest;
+  char line[4096];
+  while (fgets(line, sizeof(line), modules)) {
+    char name[256], size[32], addr[32];
+    if (sscanf(line, "%255s %31s %*s %*s %*s %31s", name, size, addr) != 3)
+      continue;
+    struct stat st = {};
+    stat(tfm::format("/sys/module/%s", name).c_str(), &st);
+    digest.append(tfm::format("%s %s %s %lu %ld.%09ld\n", name, size, addr,
+                              (unsigned long)st.st_ino, (long)st.st_ctim.tv_sec,
+                              (long)st.st_ctim.tv_nsec));
+  }
+  fclose(modules);
+  return digest;
 }
 
-void KSyms::refresh() {
-  if (syms_.empty()) {
-    bcc_procutils_each_ksym(_add_symbol, this);
-    std::sort(syms_.begin(), syms_.end());
+void KSyms::Table::_add_symbol(const char *symname, const char *modname,
+                               uint64_t addr, void *p) {
+  auto payload =
+      static_cast<std::pair<Table *, std::unordered_map<std::string, uint32_t> *> *>(p);
+  Table *t = payload->first;
+
+  auto mod = payload->second->find(modname);
+  if (mod == payload->second->end()) {
+    mod = payload->second->emplace(modname, t->strings_.size()).first;
+    t->strings_.append(modname);
+    t->strings_.push_back('\0');
   }
+
+  t->syms_.push_back({addr, (uint32_t)t->strings_.size(), mod->second});
+  t->strings_.append(symname);
+  t->strings_.push_back('\0');
 }
 
-bool KSyms::resolve_addr(uint64_t addr, struct bcc_symbol *sym, bool demangle) {
-  refresh();
+std::shared_ptr<const KSyms::Table> KSyms::Table::get() {
+  static std::mutex mutex;
+  static std::shared_ptr<const Table> current;
+
+  std::string digest = modules_digest();
+  std::lock_guard<std::mutex> guard(mutex);
+  if (current && current->modules_digest_ == digest)
+    return current;
+
+  std::shared_ptr<Table> table = std::make_shared<Table>();
+  table->modules_digest_ = std::move(digest);
+  std::unordered_map<std::string, uint32_t> mods;
+  auto payload = std::make_pair(table.get(), &mods);
+  bcc_procutils_each_ksym(_add_symbol, &payload);
+  // Aliases keep their kallsyms order, resolve_addr returns the last one
+  std::stable_sort(table->syms_.begin(), table->syms_.end(),
+                   [](const Symbol &a, const Symbol &b) {
+                     return a.addr < b.addr;
+                   });
+  table->syms_.shrink_to_fit();
+  table->strings_.shrink_to_fit();
+  current = table;
+  return current;
+}
 
-  std::vector<Symbol>::iterator it;
+bool KSyms::Table::resolve_addr(uint64_t addr, struct bcc_symbol *sym,
+                                bool demangle) const {
+  auto it = std::upper_bound(
+      syms_.begin(), syms_.end(), addr,
+      [](uint64_t addr, const Symbol &sym) { return addr < sym.addr; });
+  if (it == syms_.begin()) {
+    memset(sym, 0, sizeof(struct bcc_symbol));
+    return false;
+  }
 
-  if (syms_.empty())
-    goto unknown_symbol;
+  it--;
+  sym->name = &strings_[it->name];
+  if (demangle)
+    sym->demangle_name = sym->name;
+  sym->module = &strings_[it->mod];
+  sym->offset = addr - it->addr;
+  return true;
+}
 
-  it = std::upper_bound(syms_.begin(), syms_.end(), Symbol("", "", addr));
-  if (it != syms_.begin()) {
-    it--;
-    sym->name = (*it).name.c_str();
-    if (demangle)
-      sym->demangle_name = sym->name;
-    sym->module = (*it).mod.c_str();
-    sym->offset = addr - (*it).addr;
-    return true;
-  }
+bool KSyms::Table::resolve_name(const char *name, uint64_t *addr) const {
+  std::call_once(by_name_once_, [this]() {
+    by_name_.resize(syms_.size());
+    for (size_t i = 0; i < syms_.size(); i++)
+      by_name_[i] = i;
+    std::stable_sort(by_name_.begin(), by_name_.end(),
+                     [this](uint32_t a, uint32_t b) {
+                       return strcmp(&strings_[syms_[a].name],
+                                     &strings_[syms_[b].name]) < 0;
+                     });
+  });
+
+  auto less = [this](uint32_t i, const char *name) {
+    return strcmp(&strings_[syms_[i].name], name) < 0;
+  };
+  auto it = std::lower_bound(by_name_.begin(), by_name_.end(), name, less);
+  if (it == by_name_.end() || strcmp(&strings_[syms_[*it].name], name) != 0)
+    return false;
 
-unknown_symbol:
-  memset(sym, 0, sizeof(struct bcc_symbol));
-  return false;
+  // Of symbols sharing a name, return the one with the highest address
+  auto end = std::upper_bound(
+      it, by_name_.end(), name, [this](const char *name, uint32_t i) {
+        return strcmp(name, &strings_[syms_[i].name]) < 0;
+      });
+  *addr = syms_[*(end - 1)].addr;
+  return true;
+}
+
+KSyms::KSyms() : table_(Table::get()) {}
+
+void KSyms::refresh() {
+  table_ = Table::get();
+}
+
+bool KSyms::resolve_addr(uint64_t addr, struct bcc_symbol *sym, bool demangle) {
+  return table_->resolve_addr(addr, sym, demangle);
 }
 
 bool KSyms::resolve_name(const char *_unused, const char *name,
                          uint64_t *addr) {
-  refresh();
+  return table_->resolve_name(name, addr);
+}
+
+const std::string *ProcSyms::SymbolTable::add_name(std::string name) {
+  auto res = symnames_.emplace(std::move(name));
+  // Names are counted with the overhead of their hash set node
+  if (res.second)
+    names_bytes_ +=
+        sizeof(std::string) + 2 * sizeof(void *) + res.first->capacity();
+  return &*res.first;
+}
+
+size_t ProcSyms::SymbolTable::bytes() const {
+  // Approximation of the heap usage
+  size_t bytes =
+      sizeof(*this) + syms_.capacity() * sizeof(Symbol) + names_bytes_;
+  if (index_)
+    bytes += index_->mapped_bytes();
+  return bytes;
+}
 
-  if (syms_.size() != symnames_.size()) {
-    symnames_.clear();
-    for (Symbol &sym : syms_) {
-      symnames_[sym.name] = sym.addr;
+// SymbolTableRegistry keeps the symbol tables of ELF modules for the whole
+// process. Tables are identified by the device, inode, mtime and size of the
+// file and the symbol options they were read with, so the ProcSyms of
+// different processes mapping the same binary, or different symbolizers of
+// the same process, share one table. Tables no longer used by any ProcSyms stay cached
+// until the total memory held exceeds the budget, and are then evicted least
+// recently used first.
+class ProcSyms::SymbolTableRegistry {
+ public:
+  static SymbolTableRegistry &instance() {
+    // Never destroyed, ProcSyms instances may outlive static destructors.
+    static SymbolTableRegistry *registry = new SymbolTableRegistry();
+    return *registry;
+  }
+
+  std::shared_ptr<SymbolTable> get(std::shared_ptr<ModulePath> path,
+                                   bcc_symbol_option *option);
+  void get_stats(struct bcc_symcache_stats *stats);
+  void set_budget(uint64_t bytes);
+
+ private:
+  SymbolTableRegistry();
+  static uint64_t table_bytes(SymbolTable &table);
+  void evict();
+
+  struct Entry {
+    std::shared_ptr<SymbolTable> table;
+    std::list<std::string>::iterator lru;
+    // Size of the table when last accounted in bytes_
+    uint64_t bytes;
+  };
+  void update_bytes(Entry &entry);
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> tables_;
+  // Most recently used first
+  std::list<std::string> lru_;
+  // Total of the bytes of the entries. Tables grow as names are resolved
+  // lazily, an entry is accounted again whenever it is used and when the
+  // stats are read.
+  uint64_t bytes_ = 0;
+  uint64_t budget_;
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+  uint64_t evictions_ = 0;
+};
+
+ProcSyms::SymbolTableRegistry::SymbolTableRegistry()
+    : budget_(256ULL << 20) {
+  const char *budget = ::getenv("BCC_SYMCACHE_BUDGET");
+  if (budget && *budget)
+    budget_ = strtoull(budget, nullptr, 0);
+}
+
+std::shared_ptr<ProcSyms::SymbolTable> ProcSyms::SymbolTableRegistry::get(
+    std::shared_ptr<ModulePath> path, bcc_symbol_option *option) {
+  // Parsing the ELF for its build id is only worth it for a table that is
+  // loaded, hits are told apart by the file's identity and modification
+  auto load = [&]() {
+    char buildid[BPF_BUILD_ID_SIZE * 2 + 1];
+    if (bcc_elf_get_buildid(path->path(), buildid) < 0)
+      buildid[0] = '\0';
+    auto table = std::make_shared<SymbolTable>(path);
+    table->index_ = SymbolIndex::get(path->path(), buildid, option);
+    if (table->index_)
+      return table;
+    if (option->lazy_symbolize)
+      bcc_elf_foreach_sym_lazy(path->path(), Module::_add_symbol_lazy, option,
+                               table.get());
+    else
+      bcc_elf_foreach_sym(path->path(), Module::_add_symbol, option,
+                          table.get());
+    std::sort(table->syms_.begin(), table->syms_.end());
+    return table;
+  };
+
+  // Without a stable identity the table can't be shared
+  struct stat st;
+  if (stat(path->path(), &st) < 0)
+    return load();
+
+  std::string key = tfm::format(
+      "%u:%u:%lu:%ld.%09ld:%ld:%u:%u:%u:%u", major(st.st_dev),
+      minor(st.st_dev), (unsigned long)st.st_ino, (long)st.st_mtim.tv_sec,
+      (long)st.st_mtim.tv_nsec, (long)st.st_size, option->use_debug_file,
+      option->check_debug_file_crc, option->lazy_symbolize,
+      option->use_symbol_type);
+
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = tables_.find(key);
+    if (it != tables_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second.lru);
+      update_bytes(it->second);
+      hits_++;
+      return it->second.table;
     }
+    misses_++;
   }
 
-  auto it = symnames_.find(name);
-  if (it == symnames_.end())
-    return false;
+  // Read the symbols without holding the lock, if another thread loaded the
+  // same table in the meantime its copy wins.
+  std::shared_ptr<SymbolTable> table = load();
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto res = tables_.emplace(key, Entry{table, lru_.end(), 0});
+  if (!res.second)
+    return res.first->second.table;
+  lru_.push_front(key);
+  res.first->second.lru = lru_.begin();
+  update_bytes(res.first->second);
+  evict();
+  return table;
+}
 
-  *addr = it->second;
-  return true;
+uint64_t ProcSyms::SymbolTableRegistry::table_bytes(SymbolTable &table) {
+  // Lazily resolved names are added to tables in use
+  std::lock_guard<std::mutex> guard(table.mutex_);
+  return table.bytes();
+}
+
+void ProcSyms::SymbolTableRegistry::update_bytes(Entry &entry) {
+  uint64_t bytes = table_bytes(*entry.table);
+  bytes_ = bytes_ - entry.bytes + bytes;
+  entry.bytes = bytes;
+}
+
+void ProcSyms::SymbolTableRegistry::evict() {
+  auto it = lru_.end();
+  while (bytes_ > budget_ && it != lru_.begin()) {
+    --it;
+    auto entry = tables_.find(*it);
+    // Tables in use are not freed by dropping them here, keep them shareable
+    if (entry->second.table.use_count() > 1)
+      continue;
+    bytes_ -= entry->second.bytes;
+    tables_.erase(entry);
+    it = lru_.erase(it);
+    evictions_++;
+  }
+}
+
+void ProcSyms::SymbolTableRegistry::get_stats(struct bcc_symcache_stats *stats) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  stats->tables = tables_.size();
+  for (auto &it : tables_)
+    update_bytes(it.second);
+  stats->bytes = bytes_;
+  stats->hits = hits_;
+  stats->misses = misses_;
+  stats->evictions = evictions_;
+}
+
+void ProcSyms::SymbolTableRegistry::set_budget(uint64_t bytes) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  budget_ = bytes;
+  evict();
+}
+
+void ProcSyms::get_stats(struct bcc_symcache_stats *stats) {
+  SymbolTableRegistry::instance().get_stats(stats);
+}
+
+void ProcSyms::set_budget(uint64_t bytes) {
+  SymbolTableRegistry::instance().set_budget(bytes);
 }
 
 ProcSyms::ProcSyms(int pid, struct bcc_symbol_option *option)
@@ -183,26 +447,135 @@ ProcSyms::ProcSyms(int pid, struct bcc_symbol_option *option)
 }
 
 void ProcSyms::load_modules() {
+  maps_hash_ = maps_hash();
   bcc_procutils_each_module(pid_, _add_module, this);
 }
 
 void ProcSyms::refresh() {
+  // Reading the maps is cheap compared to loading the modules, only reload
+  // if the executable mappings changed, and then keep the modules of the
+  // files which are still mapped.
+  // If the maps can't be read the process is gone, keep what we have.
+  uint64_t hash = maps_hash();
+  if (hash == 0 || hash == maps_hash_) {
+    procstat_.reset();
+    return;
+  }
+  maps_hash_ = hash;
+  old_modules_.swap(modules_);
   modules_.clear();
-  load_modules();
+  bcc_procutils_each_module(pid_, _add_module, this);
+  old_modules_.clear();
   procstat_.reset();
 }
 
+void ProcSyms::load_all(unsigned max_threads) {
+  if (procstat_.is_stale())
+    refresh();
+
+  std::vector<Module *> pending;
+  for (Module &mod : modules_)
+    if (!mod.loaded_ && mod.type_ != ModuleType::UNKNOWN)
+      pending.push_back(&mod);
+
+  if (max_threads == 0)
+    max_threads = std::max(std::thread::hardware_concurrency(), 1U);
+  size_t nthreads = std::min<size_t>(max_threads, pending.size());
+
+  // Every module is loaded by exactly one thread, the symbol table registry
+  // they share is thread safe.
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < pending.size(); i = next++)
+      pending[i]->load_sym_table();
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < nthreads; i++)
+    threads.emplace_back(worker);
+  worker();
+  for (auto &thread : threads)
+    thread.join();
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+  // FNV-1a
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; i++) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+int ProcSyms::_hash_module(mod_info *mod, int enter_ns, void *payload) {
+  auto p = static_cast<std::pair<ProcSyms *, uint64_t> *>(payload);
+  uint64_t &hash = p->second;
+
+  // perf maps are rewritten in place by JITs, use their size and mtime
+  if (mod->inode == 0 && mod->end_addr == (uint64_t)-1) {
+    std::string path = mod->name;
+    if (enter_ns && p->first->pid_ != -1)
+      path = tfm::format("/proc/%d/root%s", p->first->pid_, mod->name);
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0)
+      return 0;
+    hash = hash_bytes(hash, mod->name, strlen(mod->name));
+    hash = hash_bytes(hash, &st.st_size, sizeof(st.st_size));
+    hash = hash_bytes(hash, &st.st_mtim, sizeof(st.st_mtim));
+    // only the first perf map found is used, see _add_module
+    return -1;
+  }
+
+  hash = hash_bytes(hash, mod->name, strlen(mod->name));
+  hash = hash_bytes(hash, &mod->start_addr, sizeof(mod->start_addr));
+  hash = hash_bytes(hash, &mod->end_addr, sizeof(mod->end_addr));
+  hash = hash_bytes(hash, &mod->file_offset, sizeof(mod->file_offset));
+  hash = hash_bytes(hash, &mod->dev_major, sizeof(mod->dev_major));
+  hash = hash_bytes(hash, &mod->dev_minor, sizeof(mod->dev_minor));
+  hash = hash_bytes(hash, &mod->inode, sizeof(mod->inode));
+  return 0;
+}
+
+uint64_t ProcSyms::maps_hash() {
+  auto payload = std::make_pair(this, (uint64_t)0xcbf29ce484222325ULL);
+  if (bcc_procutils_each_module(pid_, _hash_module, &payload) < 0)
+    return 0;
+  return payload.second;
+}
+
 int ProcSyms::_add_module(mod_info *mod, int enter_ns, void *payload) {
   ProcSyms *ps = static_cast<ProcSyms *>(payload);
-  std::shared_ptr<ModulePath> modpath =
-      std::make_shared<ModulePath>(mod->name, ps->procstat_.get_root_fd(),
-                                   ps->pid_, enter_ns && ps->pid_ != -1);
   auto it = std::find_if(
       ps->modules_.begin(), ps->modules_.end(),
       [=](const ProcSyms::Module &m) { return m.name_ == mod->name; });
   if (it == ps->modules_.end()) {
+    // The file is still mapped since the last load, keep its module and
+    // symbols, only the ranges it is mapped at may have changed. perf maps
+    // are reloaded since they grow as code gets compiled.
+    auto old = std::find_if(
+        ps->old_modules_.begin(), ps->old_modules_.end(),
+        [=](const ProcSyms::Module &m) {
+          return m.type_ != ModuleType::PERF_MAP && m.name_ == mod->name &&
+                 m.inode_ == mod->inode && m.dev_major_ == mod->dev_major &&
+                 m.dev_minor_ == mod->dev_minor;
+        });
+    if (old != ps->old_modules_.end()) {
+      old->ranges_.clear();
+      it = ps->modules_.insert(ps->modules_.end(), std::move(*old));
+      ps->old_modules_.erase(old);
+      it->ranges_.emplace_back(mod->start_addr, mod->end_addr,
+                               mod->file_offset);
+      return 0;
+    }
+
+    std::shared_ptr<ModulePath> modpath =
+        std::make_shared<ModulePath>(mod->name, ps->procstat_.get_root_fd(),
+                                     ps->pid_, enter_ns && ps->pid_ != -1);
     auto module = Module(
         mod->name, modpath, &ps->symbol_option_);
+    module.dev_major_ = mod->dev_major;
+    module.dev_minor_ = mod->dev_minor;
+    module.inode_ = mod->inode;
 
     // pid/maps doesn't account for file_offset of text within the ELF.
     // It only gives the mmap offset. We need the real offset for symbol
@@ -235,6 +608,26 @@ int ProcSyms::_add_module(mod_info *mod, int enter_ns, void *payload) {
   return 0;
 }
 
+static void demangle_symbol(struct bcc_symbol *sym) {
+  if (sym->name && (!strncmp(sym->name, "_Z", 2) || !strncmp(sym->name, "___Z", 4)))
+    sym->demangle_name =
+        abi::__cxa_demangle(sym->name, nullptr, nullptr, nullptr);
+  if (!sym->demangle_name)
+    sym->demangle_name = sym->name;
+}
+
+size_t SymbolCache::resolve_addrs(const uint64_t *addrs, size_t n,
+                                  struct bcc_symbol *syms, bool demangle) {
+  size_t resolved = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (resolve_addr(addrs[i], &syms[i], demangle))
+      resolved++;
+    else
+      syms[i].name = nullptr;
+  }
+  return resolved;
+}
+
 bool ProcSyms::resolve_addr(uint64_t addr, struct bcc_symbol *sym,
                             bool demangle) {
   if (procstat_.is_stale())
@@ -250,13 +643,8 @@ bool ProcSyms::resolve_addr(uint64_t addr, struct bcc_symbol *sym,
       continue;
     if (mod.contains(addr, offset)) {
       if (mod.find_addr(offset, sym)) {
-        if (demangle) {
-          if (sym->name && (!strncmp(sym->name, "_Z", 2) || !strncmp(sym->name, "___Z", 4)))
-            sym->demangle_name =
-                abi::__cxa_demangle(sym->name, nullptr, nullptr, nullptr);
-          if (!sym->demangle_name)
-            sym->demangle_name = sym->name;
-        }
+        if (demangle)
+          demangle_symbol(sym);
         return true;
       } else if (mod.type_ != ModuleType::PERF_MAP) {
         // In this case, we found the address in the range of a module, but
@@ -277,6 +665,93 @@ bool ProcSyms::resolve_addr(uint64_t addr, struct bcc_symbol *sym,
   return false;
 }
 
+// Same as resolve_addr, for an address which is only in the range of mod,
+// if any, and of the perf maps.
+bool ProcSyms::find_addr(Module *mod, const std::vector<Module *> &perf_maps,
+                         uint64_t addr, struct bcc_symbol *sym,
+                         bool demangle) {
+  memset(sym, 0, sizeof(struct bcc_symbol));
+
+  uint64_t offset;
+  if (mod && mod->contains(addr, offset) && mod->find_addr(offset, sym)) {
+    if (demangle)
+      demangle_symbol(sym);
+    return true;
+  }
+  for (Module *perf_map : perf_maps) {
+    if (perf_map->contains(addr, offset) && perf_map->find_addr(offset, sym)) {
+      if (demangle)
+        demangle_symbol(sym);
+      return true;
+    }
+  }
+  if (mod)
+    sym->module = mod->name_.c_str();
+  sym->name = nullptr;
+  return false;
+}
+
+size_t ProcSyms::resolve_addrs(const uint64_t *addrs, size_t n,
+                               struct bcc_symbol *syms, bool demangle) {
+  if (procstat_.is_stale())
+    refresh();
+
+  // Sort the mapped ranges and the addresses, so that a single pass over
+  // both finds the module of every address. Stacks repeat the same frames
+  // over and over, every distinct address is only looked up once.
+  struct ModuleRange {
+    uint64_t start;
+    uint64_t end;
+    Module *mod;
+  };
+  std::vector<ModuleRange> ranges;
+  std::vector<Module *> perf_maps;
+  for (Module &mod : modules_) {
+    if (mod.type_ == ModuleType::PERF_MAP) {
+      perf_maps.push_back(&mod);
+      continue;
+    }
+    for (const auto &range : mod.ranges_)
+      ranges.push_back({range.start, range.end, &mod});
+  }
+  std::stable_sort(ranges.begin(), ranges.end(),
+                   [](const ModuleRange &a, const ModuleRange &b) {
+                     return a.start < b.start;
+                   });
+
+  std::vector<size_t> order(n);
+  for (size_t i = 0; i < n; i++)
+    order[i] = i;
+  std::sort(order.begin(), order.end(),
+            [addrs](size_t a, size_t b) { return addrs[a] < addrs[b]; });
+
+  size_t resolved = 0;
+  auto range = ranges.begin();
+  for (size_t k = 0; k < n; k++) {
+    uint64_t addr = addrs[order[k]];
+    struct bcc_symbol *sym = &syms[order[k]];
+
+    if (k > 0 && addr == addrs[order[k - 1]]) {
+      *sym = syms[order[k - 1]];
+      // every entry owns its demangled name
+      if (sym->demangle_name && sym->demangle_name != sym->name)
+        sym->demangle_name = strdup(sym->demangle_name);
+      if (sym->name)
+        resolved++;
+      continue;
+    }
+
+    while (range != ranges.end() && range->end <= addr)
+      ++range;
+    Module *mod = nullptr;
+    if (range != ranges.end() && range->start <= addr)
+      mod = range->mod;
+    if (find_addr(mod, perf_maps, addr, sym, demangle))
+      resolved++;
+  }
+  return resolved;
+}
+
 bool ProcSyms::resolve_name(const char *module, const char *name,
                             uint64_t *addr) {
   if (procstat_.is_stale())
@@ -318,17 +793,16 @@ ProcSyms::Module::Module(const char *name, std::shared_ptr<ModulePath> path,
 
 int ProcSyms::Module::_add_symbol(const char *symname, uint64_t start,
                                   uint64_t size, void *p) {
-  Module *m = static_cast<Module *>(p);
-  auto res = m->symnames_.emplace(symname);
-  m->syms_.emplace_back(&*(res.first), start, size);
+  SymbolTable *t = static_cast<SymbolTable *>(p);
+  t->syms_.emplace_back(t->add_name(symname), start, size);
   return 0;
 }
 
 int ProcSyms::Module::_add_symbol_lazy(size_t section_idx, size_t str_table_idx,
                                        size_t str_len, uint64_t start,
                                        uint64_t size, int debugfile, void *p) {
-  Module *m = static_cast<Module *>(p);
-  m->syms_.emplace_back(
+  SymbolTable *t = static_cast<SymbolTable *>(p);
+  t->syms_.emplace_back(
       section_idx, str_table_idx, str_len, start, size, debugfile);
   return 0;
 }
@@ -338,22 +812,20 @@ void ProcSyms::Module::load_sym_table() {
     return;
   loaded_ = true;
 
-  if (type_ == ModuleType::UNKNOWN)
+  if (type_ == ModuleType::EXEC || type_ == ModuleType::SO) {
+    table_ = SymbolTableRegistry::instance().get(path_, symbol_option_);
     return;
+  }
 
+  // perf maps change while the process runs and the vDSO is tiny, keep
+  // their tables private to the module
+  table_ = std::make_shared<SymbolTable>(path_);
   if (type_ == ModuleType::PERF_MAP)
-    bcc_perf_map_foreach_sym(path_->path(), _add_symbol, this);
-  if (type_ == ModuleType::EXEC || type_ == ModuleType::SO) {
-    if (symbol_option_->lazy_symbolize)
-      bcc_elf_foreach_sym_lazy(path_->path(), _add_symbol_lazy, symbol_option_,
-                               this);
-    else
-      bcc_elf_foreach_sym(path_->path(), _add_symbol, symbol_option_, this);
-  }
+    bcc_perf_map_foreach_sym(path_->path(), _add_symbol, table_.get());
   if (type_ == ModuleType::VDSO)
-    bcc_elf_foreach_vdso_sym(_add_symbol, this);
+    bcc_elf_foreach_vdso_sym(_add_symbol, table_.get());
 
-  std::sort(syms_.begin(), syms_.end());
+  std::sort(table_->syms_.begin(), table_->syms_.end());
 }
 
 bool ProcSyms::Module::contains(uint64_t addr, uint64_t &offset) const {
@@ -423,8 +895,18 @@ bool ProcSyms::Module::find_addr(uint64_t offset, struct bcc_symbol *sym) {
   sym->module = name_.c_str();
   sym->offset = offset;
 
-  auto it = std::upper_bound(syms_.begin(), syms_.end(), Symbol(nullptr, offset, 0));
-  if (it == syms_.begin())
+  if (table_->index_) {
+    uint64_t sym_offset;
+    if (!table_->index_->find(offset, &sym->name, &sym_offset))
+      return false;
+    sym->offset = sym_offset;
+    return true;
+  }
+
+  std::lock_guard<std::mutex> guard(table_->mutex_);
+  std::vector<Symbol> &syms = table_->syms_;
+  auto it = std::upper_bound(syms.begin(), syms.end(), Symbol(nullptr, offset, 0));
+  if (it == syms.begin())
     return false;
 
   // 'it' points to the symbol whose start address is strictly greater than
@@ -454,12 +936,13 @@ bool ProcSyms::Module::find_addr(uint64_t offset, struct bcc_symbol *sym) {
       // Resolve and cache the symbol name if necessary
       if (!it->is_name_resolved) {
         std::string sym_name(it->data.name_idx.str_len + 1, '\0');
-        if (bcc_elf_symbol_str(path_->path(), it->data.name_idx.section_idx,
+        if (bcc_elf_symbol_str(table_->path_->path(),
+                               it->data.name_idx.section_idx,
                                it->data.name_idx.str_table_idx, &sym_name[0],
                                sym_name.size(), it->data.name_idx.debugfile))
           break;
 
-        it->data.name = &*(symnames_.emplace(std::move(sym_name)).first);
+        it->data.name = table_->add_name(std::move(sym_name));
         it->is_name_resolved = true;
       }
 
@@ -470,7 +953,7 @@ bool ProcSyms::Module::find_addr(uint64_t offset, struct bcc_symbol *sym) {
     if (limit > it->start + it->size)
       break;
     // But don't step beyond begin()!
-    if (it == syms_.begin())
+    if (it == syms.begin())
       break;
   }
 
@@ -573,6 +1056,14 @@ void *bcc_symcache_new(int pid, struct bcc_symbol_option *option) {
   return static_cast<void *>(new ProcSyms(pid, option));
 }
 
+void bcc_symcache_get_stats(struct bcc_symcache_stats *stats) {
+  ProcSyms::get_stats(stats);
+}
+
+void bcc_symcache_set_budget(uint64_t bytes) {
+  ProcSyms::set_budget(bytes);
+}
+
 void bcc_free_symcache(void *symcache, int pid) {
   if (pid < 0)
     delete static_cast<KSyms*>(symcache);
@@ -603,6 +1094,22 @@ int bcc_symcache_resolve_name(void *resolver, const char *module,
   return cache->resolve_name(module, name, addr) ? 0 : -1;
 }
 
+int bcc_symcache_resolve_batch(void *resolver, const uint64_t *addrs,
+                               int count, struct bcc_symbol *syms,
+                               int demangle) {
+  SymbolCache *cache = static_cast<SymbolCache *>(resolver);
+  if (count <= 0)
+    return 0;
+  return cache->resolve_addrs(addrs, count, syms, demangle);
+}
+
+void bcc_symcache_load_all(void *resolver, int pid, int max_threads) {
+  // The kernel symbols are loaded in one go anyway
+  if (pid < 0)
+    return;
+  static_cast<ProcSyms *>(resolver)->load_all(std::max(max_threads, 0));
+}
+
 void bcc_symcache_refresh(void *resolver) {
   SymbolCache *cache = static_cast<SymbolCache *>(resolver);
   cache->refresh();
@@ -54,6 +54,23 @@ struct bcc_symbol_option {
   uint32_t use_symbol_type;
 };
 
+// Symbol tables of ELF files are shared by all symcaches of the process and
+// identified by (device, inode, build id), so the same binary mapped by
+// several processes or symbolized by several tables is only read once. Tables
+// not used by any symcache are kept, and evicted least recently used first
+// when the memory they hold exceeds the budget (BCC_SYMCACHE_BUDGET bytes,
+// 256MB by default).
+struct bcc_symcache_stats {
+  uint64_t tables;    // symbol tables held
+  uint64_t bytes;     // approximate memory held by them
+  uint64_t hits;      // lookups served by an already loaded table
+  uint64_t misses;    // lookups which loaded the table
+  uint64_t evictions; // tables evicted to stay in the budget
+};
+
+void bcc_symcache_get_stats(struct bcc_symcache_stats *stats);
+void bcc_symcache_set_budget(uint64_t bytes);
+
 void *bcc_symcache_new(int pid, struct bcc_symbol_option *option);
 void bcc_free_symcache(void *symcache, int pid);
 
@@ -65,9 +82,20 @@ int bcc_symcache_resolve(void *symcache, uint64_t addr, struct bcc_symbol *sym);
 int bcc_symcache_resolve_no_demangle(void *symcache, uint64_t addr,
                                      struct bcc_symbol *sym);
 
+// Resolves count addresses at once, which is much faster than resolving them
+// one by one for the frames of many stacks of a process. Returns the number of
+// addresses resolved, the entries of the others have a NULL name. Every entry
+// has to be released with bcc_symbol_free_demangle_name.
+int bcc_symcache_resolve_batch(void *resolver, const uint64_t *addrs,
+                               int count, struct bcc_symbol *syms,
+                               int demangle);
 int bcc_symcache_resolve_name(void *resolver, const char *module,
                               const char *name, uint64_t *addr);
 void bcc_symcache_refresh(void *resolver);
+// Loads the symbols of all modules mapped by pid on up to max_threads threads
+// (0 for one per CPU), so that the first addresses resolved don't have to wait
+// for the modules to be loaded one after the other.
+void bcc_symcache_load_all(void *resolver, int pid, int max_threads);
 
 int _bcc_syms_find_module(struct mod_info *info, int enter_ns, void *p);
 int bcc_resolve_global_addr(int pid, const char *module, const uint64_t address,
@@ -90,6 +90,13 @@ const char *bcc_usdt_get_fully_specified_probe_argctype(
 typedef void (*bcc_usdt_uprobe_cb)(const char *, const char *, uint64_t, int);
 void bcc_usdt_foreach_uprobe(void *usdt, bcc_usdt_uprobe_cb callback);
 
+// Table mode: argument specs are looked up at run time from the
+// __bcc_usdt_args map, which must be filled after the program is loaded.
+// bcc_usdt_set_table_args must be called before bcc_usdt_genargs.
+#define BCC_USDT_HAS_TABLE_ARGS
+void bcc_usdt_set_table_args(void *usdt, int enable);
+int bcc_usdt_fill_table_args(void *usdt, int map_fd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -16,6 +16,7 @@
 #include "bpf_module.h"
 
 #include <fcntl.h>
+#include <malloc.h>
 #include <linux/bpf.h>
 #if LLVM_VERSION_MAJOR <= 16
 #include <llvm-c/Transforms/IPO.h>
@@ -53,6 +54,7 @@
 #include <unistd.h>
 
 #include <map>
+#include <mutex>
 #include <set>
 #include <string>
 #include <iostream>
@@ -62,6 +64,8 @@
 #include "bcc_debug.h"
 #include "bcc_elf.h"
 #include "bcc_libbpf_inc.h"
+#include "bcc_version.h"
+#include "bpf_module_cache.h"
 #include "common.h"
 #include "exported_files.h"
 #include "frontends/clang/b_frontend_action.h"
@@ -150,19 +154,32 @@ BPFModule::BPFModule(unsigned flags, TableStorage *ts, bool rw_engine_enabled,
       used_b_loader_(false),
       allow_rlimit_(allow_rlimit),
       ctx_(new LLVMContext),
+      rw_mod_(nullptr),
+      cache_pending_(false),
+      loaded_from_cache_(false),
+      released_(false),
+      sections_copied_(false),
       id_(std::to_string((uintptr_t)this)),
       maps_ns_(maps_ns),
       ts_(ts), btf_(nullptr) {
   ifindex_ = dev_name ? if_nametoindex(dev_name) : 0;
-  initialize_rw_engine();
-  LLVMInitializeBPFTarget();
-  LLVMInitializeBPFTargetMC();
-  LLVMInitializeBPFTargetInfo();
-  LLVMInitializeBPFAsmPrinter();
+  // Registering targets isn't thread safe, and only needs to happen once
+  static std::once_flag targets_initialized;
+  std::call_once(targets_initialized, [this]() {
+    initialize_rw_engine();
+    LLVMInitializeBPFTarget();
+    LLVMInitializeBPFTargetMC();
+    LLVMInitializeBPFTargetInfo();
+    LLVMInitializeBPFAsmPrinter();
 #if LLVM_VERSION_MAJOR >= 6
-  LLVMInitializeBPFAsmParser();
+    LLVMInitializeBPFAsmParser();
+#endif
+  });
+#if LLVM_VERSION_MAJOR >= 6
+  static std::once_flag disassembler_initialized;
   if (flags & DEBUG_SOURCE)
-    LLVMInitializeBPFDisassembler();
+    std::call_once(disassembler_initialized,
+                   []() { LLVMInitializeBPFDisassembler(); });
 #endif
   LLVMLinkInMCJIT(); /* call empty function to force linking of MCJIT */
   if (!ts_) {
@@ -187,7 +204,7 @@ BPFModule::~BPFModule() {
     v->leaf_snprintf = unimplemented_snprintf;
   }
 
-  if (!rw_engine_enabled_) {
+  if (!rw_engine_enabled_ || loaded_from_cache_ || sections_copied_) {
     prog_func_info_->for_each_func(
         [&](std::string name, FuncInfo &info) {
       if (!info.start_)
@@ -211,9 +228,12 @@ BPFModule::~BPFModule() {
 }
 
 int BPFModule::free_bcc_memory() {
+  release_header_cache();
   return bcc_free_memory();
 }
 
+void BPFModule::release_header_cache() { ClangLoader::release_header_cache(); }
+
 // load an entire c file as a module
 int BPFModule::load_cfile(const string &file, bool in_memory, const char *cflags[], int ncflags) {
   ClangLoader clang_loader(&*ctx_, flags_);
@@ -221,6 +241,10 @@ int BPFModule::load_cfile(const string &file, bool in_memory, const char *cflags
                          *prog_func_info_, mod_src_, maps_ns_, fake_fd_map_,
                          perf_events_))
     return -1;
+  // The cache key only covers the kernel headers, programs including other
+  // files, whose contents may change, are not cached.
+  if (clang_loader.external_includes())
+    cache_pending_ = false;
   return 0;
 }
 
@@ -246,6 +270,7 @@ void BPFModule::annotate_light() {
 
   size_t id = 0;
   Path path({id_});
+  auto lock = ts_->lock();
   for (auto it = ts_->lower_bound(path), up = ts_->upper_bound(path); it != up; ++it) {
     TableDesc &table = it->second;
     tables_.push_back(&it->second);
@@ -519,14 +544,30 @@ int BPFModule::load_maps(sec_map_def &sections) {
   if (create_maps(map_tids, map_fds, inner_map_fds, false) < 0)
     return -1;
 
-  // update map table fd's
-  for (auto it = ts_->begin(), up = ts_->end(); it != up; ++it) {
-    TableDesc &table = it->second;
+  // update map table fd's, of this module's tables and of the copies it
+  // exported or shared. The tables of other modules are left alone, they may
+  // be loading at the same time.
+  auto update_fd = [&](TableDesc &table) {
     if (map_fds.find(table.fake_fd) != map_fds.end()) {
       table.fd = map_fds[table.fake_fd];
       table.fake_fd = 0;
     }
+  };
+  // The copies are shared with other modules, hold the lock while their fds
+  // are written and not only while they are looked up
+  auto lock = ts_->lock();
+  for (TableDesc *table : tables_) {
+    // Modules from the cache have no copies, and their fake fds may be those
+    // of another module's copies
+    TableStorage::iterator it;
+    if (!loaded_from_cache_ && ts_->Find(Path({table->name}), it))
+      update_fd(it->second);
+    if (!loaded_from_cache_ &&
+        ts_->Find(Path({"ns", maps_ns_, table->name}), it))
+      update_fd(it->second);
+    update_fd(*table);
   }
+  lock.unlock();
 
   // update instructions
   prog_func_info_->for_each_func([&](std::string name, FuncInfo &info) {
@@ -593,6 +634,12 @@ int BPFModule::finalize() {
   });
   finalize_prog_func_info();
 
+  // Snapshot the instructions before map fds and BTF line info are patched
+  // into them.
+  string cache_entry;
+  if (cache_pending_)
+    cache_entry = serialize_cache_entry(*sections_p);
+
   if (flags_ & DEBUG_SOURCE) {
     SourceDebugger src_debugger(mod, *sections_p, *prog_func_info_, mod_src_,
                                 src_dbg_fmap_);
@@ -603,30 +650,374 @@ int BPFModule::finalize() {
   if (load_maps(*sections_p))
     return -1;
 
+  if (cache_pending_) {
+    if (BPFModuleCache *cache = BPFModuleCache::instance())
+      cache->store(cache_key_, cache_entry);
+    cache_pending_ = false;
+  }
+
   if (!rw_engine_enabled_) {
     // Setup sections_ correctly and then free llvm internal memory
-    for (auto section : tmp_sections) {
-      auto fname = section.first;
-      uintptr_t size = get<1>(section.second);
-      uint8_t *tmp_p = NULL;
-      // Only copy data for non-map sections
-      if (strncmp("maps/", section.first.c_str(), 5)) {
-        uint8_t *addr = get<0>(section.second);
-        tmp_p = new uint8_t[size];
-        memcpy(tmp_p, addr, size);
+    copy_sections(tmp_sections);
+    engine_.reset();
+    ctx_.reset();
+  }
+
+  return 0;
+}
+
+// Copy the sections and the functions out of the memory of engine_, so that it
+// can be freed.
+void BPFModule::copy_sections(const sec_map_def &sections) {
+  sec_map_def copied;
+  for (auto section : sections) {
+    auto fname = section.first;
+    uintptr_t size = get<1>(section.second);
+    uint8_t *tmp_p = NULL;
+    // Only copy data for non-map sections
+    if (strncmp("maps/", section.first.c_str(), 5)) {
+      uint8_t *addr = get<0>(section.second);
+      tmp_p = new uint8_t[size];
+      memcpy(tmp_p, addr, size);
+    }
+    copied[fname] = make_tuple(tmp_p, size, get<2>(section.second));
+  }
+  sections_ = move(copied);
+
+  prog_func_info_->for_each_func([](std::string name, FuncInfo &info) {
+    uint8_t *tmp_p = new uint8_t[info.size_];
+    memcpy(tmp_p, info.start_, info.size_);
+    info.start_ = tmp_p;
+  });
+  sections_copied_ = true;
+}
+
+static size_t resident_memory() {
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f)
+    return 0;
+  unsigned long size, resident = 0;
+  if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+    resident = 0;
+  fclose(f);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Drop everything the compiler left behind once the maps are created: the
+// LLVM context and the execution engine holding the program, the program
+// source and the per function source text. The instructions are copied out
+// first so functions can still be loaded, and the key/leaf readers and
+// writers move to a context of their own. freed receives the decrease of the
+// resident memory of the process.
+int BPFModule::release_compiler_memory(size_t *freed) {
+  if (sections_.empty()) {
+    fprintf(stderr, "Program not initialized\n");
+    return -1;
+  }
+
+  size_t before = resident_memory();
+  if (!released_) {
+    if (rw_engine_enabled_ && !loaded_from_cache_) {
+      // The engine is already gone when retrying after a failed isolation,
+      // which leaves the old reader/writer engine in place
+      if (engine_) {
+        copy_sections(sections_);
+        engine_.reset();
+        readers_.clear();
+        writers_.clear();
       }
-      sections_[fname] = make_tuple(tmp_p, size, get<2>(section.second));
+      if (isolate_rw_engine())
+        return -1;
     }
+    released_ = true;
 
+    string().swap(mod_src_);
+    src_dbg_fmap_.clear();
     prog_func_info_->for_each_func([](std::string name, FuncInfo &info) {
-      uint8_t *tmp_p = new uint8_t[info.size_];
-      memcpy(tmp_p, info.start_, info.size_);
-      info.start_ = tmp_p;
+      string().swap(info.src_);
+      string().swap(info.src_rewritten_);
     });
-    engine_.reset();
-    ctx_.reset();
+    table_rw_fns_.clear();
+    string().swap(rw_bitcode_);
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+  }
+
+  if (freed) {
+    size_t after = resident_memory();
+    *freed = before > after ? before - after : 0;
+  }
+  return 0;
+}
+
+string BPFModule::cache_key(const string &text, const char *cflags[],
+                             int ncflags) const {
+  string key = "bcc " LIBBCC_VERSION " llvm " LLVM_VERSION_STRING "\n";
+  key += ClangLoader::kernel_headers_id();
+  key += "flags " + std::to_string(flags_) + " rw_engine " +
+         std::to_string(rw_engine_enabled_) + " maps_ns " + maps_ns_ + "\n";
+  for (int i = 0; i < ncflags; i++) {
+    key += cflags[i];
+    key += '\0';
+  }
+  key += "\n";
+  key += text;
+  return key;
+}
+
+string BPFModule::serialize_cache_entry(const sec_map_def &sections) const {
+  CacheEntryWriter w;
+
+  w.put_u32(tables_.size());
+  for (auto table : tables_) {
+    w.put_str(table->name);
+    w.put_u32(table->fake_fd);
+    w.put_u32(table->type);
+    w.put_u64(table->key_size);
+    w.put_u64(table->leaf_size);
+    w.put_u64(table->max_entries);
+    w.put_u32(table->flags);
+    w.put_str(table->key_desc);
+    w.put_str(table->leaf_desc);
+  }
+
+  w.put_u32(fake_fd_map_.size());
+  for (auto &map : fake_fd_map_) {
+    w.put_u32(map.first);
+    w.put_u32(get<0>(map.second));
+    w.put_str(get<1>(map.second));
+    w.put_u32(get<2>(map.second));
+    w.put_u32(get<3>(map.second));
+    w.put_u32(get<4>(map.second));
+    w.put_u32(get<5>(map.second));
+    w.put_u32(get<6>(map.second));
+    w.put_str(get<7>(map.second));
+    w.put_str(get<8>(map.second));
+  }
+
+  w.put_u32(perf_events_.size());
+  for (auto &event : perf_events_) {
+    w.put_str(event.first);
+    w.put_u32(event.second.size());
+    for (auto &field : event.second)
+      w.put_str(field);
+  }
+
+  w.put_str(mod_src_);
+
+  // Map sections only hold placeholders, the maps are created at load time.
+  w.put_u32(sections.size());
+  for (auto &section : sections) {
+    bool is_map = strncmp("maps/", section.first.c_str(), 5) == 0;
+    w.put_str(section.first);
+    w.put_u32(get<2>(section.second));
+    if (is_map)
+      w.put_bytes(nullptr, 0);
+    else
+      w.put_bytes(get<0>(section.second), get<1>(section.second));
+    w.put_u64(get<1>(section.second));
+  }
+
+  w.put_u32(prog_func_info_->num_funcs());
+  prog_func_info_->for_each_func([&](std::string name, FuncInfo &info) {
+    w.put_str(name);
+    w.put_str(info.section_);
+    w.put_bytes(info.start_, info.size_);
+    w.put_str(info.src_);
+    w.put_str(info.src_rewritten_);
+  });
+
+  w.put_u32(table_rw_fns_.size());
+  for (auto &fns : table_rw_fns_) {
+    w.put_str(fns.first);
+    w.put_u32(fns.second.size());
+    for (auto &fn : fns.second)
+      w.put_str(fn);
   }
+  w.put_str(rw_bitcode_);
 
+  return w.data();
+}
+
+void BPFModule::reset_cache_entry() {
+  prog_func_info_->for_each_func([&](std::string name, FuncInfo &info) {
+    delete[] info.start_;
+  });
+  prog_func_info_ = ebpf::make_unique<ProgFuncInfo>();
+  for (auto &section : sections_)
+    delete[] get<0>(section.second);
+  sections_.clear();
+  ts_->DeletePrefix(Path({id_}));
+  tables_.clear();
+  table_names_.clear();
+  fake_fd_map_.clear();
+  perf_events_.clear();
+  mod_src_.clear();
+  table_rw_fns_.clear();
+  rw_bitcode_.clear();
+  loaded_from_cache_ = false;
+}
+
+// Restore a module from a cache entry. Returns 0 on success, 1 if the entry
+// cannot be used (the module is left untouched), and -1 if the maps of the
+// restored module could not be created.
+int BPFModule::load_cache_entry(const string &entry) {
+  struct CachedTable {
+    string name, key_desc, leaf_desc;
+    uint32_t fake_fd, type, flags;
+    uint64_t key_size, leaf_size, max_entries;
+  };
+  struct CachedFunc {
+    string name, section, code, src, src_rewritten;
+  };
+  struct CachedSection {
+    string name, data;
+    uint32_t id;
+    uint64_t size;
+  };
+  vector<CachedTable> tables;
+  vector<CachedFunc> funcs;
+  vector<CachedSection> sections;
+  fake_fd_map_def fake_fd_map;
+  std::map<string, vector<string>> perf_events;
+  std::map<string, vector<string>> table_rw_fns;
+  string mod_src, rw_bitcode;
+  uint32_t cnt;
+
+  CacheEntryReader r(entry);
+  if (!r.get_u32(cnt))
+    return 1;
+  tables.resize(cnt);
+  for (auto &t : tables) {
+    if (!r.get_str(t.name) || !r.get_u32(t.fake_fd) || !r.get_u32(t.type) ||
+        !r.get_u64(t.key_size) || !r.get_u64(t.leaf_size) ||
+        !r.get_u64(t.max_entries) || !r.get_u32(t.flags) ||
+        !r.get_str(t.key_desc) || !r.get_str(t.leaf_desc))
+      return 1;
+  }
+
+  if (!r.get_u32(cnt))
+    return 1;
+  for (uint32_t i = 0; i < cnt; i++) {
+    uint32_t fake_fd, type, key_size, value_size, max_entries, flags, pinned_id;
+    string name, inner_map_name, pinned;
+    if (!r.get_u32(fake_fd) || !r.get_u32(type) || !r.get_str(name) ||
+        !r.get_u32(key_size) || !r.get_u32(value_size) ||
+        !r.get_u32(max_entries) || !r.get_u32(flags) || !r.get_u32(pinned_id) ||
+        !r.get_str(inner_map_name) || !r.get_str(pinned))
+      return 1;
+    fake_fd_map[(int)fake_fd] = make_tuple(
+        (int)type, name, (int)key_size, (int)value_size, (int)max_entries,
+        (int)flags, (int)pinned_id, inner_map_name, pinned);
+  }
+
+  if (!r.get_u32(cnt))
+    return 1;
+  for (uint32_t i = 0; i < cnt; i++) {
+    string name;
+    uint32_t nr_fields;
+    if (!r.get_str(name) || !r.get_u32(nr_fields))
+      return 1;
+    auto &fields = perf_events[name];
+    fields.resize(nr_fields);
+    for (auto &field : fields)
+      if (!r.get_str(field))
+        return 1;
+  }
+
+  if (!r.get_str(mod_src))
+    return 1;
+
+  if (!r.get_u32(cnt))
+    return 1;
+  sections.resize(cnt);
+  for (auto &sec : sections) {
+    if (!r.get_str(sec.name) || !r.get_u32(sec.id) || !r.get_str(sec.data) ||
+        !r.get_u64(sec.size))
+      return 1;
+  }
+
+  if (!r.get_u32(cnt))
+    return 1;
+  funcs.resize(cnt);
+  for (auto &fn : funcs) {
+    if (!r.get_str(fn.name) || !r.get_str(fn.section) || !r.get_str(fn.code) ||
+        !r.get_str(fn.src) || !r.get_str(fn.src_rewritten))
+      return 1;
+  }
+
+  if (!r.get_u32(cnt))
+    return 1;
+  for (uint32_t i = 0; i < cnt; i++) {
+    string name;
+    uint32_t nr_fns;
+    if (!r.get_str(name) || !r.get_u32(nr_fns))
+      return 1;
+    auto &fns = table_rw_fns[name];
+    fns.resize(nr_fns);
+    for (auto &fn : fns)
+      if (!r.get_str(fn))
+        return 1;
+  }
+  if (!r.get_str(rw_bitcode) || !r.done())
+    return 1;
+
+  // The entry is complete, populate the module as the compiler would have.
+  loaded_from_cache_ = true;
+  for (auto &t : tables) {
+    TableDesc desc(t.name, FileDesc(-1), t.type, t.key_size, t.leaf_size,
+                   t.max_entries, t.flags);
+    desc.fake_fd = t.fake_fd;
+    desc.key_desc = t.key_desc;
+    desc.leaf_desc = t.leaf_desc;
+    ts_->Insert(Path({id_, t.name}), move(desc));
+  }
+  size_t id = 0;
+  Path path({id_});
+  auto lock = ts_->lock();
+  for (auto it = ts_->lower_bound(path), up = ts_->upper_bound(path); it != up; ++it) {
+    tables_.push_back(&it->second);
+    table_names_[it->second.name] = id++;
+  }
+  lock.unlock();
+
+  fake_fd_map_ = move(fake_fd_map);
+  perf_events_ = move(perf_events);
+  mod_src_ = move(mod_src);
+
+  for (auto &sec : sections) {
+    uint8_t *data = nullptr;
+    if (!sec.data.empty()) {
+      data = new uint8_t[sec.data.size()];
+      memcpy(data, sec.data.data(), sec.data.size());
+    }
+    sections_[sec.name] = make_tuple(data, sec.size, sec.id);
+  }
+
+  for (auto &fn : funcs) {
+    auto info = prog_func_info_->add_func(fn.name);
+    if (!info)
+      continue;
+    info->start_ = new uint8_t[fn.code.size()];
+    memcpy(info->start_, fn.code.data(), fn.code.size());
+    info->size_ = fn.code.size();
+    info->section_ = fn.section;
+    info->src_ = fn.src;
+    info->src_rewritten_ = fn.src_rewritten;
+  }
+
+  if (rw_engine_enabled_) {
+    table_rw_fns_ = move(table_rw_fns);
+    if (annotate_from_cache(rw_bitcode)) {
+      reset_cache_entry();
+      return 1;
+    }
+  }
+
+  load_btf(sections_);
+  if (load_maps(sections_))
+    return -1;
   return 0;
 }
 
@@ -978,8 +1369,44 @@ int BPFModule::load_string(const string &text, const char *cflags[], int ncflags
     fprintf(stderr, "Program already initialized\n");
     return -1;
   }
+
+  BPFModuleCache *cache = BPFModuleCache::instance();
+  if (cache && !(flags_ & (DEBUG_LLVM_IR | DEBUG_PREPROCESSOR | DEBUG_SOURCE |
+                           DEBUG_BTF))) {
+    string entry;
+    cache_key_ = cache_key(text, cflags, ncflags);
+    if (cache->lookup(cache_key_, entry)) {
+      int rc = load_cache_entry(entry);
+      if (rc <= 0)
+        return rc;
+      // The entry could not be used, compile the program instead.
+    }
+    cache_pending_ = true;
+  }
+
   if (int rc = load_cfile(text, true, cflags, ncflags))
     return rc;
+
+  if (cache_pending_) {
+    // Only self-contained modules are cached: extern tables, tables pinned at
+    // compile time and tables exported to other modules all depend on state
+    // outside of the program text. An exported copy of a table with the same
+    // name made by another module also disables caching, which is harmless.
+    Path path({id_});
+    auto lock = ts_->lock();
+    for (auto it = ts_->lower_bound(path), up = ts_->upper_bound(path);
+         it != up; ++it) {
+      TableStorage::iterator copy;
+      if (it->second.is_extern || it->second.is_shared ||
+          ts_->Find(Path({it->second.name}), copy) ||
+          ts_->Find(Path({"ns", maps_ns_, it->second.name}), copy))
+        cache_pending_ = false;
+    }
+    lock.unlock();
+    for (auto &map : fake_fd_map_)
+      if (get<6>(map.second) > 0)
+        cache_pending_ = false;
+  }
   if (rw_engine_enabled_) {
     if (int rc = annotate())
       return rc;
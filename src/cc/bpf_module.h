@@ -74,8 +74,11 @@ class BPFModule {
   int parse(llvm::Module *mod);
   int finalize();
   int annotate();
+  int annotate_from_cache(const std::string &bitcode);
+  int isolate_rw_engine();
   void annotate_light();
   void finalize_prog_func_info();
+  void copy_sections(const sec_map_def &sections);
   std::unique_ptr<llvm::ExecutionEngine> finalize_rw(std::unique_ptr<llvm::Module> mod);
   std::string make_reader(llvm::Module *mod, llvm::Type *type);
   std::string make_writer(llvm::Module *mod, llvm::Type *type);
@@ -94,13 +97,20 @@ class BPFModule {
                   std::map<int, int> &map_fds,
                   std::map<std::string, int> &inner_map_fds,
                   bool for_inner_map);
+  std::string cache_key(const std::string &text, const char *cflags[],
+                        int ncflags) const;
+  std::string serialize_cache_entry(const sec_map_def &sections) const;
+  int load_cache_entry(const std::string &entry);
+  void reset_cache_entry();
 
  public:
   BPFModule(unsigned flags, TableStorage *ts = nullptr, bool rw_engine_enabled = true,
             const std::string &maps_ns = "", bool allow_rlimit = true,
             const char *dev_name = nullptr);
   ~BPFModule();
-  int free_bcc_memory();
+  static int free_bcc_memory();
+  static void release_header_cache();
+  int release_compiler_memory(size_t *freed = nullptr);
   int load_c(const std::string &filename, const char *cflags[], int ncflags);
   int load_string(const std::string &text, const char *cflags[], int ncflags);
   std::string id() const { return id_; }
@@ -163,6 +173,7 @@ class BPFModule {
   std::unique_ptr<llvm::LLVMContext> ctx_;
   std::unique_ptr<llvm::ExecutionEngine> engine_;
   std::unique_ptr<llvm::ExecutionEngine> rw_engine_;
+  llvm::Module *rw_mod_;  // owned by rw_engine_
   std::unique_ptr<llvm::Module> mod_;
   std::unique_ptr<ProgFuncInfo> prog_func_info_;
   sec_map_def sections_;
@@ -170,6 +181,18 @@ class BPFModule {
   std::map<std::string, size_t> table_names_;
   std::map<llvm::Type *, std::string> readers_;
   std::map<llvm::Type *, std::string> writers_;
+  // Cached modules carry the key/leaf reader and writer functions as bitcode,
+  // along with the function names assigned to each table.
+  bool cache_pending_;
+  bool loaded_from_cache_;
+  // Set once the compiler state is released
+  bool released_;
+  // Set once sections_ and the functions are copies owned by the module,
+  // which may happen before the release completes
+  bool sections_copied_;
+  std::string cache_key_;
+  std::string rw_bitcode_;
+  std::map<std::string, std::vector<std::string>> table_rw_fns_;
   std::string id_;
   std::string maps_ns_;
   std::string mod_src_;
@@ -0,0 +1,246 @@
+#include "bpf_module_cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include "file_desc.h"
+
+namespace ebpf {
+
+namespace {
+
+const char *CACHE_MAGIC = "bcc-module-cache-v1";
+const char *CACHE_SUFFIX = ".bcc";
+const uint64_t DEFAULT_CACHE_MAX_SIZE = 256ULL << 20;
+
+std::atomic<uint64_t> cache_hits(0);
+std::atomic<uint64_t> cache_misses(0);
+std::atomic<uint64_t> cache_stores(0);
+std::atomic<uint64_t> cache_evictions(0);
+std::atomic<uint64_t> cache_errors(0);
+
+std::once_flag instance_once;
+std::atomic<BPFModuleCache *> instance_cache(nullptr);
+
+uint64_t fnv1a(const std::string &s, uint64_t hash) {
+  for (unsigned char c : s) {
+    hash ^= c;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+bool read_file(const std::string &path, std::string &data) {
+  FileDesc fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW));
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    return false;
+
+  data.resize(st.st_size);
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t ret = ::read(fd, &data[done], data.size() - done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    done += ret;
+  }
+  return true;
+}
+
+bool write_all(int fd, const std::string &data) {
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t ret = ::write(fd, data.data() + done, data.size() - done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    done += ret;
+  }
+  return true;
+}
+
+bool has_suffix(const char *name, const char *suffix) {
+  size_t len = strlen(name), suffix_len = strlen(suffix);
+  return len > suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+}  // namespace
+
+bool CacheEntryReader::get_raw(void *v, size_t size) {
+  if (buf_.size() - pos_ < size)
+    return false;
+  memcpy(v, buf_.data() + pos_, size);
+  pos_ += size;
+  return true;
+}
+
+bool CacheEntryReader::get_str(std::string &s) {
+  uint64_t size;
+  if (!get_u64(size) || buf_.size() - pos_ < size)
+    return false;
+  s.assign(buf_.data() + pos_, size);
+  pos_ += size;
+  return true;
+}
+
+BPFModuleCache *BPFModuleCache::create_from_env() {
+  const char *dir = ::getenv("BCC_CACHE_DIR");
+  if (!dir || !*dir)
+    return nullptr;
+
+  if (!private_cache_dir(dir))
+    return nullptr;
+
+  uint64_t max_size = DEFAULT_CACHE_MAX_SIZE;
+  const char *max_size_env = ::getenv("BCC_CACHE_MAX_SIZE");
+  if (max_size_env && *max_size_env)
+    max_size = strtoull(max_size_env, nullptr, 0);
+
+  return new BPFModuleCache(dir, max_size);
+}
+
+BPFModuleCache *BPFModuleCache::instance() {
+  std::call_once(instance_once, []() { instance_cache = create_from_env(); });
+  return instance_cache;
+}
+
+BPFModuleCache *BPFModuleCache::set_instance(BPFModuleCache *cache) {
+  instance();
+  return instance_cache.exchange(cache);
+}
+
+BPFModuleCacheStats BPFModuleCache::stats() {
+  BPFModuleCacheStats stats;
+  stats.hits = cache_hits;
+  stats.misses = cache_misses;
+  stats.stores = cache_stores;
+  stats.evictions = cache_evictions;
+  stats.errors = cache_errors;
+  return stats;
+}
+
+std::string cache_key_hash(const std::string &key) {
+  char name[33];
+  snprintf(name, sizeof(name), "%016llx%016llx",
+           (unsigned long long)fnv1a(key, 0xcbf29ce484222325ULL),
+           (unsigned long long)fnv1a(key, 0x84222325cbf29ce4ULL));
+  return name;
+}
+
+std::string BPFModuleCache::entry_path(const std::string &key) const {
+  return dir_ + "/" + cache_key_hash(key) + CACHE_SUFFIX;
+}
+
+bool BPFModuleCache::lookup(const std::string &key, std::string &entry) {
+  std::string path = entry_path(key);
+  std::string data;
+  if (!read_file(path, data)) {
+    cache_misses++;
+    return false;
+  }
+
+  CacheEntryReader reader(data);
+  std::string magic, stored_key;
+  if (!reader.get_str(magic) || magic != CACHE_MAGIC ||
+      !reader.get_str(stored_key) || stored_key != key ||
+      !reader.get_str(entry) || !reader.done()) {
+    cache_misses++;
+    return false;
+  }
+
+  // Entries are evicted by modification time, refresh it to keep the ones in
+  // use alive.
+  utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+  cache_hits++;
+  return true;
+}
+
+bool BPFModuleCache::store(const std::string &key, const std::string &entry) {
+  CacheEntryWriter writer;
+  writer.put_str(CACHE_MAGIC);
+  writer.put_str(key);
+  writer.put_str(entry);
+
+  // Write to a temporary file and rename it into place, so concurrent readers
+  // never observe a partially written entry.
+  std::string tmp_path = dir_ + "/.tmp.XXXXXX";
+  int fd = mkstemp(&tmp_path[0]);
+  if (fd < 0) {
+    cache_errors++;
+    return false;
+  }
+
+  bool ok = write_all(fd, writer.data());
+  if (::close(fd) != 0)
+    ok = false;
+  if (!ok || ::rename(tmp_path.c_str(), entry_path(key).c_str()) != 0) {
+    ::unlink(tmp_path.c_str());
+    cache_errors++;
+    return false;
+  }
+
+  cache_stores++;
+  evict();
+  return true;
+}
+
+void BPFModuleCache::evict() {
+  struct CacheFile {
+    std::string path;
+    struct timespec mtime;
+    uint64_t size;
+  };
+  std::vector<CacheFile> files;
+  uint64_t total = 0;
+
+  DIR *dir = opendir(dir_.c_str());
+  if (!dir)
+    return;
+  while (struct dirent *ent = readdir(dir)) {
+    if (!has_suffix(ent->d_name, CACHE_SUFFIX))
+      continue;
+    std::string path = dir_ + "/" + ent->d_name;
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+    files.push_back({path, st.st_mtim, (uint64_t)st.st_size});
+    total += st.st_size;
+  }
+  closedir(dir);
+
+  if (total <= max_size_)
+    return;
+
+  std::sort(files.begin(), files.end(),
+            [](const CacheFile &a, const CacheFile &b) {
+              if (a.mtime.tv_sec != b.mtime.tv_sec)
+                return a.mtime.tv_sec < b.mtime.tv_sec;
+              return a.mtime.tv_nsec < b.mtime.tv_nsec;
+            });
+  for (const auto &f : files) {
+    if (total <= max_size_)
+      break;
+    if (::unlink(f.path.c_str()) == 0)
+      cache_evictions++;
+    total -= f.size;
+  }
+}
+
+}  // namespace ebpf
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// private_cache_dir(), which the directories of the cache go through
+#include "common.h"
+
+namespace ebpf {
+
+struct BPFModuleCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t stores;
+  uint64_t evictions;
+  uint64_t errors;
+};
+
+/// CacheEntryWriter appends fixed-width integers and length-prefixed byte
+/// strings to a buffer. Entries are only ever read back on the host that
+/// wrote them, so values are stored in host byte order.
+class CacheEntryWriter {
+ public:
+  void put_u32(uint32_t v) { buf_.append((const char *)&v, sizeof(v)); }
+  void put_u64(uint64_t v) { buf_.append((const char *)&v, sizeof(v)); }
+  void put_bytes(const void *data, size_t size) {
+    put_u64(size);
+    buf_.append((const char *)data, size);
+  }
+  void put_str(const std::string &s) { put_bytes(s.data(), s.size()); }
+  const std::string &data() const { return buf_; }
+
+ private:
+  std::string buf_;
+};
+
+/// CacheEntryReader is the counterpart of CacheEntryWriter. Every getter
+/// returns false once the buffer is exhausted, so a truncated or corrupted
+/// entry is detected instead of being partially applied.
+class CacheEntryReader {
+ public:
+  explicit CacheEntryReader(const std::string &buf) : buf_(buf), pos_(0) {}
+  bool get_u32(uint32_t &v) { return get_raw(&v, sizeof(v)); }
+  bool get_u64(uint64_t &v) { return get_raw(&v, sizeof(v)); }
+  bool get_str(std::string &s);
+  bool done() const { return pos_ == buf_.size(); }
+
+ private:
+  bool get_raw(void *v, size_t size);
+
+  const std::string &buf_;
+  size_t pos_;
+};
+
+/// Returns a 128 bit hash of key as 32 hex digits, used to name the files of
+/// persistent caches.
+std::string cache_key_hash(const std::string &key);
+
+/// BPFModuleCache is a persistent, content-addressed store of compiled BPF
+/// modules, which lets BPFModule skip the clang and LLVM pipeline when the
+/// same program is loaded again against the same kernel headers.
+///
+/// The cache is disabled unless BCC_CACHE_DIR names a directory to keep the
+/// entries in. BCC_CACHE_MAX_SIZE bounds the total size of the entries in
+/// bytes (256MB by default); the least recently used entries are evicted when
+/// it is exceeded. Entries are written atomically, so the directory can be
+/// shared by concurrently running tools of the same user. A directory other
+/// users can write to is refused.
+class BPFModuleCache {
+ public:
+  BPFModuleCache(const std::string &dir, uint64_t max_size)
+      : dir_(dir), max_size_(max_size) {}
+
+  // Returns the process-wide cache, or nullptr if caching is disabled.
+  static BPFModuleCache *instance();
+  // Replaces the process-wide cache, nullptr disables caching. Returns the
+  // previous one. Meant for tests, the caller keeps ownership of both.
+  static BPFModuleCache *set_instance(BPFModuleCache *cache);
+  static BPFModuleCacheStats stats();
+
+  // key is the complete description of the compilation input. It is stored
+  // with the entry and compared on lookup, so a hash collision never returns
+  // another program.
+  bool lookup(const std::string &key, std::string &entry);
+  bool store(const std::string &key, const std::string &entry);
+
+  const std::string &dir() const { return dir_; }
+  uint64_t max_size() const { return max_size_; }
+
+ private:
+  static BPFModuleCache *create_from_env();
+
+  std::string entry_path(const std::string &key) const;
+  void evict();
+
+  std::string dir_;
+  uint64_t max_size_;
+};
+
+}  // namespace ebpf
@@ -17,9 +17,13 @@
 #include <string>
 #include <vector>
 
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/ExecutionEngine/MCJIT.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
 
 #include "common.h"
 #include "bpf_module.h"
@@ -437,10 +441,17 @@ int BPFModule::annotate() {
 
   size_t id = 0;
   Path path({id_});
+  auto lock = ts_->lock();
   for (auto it = ts_->lower_bound(path), up = ts_->upper_bound(path); it != up; ++it) {
-    TableDesc &table = it->second;
     tables_.push_back(&it->second);
-    table_names_[table.name] = id++;
+    table_names_[it->second.name] = id++;
+  }
+  lock.unlock();
+
+  // The tables of this module are only written by it, generate their readers
+  // and writers without holding up the modules loading at the same time
+  for (TableDesc *desc : tables_) {
+    TableDesc &table = *desc;
     GlobalValue *gvar = mod_->getNamedValue(table.name);
     if (!gvar) continue;
 #if LLVM_VERSION_MAJOR >= 14
@@ -459,25 +470,111 @@ int BPFModule::annotate() {
         using std::placeholders::_1;
         using std::placeholders::_2;
         using std::placeholders::_3;
-        table.key_sscanf = std::bind(&BPFModule::sscanf, this,
-                                     make_reader(&*m, key_type), _1, _2);
-        table.leaf_sscanf = std::bind(&BPFModule::sscanf, this,
-                                      make_reader(&*m, leaf_type), _1, _2);
-        table.key_snprintf = std::bind(&BPFModule::snprintf, this,
-                                       make_writer(&*m, key_type), _1, _2, _3);
-        table.leaf_snprintf =
-            std::bind(&BPFModule::snprintf, this, make_writer(&*m, leaf_type),
-                      _1, _2, _3);
+        string key_reader = make_reader(&*m, key_type);
+        string leaf_reader = make_reader(&*m, leaf_type);
+        string key_writer = make_writer(&*m, key_type);
+        string leaf_writer = make_writer(&*m, leaf_type);
+        table.key_sscanf = std::bind(&BPFModule::sscanf, this, key_reader,
+                                     _1, _2);
+        table.leaf_sscanf = std::bind(&BPFModule::sscanf, this, leaf_reader,
+                                      _1, _2);
+        table.key_snprintf = std::bind(&BPFModule::snprintf, this, key_writer,
+                                       _1, _2, _3);
+        table.leaf_snprintf = std::bind(&BPFModule::snprintf, this,
+                                        leaf_writer, _1, _2, _3);
+        if (cache_pending_)
+          table_rw_fns_[table.name] = {key_reader, leaf_reader, key_writer,
+                                       leaf_writer};
       }
     }
   }
 
+  if (cache_pending_) {
+    raw_string_ostream os(rw_bitcode_);
+#if LLVM_VERSION_MAJOR >= 7
+    WriteBitcodeToFile(*m, os);
+#else
+    WriteBitcodeToFile(&*m, os);
+#endif
+    os.flush();
+  }
+
+  rw_mod_ = &*m;
   rw_engine_ = finalize_rw(move(m));
   if (!rw_engine_)
     return -1;
   return 0;
 }
 
+// Rebuild the reader and writer functions of a module restored from the
+// cache, from the bitcode and function names saved by annotate().
+int BPFModule::annotate_from_cache(const string &bitcode) {
+  auto buf = MemoryBuffer::getMemBuffer(bitcode, "sscanf", false);
+  auto m = parseBitcodeFile(buf->getMemBufferRef(), *ctx_);
+  if (!m) {
+    consumeError(m.takeError());
+    return -1;
+  }
+
+  for (auto table : tables_) {
+    auto fns = table_rw_fns_.find(table->name);
+    if (fns == table_rw_fns_.end() || fns->second.size() != 4)
+      continue;
+
+    using std::placeholders::_1;
+    using std::placeholders::_2;
+    using std::placeholders::_3;
+    table->key_sscanf = std::bind(&BPFModule::sscanf, this, fns->second[0],
+                                  _1, _2);
+    table->leaf_sscanf = std::bind(&BPFModule::sscanf, this, fns->second[1],
+                                   _1, _2);
+    table->key_snprintf = std::bind(&BPFModule::snprintf, this,
+                                    fns->second[2], _1, _2, _3);
+    table->leaf_snprintf = std::bind(&BPFModule::snprintf, this,
+                                     fns->second[3], _1, _2, _3);
+  }
+
+  rw_mod_ = &**m;
+  rw_engine_ = finalize_rw(move(*m));
+  if (!rw_engine_)
+    return -1;
+  return 0;
+}
+
+// Rebuild the reader and writer functions in a context of their own, which
+// replaces ctx_. The functions keep their names, so the bindings of the tables
+// stay valid.
+int BPFModule::isolate_rw_engine() {
+  if (!rw_mod_)
+    return 0;
+
+  string bitcode;
+  raw_string_ostream os(bitcode);
+#if LLVM_VERSION_MAJOR >= 7
+  WriteBitcodeToFile(*rw_mod_, os);
+#else
+  WriteBitcodeToFile(rw_mod_, os);
+#endif
+  os.flush();
+
+  auto ctx = ebpf::make_unique<LLVMContext>();
+  auto buf = MemoryBuffer::getMemBuffer(bitcode, "sscanf", false);
+  auto m = parseBitcodeFile(buf->getMemBufferRef(), *ctx);
+  if (!m) {
+    consumeError(m.takeError());
+    return -1;
+  }
+
+  Module *rw_mod = &**m;
+  auto engine = finalize_rw(move(*m));
+  if (!engine)
+    return -1;
+  rw_engine_ = move(engine);
+  rw_mod_ = rw_mod;
+  ctx_ = move(ctx);
+  return 0;
+}
+
 StatusTuple BPFModule::sscanf(string fn_name, const char *str, void *val) {
   if (!rw_engine_enabled_)
     return StatusTuple(-1, "rw_engine not enabled");
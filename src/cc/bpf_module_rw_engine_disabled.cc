@@ -32,4 +32,12 @@ int BPFModule::annotate() {
   return -1;
 }
 
+int BPFModule::annotate_from_cache(const std::string &bitcode) {
+  return -1;
+}
+
+int BPFModule::isolate_rw_engine() {
+  return 0;
+}
+
 } // namespace ebpf
@@ -13,6 +13,10 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <cstring>
 #include <fstream>
 #include <sstream>
 
@@ -219,6 +223,30 @@ std::string tracefs_path() {
   return use_debugfs ? DEBUGFS_TRACEFS : TRACEFS;
 }
 
+bool private_cache_dir(const std::string &dir) {
+  if (::mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+    fprintf(stderr, "cannot create bcc cache directory %s: %s\n", dir.c_str(),
+            strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if (::lstat(dir.c_str(), &st) != 0) {
+    fprintf(stderr, "cannot stat bcc cache directory %s: %s\n", dir.c_str(),
+            strerror(errno));
+    return false;
+  }
+  if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+      (st.st_mode & (S_IWGRP | S_IWOTH))) {
+    fprintf(stderr,
+            "ignoring bcc cache directory %s: it must be a directory owned by "
+            "uid %u that no other user can write to\n",
+            dir.c_str(), (unsigned)geteuid());
+    return false;
+  }
+  return true;
+}
+
 std::string tracepoint_format_file(std::string const& category,
                                    std::string const& event) {
   return tracefs_path() + "/events/" + category + "/" + event + "/format";
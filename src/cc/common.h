@@ -41,6 +41,12 @@ std::string get_pid_exe(pid_t pid);
 
 std::string tracefs_path();
 
+// Creates dir if it doesn't exist yet. Returns whether dir is a directory
+// owned by the effective user that no other user can write to, as the files
+// bcc persists, compiled code and symbol indexes, are only ever loaded from
+// such directories.
+bool private_cache_dir(const std::string &dir);
+
 std::string tracepoint_format_file(std::string const& category,
                                    std::string const& event);
 
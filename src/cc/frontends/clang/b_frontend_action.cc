@@ -19,6 +19,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 
+#include <mutex>
+
 #include <clang/AST/ASTConsumer.h>
 #include <clang/AST/ASTContext.h>
 #include <clang/AST/RecordLayout.h>
@@ -123,20 +125,28 @@ const char *pt_regs_syscall_regs(void) {
   return calling_conv_regs[0];
 }
 
-/* Use resolver only once per translation */
+/* Use resolver only once per translation. Programs can be compiled on
+ * several threads at once, the resolver is shared. */
+static std::mutex kresolver_mutex;
 static void *kresolver = NULL;
-static void *get_symbol_resolver(void) {
+static bool kernel_symbol_exists(const char *name) {
+  std::lock_guard<std::mutex> lock(kresolver_mutex);
   if (!kresolver)
     kresolver = bcc_symcache_new(-1, nullptr);
-  return kresolver;
+  uint64_t addr = 0;
+  return bcc_symcache_resolve_name(kresolver, nullptr, name, &addr) >= 0;
+}
+
+static void free_symbol_resolver(void) {
+  std::lock_guard<std::mutex> lock(kresolver_mutex);
+  if (kresolver) {
+    bcc_free_symcache(kresolver, -1);
+    kresolver = NULL;
+  }
 }
 
 static std::string check_bpf_probe_read_kernel(void) {
-  bool is_probe_read_kernel;
-  void *resolver = get_symbol_resolver();
-  uint64_t addr = 0;
-  is_probe_read_kernel = bcc_symcache_resolve_name(resolver, nullptr,
-                          "bpf_probe_read_kernel", &addr) >= 0 ? true: false;
+  bool is_probe_read_kernel = kernel_symbol_exists("bpf_probe_read_kernel");
 
   /* If bpf_probe_read is not found (ARCH_HAS_NON_OVERLAPPING_ADDRESS_SPACE) is
    * not set in newer kernel, then bcc would anyway fail */
@@ -151,10 +161,7 @@ static std::string check_bpf_probe_read_user(llvm::StringRef probe,
   if (probe.str() == "bpf_probe_read_user" ||
       probe.str() == "bpf_probe_read_user_str") {
     // Check for probe_user symbols in backported kernel before fallback
-    void *resolver = get_symbol_resolver();
-    uint64_t addr = 0;
-    bool found = bcc_symcache_resolve_name(resolver, nullptr,
-                  "bpf_probe_read_user", &addr) >= 0 ? true: false;
+    bool found = kernel_symbol_exists("bpf_probe_read_user");
     if (found)
       return probe.str();
 
@@ -832,8 +839,29 @@ void BTypeVisitor::genParamIndirectAssign(FunctionDecl *D, string& preamble,
   preamble += tmp_preamble;
 }
 
+static bool calls_usdt_readarg(Stmt *S) {
+  if (!S)
+    return false;
+  if (CallExpr *Call = dyn_cast<CallExpr>(S)) {
+    if (FunctionDecl *F = Call->getDirectCallee()) {
+      if (F->getIdentifier() && (F->getName() == "bpf_usdt_readarg" ||
+                                 F->getName() == "bpf_usdt_readarg_p"))
+        return true;
+    }
+  }
+  for (Stmt *child : S->children())
+    if (calls_usdt_readarg(child))
+      return true;
+  return false;
+}
+
 void BTypeVisitor::rewriteFuncParam(FunctionDecl *D) {
   string preamble = "{\n";
+  // In table mode the argument readers look the probe up on first use and
+  // leave it here for the next ones
+  usdt_spec_declared_ = calls_usdt_readarg(D->getBody());
+  if (usdt_spec_declared_)
+    preamble += "void *__bcc_usdt_spec = 0;\n";
   if (D->param_size() > 1) {
     bool is_syscall = false;
     if (strncmp(D->getName().str().c_str(), "syscall__", 9) == 0 ||
@@ -911,6 +939,8 @@ bool BTypeVisitor::VisitFunctionDecl(FunctionDecl *D) {
     // rewritable functions that are static should be always treated as helper
     rewriter_.InsertText(real_start_loc, "__attribute__((always_inline))\n");
   }
+  if (D->doesThisDeclarationHaveABody() && !fe_.is_rewritable_ext_func(D))
+    usdt_spec_declared_ = false;
   return true;
 }
 
@@ -1231,6 +1261,8 @@ bool BTypeVisitor::VisitCallExpr(CallExpr *Call) {
 
         for (auto arg : Call->arguments())
           args.push_back(rewriter_.getRewrittenText(expansionRange(arg->getSourceRange())));
+        // Helper functions look the USDT argument spec up on every read
+        string usdt_spec = usdt_spec_declared_ ? "&__bcc_usdt_spec" : "(void **)0";
 
         if (Decl->getName() == "incr_cksum_l3") {
           text = "bpf_l3_csum_replace_(" + fn_args_[0]->getName().str() + ", (u64)";
@@ -1262,7 +1294,8 @@ bool BTypeVisitor::VisitCallExpr(CallExpr *Call) {
         } else if (Decl->getName() == "bpf_usdt_readarg_p") {
           text = "({ u64 __addr = 0x0; ";
           text += "_bpf_readarg_" + current_fn_ + "_" + args[0] + "(" +
-                  args[1] + ", &__addr, sizeof(__addr));";
+                  args[1] + ", " + usdt_spec +
+                  ", &__addr, sizeof(__addr));";
 
           bool overlap_addr = false;
           text += check_bpf_probe_read_user(StringRef("bpf_probe_read_user"),
@@ -1277,7 +1310,8 @@ bool BTypeVisitor::VisitCallExpr(CallExpr *Call) {
           rewriter_.ReplaceText(expansionRange(Call->getSourceRange()), text);
         } else if (Decl->getName() == "bpf_usdt_readarg") {
           text = "_bpf_readarg_" + current_fn_ + "_" + args[0] + "(" + args[1] +
-                 ", " + args[2] + ", sizeof(*(" + args[2] + ")))";
+                 ", " + usdt_spec + ", " + args[2] + ", sizeof(*(" + args[2] +
+                 ")))";
           rewriter_.ReplaceText(expansionRange(Call->getSourceRange()), text);
         }
       }
@@ -1786,7 +1820,6 @@ BFrontendAction::BFrontendAction(
       main_path_(main_path),
       prog_func_info_(prog_func_info),
       mod_src_(mod_src),
-      next_fake_fd_(-1),
       fake_fd_map_(fake_fd_map),
       perf_events_(perf_events) {}
 
@@ -1804,10 +1837,7 @@ void BFrontendAction::DoMiscWorkAround() {
   // CONFIG_CC_STACKPROTECTOR properly based on other configs, so it relieved any bpf
   // program (using task_struct, etc.) of patching the below code.
   std::string probefunc = check_bpf_probe_read_kernel();
-  if (kresolver) {
-    bcc_free_symcache(kresolver, -1);
-    kresolver = NULL;
-  }
+  free_symbol_resolver();
   if (probefunc == "bpf_probe_read") {
     probefunc = "#define bpf_probe_read_kernel bpf_probe_read\n"
       "#define bpf_probe_read_kernel_str bpf_probe_read_str\n"
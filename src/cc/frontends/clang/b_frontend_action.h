@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <atomic>
 #include <map>
 #include <memory>
 #include <set>
@@ -90,6 +91,9 @@ class BTypeVisitor : public clang::RecursiveASTVisitor<BTypeVisitor> {
   std::vector<clang::ParmVarDecl *> fn_args_;
   std::set<clang::Expr *> visited_;
   std::string current_fn_;
+  // the function being visited declares __bcc_usdt_spec, the USDT argument
+  // spec its bpf_usdt_readarg() calls share
+  bool usdt_spec_declared_ = false;
   bool cannot_fall_back_safely;
 };
 
@@ -174,7 +178,12 @@ class BFrontendAction : public clang::ASTFrontendAction {
   bool is_rewritable_ext_func(clang::FunctionDecl *D);
   void DoMiscWorkAround();
   // negative fake_fd to be different from real fd in bpf_pseudo_fd.
-  int get_next_fake_fd() { return next_fake_fd_--; }
+  // Fake fds are unique in the process, so that modules compiled at the same
+  // time can't mistake each other's tables for their own
+  int get_next_fake_fd() {
+    static std::atomic<int> next_fake_fd(-1);
+    return next_fake_fd--;
+  }
   void add_map_def(int fd,
     std::tuple<int, std::string, int, int, int, int, int, std::string,
                std::string> map_def) {
@@ -194,7 +203,6 @@ class BFrontendAction : public clang::ASTFrontendAction {
   ProgFuncInfo &prog_func_info_;
   std::string &mod_src_;
   std::set<clang::Decl *> m_;
-  int next_fake_fd_;
   fake_fd_map_def &fake_fd_map_;
   std::map<std::string, std::vector<std::string>> &perf_events_;
 };
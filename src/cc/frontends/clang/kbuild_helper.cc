@@ -19,9 +19,20 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 #include <unistd.h>
+#ifdef HAVE_LIBLZMA
+#include <lzma.h>
+#endif
 
+#include <algorithm>
+#include <mutex>
+
+#include "bpf_module_cache.h"
+#include "file_desc.h"
 #include "kbuild_helper.h"
 
 namespace ebpf {
@@ -155,7 +166,8 @@ static inline int file_exists_and_ownedby(const char *f, uid_t uid)
 
 static inline int proc_kheaders_exists(void)
 {
-  return file_exists_and_ownedby(PROC_KHEADERS_PATH, 0);
+  // A file owned by anyone but root is not trusted
+  return file_exists_and_ownedby(PROC_KHEADERS_PATH, 0) == 1;
 }
 
 static inline const char *get_tmp_dir() {
@@ -166,10 +178,353 @@ static inline const char *get_tmp_dir() {
   return "/tmp";
 }
 
-static inline int extract_kheaders(const std::string &dirpath,
-                                   const struct utsname &uname_data)
+namespace {
+
+// Written into an extracted kheaders directory once it is complete, with the
+// digest of the archive it was extracted from.
+const char *KHEADERS_MARKER = ".bcc-kheaders";
+
+bool read_fd(int fd, string &data) {
+  data.clear();
+  char buf[64 * 1024];
+  while (true) {
+    ssize_t ret = ::read(fd, buf, sizeof(buf));
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0)
+      return false;
+    if (ret == 0)
+      return true;
+    data.append(buf, ret);
+  }
+}
+
+bool read_file(const string &path, string &data) {
+  FileDesc fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  return fd >= 0 && read_fd(fd, data);
+}
+
+bool write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t ret = ::write(fd, data, size);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    data += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+void remove_tree(const string &path) {
+  if (::nftw(path.c_str(), ftw_cb, 20, FTW_DEPTH | FTW_PHYS) < 0)
+    ::perror("ftw");
+}
+
+// Only trust a directory nobody else could have written to
+bool owned_by_us(const string &path) {
+  struct stat st;
+  return ::lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode) &&
+         st.st_uid == geteuid() && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+// Creates the directories leading to path below dir. An existing component
+// which isn't a directory, e.g. a symlink extracted earlier, is refused, so
+// that nothing is ever written through a link.
+bool make_dirs(const string &dir, const string &path) {
+  for (size_t pos = path.find('/'); pos != string::npos;
+       pos = path.find('/', pos + 1)) {
+    string sub = dir + "/" + path.substr(0, pos);
+    struct stat st;
+    if (::lstat(sub.c_str(), &st) == 0) {
+      if (!S_ISDIR(st.st_mode))
+        return false;
+    } else if (errno != ENOENT ||
+               (::mkdir(sub.c_str(), 0755) != 0 && errno != EEXIST)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+bool safe_path(const string &path) {
+  if (path.empty() || path[0] == '/')
+    return false;
+  size_t pos = 0;
+  while (pos <= path.size()) {
+    size_t next = path.find('/', pos);
+    if (next == string::npos)
+      next = path.size();
+    if (path.compare(pos, next - pos, "..") == 0)
+      return false;
+    pos = next + 1;
+  }
+  return true;
+}
+
+bool safe_link(const string &name, const string &target) {
+  if (!safe_path(name) || target.empty() || target[0] == '/')
+    return false;
+
+  // Components of the directory holding the link, then of the target on top
+  vector<string> parts;
+  size_t slash = name.rfind('/');
+  string path = slash == string::npos ? target
+                                      : name.substr(0, slash + 1) + target;
+  size_t pos = 0;
+  while (pos <= path.size()) {
+    size_t next = path.find('/', pos);
+    if (next == string::npos)
+      next = path.size();
+    string part = path.substr(pos, next - pos);
+    if (part == "..") {
+      if (parts.empty())
+        return false;
+      parts.pop_back();
+    } else if (!part.empty() && part != ".") {
+      parts.push_back(part);
+    }
+    pos = next + 1;
+  }
+  return true;
+}
+
+TarExtractor::TarExtractor(const string &dir)
+    : dir_(dir), block_len_(0), state_(HEADER), left_(0), end_(false) {}
+
+bool TarExtractor::feed(const char *data, size_t size) {
+  while (size > 0 && !end_) {
+    size_t n = std::min(size, sizeof(block_) - block_len_);
+    memcpy(block_ + block_len_, data, n);
+    block_len_ += n;
+    data += n;
+    size -= n;
+    if (block_len_ < sizeof(block_))
+      break;
+    block_len_ = 0;
+    if (!process_block())
+      return false;
+  }
+  return true;
+}
+
+uint64_t TarExtractor::parse_octal(const char *p, size_t len) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < len && p[i]; i++)
+    if (p[i] >= '0' && p[i] <= '7')
+      v = v * 8 + (p[i] - '0');
+  return v;
+}
+
+string TarExtractor::field(const char *p, size_t len) {
+  return string(p, strnlen(p, len));
+}
+
+bool TarExtractor::process_block() {
+  size_t n = std::min<uint64_t>(left_, sizeof(block_));
+  switch (state_) {
+  case HEADER:
+    return process_header();
+  case FILE_DATA:
+    if (!write_all(file_, block_, n))
+      return false;
+    break;
+  case LONG_NAME:
+  case PAX_HEADER:
+    meta_.append(block_, n);
+    break;
+  case SKIP:
+    break;
+  }
+  left_ -= n;
+  if (left_ > 0)
+    return true;
+
+  if (state_ == FILE_DATA)
+    file_ = -1;
+  else if (state_ == LONG_NAME)
+    long_name_ = meta_.c_str();
+  else if (state_ == PAX_HEADER)
+    parse_pax();
+  state_ = HEADER;
+  return true;
+}
+
+void TarExtractor::parse_pax() {
+  // Records are "<length> <key>=<value>\n"
+  size_t pos = 0;
+  while (pos < meta_.size()) {
+    size_t len = strtoul(meta_.c_str() + pos, nullptr, 10);
+    size_t sp = meta_.find(' ', pos);
+    if (len == 0 || sp == string::npos || pos + len > meta_.size())
+      return;
+    string record = meta_.substr(sp + 1, pos + len - sp - 2);
+    if (record.compare(0, 5, "path=") == 0)
+      long_name_ = record.substr(5);
+    pos += len;
+  }
+}
+
+bool TarExtractor::process_header() {
+  static const char zeros[512] = {};
+  if (memcmp(block_, zeros, sizeof(block_)) == 0) {
+    end_ = true;
+    return true;
+  }
+
+  string name = field(block_, 100);
+  string prefix = field(block_ + 345, 155);
+  if (memcmp(block_ + 257, "ustar", 5) == 0 && !prefix.empty())
+    name = prefix + "/" + name;
+  if (!long_name_.empty()) {
+    name = long_name_;
+    long_name_.clear();
+  }
+  while (name.compare(0, 2, "./") == 0)
+    name = name.substr(2);
+  while (!name.empty() && name.back() == '/')
+    name.pop_back();
+
+  left_ = parse_octal(block_ + 124, 12);
+  mode_t mode = parse_octal(block_ + 100, 8) & 0755;
+  char type = block_[156];
+  meta_.clear();
+
+  if (type == 'L') {
+    state_ = LONG_NAME;
+  } else if (type == 'x') {
+    state_ = PAX_HEADER;
+  } else if (type != '0' && type != '\0' && type != '7' && type != '5' &&
+             type != '2') {
+    state_ = SKIP;
+  } else if (name.empty()) {
+    state_ = SKIP;
+  } else if (!safe_path(name) || !make_dirs(dir_, name)) {
+    fprintf(stderr, "kheaders: invalid path %s in archive\n", name.c_str());
+    return false;
+  } else if (type == '5') {
+    string path = dir_ + "/" + name;
+    if (::mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+      return false;
+    state_ = SKIP;
+  } else if (type == '2') {
+    string target = field(block_ + 157, 100);
+    if (!safe_link(name, target)) {
+      fprintf(stderr, "kheaders: invalid link %s in archive\n", name.c_str());
+      return false;
+    }
+    string path = dir_ + "/" + name;
+    if (::symlink(target.c_str(), path.c_str()) != 0)
+      return false;
+    state_ = SKIP;
+  } else {
+    string path = dir_ + "/" + name;
+    file_ = ::open(path.c_str(),
+                   O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                   mode | 0600);
+    if (file_ < 0)
+      return false;
+    state_ = FILE_DATA;
+  }
+
+  if (left_ == 0)
+    return process_block();
+  return true;
+}
+
+namespace {
+
+// Decompresses the archive and extracts it into dir as the data comes out
+// of the decoder, so the uncompressed tar never exists as a whole.
+int extract_archive(const string &archive, const string &dir) {
+#ifdef HAVE_LIBLZMA
+  lzma_stream stream = LZMA_STREAM_INIT;
+  if (lzma_stream_decoder(&stream, UINT64_MAX, 0) != LZMA_OK)
+    return -1;
+
+  TarExtractor tar(dir);
+  uint8_t out[64 * 1024];
+  stream.next_in = reinterpret_cast<const uint8_t *>(archive.data());
+  stream.avail_in = archive.size();
+  lzma_ret ret;
+  do {
+    stream.next_out = out;
+    stream.avail_out = sizeof(out);
+    ret = lzma_code(&stream, LZMA_FINISH);
+    if ((ret != LZMA_OK && ret != LZMA_STREAM_END) ||
+        !tar.feed(reinterpret_cast<const char *>(out),
+                  sizeof(out) - stream.avail_out)) {
+      lzma_end(&stream);
+      return -1;
+    }
+  } while (ret != LZMA_STREAM_END && !tar.done());
+  lzma_end(&stream);
+  return tar.done() ? 0 : -1;
+#else
+  (void)archive;
+  string cmd = string("tar -xf ") + PROC_KHEADERS_PATH + " -C " + dir;
+  return system(cmd.c_str());
+#endif
+}
+
+// Reading and hashing the archive takes longer than the rest of a parse.
+// Its digest is computed once per process, and again only when the archive
+// no longer looks the same, e.g. after the module was reloaded. With archive
+// set, the archive is read into it and the digest is that of what was read.
+bool kheaders_digest(string &digest, string *archive = nullptr) {
+  static std::mutex mutex;
+  static string cached_stamp, cached_digest;
+
+  if (!proc_kheaders_exists())
+    return false;
+  FileDesc fd(::open(PROC_KHEADERS_PATH, O_RDONLY | O_CLOEXEC));
+  struct stat st;
+  if (fd < 0 || ::fstat(fd, &st) != 0)
+    return false;
+  string stamp = std::to_string(st.st_dev) + " " + std::to_string(st.st_ino) +
+                 " " + std::to_string(st.st_size) + " " +
+                 std::to_string(st.st_mtim.tv_sec) + "." +
+                 std::to_string(st.st_mtim.tv_nsec);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  string data;
+  if ((archive || stamp != cached_stamp) && !read_fd(fd, data))
+    return false;
+  if (stamp != cached_stamp) {
+    cached_digest = cache_key_hash(data);
+    cached_stamp = stamp;
+  }
+  digest = cached_digest;
+  if (archive)
+    *archive = std::move(data);
+  return true;
+}
+
+// A directory is usable once its marker is written. If the archive can be
+// read without loading the module, its digest has to match too, which
+// catches a kernel rebuilt with the same release and version string.
+bool kheaders_dir_valid(const string &dirpath, const string *digest) {
+  string marker;
+  if (!owned_by_us(dirpath) ||
+      !read_file(dirpath + "/" + KHEADERS_MARKER, marker))
+    return false;
+  if (!digest) {
+    string archive_digest;
+    if (!kheaders_digest(archive_digest))
+      return true;
+    return marker == archive_digest + "\n";
+  }
+  return marker == *digest + "\n";
+}
+
+}  // namespace
+
+static inline int extract_kheaders(const std::string &dirpath)
 {
-  char tar_cmd[256], dirpath_tmp[256];
+  string archive, digest, tmp;
   int ret;
   bool module = false;
 
@@ -184,30 +539,53 @@ static inline int extract_kheaders(const std::string &dirpath,
     }
   }
 
-  snprintf(dirpath_tmp, sizeof(dirpath_tmp), "%s/kheaders-%s-XXXXXX",
-           get_tmp_dir(), uname_data.release);
-  if (mkdtemp(dirpath_tmp) == NULL) {
+  // The marker has to describe what is extracted, the digest is that of the
+  // archive read here
+  if (!kheaders_digest(digest, &archive)) {
     ret = -1;
     goto cleanup;
   }
+  ret = 0;
+  if (kheaders_dir_valid(dirpath, &digest))
+    goto cleanup;
 
-  if ((size_t)snprintf(tar_cmd, sizeof(tar_cmd), "tar -xf %s -C %s", PROC_KHEADERS_PATH, dirpath_tmp) >= sizeof(tar_cmd)) {
+  // Extract next to the final directory and rename it into place, so that
+  // it is never seen half extracted
+  tmp = dirpath + ".XXXXXX";
+  if (mkdtemp(&tmp[0]) == NULL) {
     ret = -1;
     goto cleanup;
   }
-  ret = system(tar_cmd);
-  if (ret) {
-    system(("rm -rf " + std::string(dirpath_tmp)).c_str());
+  if (extract_archive(archive, tmp) != 0) {
+    fprintf(stderr, "Unable to extract %s\n", PROC_KHEADERS_PATH);
+    remove_tree(tmp);
+    ret = -1;
     goto cleanup;
   }
 
-  /*
-   * If the new directory exists, it could have raced with a parallel
-   * extraction, in this case just delete the old directory and ignore.
-   */
-  ret = rename(dirpath_tmp, dirpath.c_str());
-  if (ret)
-    ret = system(("rm -rf " + std::string(dirpath_tmp)).c_str());
+  {
+    string marker = digest + "\n";
+    FileDesc fd(::open((tmp + "/" + KHEADERS_MARKER).c_str(),
+                       O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644));
+    if (fd < 0 || !write_all(fd, marker.data(), marker.size())) {
+      remove_tree(tmp);
+      ret = -1;
+      goto cleanup;
+    }
+  }
+
+  // Replace an outdated or incomplete directory of our own
+  if (owned_by_us(dirpath)) {
+    string old = dirpath + ".old.XXXXXX";
+    if (mkdtemp(&old[0]) != NULL && ::rename(dirpath.c_str(), old.c_str()) == 0)
+      remove_tree(old);
+    else if (!old.empty())
+      ::rmdir(old.c_str());
+  }
+  if (::rename(tmp.c_str(), dirpath.c_str()) != 0) {
+    remove_tree(tmp);
+    ret = kheaders_dir_valid(dirpath, &digest) ? 0 : -1;
+  }
 
 cleanup:
   if (module) {
@@ -222,20 +600,29 @@ cleanup:
 int get_proc_kheaders(std::string &dirpath)
 {
   struct utsname uname_data;
-  char dirpath_tmp[256];
 
   if (uname(&uname_data))
     return -errno;
 
-  snprintf(dirpath_tmp, 256, "%s/kheaders-%s", get_tmp_dir(),
-           uname_data.release);
-  dirpath = std::string(dirpath_tmp);
+  // The version string tells apart builds of the same release
+  dirpath = string(get_tmp_dir()) + "/kheaders-" + uname_data.release + "-" +
+            cache_key_hash(uname_data.version).substr(0, 16);
 
-  if (file_exists_and_ownedby(dirpath_tmp, 0))
+  if (kheaders_dir_valid(dirpath, nullptr))
     return 0;
 
-  // First time so extract it
-  return extract_kheaders(dirpath, uname_data);
+  // Only one process extracts at a time, the others wait and then use its
+  // result
+  FileDesc lock(::open((dirpath + ".lock").c_str(),
+                       O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600));
+  if (lock >= 0) {
+    while (flock(lock, LOCK_EX) != 0 && errno == EINTR)
+      ;
+    if (kheaders_dir_valid(dirpath, nullptr))
+      return 0;
+  }
+
+  return extract_kheaders(dirpath);
 }
 
 }  // namespace ebpf
@@ -13,6 +13,7 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <cstdint>
 #include <cstring>
 #include <memory>
 #include <string>
@@ -21,6 +22,8 @@
 #include <errno.h>
 #include <ftw.h>
 
+#include "file_desc.h"
+
 #define PROC_KHEADERS_PATH "/sys/kernel/kheaders.tar.xz"
 
 namespace ebpf {
@@ -104,4 +107,41 @@ class KBuildHelper {
 };
 
 int get_proc_kheaders(std::string &dir);
+
+// Relative paths which stay inside the extraction directory
+bool safe_path(const std::string &path);
+// A symlink at name pointing to target, once the target is resolved against
+// the directory of the link, stays inside the extraction directory
+bool safe_link(const std::string &name, const std::string &target);
+
+// Extracts a stream of tar data into a directory as it is decompressed.
+// Handles what kheaders archives are made of: ustar and GNU tar headers,
+// regular files, directories, relative symlinks and long names.
+class TarExtractor {
+ public:
+  explicit TarExtractor(const std::string &dir);
+
+  bool feed(const char *data, size_t size);
+  // The archive ended with its end-of-archive blocks
+  bool done() const { return end_; }
+
+ private:
+  enum State { HEADER, FILE_DATA, LONG_NAME, PAX_HEADER, SKIP };
+
+  static uint64_t parse_octal(const char *p, size_t len);
+  static std::string field(const char *p, size_t len);
+  bool process_block();
+  void parse_pax();
+  bool process_header();
+
+  std::string dir_;
+  char block_[512];
+  size_t block_len_;
+  State state_;
+  uint64_t left_;
+  FileDesc file_;
+  std::string meta_;
+  std::string long_name_;
+  bool end_;
+};
 }  // namespace ebpf
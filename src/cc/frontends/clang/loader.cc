@@ -18,18 +18,26 @@
 #include <string>
 #include <algorithm>
 #include <fcntl.h>
+#include <dirent.h>
 #include <ftw.h>
 #include <map>
 #include <stdlib.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 #include <utility>
 #include <vector>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <cstring>
 #include <iostream>
+#include <mutex>
 #include <linux/bpf.h>
 
 #include <clang/Basic/FileManager.h>
@@ -45,13 +53,20 @@
 #include <clang/Frontend/FrontendActions.h>
 #include <clang/Frontend/FrontendDiagnostic.h>
 #include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Frontend/Utils.h>
 #include <clang/FrontendTool/Utils.h>
+#include <clang/Lex/Preprocessor.h>
 #include <clang/Lex/PreprocessorOptions.h>
 
 #include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
 
+#include "bcc_common.h"
 #include "bcc_exception.h"
+#include "bcc_version.h"
 #include "bpf_module.h"
+#include "bpf_module_cache.h"
 #include "exported_files.h"
 #include "kbuild_helper.h"
 #include "b_frontend_action.h"
@@ -105,7 +120,7 @@ optional<FuncInfo &> ProgFuncInfo::add_func(std::string name) {
 }
 
 ClangLoader::ClangLoader(llvm::LLVMContext *ctx, unsigned flags)
-    : ctx_(ctx), flags_(flags)
+    : external_includes_(false), ctx_(ctx), flags_(flags)
 {
   for (auto f : ExportedFiles::headers())
     remapped_headers_[f.first] = llvm::MemoryBuffer::getMemBuffer(f.second);
@@ -140,6 +155,36 @@ void ClangLoader::add_main_input(clang::CompilerInvocation& invocation,
   );
 }
 
+void ClangLoader::use_kernel_fs(clang::CompilerInstance &compiler)
+{
+#if LLVM_VERSION_MAJOR >= 10
+  compiler.createFileManager(kernel_fs_);
+#endif
+}
+
+void ClangLoader::add_prelude(clang::CompilerInvocation& invocation,
+                              const std::vector<std::string>& prelude,
+                              const std::string& pch_path)
+{
+  auto &pp_opts = invocation.getPreprocessorOpts();
+  if (pch_path.empty()) {
+    pp_opts.Includes.insert(pp_opts.Includes.begin(), prelude.begin(),
+                            prelude.end());
+    return;
+  }
+
+  // The name of the precompiled header covers everything its validation
+  // would check, and more: the remapped headers have no modification time to
+  // compare.
+  pp_opts.ImplicitPCHInclude = pch_path;
+#if LLVM_VERSION_MAJOR >= 13
+  pp_opts.DisablePCHOrModuleValidation =
+      clang::DisableValidationForModuleKind::PCH;
+#else
+  pp_opts.DisablePCHValidation = true;
+#endif
+}
+
 namespace
 {
 
@@ -175,6 +220,326 @@ std::pair<bool, string> get_kernel_path_info(const string kdir)
   return std::make_pair(false, "build");
 }
 
+const char *PCH_PRELUDE_PATH = "/virtual/include/bcc/prelude.h";
+const char *PCH_PREFIX = "bcc-prelude-";
+const char *PCH_SUFFIX = ".pch";
+// The identifiers a precompiled prelude refers to, next to it
+const char *PCH_IDS_SUFFIX = ".ids";
+const size_t PCH_MAX_FILES = 8;
+
+// Precompiled preludes are kept in BCC_PCH_DIR, or along with the compiled
+// modules in BCC_CACHE_DIR if it is not set. An empty BCC_PCH_DIR disables
+// them, as does one another user can write to.
+string pch_dir()
+{
+  const char *dir = ::getenv("BCC_PCH_DIR");
+  if (dir) {
+    if (*dir && !private_cache_dir(dir))
+      return "";
+    return dir;
+  }
+  BPFModuleCache *cache = BPFModuleCache::instance();
+  return cache ? cache->dir() : "";
+}
+
+// Precompiled preludes are named by the prefix, the 32 hex digits of their
+// key and the suffix
+bool is_pch_name(const string &name)
+{
+  size_t prefix_len = strlen(PCH_PREFIX), suffix_len = strlen(PCH_SUFFIX);
+  if (name.size() != prefix_len + 32 + suffix_len ||
+      name.compare(0, prefix_len, PCH_PREFIX) ||
+      name.compare(prefix_len + 32, suffix_len, PCH_SUFFIX))
+    return false;
+  for (size_t i = prefix_len; i < prefix_len + 32; i++)
+    if (!isxdigit(name[i]))
+      return false;
+  return true;
+}
+
+// Every combination of kernel headers and cflags has its own precompiled
+// prelude, only keep the most recently used ones. Other files in the
+// directory are left alone.
+void evict_pchs(const string &dir)
+{
+  std::vector<std::pair<time_t, string>> files;
+  DIR *d = opendir(dir.c_str());
+  if (!d)
+    return;
+  while (struct dirent *ent = readdir(d)) {
+    string name = ent->d_name;
+    if (!is_pch_name(name))
+      continue;
+    struct stat st;
+    string path = dir + "/" + name;
+    if (::lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+      files.emplace_back(st.st_mtime, path);
+  }
+  closedir(d);
+
+  if (files.size() <= PCH_MAX_FILES)
+    return;
+  std::sort(files.begin(), files.end());
+  for (size_t i = 0; i < files.size() - PCH_MAX_FILES; i++) {
+    ::unlink(files[i].second.c_str());
+    ::unlink((files[i].second + PCH_IDS_SUFFIX).c_str());
+  }
+}
+
+// The name of the macro of a -D or -U value
+string macro_name(const string &value)
+{
+  return value.substr(0, value.find_first_of("=("));
+}
+
+// Options of clang -cc1 whose value is the next argument
+bool has_separate_value(const char *arg)
+{
+  static const std::set<string> args = {
+      "-D", "-U", "-I", "-include", "-imacros", "-isystem", "-iquote",
+      "-idirafter", "-internal-isystem", "-internal-externc-isystem",
+      "-isysroot", "-resource-dir", "-triple", "-target-cpu",
+      "-target-feature", "-target-abi", "-tune-cpu", "-mllvm",
+      "-main-file-name", "-o", "-x", "-ferror-limit", "-fmessage-length",
+      "-dwarf-debug-flags", "-fdebug-compilation-dir", "-mrelocation-model",
+      "-mthread-model", "-debugger-tuning"};
+  return args.count(arg);
+}
+
+// Whether an option can change what the prelude compiles to: macros, include
+// paths, the target and the language. Warnings, debug info and the files of
+// the program can't.
+bool is_prelude_option(const char *arg)
+{
+  static const char *prefixes[] = {"-D", "-U", "-I", "-i", "-nostd",
+                                   "-nobuiltininc", "-resource-dir", "-triple",
+                                   "-target-", "-std=", "-O", "-f"};
+  static const char *excluded[] = {"-fdebug-", "-fcoverage-", "-ferror-limit",
+                                   "-fmessage-length", "-fcolor-diagnostics",
+                                   "-fno-color-diagnostics"};
+  for (auto prefix : excluded)
+    if (!strncmp(arg, prefix, strlen(prefix)))
+      return false;
+  for (auto prefix : prefixes)
+    if (!strncmp(arg, prefix, strlen(prefix)))
+      return true;
+  return false;
+}
+
+// The identifiers of the precompiled preludes used by the process
+std::mutex pch_ids_mutex;
+std::map<string, std::shared_ptr<const std::set<string>>> pch_ids;
+
+std::shared_ptr<const std::set<string>> read_pch_ids(const string &pch_path)
+{
+  std::lock_guard<std::mutex> lock(pch_ids_mutex);
+  auto it = pch_ids.find(pch_path);
+  if (it != pch_ids.end())
+    return it->second;
+
+  std::ifstream in(pch_path + PCH_IDS_SUFFIX);
+  if (!in)
+    return nullptr;
+  auto ids = std::make_shared<std::set<string>>();
+  string id;
+  while (std::getline(in, id))
+    ids->insert(id);
+  pch_ids[pch_path] = ids;
+  return ids;
+}
+
+// Precompiles the prelude and records every identifier it came across, a
+// macro not among them can't change it
+class PreludePCHAction : public clang::GeneratePCHAction {
+ public:
+  explicit PreludePCHAction(string &ids) : ids_(ids) {}
+
+ protected:
+  void EndSourceFileAction() override {
+    for (const auto &id :
+         getCompilerInstance().getPreprocessor().getIdentifierTable())
+      ids_ += id.getKey().str() + "\n";
+    clang::GeneratePCHAction::EndSourceFileAction();
+  }
+
+ private:
+  string &ids_;
+};
+
+#if LLVM_VERSION_MAJOR >= 10
+// A file of the header cache, every open shares the same buffer
+class CachedFile : public llvm::vfs::File {
+ public:
+  CachedFile(const llvm::vfs::Status &status, const llvm::MemoryBuffer &buf)
+      : status_(status), buf_(buf) {}
+
+  llvm::ErrorOr<llvm::vfs::Status> status() override { return status_; }
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> getBuffer(
+      const llvm::Twine &name, int64_t file_size, bool requires_null_terminator,
+      bool is_volatile) override {
+    return llvm::MemoryBuffer::getMemBuffer(buf_.getBuffer(), name.str(),
+                                            requires_null_terminator);
+  }
+  std::error_code close() override { return std::error_code(); }
+
+ private:
+  llvm::vfs::Status status_;
+  const llvm::MemoryBuffer &buf_;
+};
+
+// Kernel headers don't change while a process compiles programs against
+// them. The status and contents of the files below the kernel directories are
+// read once and shared by every compilation in the process, including
+// the lookups of headers which don't exist there. Other files are passed
+// through.
+class HeaderCacheFS : public llvm::vfs::ProxyFileSystem {
+ public:
+  HeaderCacheFS(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs,
+                const vector<string> &roots)
+      : ProxyFileSystem(fs) {
+    for (const auto &root : roots) {
+      char resolved[PATH_MAX];
+      roots_.push_back(root + "/");
+      if (::realpath(root.c_str(), resolved) && root != resolved)
+        roots_.push_back(string(resolved) + "/");
+    }
+  }
+
+  llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine &path) override {
+    string key;
+    if (!cached(path, key))
+      return ProxyFileSystem::status(path);
+    const Entry &e = lookup(key);
+    if (e.error)
+      return e.error;
+    return llvm::vfs::Status::copyWithNewName(e.status, path.str());
+  }
+
+  llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(
+      const llvm::Twine &path) override {
+    string key;
+    if (!cached(path, key))
+      return ProxyFileSystem::openFileForRead(path);
+    const Entry &e = lookup(key);
+    if (e.error)
+      return e.error;
+    if (!e.buf)
+      return ProxyFileSystem::openFileForRead(path);
+    return std::unique_ptr<llvm::vfs::File>(new CachedFile(
+        llvm::vfs::Status::copyWithNewName(e.status, path.str()), *e.buf));
+  }
+
+  void get_stats(struct bcc_header_cache_stats *stats) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats->files = entries_.size();
+    stats->bytes = bytes_;
+    stats->hits = hits_;
+    stats->misses = misses_;
+  }
+
+ private:
+  struct Entry {
+    std::error_code error;
+    llvm::vfs::Status status;
+    std::unique_ptr<llvm::MemoryBuffer> buf;
+  };
+
+  bool cached(const llvm::Twine &path, string &key) {
+    llvm::SmallString<256> abs;
+    path.toVector(abs);
+    if (makeAbsolute(abs))
+      return false;
+    llvm::sys::path::remove_dots(abs);
+    key = abs.str().str();
+    for (const auto &root : roots_)
+      if (key.compare(0, root.size(), root) == 0)
+        return true;
+    return false;
+  }
+
+  // Entries are never removed, the whole cache is dropped instead
+  const Entry &lookup(const string &key) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = entries_.find(key);
+      if (it != entries_.end()) {
+        hits_++;
+        return it->second;
+      }
+      misses_++;
+    }
+
+    // The file is read without holding the lock, if another compile read it
+    // in the meantime its copy wins
+    Entry e;
+    auto status = getUnderlyingFS().status(key);
+    if (!status) {
+      e.error = status.getError();
+    } else {
+      e.status = *status;
+      // Files are read rather than mapped, in case they are replaced later on
+      if (status->isRegularFile()) {
+        auto buf = getUnderlyingFS().getBufferForFile(key, -1, true, true);
+        if (buf)
+          e.buf = std::move(*buf);
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto res = entries_.emplace(key, std::move(e));
+    if (res.second && res.first->second.buf)
+      bytes_ += res.first->second.buf->getBufferSize();
+    return res.first->second;
+  }
+
+  vector<string> roots_;
+  std::mutex mutex_;
+  std::map<string, Entry> entries_;
+  uint64_t bytes_ = 0;
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+};
+
+std::mutex header_cache_mutex;
+llvm::IntrusiveRefCntPtr<HeaderCacheFS> header_cache;
+string header_cache_id;
+
+// The file system clang reads through, relative paths are relative to the
+// kernel directory. The process' working directory is left alone, so that
+// several threads can compile at once.
+//
+// It shares the header cache of the kernel headers in kpath, a new one is
+// started when they change. BCC_HEADER_CACHE=0 disables it.
+llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> get_kernel_fs(
+    const string &kpath, const vector<string> &roots, const string &id) {
+  llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs(
+      llvm::vfs::createPhysicalFileSystem().release());
+  if (std::error_code ec = fs->setCurrentWorkingDirectory(kpath)) {
+    fprintf(stderr, "kernel directory %s: %s\n", kpath.c_str(),
+            ec.message().c_str());
+    return nullptr;
+  }
+
+  const char *env = ::getenv("BCC_HEADER_CACHE");
+  if (env && !strcmp(env, "0"))
+    return fs;
+
+  string cache_id = id + kpath;
+  std::lock_guard<std::mutex> lock(header_cache_mutex);
+  if (!header_cache || header_cache_id != cache_id) {
+    header_cache = new HeaderCacheFS(fs, roots);
+    header_cache_id = cache_id;
+  }
+  return header_cache;
+}
+#endif
+
+// Records every file a compile reads, system headers included
+class IncludeCollector : public clang::DependencyCollector {
+ public:
+  bool needSystemDependencies() override { return true; }
+};
+
 static int CreateFromArgs(clang::CompilerInvocation &invocation,
                           const llvm::opt::ArgStringList &ccargs,
                           clang::DiagnosticsEngine &diags)
@@ -190,6 +555,211 @@ static int CreateFromArgs(clang::CompilerInvocation &invocation,
 
 }
 
+void ClangLoader::release_header_cache() {
+#if LLVM_VERSION_MAJOR >= 10
+  // Compiles in progress keep using the cache they started with
+  std::lock_guard<std::mutex> lock(header_cache_mutex);
+  header_cache.reset();
+  header_cache_id.clear();
+#endif
+}
+
+void ClangLoader::header_cache_stats(struct bcc_header_cache_stats *stats) {
+  *stats = {};
+#if LLVM_VERSION_MAJOR >= 10
+  std::lock_guard<std::mutex> lock(header_cache_mutex);
+  if (header_cache)
+    header_cache->get_stats(stats);
+#endif
+}
+
+std::string ClangLoader::kernel_headers_id() {
+  struct utsname un;
+  uname(&un);
+  string id = string(un.release) + " " + un.version + " " + un.machine + "\n";
+
+  const char *envs[] = {"BCC_KERNEL_SOURCE", "BCC_KERNEL_MODULES_SUFFIX",
+                        "BCC_LINUX_VERSION_CODE", "ARCH"};
+  for (auto env : envs) {
+    const char *val = ::getenv(env);
+    id += string(env) + "=" + (val ? val : "") + "\n";
+  }
+
+  string kpath;
+  const char *kpath_env = ::getenv("BCC_KERNEL_SOURCE");
+  if (kpath_env) {
+    kpath = string(kpath_env);
+  } else {
+    string kdir = string(KERNEL_MODULES_DIR) + "/" + un.release;
+    kpath = kdir + "/" + get_kernel_path_info(kdir).second;
+  }
+
+  // Headers installed from a package are replaced as a whole, the generated
+  // config headers are enough to tell one installation from the next.
+  const char *files[] = {"/include/linux/kconfig.h",
+                         "/include/generated/autoconf.h",
+                         "/include/generated/uapi/linux/version.h"};
+  for (auto f : files) {
+    struct stat st;
+    string path = kpath + f;
+    if (::stat(path.c_str(), &st) == 0)
+      id += path + " " + std::to_string(st.st_ino) + " " +
+            std::to_string(st.st_size) + " " +
+            std::to_string(st.st_mtim.tv_sec) + "\n";
+  }
+  return id;
+}
+
+string ClangLoader::get_pch(const vector<const char *> &ccargs,
+                           const vector<string> &prelude, FileDesc &pch_fd) {
+  string dir = pch_dir();
+  if (dir.empty())
+    return "";
+
+  string text;
+  for (const auto &f : prelude)
+    text += "#include \"" + f + "\"\n";
+  // Kernel headers most programs include can be precompiled too, they then
+  // come before the program's own defines.
+  const char *headers = ::getenv("BCC_PCH_HEADERS");
+  if (headers) {
+    std::stringstream ss(headers);
+    string header;
+    while (std::getline(ss, header, ':'))
+      if (!header.empty())
+        text += "#include <" + header + ">\n";
+  }
+
+  // Only options which can change the prelude go into the key. The macros
+  // the program defines in its cflags are left out of the prelude, so that
+  // programs which only differ in these, e.g. -DPID=..., share it. They are
+  // still defined for the program, and the precompiled prelude isn't used if
+  // it refers to any of them.
+  vector<const char *> args;
+  string key = "bcc " LIBBCC_VERSION " llvm " LLVM_VERSION_STRING "\n";
+  key += kernel_headers_id();
+  for (size_t i = 0; i < ccargs.size(); i++) {
+    const char *arg = ccargs[i];
+    const char *value = nullptr;
+    if (has_separate_value(arg) && i + 1 < ccargs.size())
+      value = ccargs[++i];
+    if ((!strncmp(arg, "-D", 2) || !strncmp(arg, "-U", 2)) &&
+        user_macros_.count(macro_name(value ? value : arg + 2)))
+      continue;
+
+    args.push_back(arg);
+    if (value)
+      args.push_back(value);
+    if (!is_prelude_option(arg))
+      continue;
+    key += arg;
+    key += '\0';
+    if (value) {
+      key += value;
+      key += '\0';
+    }
+  }
+  key += "\n" + text;
+  for (const auto &f : remapped_headers_)
+    if (f.first != PCH_PRELUDE_PATH)
+      key += f.first + " " + cache_key_hash(f.second->getBuffer().str()) + "\n";
+
+  string path = dir + "/" + PCH_PREFIX + cache_key_hash(key) + PCH_SUFFIX;
+  remapped_headers_[PCH_PRELUDE_PATH] =
+      llvm::MemoryBuffer::getMemBufferCopy(text);
+  if (is_file(path) && is_file(path + PCH_IDS_SUFFIX)) {
+    // Eviction goes by modification time, keep the ones in use
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+  } else if (build_pch(args, path)) {
+    evict_pchs(dir);
+  } else {
+    if (flags_ & DEBUG_PREPROCESSOR)
+      llvm::errs() << "failed to precompile prelude, including it instead\n";
+    return "";
+  }
+
+  // Another process may evict the header at any time. The passes read it
+  // through this descriptor, which keeps it around, and don't see it being
+  // replaced either.
+  pch_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (pch_fd < 0) {
+    if (flags_ & DEBUG_PREPROCESSOR)
+      llvm::errs() << "precompiled prelude went away, including it instead\n";
+    return "";
+  }
+
+  if (refers_to_user_macros(path)) {
+    if (flags_ & DEBUG_PREPROCESSOR)
+      llvm::errs() << "prelude refers to macros of the cflags, including it "
+                      "instead\n";
+    pch_fd = -1;
+    return "";
+  }
+  return path;
+}
+
+bool ClangLoader::refers_to_user_macros(const string &pch_path) {
+  auto ids = read_pch_ids(pch_path);
+  if (!ids)
+    return true;
+  for (const auto &name : user_macros_)
+    if (ids->count(name))
+      return true;
+  return false;
+}
+
+bool ClangLoader::build_pch(const vector<const char *> &ccargs,
+                            const string &path) {
+  using namespace clang;
+
+  IntrusiveRefCntPtr<DiagnosticOptions> diag_opts(new DiagnosticOptions());
+  IntrusiveRefCntPtr<DiagnosticIDs> diag_id(new DiagnosticIDs());
+  DiagnosticsEngine diags(diag_id, &*diag_opts, new IgnoringDiagConsumer());
+
+  CompilerInstance compiler;
+  CompilerInvocation &invocation = compiler.getInvocation();
+  llvm::opt::ArgStringList args(ccargs.begin(), ccargs.end());
+  if (!CreateFromArgs(invocation, args, diags))
+    return false;
+
+  // Only the prelude goes into the header, -include'd files of the program
+  // are still included after it
+  invocation.getPreprocessorOpts().Includes.clear();
+  add_remapped_includes(invocation);
+  invocation.getFrontendOpts().Inputs.clear();
+  invocation.getFrontendOpts().Inputs.push_back(FrontendInputFile(
+      PCH_PRELUDE_PATH, FrontendOptions::getInputKindForExtension("c")));
+  string tmp_path = path + ".tmp." + std::to_string(getpid()) + "." +
+                    std::to_string(syscall(SYS_gettid));
+  invocation.getFrontendOpts().ProgramAction = frontend::GeneratePCH;
+  invocation.getFrontendOpts().OutputFile = tmp_path;
+  invocation.getFrontendOpts().DisableFree = false;
+  compiler.createDiagnostics(new IgnoringDiagConsumer());
+  use_kernel_fs(compiler);
+
+  // Concurrent builds of the same header each write their own files, the
+  // last rename wins. The identifiers go first, a header is only used along
+  // with them.
+  string ids;
+  PreludePCHAction act(ids);
+  bool ok = compiler.ExecuteAction(act);
+  if (ok) {
+    string ids_tmp_path = tmp_path + PCH_IDS_SUFFIX;
+    std::ofstream out(ids_tmp_path);
+    out << ids;
+    out.close();
+    ok = out && ::rename(ids_tmp_path.c_str(),
+                         (path + PCH_IDS_SUFFIX).c_str()) == 0;
+    if (!ok)
+      ::unlink(ids_tmp_path.c_str());
+  }
+  if (!ok || ::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    ::unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
 int ClangLoader::parse(
     unique_ptr<llvm::Module> *mod, TableStorage &ts, const string &file,
     bool in_memory, const char *cflags[], int ncflags, const std::string &id,
@@ -234,10 +804,39 @@ int ClangLoader::parse(
   if (flags_ & DEBUG_PREPROCESSOR)
     std::cout << "Running from kernel directory at: " << kpath.c_str() << "\n";
 
-  // clang needs to run inside the kernel dir
+  // Kernel headers are included with paths relative to kpath, or below these
+  kernel_roots_ = {kpath + "/"};
+  if (has_kpath_source)
+    kernel_roots_.push_back(kdir + "/build/");
+  for (size_t i = 0, n = kernel_roots_.size(); i < n; i++) {
+    char resolved[PATH_MAX];
+    if (::realpath(kernel_roots_[i].c_str(), resolved))
+      kernel_roots_.push_back(string(resolved) + "/");
+  }
+  external_includes_ = false;
+
+#if LLVM_VERSION_MAJOR >= 10
+  // clang resolves relative paths against the kernel dir
+  vector<string> kroots({kpath});
+  if (has_kpath_source)
+    kroots.push_back(kdir + "/build");
+  kernel_fs_ = get_kernel_fs(kpath, kroots, kernel_headers_id());
+  if (!kernel_fs_)
+    return -1;
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == NULL) {
+    ::perror("getcwd");
+    return -1;
+  }
+#else
+  // clang needs to run inside the kernel dir, one compile at a time
+  static std::mutex kdir_mutex;
+  std::lock_guard<std::mutex> kdir_lock(kdir_mutex);
   DirStack dstack(kpath);
   if (!dstack.ok())
     return -1;
+  const char *cwd = dstack.cwd();
+#endif
 
   string abs_file;
   if (in_memory) {
@@ -247,7 +846,7 @@ int ClangLoader::parse(
     if (file.substr(0, 1) == "/")
       abs_file = file;
     else
-      abs_file = string(dstack.cwd()) + "/" + file;
+      abs_file = string(cwd) + "/" + file;
   }
 
   // -fno-color-diagnostics: this is a workaround for a bug in llvm terminalHasColors() as of
@@ -258,7 +857,7 @@ int ClangLoader::parse(
   // "-D __BPF_TRACING__" below is added to suppress a warning in 4.17+.
   // It can be removed once clang supports asm-goto or the kernel removes
   // the warning.
-  vector<const char *> flags_cstr({"-O0", "-O2", "-emit-llvm", "-I", dstack.cwd(),
+  vector<const char *> flags_cstr({"-O0", "-O2", "-emit-llvm", "-I", cwd,
                                    "-D", "__BPF_TRACING__",
                                    "-Wno-deprecated-declarations",
                                    "-Wno-gnu-variable-sized-type-not-at-end",
@@ -307,13 +906,19 @@ int ClangLoader::parse(
     flags_cstr_rem.push_back(vmacro.c_str());
   }
 
-  flags_cstr_rem.push_back("-include");
-  flags_cstr_rem.push_back("/virtual/include/bcc/helpers.h");
   flags_cstr_rem.push_back("-isystem");
   flags_cstr_rem.push_back("/virtual/include");
+  user_macros_.clear();
   if (cflags) {
-    for (auto i = 0; i < ncflags; ++i)
+    for (auto i = 0; i < ncflags; ++i) {
       flags_cstr_rem.push_back(cflags[i]);
+      if (strncmp(cflags[i], "-D", 2) && strncmp(cflags[i], "-U", 2))
+        continue;
+      if (cflags[i][2])
+        user_macros_.insert(macro_name(cflags[i] + 2));
+      else if (i + 1 < ncflags)
+        user_macros_.insert(macro_name(cflags[i + 1]));
+    }
   }
 #ifdef CUR_CPU_IDENTIFIER
   string cur_cpu_flag = string("-DCUR_CPU_IDENTIFIER=") + CUR_CPU_IDENTIFIER;
@@ -394,15 +999,17 @@ int ClangLoader::do_compile(
   using namespace clang;
 
   vector<const char *> flags_cstr = flags_cstr_in;
-  if (use_internal_bpfh) {
-    flags_cstr.push_back("-include");
-    flags_cstr.push_back("/virtual/include/bcc/bpf.h");
-  }
-  flags_cstr.push_back("-include");
-  flags_cstr.push_back("/virtual/include/bcc/bpf_workaround.h");
   flags_cstr.insert(flags_cstr.end(), flags_cstr_rem.begin(),
                     flags_cstr_rem.end());
 
+  // Headers included ahead of every program, either one by one or from a
+  // precompiled header.
+  vector<string> prelude;
+  if (use_internal_bpfh)
+    prelude.push_back("/virtual/include/bcc/bpf.h");
+  prelude.push_back("/virtual/include/bcc/bpf_workaround.h");
+  prelude.push_back("/virtual/include/bcc/helpers.h");
+
   // set up the error reporting class
   IntrusiveRefCntPtr<DiagnosticOptions> diag_opts(new DiagnosticOptions());
   auto diag_client = new TextDiagnosticPrinter(llvm::errs(), &*diag_opts);
@@ -413,7 +1020,12 @@ int ClangLoader::do_compile(
   // set up the command line argument wrapper
 
   string target_triple = get_clang_target();
+#if LLVM_VERSION_MAJOR >= 10
+  driver::Driver drv("", target_triple, diags, "clang LLVM compiler",
+                     kernel_fs_);
+#else
   driver::Driver drv("", target_triple, diags);
+#endif
 
 #if LLVM_VERSION_MAJOR >= 4
   if (target_triple == "x86_64-unknown-linux-gnu" || target_triple == "aarch64-unknown-linux-gnu")
@@ -446,13 +1058,27 @@ int ClangLoader::do_compile(
   // Initialize a compiler invocation object from the clang (-cc1) arguments.
   const llvm::opt::ArgStringList &ccargs = cmd.getArguments();
 
+  FileDesc pch_fd;
+  string pch_path = get_pch(vector<const char *>(ccargs.begin(), ccargs.end()),
+                            prelude, pch_fd);
+
   if (flags_ & DEBUG_PREPROCESSOR) {
     llvm::errs() << "clang";
     for (auto arg : ccargs)
       llvm::errs() << " " << arg;
+    if (!pch_path.empty()) {
+      llvm::errs() << " -include-pch " << pch_path;
+    } else {
+      for (const auto &f : prelude)
+        llvm::errs() << " -include " << f;
+    }
     llvm::errs() << "\n";
   }
 
+  string pch_include;
+  if (!pch_path.empty())
+    pch_include = "/proc/self/fd/" + std::to_string((int)pch_fd);
+
   // pre-compilation pass for generating tracepoint structures
   CompilerInstance compiler0;
   CompilerInvocation &invocation0 = compiler0.getInvocation();
@@ -460,6 +1086,7 @@ int ClangLoader::do_compile(
     return -1;
 
   add_remapped_includes(invocation0);
+  add_prelude(invocation0, prelude, pch_include);
 
   if (in_memory) {
     add_main_input(invocation0, main_path, &*main_buf);
@@ -467,6 +1094,7 @@ int ClangLoader::do_compile(
   invocation0.getFrontendOpts().DisableFree = false;
 
   compiler0.createDiagnostics(new IgnoringDiagConsumer());
+  use_kernel_fs(compiler0);
 
   // capture the rewritten c file
   string out_str;
@@ -482,10 +1110,14 @@ int ClangLoader::do_compile(
     return -1;
 
   add_remapped_includes(invocation1);
+  add_prelude(invocation1, prelude, pch_include);
   add_main_input(invocation1, main_path, &*out_buf);
   invocation1.getFrontendOpts().DisableFree = false;
 
   compiler1.createDiagnostics();
+  use_kernel_fs(compiler1);
+  auto includes = std::make_shared<IncludeCollector>();
+  compiler1.addDependencyCollector(includes);
 
   // capture the rewritten c file
   string out_str1;
@@ -494,6 +1126,15 @@ int ClangLoader::do_compile(
                        maps_ns, fake_fd_map, perf_events);
   if (!compiler1.ExecuteAction(bact))
     return -1;
+  for (const auto &dep : includes->getDependencies()) {
+    if (dep.compare(0, 9, "/virtual/") == 0 || dep[0] != '/')
+      continue;
+    bool kernel = false;
+    for (const auto &root : kernel_roots_)
+      kernel = kernel || dep.compare(0, root.size(), root) == 0;
+    if (!kernel)
+      external_includes_ = true;
+  }
   unique_ptr<llvm::MemoryBuffer> out_buf1 = llvm::MemoryBuffer::getMemBuffer(out_str1);
 
   // second pass, clear input and take rewrite buffer
@@ -503,6 +1144,7 @@ int ClangLoader::do_compile(
     return -1;
 
   add_remapped_includes(invocation2);
+  add_prelude(invocation2, prelude, pch_include);
   add_main_input(invocation2, main_path, &*out_buf1);
   invocation2.getFrontendOpts().DisableFree = false;
   invocation2.getCodeGenOpts().DisableFree = false;
@@ -512,6 +1154,7 @@ int ClangLoader::do_compile(
   // suppress warnings in the 2nd pass, but bail out on errors (our fault)
   invocation2.getDiagnosticOpts().IgnoreWarnings = true;
   compiler2.createDiagnostics();
+  use_kernel_fs(compiler2);
 
   EmitLLVMOnlyAction ir_act(&*ctx_);
   if (!compiler2.ExecuteAction(ir_act))
@@ -521,3 +1164,9 @@ int ClangLoader::do_compile(
   return 0;
 }
 }  // namespace ebpf
+
+void bcc_header_cache_get_stats(struct bcc_header_cache_stats *stats) {
+  ebpf::ClangLoader::header_cache_stats(stats);
+}
+
+void bcc_header_cache_release() { ebpf::ClangLoader::release_header_cache(); }
@@ -17,24 +17,36 @@
 #pragma once
 
 #include <clang/Frontend/CompilerInvocation.h>
+#if LLVM_VERSION_MAJOR >= 10
+#include <llvm/Support/VirtualFileSystem.h>
+#endif
 
 #include <functional>
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <vector>
 
+#include "file_desc.h"
 #include "table_storage.h"
 #include "vendor/optional.hpp"
 
 using std::experimental::nullopt;
 using std::experimental::optional;
 
+struct bcc_header_cache_stats;
+
 namespace llvm {
 class Module;
 class LLVMContext;
 class MemoryBuffer;
 }
 
+namespace clang {
+class CompilerInstance;
+}
+
 namespace ebpf {
 
 struct FuncInfo {
@@ -77,6 +89,19 @@ class ClangLoader {
             fake_fd_map_def &fake_fd_map,
             std::map<std::string, std::vector<std::string>> &perf_events);
 
+  // The kernel headers read by parse() are kept in memory for the whole
+  // process, until released here
+  static void release_header_cache();
+  static void header_cache_stats(struct bcc_header_cache_stats *stats);
+
+  // Describe the kernel headers parse() compiles against. Compiled output can
+  // be reused for as long as this stays the same.
+  static std::string kernel_headers_id();
+
+  // Whether the last parse() included files other than the kernel headers
+  // and the headers of bcc, such as the program's own headers.
+  bool external_includes() const { return external_includes_; }
+
  private:
   int do_compile(std::unique_ptr<llvm::Module> *mod, TableStorage &ts,
                  bool in_memory, const std::vector<const char *> &flags_cstr_in,
@@ -88,6 +113,21 @@ class ClangLoader {
                  const std::string &maps_ns, fake_fd_map_def &fake_fd_map,
                  std::map<std::string, std::vector<std::string>> &perf_events);
   void add_remapped_includes(clang::CompilerInvocation& invocation);
+  // Reads files through kernel_fs_
+  void use_kernel_fs(clang::CompilerInstance &compiler);
+  void add_prelude(clang::CompilerInvocation& invocation,
+                   const std::vector<std::string>& prelude,
+                   const std::string& pch_path);
+  // Returns the path of the precompiled header of prelude for ccargs,
+  // building it if needed, and opens it into pch_fd. Returns an empty string
+  // if precompiled headers are disabled, the prelude can't be precompiled or
+  // it refers to one of user_macros_.
+  std::string get_pch(const std::vector<const char *> &ccargs,
+                      const std::vector<std::string> &prelude,
+                      FileDesc &pch_fd);
+  bool build_pch(const std::vector<const char *> &ccargs,
+                 const std::string &path);
+  bool refers_to_user_macros(const std::string &pch_path);
   void add_main_input(clang::CompilerInvocation& invocation,
                       const std::string& main_path,
                       llvm::MemoryBuffer *main_buf);
@@ -95,6 +135,13 @@ class ClangLoader {
  private:
   std::map<std::string, std::unique_ptr<llvm::MemoryBuffer>> remapped_headers_;
   std::map<std::string, std::unique_ptr<llvm::MemoryBuffer>> remapped_footers_;
+#if LLVM_VERSION_MAJOR >= 10
+  llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> kernel_fs_;
+#endif
+  std::vector<std::string> kernel_roots_;
+  // Names of the macros defined or undefined by the cflags of the program
+  std::set<std::string> user_macros_;
+  bool external_includes_;
   llvm::LLVMContext *ctx_;
   unsigned flags_;
 };
@@ -58,6 +58,12 @@
 
 #include "bcc_libbpf_inc.h"
 
+// Kernel-internal errno, returned to user space by some bpf() commands but
+// not defined by the libc headers
+#ifndef ENOTSUPP
+#define ENOTSUPP 524
+#endif
+
 // TODO: remove these defines when linux-libc-dev exports them properly
 
 #ifndef __NR_bpf
@@ -369,7 +375,7 @@ int bcc_create_map_xattr(struct bcc_create_map_attr *attr, bool allow_rlimit)
 
   // kernel already supports btf if its loading is successful,
   // but this map type may not support pretty print yet.
-  if (ret < 0 && attr->btf_key_type_id && errno == 524 /* ENOTSUPP */) {
+  if (ret < 0 && attr->btf_key_type_id && errno == ENOTSUPP) {
     attr->btf_fd = 0;
     attr->btf_key_type_id = 0;
     attr->btf_value_type_id = 0;
@@ -628,6 +634,30 @@ int bpf_prog_compute_tag(const struct bpf_insn *insns, int prog_len,
   return 0;
 }
 
+int bpf_enable_run_time_stats(void)
+{
+  int fd = bpf_enable_stats(BPF_STATS_RUN_TIME);
+  if (fd < 0)
+    return -errno;
+  return fd;
+}
+
+int bpf_prog_get_stats(int prog_fd, struct bcc_prog_stats *stats)
+{
+  struct bpf_prog_info info = {};
+  uint32_t info_len = sizeof(info);
+  int ret;
+
+  ret = bpf_obj_get_info_by_fd(prog_fd, &info, &info_len);
+  if (ret < 0)
+    return ret;
+
+  stats->run_cnt = info.run_cnt;
+  stats->run_time_ns = info.run_time_ns;
+  stats->recursion_misses = info.recursion_misses;
+  return 0;
+}
+
 int bpf_prog_get_tag(int fd, unsigned long long *ptag)
 {
   char fmt[64];
@@ -1358,6 +1388,21 @@ int bpf_attach_kprobe(int progfd, enum bpf_probe_attach_type attach_type,
                           fn_offset, -1, maxactive, 0);
 }
 
+int bpf_attach_kprobe_multi(int progfd, enum bpf_probe_attach_type attach_type,
+                            const char **fn_names, int cnt)
+{
+  DECLARE_LIBBPF_OPTS(bpf_link_create_opts, link_create_opts);
+
+  // The program must have been loaded with expected_attach_type set to
+  // BPF_TRACE_KPROBE_MULTI. The kernel resolves the names through kallsyms
+  // and attaches all of them through a single fprobe.
+  link_create_opts.kprobe_multi.syms = fn_names;
+  link_create_opts.kprobe_multi.cnt = cnt;
+  if (attach_type == BPF_PROBE_RETURN)
+    link_create_opts.kprobe_multi.flags = BPF_F_KPROBE_MULTI_RETURN;
+  return bpf_link_create(progfd, 0, BPF_TRACE_KPROBE_MULTI, &link_create_opts);
+}
+
 static int _find_archive_path_and_offset(const char *entry_path,
                                          char out_path[PATH_MAX],
                                          uint64_t *offset) {
@@ -1400,72 +1445,146 @@ int bpf_attach_uprobe(int progfd, enum bpf_probe_attach_type attach_type,
                           offset, pid, -1, ref_ctr_offset);
 }
 
-static int bpf_detach_probe(const char *ev_name, const char *event_type)
+static int cmp_str(const void *a, const void *b)
 {
-  int kfd = -1, res;
-  char buf[PATH_MAX];
-  int found_event = 0;
-  size_t bufsize = 0;
+  return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// Max size of a single write to [k,u]probe_events, the kernel splits what it
+// gets into lines but refuses writes larger than its command buffer.
+#define PROBE_EVENTS_WRITE_SIZE 4000
+
+// Writes the "-:" commands in buf to [k,u]probe_events. The kernel stops at
+// the first command that fails, e.g. with EBUSY for an event still in use,
+// and the ones after it are not run. Then each command is written again on
+// its own, the ones already run fail with ENOENT, which is fine.
+static int write_probe_events(int kfd, char *buf, size_t len,
+                              const char *event_type)
+{
+  char *line, *end;
+  int ret = 0;
+
+  if (write(kfd, buf, len) >= 0)
+    return 0;
+
+  for (line = buf; line < buf + len; line = end + 1) {
+    end = memchr(line, '\n', buf + len - line);
+    if (!end)
+      end = buf + len;
+    if (write(kfd, line, end - line + 1) < 0 && errno != ENOENT) {
+      fprintf(stderr, "write(%s_events, %.*s): %s\n", event_type,
+              (int)(end - line), line, strerror(errno));
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+static int bpf_detach_probes(const char **ev_names, int cnt,
+                             const char *event_type)
+{
+  int kfd = -1, res, ret = -1;
+  char buf[PATH_MAX], name[PATH_MAX];
+  char **events = NULL, **tmp;
+  int nevents = 0, cap = 0, i;
+  char *wbuf = NULL, *p, *end;
+  size_t bufsize = 0, wlen = 0;
   char *cptr = NULL;
   FILE *fp;
 
   /*
-   * For [k,u]probe created with perf_event_open (on newer kernel), it is
-   * not necessary to clean it up in [k,u]probe_events. We first look up
-   * the %s_bcc_%d line in [k,u]probe_events. If the event is not found,
-   * it is safe to skip the cleaning up process (write -:... to the file).
+   * For [k,u]probes created with perf_event_open (on newer kernel), it is
+   * not necessary to clean them up in [k,u]probe_events. Read the file once
+   * and only remove the %s_bcc_%d events that are actually listed there.
+   * Each line looks like "p:kprobes/p_vfs_read_bcc_1234 vfs_read".
    */
   snprintf(buf, sizeof(buf), "%s/%s_events", get_tracefs_path(), event_type);
   fp = fopen(buf, "r");
   if (!fp) {
     fprintf(stderr, "open(%s): %s\n", buf, strerror(errno));
-    goto error;
-  }
-
-  res = snprintf(buf, sizeof(buf), "%ss/%s_bcc_%d", event_type, ev_name, getpid());
-  if (res < 0 || res >= sizeof(buf)) {
-    fprintf(stderr, "snprintf(%s): %d\n", ev_name, res);
-    goto error;
+    return -1;
   }
-
-  while (getline(&cptr, &bufsize, fp) != -1)
-    if (strstr(cptr, buf) != NULL) {
-      found_event = 1;
-      break;
+  while (getline(&cptr, &bufsize, fp) != -1) {
+    p = strchr(cptr, ':');
+    if (!p)
+      continue;
+    p++;
+    end = p + strcspn(p, " \n");
+    *end = '\0';
+    if (nevents == cap) {
+      cap = cap ? cap * 2 : 64;
+      tmp = realloc(events, cap * sizeof(*events));
+      if (!tmp)
+        goto out;
+      events = tmp;
     }
+    events[nevents] = strdup(p);
+    if (!events[nevents])
+      goto out;
+    nevents++;
+  }
   free(cptr);
+  cptr = NULL;
   fclose(fp);
   fp = NULL;
 
-  if (!found_event)
-    return 0;
+  if (nevents == 0) {
+    ret = 0;
+    goto out;
+  }
+  qsort(events, nevents, sizeof(*events), cmp_str);
 
   snprintf(buf, sizeof(buf), "%s/%s_events", get_tracefs_path(), event_type);
   kfd = open(buf, O_WRONLY | O_APPEND, 0);
   if (kfd < 0) {
     fprintf(stderr, "open(%s): %s\n", buf, strerror(errno));
-    goto error;
-  }
-
-  res = snprintf(buf, sizeof(buf), "-:%ss/%s_bcc_%d", event_type, ev_name, getpid());
-  if (res < 0 || res >= sizeof(buf)) {
-    fprintf(stderr, "snprintf(%s): %d\n", ev_name, res);
-    goto error;
-  }
-  if (write(kfd, buf, strlen(buf)) < 0) {
-    fprintf(stderr, "write(%s): %s\n", buf, strerror(errno));
-    goto error;
+    goto out;
+  }
+  wbuf = malloc(PROBE_EVENTS_WRITE_SIZE);
+  if (!wbuf)
+    goto out;
+
+  // Batch the removals, many "-:" commands per write.
+  ret = 0;
+  for (i = 0; i < cnt; i++) {
+    const char *key = name;
+
+    res = snprintf(name, sizeof(name), "%ss/%s_bcc_%d", event_type,
+                   ev_names[i], getpid());
+    if (res < 0 || res + 3 > PROBE_EVENTS_WRITE_SIZE) {
+      fprintf(stderr, "snprintf(%s): %d\n", ev_names[i], res);
+      ret = -1;
+      continue;
+    }
+    if (!bsearch(&key, events, nevents, sizeof(*events), cmp_str))
+      continue;
+    if (wlen + res + 3 > PROBE_EVENTS_WRITE_SIZE) {
+      if (write_probe_events(kfd, wbuf, wlen, event_type) < 0)
+        ret = -1;
+      wlen = 0;
+    }
+    wlen += snprintf(wbuf + wlen, PROBE_EVENTS_WRITE_SIZE - wlen, "-:%s\n",
+                     name);
   }
+  if (wlen > 0 && write_probe_events(kfd, wbuf, wlen, event_type) < 0)
+    ret = -1;
 
-  close(kfd);
-  return 0;
-
-error:
-  if (kfd >= 0)
-    close(kfd);
+out:
+  free(cptr);
   if (fp)
     fclose(fp);
-  return -1;
+  if (kfd >= 0)
+    close(kfd);
+  free(wbuf);
+  for (i = 0; i < nevents; i++)
+    free(events[i]);
+  free(events);
+  return ret;
+}
+
+static int bpf_detach_probe(const char *ev_name, const char *event_type)
+{
+  return bpf_detach_probes(&ev_name, 1, event_type);
 }
 
 int bpf_detach_kprobe(const char *ev_name)
@@ -1473,11 +1592,61 @@ int bpf_detach_kprobe(const char *ev_name)
   return bpf_detach_probe(ev_name, "kprobe");
 }
 
+int bpf_detach_kprobes(const char **ev_names, int cnt)
+{
+  return bpf_detach_probes(ev_names, cnt, "kprobe");
+}
+
+int bpf_attach_uprobe_multi(int progfd, enum bpf_probe_attach_type attach_type,
+                            const char *binary_path, const uint64_t *offsets,
+                            int cnt, pid_t pid)
+{
+  DECLARE_LIBBPF_OPTS(bpf_link_create_opts, link_create_opts);
+  char archive_path[PATH_MAX];
+  uint64_t archive_offset = 0;
+  unsigned long *offs;
+  int i, ret;
+
+  if (cnt <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (access(binary_path, F_OK) != 0 &&
+      _find_archive_path_and_offset(binary_path, archive_path,
+                                    &archive_offset) == 0) {
+    binary_path = archive_path;
+  }
+
+  offs = calloc(cnt, sizeof(*offs));
+  if (!offs)
+    return -1;
+  for (i = 0; i < cnt; i++)
+    offs[i] = offsets[i] + archive_offset;
+
+  // The program must have been loaded with expected_attach_type set to
+  // BPF_TRACE_UPROBE_MULTI. A pid of 0 traces all processes.
+  link_create_opts.uprobe_multi.path = binary_path;
+  link_create_opts.uprobe_multi.offsets = offs;
+  link_create_opts.uprobe_multi.cnt = cnt;
+  link_create_opts.uprobe_multi.pid = pid > 0 ? pid : 0;
+  if (attach_type == BPF_PROBE_RETURN)
+    link_create_opts.uprobe_multi.flags = BPF_F_UPROBE_MULTI_RETURN;
+  ret = bpf_link_create(progfd, 0, BPF_TRACE_UPROBE_MULTI, &link_create_opts);
+
+  free(offs);
+  return ret;
+}
+
 int bpf_detach_uprobe(const char *ev_name)
 {
   return bpf_detach_probe(ev_name, "uprobe");
 }
 
+int bpf_detach_uprobes(const char **ev_names, int cnt)
+{
+  return bpf_detach_probes(ev_names, cnt, "uprobe");
+}
+
 int bpf_attach_tracepoint(int progfd, const char *tp_category,
                           const char *tp_name)
 {
@@ -1598,15 +1767,12 @@ void * bpf_open_perf_buffer(perf_reader_raw_cb raw_cb,
   return bpf_open_perf_buffer_opts(raw_cb, lost_cb, cb_cookie, page_cnt, &opts);
 }
 
-void * bpf_open_perf_buffer_opts(perf_reader_raw_cb raw_cb,
-                            perf_reader_lost_cb lost_cb, void *cb_cookie,
-                            int page_cnt, struct bcc_perf_buffer_opts *opts)
+static void * open_perf_buffer(struct perf_reader *reader,
+                               struct bcc_perf_buffer_opts *opts)
 {
   int pfd, pid = opts->pid, cpu = opts->cpu;
   struct perf_event_attr attr = {};
-  struct perf_reader *reader = NULL;
 
-  reader = perf_reader_new(raw_cb, lost_cb, cb_cookie, page_cnt);
   if (!reader)
     goto error;
 
@@ -1640,6 +1806,25 @@ error:
   return NULL;
 }
 
+void * bpf_open_perf_buffer_opts(perf_reader_raw_cb raw_cb,
+                            perf_reader_lost_cb lost_cb, void *cb_cookie,
+                            int page_cnt, struct bcc_perf_buffer_opts *opts)
+{
+  return open_perf_buffer(perf_reader_new(raw_cb, lost_cb, cb_cookie, page_cnt),
+                          opts);
+}
+
+void * bpf_open_perf_buffer_batch(bcc_batch_cb batch_cb,
+                                  perf_reader_lost_cb lost_cb, void *cb_cookie,
+                                  int page_cnt,
+                                  struct bcc_perf_buffer_opts *opts,
+                                  struct bcc_batch_opts *batch_opts)
+{
+  return open_perf_buffer(perf_reader_new_batch(batch_cb, lost_cb, cb_cookie,
+                                                page_cnt, batch_opts),
+                          opts);
+}
+
 static int invalid_perf_config(uint32_t type, uint64_t config) {
   switch (type) {
   case PERF_TYPE_HARDWARE:
@@ -103,15 +103,54 @@ int bpf_open_raw_sock(const char *name);
 typedef void (*perf_reader_raw_cb)(void *cb_cookie, void *raw, int raw_size);
 typedef void (*perf_reader_lost_cb)(void *cb_cookie, uint64_t lost);
 
+/* A record handed to a bcc_batch_cb, data is only valid until the callback
+ * returns. */
+struct bcc_batch_record {
+  void *data;
+  int size;
+};
+typedef void (*bcc_batch_cb)(void *cb_cookie, struct bcc_batch_record *records,
+                             int num_records);
+
+struct bcc_batch_opts {
+  /* deliver the batch as soon as it holds this many records */
+  int max_records;
+  /* deliver pending records at the latest this long after the first of them
+   * arrived, 0 delivers them at the end of every poll */
+  int max_latency_ms;
+};
+
 int bpf_attach_kprobe(int progfd, enum bpf_probe_attach_type attach_type,
                       const char *ev_name, const char *fn_name, uint64_t fn_offset,
                       int maxactive);
 int bpf_detach_kprobe(const char *ev_name);
+/* Remove the tracefs events of many detached kprobes with a single pass over
+ * kprobe_events. Their perf event fds must have been closed already.
+ */
+int bpf_detach_kprobes(const char **ev_names, int cnt);
+
+/* Attach progfd, loaded with expected_attach_type BPF_TRACE_KPROBE_MULTI, to
+ * all the kernel functions in fn_names through one kprobe_multi link.
+ * Returns the link fd, or a negative value with errno set on failure.
+ */
+int bpf_attach_kprobe_multi(int progfd, enum bpf_probe_attach_type attach_type,
+                            const char **fn_names, int cnt);
 
 int bpf_attach_uprobe(int progfd, enum bpf_probe_attach_type attach_type,
                       const char *ev_name, const char *binary_path,
                       uint64_t offset, pid_t pid, uint32_t ref_ctr_offset);
 int bpf_detach_uprobe(const char *ev_name);
+/* Same as bpf_detach_kprobes() for uprobe_events */
+int bpf_detach_uprobes(const char **ev_names, int cnt);
+
+/* Attach progfd, loaded with expected_attach_type BPF_TRACE_UPROBE_MULTI, to
+ * cnt file offsets in binary_path through one uprobe_multi link, for pid or
+ * for all processes if pid is -1.
+ * Returns the link fd, or a negative value with errno set on failure.
+ */
+int bpf_attach_uprobe_multi(int progfd, enum bpf_probe_attach_type attach_type,
+                            const char *binary_path, const uint64_t *offsets,
+                            int cnt, pid_t pid);
 
 int bpf_attach_tracepoint(int progfd, const char *tp_category,
                           const char *tp_name);
@@ -135,6 +174,15 @@ void * bpf_open_perf_buffer_opts(perf_reader_raw_cb raw_cb,
                             perf_reader_lost_cb lost_cb, void *cb_cookie,
                             int page_cnt, struct bcc_perf_buffer_opts *opts);
 
+/* Like bpf_open_perf_buffer_opts, but samples are collected and handed to
+ * batch_cb several at a time as configured by batch_opts. perf_reader_poll
+ * delivers the batches which are due, perf_reader_consume all pending ones. */
+void * bpf_open_perf_buffer_batch(bcc_batch_cb batch_cb,
+                                  perf_reader_lost_cb lost_cb, void *cb_cookie,
+                                  int page_cnt,
+                                  struct bcc_perf_buffer_opts *opts,
+                                  struct bcc_batch_opts *batch_opts);
+
 /* attached a prog expressed by progfd to the device specified in dev_name */
 int bpf_attach_xdp(const char *dev_name, int progfd, uint32_t flags);
 
@@ -163,6 +211,26 @@ int bpf_add_ringbuf(struct ring_buffer *rb, int map_fd,
 int bpf_poll_ringbuf(struct ring_buffer *rb, int timeout_ms);
 int bpf_consume_ringbuf(struct ring_buffer *rb);
 
+/* A bcc_batch copies the records added to it and hands them to its callback
+ * several at a time, which amortizes the per-callback cost for consumers like
+ * the Python bindings. To batch a ring buffer, add it to the ring buffer
+ * manager with bcc_batch_ringbuf_cb as sample_cb and the batch as ctx, shorten
+ * the poll timeout with bcc_batch_poll_timeout, and call bcc_batch_flush
+ * after every poll. */
+struct bcc_batch;
+
+struct bcc_batch * bcc_batch_new(bcc_batch_cb cb, void *cb_cookie,
+                                 struct bcc_batch_opts *opts);
+void bcc_batch_free(struct bcc_batch *batch);
+int bcc_batch_add(struct bcc_batch *batch, const void *data, int size);
+/* Deliver the pending records if they are due, or unconditionally if force
+ * is set. Returns the number of records delivered. */
+int bcc_batch_flush(struct bcc_batch *batch, int force);
+/* Returns timeout_ms, shortened to the time left until the pending records
+ * are due. */
+int bcc_batch_poll_timeout(struct bcc_batch *batch, int timeout_ms);
+int bcc_batch_ringbuf_cb(void *ctx, void *data, size_t size);
+
 int bpf_obj_pin(int fd, const char *pathname);
 int bpf_obj_get(const char *pathname);
 int bpf_obj_get_info(int prog_map_fd, void *info, uint32_t *info_len);
@@ -174,6 +242,16 @@ int bpf_prog_get_fd_by_id(uint32_t id);
 int bpf_map_get_fd_by_id(uint32_t id);
 int bpf_obj_get_info_by_fd(int prog_fd, void *info, uint32_t *info_len);
 
+struct bcc_prog_stats {
+  uint64_t run_cnt;
+  uint64_t run_time_ns;
+  uint64_t recursion_misses;
+};
+/* Turns on run_cnt/run_time_ns accounting for all BPF programs until the
+ * returned fd is closed. Returns a negative errno on failure. */
+int bpf_enable_run_time_stats(void);
+int bpf_prog_get_stats(int prog_fd, struct bcc_prog_stats *stats);
+
 int bcc_iter_attach(int prog_fd, union bpf_iter_link_info *link_info,
                     uint32_t link_info_len);
 int bcc_iter_create(int link_fd);
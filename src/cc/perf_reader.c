@@ -24,6 +24,7 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <linux/types.h>
 #include <linux/perf_event.h>
@@ -37,6 +38,127 @@ enum {
   RB_USED_IN_READ = 2, // used in read
 };
 
+struct bcc_batch {
+  bcc_batch_cb cb;
+  void *cb_cookie;
+  int max_records;
+  uint64_t max_latency_ns;
+  // copies of the pending records, records[i].data is only set on delivery
+  char *buf;
+  size_t buf_len;
+  size_t buf_size;
+  size_t *offsets;
+  struct bcc_batch_record *records;
+  int num_records;
+  uint64_t first_ns; // arrival time of the oldest pending record
+};
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct bcc_batch * bcc_batch_new(bcc_batch_cb cb, void *cb_cookie,
+                                 struct bcc_batch_opts *opts) {
+  struct bcc_batch *batch;
+
+  if (!cb || !opts || opts->max_records <= 0 || opts->max_latency_ms < 0) {
+    fprintf(stderr, "%s: invalid batch options\n", __FUNCTION__);
+    return NULL;
+  }
+
+  batch = calloc(1, sizeof(struct bcc_batch));
+  if (!batch)
+    return NULL;
+  batch->cb = cb;
+  batch->cb_cookie = cb_cookie;
+  batch->max_records = opts->max_records;
+  batch->max_latency_ns = opts->max_latency_ms * 1000000ULL;
+  batch->offsets = calloc(opts->max_records, sizeof(size_t));
+  batch->records = calloc(opts->max_records, sizeof(struct bcc_batch_record));
+  if (!batch->offsets || !batch->records) {
+    bcc_batch_free(batch);
+    return NULL;
+  }
+  return batch;
+}
+
+void bcc_batch_free(struct bcc_batch *batch) {
+  if (!batch)
+    return;
+  free(batch->buf);
+  free(batch->offsets);
+  free(batch->records);
+  free(batch);
+}
+
+int bcc_batch_add(struct bcc_batch *batch, const void *data, int size) {
+  if (size < 0)
+    return -1;
+
+  if (batch->buf_len + size > batch->buf_size) {
+    size_t buf_size = batch->buf_size ? batch->buf_size : 4096;
+    while (buf_size < batch->buf_len + size)
+      buf_size *= 2;
+    char *buf = realloc(batch->buf, buf_size);
+    if (!buf) {
+      fprintf(stderr, "%s: cannot allocate %zu bytes\n", __FUNCTION__, buf_size);
+      return -1;
+    }
+    batch->buf = buf;
+    batch->buf_size = buf_size;
+  }
+
+  if (batch->num_records == 0)
+    batch->first_ns = monotonic_ns();
+  memcpy(batch->buf + batch->buf_len, data, size);
+  batch->offsets[batch->num_records] = batch->buf_len;
+  batch->records[batch->num_records].size = size;
+  batch->buf_len += size;
+  batch->num_records++;
+
+  if (batch->num_records == batch->max_records)
+    bcc_batch_flush(batch, 1);
+  return 0;
+}
+
+int bcc_batch_flush(struct bcc_batch *batch, int force) {
+  int i, num_records = batch->num_records;
+
+  if (num_records == 0)
+    return 0;
+  if (!force && monotonic_ns() - batch->first_ns < batch->max_latency_ns)
+    return 0;
+
+  // Pointers are only resolved now, as buf may have moved while growing
+  for (i = 0; i < num_records; i++)
+    batch->records[i].data = batch->buf + batch->offsets[i];
+  batch->num_records = 0;
+  batch->buf_len = 0;
+  batch->cb(batch->cb_cookie, batch->records, num_records);
+  return num_records;
+}
+
+int bcc_batch_poll_timeout(struct bcc_batch *batch, int timeout_ms) {
+  uint64_t now, due;
+  int left_ms;
+
+  if (batch->num_records == 0)
+    return timeout_ms;
+
+  now = monotonic_ns();
+  due = batch->first_ns + batch->max_latency_ns;
+  left_ms = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+  if (timeout_ms < 0 || left_ms < timeout_ms)
+    return left_ms;
+  return timeout_ms;
+}
+
+int bcc_batch_ringbuf_cb(void *ctx, void *data, size_t size) {
+  return bcc_batch_add(ctx, data, size);
+}
+
 struct perf_reader {
   perf_reader_raw_cb raw_cb;
   perf_reader_lost_cb lost_cb;
@@ -49,6 +171,9 @@ struct perf_reader {
   int page_size;
   int page_cnt;
   int fd;
+  uint64_t consumed; // samples handed to raw_cb
+  uint64_t lost; // samples reported lost by the kernel
+  struct bcc_batch *batch; // collects the samples instead of raw_cb if set
 };
 
 struct perf_reader * perf_reader_new(perf_reader_raw_cb raw_cb,
@@ -66,6 +191,21 @@ struct perf_reader * perf_reader_new(perf_reader_raw_cb raw_cb,
   return reader;
 }
 
+struct perf_reader * perf_reader_new_batch(bcc_batch_cb batch_cb,
+                                           perf_reader_lost_cb lost_cb,
+                                           void *cb_cookie, int page_cnt,
+                                           struct bcc_batch_opts *batch_opts) {
+  struct perf_reader *reader = perf_reader_new(NULL, lost_cb, cb_cookie, page_cnt);
+  if (!reader)
+    return NULL;
+  reader->batch = bcc_batch_new(batch_cb, cb_cookie, batch_opts);
+  if (!reader->batch) {
+    free(reader);
+    return NULL;
+  }
+  return reader;
+}
+
 void perf_reader_free(void *ptr) {
   if (ptr) {
     struct perf_reader *reader = ptr;
@@ -81,6 +221,7 @@ void perf_reader_free(void *ptr) {
       close(reader->fd);
     }
     free(reader->buf);
+    bcc_batch_free(reader->batch);
     free(ptr);
   }
 }
@@ -142,7 +283,9 @@ static void parse_sw(struct perf_reader *reader, void *data, int size) {
     return;
   }
 
-  if (reader->raw_cb)
+  if (reader->batch)
+    bcc_batch_add(reader->batch, raw->data, raw->size);
+  else if (reader->raw_cb)
     reader->raw_cb(reader->cb_cookie, raw->data, raw->size);
 }
 
@@ -170,8 +313,9 @@ void perf_reader_event_read(struct perf_reader *reader) {
     return;
 
   // Consume all the events on this ring, calling the cb function for each one.
-  // The message may fall on the ring boundary, in which case copy the message
-  // into a malloced buffer.
+  // The callback is handed a pointer into the ring itself. Only a message that
+  // falls on the ring boundary is copied, into a buffer that is kept for the
+  // lifetime of the reader and only grows.
   for (data_head = read_data_head(perf_header); perf_header->data_tail != data_head;
       data_head = read_data_head(perf_header)) {
     uint64_t data_tail = perf_header->data_tail;
@@ -184,7 +328,17 @@ void perf_reader_event_read(struct perf_reader *reader) {
     end = base + (data_tail + e->size) % buffer_size;
     if (end < begin) {
       // perf event wraps around the ring, make a contiguous copy
-      reader->buf = realloc(reader->buf, e->size);
+      if (e->size > reader->buf_size) {
+        void *buf = realloc(reader->buf, e->size);
+        if (!buf) {
+          fprintf(stderr, "%s: cannot allocate %d bytes for a wrapped event\n",
+                  __FUNCTION__, e->size);
+          write_data_tail(perf_header, perf_header->data_tail + e->size);
+          continue;
+        }
+        reader->buf = buf;
+        reader->buf_size = e->size;
+      }
       size_t len = sentinel - begin;
       memcpy(reader->buf, begin, len);
       memcpy((void *)((unsigned long)reader->buf + len), base, e->size - len);
@@ -201,12 +355,14 @@ void perf_reader_event_read(struct perf_reader *reader) {
        * };
        */
       uint64_t lost = *(uint64_t *)(ptr + sizeof(*e) + sizeof(uint64_t));
+      __atomic_fetch_add(&reader->lost, lost, __ATOMIC_RELAXED);
       if (reader->lost_cb) {
         reader->lost_cb(reader->cb_cookie, lost);
       } else {
         fprintf(stderr, "Possibly lost %" PRIu64 " samples\n", lost);
       }
     } else if (e->type == PERF_RECORD_SAMPLE) {
+      __atomic_fetch_add(&reader->consumed, 1, __ATOMIC_RELAXED);
       parse_sw(reader, ptr, e->size);
     } else {
       fprintf(stderr, "%s: unknown sample type %d\n", __FUNCTION__, e->type);
@@ -214,6 +370,8 @@ void perf_reader_event_read(struct perf_reader *reader) {
 
     write_data_tail(perf_header, perf_header->data_tail + e->size);
   }
+  if (reader->batch)
+    bcc_batch_flush(reader->batch, 0);
   reader->rb_use_state = RB_NOT_USED;
   __sync_synchronize();
   reader->rb_read_tid = 0;
@@ -226,6 +384,8 @@ int perf_reader_poll(int num_readers, struct perf_reader **readers, int timeout)
   for (i = 0; i <num_readers; ++i) {
     pfds[i].fd = readers[i]->fd;
     pfds[i].events = POLLIN;
+    // wake up in time to deliver pending batches
+    timeout = perf_reader_poll_timeout(readers[i], timeout);
   }
 
   if (poll(pfds, num_readers, timeout) > 0) {
@@ -234,6 +394,8 @@ int perf_reader_poll(int num_readers, struct perf_reader **readers, int timeout)
         perf_reader_event_read(readers[i]);
     }
   }
+  for (i = 0; i < num_readers; ++i)
+    perf_reader_flush(readers[i], 0);
   return 0;
 }
 
@@ -241,10 +403,30 @@ int perf_reader_consume(int num_readers, struct perf_reader **readers) {
   int i;
   for (i = 0; i < num_readers; ++i) {
     perf_reader_event_read(readers[i]);
+    perf_reader_flush(readers[i], 1);
   }
   return 0;
 }
 
+int perf_reader_flush(struct perf_reader *reader, int force) {
+  int ret;
+
+  if (!reader->batch)
+    return 0;
+  if (!__sync_bool_compare_and_swap(&reader->rb_use_state, RB_NOT_USED, RB_USED_IN_READ))
+    return 0;
+  ret = bcc_batch_flush(reader->batch, force);
+  reader->rb_use_state = RB_NOT_USED;
+  __sync_synchronize();
+  return ret;
+}
+
+int perf_reader_poll_timeout(struct perf_reader *reader, int timeout) {
+  if (!reader->batch)
+    return timeout;
+  return bcc_batch_poll_timeout(reader->batch, timeout);
+}
+
 void perf_reader_set_fd(struct perf_reader *reader, int fd) {
   reader->fd = fd;
 }
@@ -252,3 +434,11 @@ void perf_reader_set_fd(struct perf_reader *reader, int fd) {
 int perf_reader_fd(struct perf_reader *reader) {
   return reader->fd;
 }
+
+uint64_t perf_reader_consumed(struct perf_reader *reader) {
+  return __atomic_load_n(&reader->consumed, __ATOMIC_RELAXED);
+}
+
+uint64_t perf_reader_lost(struct perf_reader *reader) {
+  return __atomic_load_n(&reader->lost, __ATOMIC_RELAXED);
+}
@@ -28,6 +28,10 @@ struct perf_reader;
 struct perf_reader * perf_reader_new(perf_reader_raw_cb raw_cb,
                                      perf_reader_lost_cb lost_cb,
                                      void *cb_cookie, int page_cnt);
+struct perf_reader * perf_reader_new_batch(bcc_batch_cb batch_cb,
+                                           perf_reader_lost_cb lost_cb,
+                                           void *cb_cookie, int page_cnt,
+                                           struct bcc_batch_opts *batch_opts);
 void perf_reader_free(void *ptr);
 int perf_reader_mmap(struct perf_reader *reader);
 void perf_reader_event_read(struct perf_reader *reader);
@@ -35,6 +39,16 @@ int perf_reader_poll(int num_readers, struct perf_reader **readers, int timeout)
 int perf_reader_consume(int num_readers, struct perf_reader **readers);
 int perf_reader_fd(struct perf_reader *reader);
 void perf_reader_set_fd(struct perf_reader *reader, int fd);
+// Deliver the pending samples of a batching reader if they are due, or
+// unconditionally if force is set. Returns the number of samples delivered.
+int perf_reader_flush(struct perf_reader *reader, int force);
+// Returns timeout, shortened to the time left until the pending samples of a
+// batching reader are due.
+int perf_reader_poll_timeout(struct perf_reader *reader, int timeout);
+// Number of samples consumed from and reported lost on the reader's ring so
+// far. Safe to call while another thread consumes the ring.
+uint64_t perf_reader_consumed(struct perf_reader *reader);
+uint64_t perf_reader_lost(struct perf_reader *reader);
 
 #ifdef __cplusplus
 }
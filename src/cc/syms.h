@@ -17,6 +17,7 @@
 
 #include <algorithm>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <sys/types.h>
 #include <unordered_map>
@@ -24,6 +25,7 @@
 #include <vector>
 
 #include "bcc_proc.h"
+#include "bcc_sym_index.h"
 #include "bcc_syms.h"
 #include "file_desc.h"
 
@@ -58,25 +60,50 @@ public:
 
   virtual void refresh() = 0;
   virtual bool resolve_addr(uint64_t addr, struct bcc_symbol *sym, bool demangle = true) = 0;
+  // Resolves addrs[0..n) into syms[0..n) and returns the number of addresses
+  // resolved, the name of the others is left null.
+  virtual size_t resolve_addrs(const uint64_t *addrs, size_t n,
+                               struct bcc_symbol *syms, bool demangle = true);
   virtual bool resolve_name(const char *module, const char *name,
                             uint64_t *addr) = 0;
 };
 
 class KSyms : SymbolCache {
-  struct Symbol {
-    Symbol(const char *name, const char *mod, uint64_t addr) : name(name), mod(mod), addr(addr) {}
-    std::string name;
-    std::string mod;
-    uint64_t addr;
+  // Symbols of /proc/kallsyms, names and module names are stored in a single
+  // string arena with every module name interned once. The table is shared by
+  // all KSyms instances of the process, see get().
+  class Table {
+   public:
+    // Returns the current table, rebuilt if kernel modules were loaded or
+    // unloaded since it was built.
+    static std::shared_ptr<const Table> get();
+
+    bool resolve_addr(uint64_t addr, struct bcc_symbol *sym,
+                      bool demangle) const;
+    bool resolve_name(const char *name, uint64_t *addr) const;
 
-    bool operator<(const Symbol &rhs) const { return addr < rhs.addr; }
+   private:
+    struct Symbol {
+      uint64_t addr;
+      uint32_t name;  // offsets in strings_
+      uint32_t mod;
+    };
+
+    static std::string modules_digest();
+    static void _add_symbol(const char *, const char *, uint64_t, void *);
+
+    std::string modules_digest_;
+    std::string strings_;
+    std::vector<Symbol> syms_;
+    // symbols sorted by name for resolve_name, built on first use
+    mutable std::once_flag by_name_once_;
+    mutable std::vector<uint32_t> by_name_;
   };
 
-  std::vector<Symbol> syms_;
-  std::unordered_map<std::string, uint64_t> symnames_;
-  static void _add_symbol(const char *, const char *, uint64_t, void *);
+  std::shared_ptr<const Table> table_;
 
 public:
+  KSyms();
   virtual bool resolve_addr(uint64_t addr, struct bcc_symbol *sym, bool demangle = true) override;
   virtual bool resolve_name(const char *unused, const char *name,
                             uint64_t *addr) override;
@@ -149,6 +176,27 @@ class ProcSyms : SymbolCache {
     }
   };
 
+  // Symbols of a module. The tables of ELF files are shared by all ProcSyms
+  // instances mapping the same file through SymbolTableRegistry, so access
+  // to syms_ and symnames_ needs to hold mutex_.
+  struct SymbolTable {
+    explicit SymbolTable(std::shared_ptr<ModulePath> path) : path_(path) {}
+
+    // keeps the file open for resolving names lazily
+    std::shared_ptr<ModulePath> path_;
+    std::mutex mutex_;
+    std::unordered_set<std::string> symnames_;
+    std::vector<Symbol> syms_;
+    // When set the symbols are looked up in the index, syms_ stays empty
+    std::unique_ptr<SymbolIndex> index_;
+    // Heap usage of symnames_, kept up to date by add_name()
+    size_t names_bytes_ = 0;
+
+    const std::string *add_name(std::string name);
+    size_t bytes() const;
+  };
+  class SymbolTableRegistry;
+
   struct Module {
     struct Range {
       uint64_t start;
@@ -163,6 +211,10 @@ class ProcSyms : SymbolCache {
 
     std::string name_;
     std::shared_ptr<ModulePath> path_;
+    // identity of the mapped file, to keep the module across refreshes
+    uint64_t dev_major_ = 0;
+    uint64_t dev_minor_ = 0;
+    uint64_t inode_ = 0;
     std::vector<Range> ranges_;
     bool loaded_;
     bcc_symbol_option *symbol_option_;
@@ -172,8 +224,7 @@ class ProcSyms : SymbolCache {
     uint64_t elf_so_offset_;
     uint64_t elf_so_addr_;
 
-    std::unordered_set<std::string> symnames_;
-    std::vector<Symbol> syms_;
+    std::shared_ptr<SymbolTable> table_;
 
     void load_sym_table();
 
@@ -192,16 +243,32 @@ class ProcSyms : SymbolCache {
 
   int pid_;
   std::vector<Module> modules_;
+  // modules of the previous load which may be reused by refresh()
+  std::vector<Module> old_modules_;
+  // hash of the mappings modules_ was loaded from
+  uint64_t maps_hash_ = 0;
   ProcStat procstat_;
   bcc_symbol_option symbol_option_;
 
   static int _add_module(mod_info *, int, void *);
+  static int _hash_module(mod_info *, int, void *);
+  uint64_t maps_hash();
   void load_modules();
+  bool find_addr(Module *mod, const std::vector<Module *> &perf_maps,
+                 uint64_t addr, struct bcc_symbol *sym, bool demangle);
 
 public:
   ProcSyms(int pid, struct bcc_symbol_option *option = nullptr);
+  // Loads the symbols of all modules up front on up to max_threads threads
+  // (0 for one per CPU) instead of on the first address resolved in each.
+  void load_all(unsigned max_threads = 0);
+  static void get_stats(struct bcc_symcache_stats *stats);
+  static void set_budget(uint64_t bytes);
   virtual void refresh() override;
   virtual bool resolve_addr(uint64_t addr, struct bcc_symbol *sym, bool demangle = true) override;
+  virtual size_t resolve_addrs(const uint64_t *addrs, size_t n,
+                               struct bcc_symbol *syms,
+                               bool demangle = true) override;
   virtual bool resolve_name(const char *module, const char *name,
                             uint64_t *addr) override;
 };
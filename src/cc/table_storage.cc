@@ -28,17 +28,30 @@ using std::unique_ptr;
 
 const string Path::DELIM = "/";
 
+namespace {
+std::recursive_mutex storage_mutex;
+}
+
 TableStorage::TableStorage() {}
 TableStorage::~TableStorage() {}
 void TableStorage::Init(unique_ptr<TableStorageImpl> impl) { impl_ = move(impl); }
+std::unique_lock<std::recursive_mutex> TableStorage::lock() const {
+  return std::unique_lock<std::recursive_mutex>(storage_mutex);
+}
 bool TableStorage::Find(const Path &path, TableStorage::iterator &result) const {
+  auto l = lock();
   return impl_->Find(path.to_string(), result);
 }
 bool TableStorage::Insert(const Path &path, TableDesc &&desc) {
+  auto l = lock();
   return impl_->Insert(path.to_string(), move(desc));
 }
-bool TableStorage::Delete(const Path &path) { return impl_->Delete(path.to_string()); }
+bool TableStorage::Delete(const Path &path) {
+  auto l = lock();
+  return impl_->Delete(path.to_string());
+}
 size_t TableStorage::DeletePrefix(const Path &path) {
+  auto l = lock();
   size_t i = 0;
   auto it = lower_bound(path);
   auto upper = upper_bound(path);
@@ -58,12 +71,20 @@ void TableStorage::VisitMapType(TableDesc &desc, clang::ASTContext &C, clang::Qu
     v->Visit(desc, C, key_type, leaf_type);
 }
 
-TableStorage::iterator TableStorage::begin() { return impl_->begin(); }
-TableStorage::iterator TableStorage::end() { return impl_->end(); }
+TableStorage::iterator TableStorage::begin() {
+  auto l = lock();
+  return impl_->begin();
+}
+TableStorage::iterator TableStorage::end() {
+  auto l = lock();
+  return impl_->end();
+}
 TableStorage::iterator TableStorage::lower_bound(const Path &p) {
+  auto l = lock();
   return impl_->lower_bound(p.to_string());
 }
 TableStorage::iterator TableStorage::upper_bound(const Path &p) {
+  auto l = lock();
   return impl_->upper_bound(p.to_string() + "\x7f");
 }
 
@@ -79,6 +100,7 @@ TableStorage::iterator &TableStorage::iterator::operator=(iterator &&that) {
 }
 
 TableStorage::iterator &TableStorage::iterator::operator++() {
+  std::lock_guard<std::recursive_mutex> l(storage_mutex);
   ++*impl_;
   return *this;
 }
@@ -20,6 +20,7 @@
 #include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -103,6 +104,12 @@ class TableStorage {
   iterator lower_bound(const Path &p);
   iterator upper_bound(const Path &p);
 
+  /// Every operation holds this lock, as the tables of all modules share one
+  /// storage and modules can be compiled on several threads at once. Hold it
+  /// while iterating over a range of tables, so that the tables at either end
+  /// of the range stay in place.
+  std::unique_lock<std::recursive_mutex> lock() const;
+
  private:
   std::unique_ptr<TableStorageImpl> impl_;
   std::vector<std::unique_ptr<MapTypesVisitor>> visitors_;
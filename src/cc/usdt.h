@@ -43,6 +43,40 @@ static const std::string USDT_PROGRAM_HEADER =
 static const std::string COMPILER_BARRIER =
     "__asm__ __volatile__(\"\": : :\"memory\");";
 
+// In table mode the argument specs of every probe location live in the
+// __bcc_usdt_args map instead of being compiled into the program. The layout
+// of these structs must match the ones emitted by Probe::usdt_getarg.
+static const size_t USDT_TABLE_MAX_ARGS = 12;
+static const size_t USDT_TABLE_MAX_ENTRIES = 10240;
+
+enum TableArgType {
+  USDT_TABLE_ARG_NONE = 0,
+  USDT_TABLE_ARG_CONST,
+  USDT_TABLE_ARG_REG,
+  USDT_TABLE_ARG_REG_DEREF,
+  USDT_TABLE_ARG_ADDR_DEREF,
+};
+
+struct TableKey {
+  uint32_t probe_id;
+  uint32_t pid;  // 0 when the entry is valid for every process
+  uint64_t ip;   // global address, or page offset if unique within the probe
+};
+
+struct TableArg {
+  uint64_t val;       // constant, deref offset or absolute address
+  int32_t reg;        // index into the register list of the probe, or -1
+  int32_t index_reg;
+  int32_t scale;
+  int8_t type;
+  int8_t size;        // negative for signed arguments
+  uint16_t pad;
+};
+
+struct TableSpec {
+  TableArg args[USDT_TABLE_MAX_ARGS];
+};
+
 class Argument {
 private:
   optional<int> arg_size_;
@@ -63,6 +97,9 @@ public:
   bool assign_to_local(std::ostream &stream, const std::string &local_name,
                        const std::string &binpath,
                        const optional<int> &pid = nullopt) const;
+  bool assign_to_table(TableArg *arg, const std::vector<std::string> &registers,
+                       const std::string &binpath,
+                       const optional<int> &pid = nullopt) const;
 
   int arg_size() const { return arg_size_.value_or(sizeof(void *)); }
   std::string ctype() const;
@@ -246,12 +283,23 @@ class Probe {
   optional<std::string> attached_to_;
   optional<uint64_t> attached_semaphore_;
   uint8_t mod_match_inode_only_;
+  bool table_args_;
 
   const char *largest_arg_type(size_t arg_n);
+  std::vector<std::string> table_registers() const;
+  uint32_t table_probe_id(const std::string &probe_func) const;
+  bool usdt_getarg_table(std::ostream &stream, const std::string &probe_func);
+  bool table_by_page_offset() const;
+  bool args_depend_on_pid(const Location &location);
+  bool table_key(const Location &location, uint32_t probe_id,
+                 bool by_page_offset, const optional<int> &pid, TableKey *key);
 
   bool add_to_semaphore(int16_t val);
+  bool write_semaphore(int pid, uint64_t semaphore_addr, int16_t val);
   bool resolve_global_address(uint64_t *global, const std::string &bin_path,
                               const uint64_t addr);
+  bool resolve_global_address(uint64_t *global, const std::string &bin_path,
+                              const uint64_t addr, const optional<int> &pid);
   bool lookup_semaphore_addr(uint64_t *address);
   void add_location(uint64_t addr, const std::string &bin_path, const char *fmt);
 
@@ -271,6 +319,18 @@ public:
 
   bool usdt_getarg(std::ostream &stream);
   bool usdt_getarg(std::ostream &stream, const std::string& probe_func);
+  bool fill_table_args(int map_fd, const std::string &probe_func);
+  // Variants for processes other than the one the probe was created for. They
+  // let a program compiled once for a binary be attached to more of its pids.
+  bool fill_table_args(int map_fd, const std::string &probe_func,
+                       const optional<int> &pid);
+  void clear_table_args(int map_fd, const std::string &probe_func, int pid);
+  bool add_to_semaphore(int pid, int16_t val);
+  // Whether the argument reading generated outside of table mode uses
+  // addresses only valid in the process it was generated for
+  bool getarg_depends_on_pid();
+  void set_table_args(bool enable) { table_args_ = enable; }
+  bool table_args() const { return table_args_; }
   std::string get_arg_ctype(int arg_index) {
     return largest_arg_type(arg_index);
   }
@@ -316,6 +376,7 @@ class Context {
 
 private:
   uint8_t mod_match_inode_only_;
+  bool table_args_;
 
 public:
   Context(const std::string &bin_path, uint8_t mod_match_inode_only = 1);
@@ -340,6 +401,10 @@ public:
                     const std::string &probe_name, const std::string &fn_name,
                     int16_t val);
 
+  void set_table_args(bool enable);
+  bool table_args() const { return table_args_; }
+  bool fill_table_args(int map_fd);
+
   typedef void (*each_cb)(struct bcc_usdt *);
   void each(each_cb callback);
 
@@ -14,7 +14,9 @@
  * limitations under the License.
  */
 #include <algorithm>
+#include <cerrno>
 #include <cstring>
+#include <set>
 #include <sstream>
 #include <unordered_set>
 
@@ -26,6 +28,7 @@
 #include "bcc_elf.h"
 #include "bcc_proc.h"
 #include "common.h"
+#include "libbpf.h"
 #include "usdt.h"
 #include "vendor/tinyformat.hpp"
 #include "bcc_usdt.h"
@@ -66,7 +69,8 @@ Probe::Probe(const char *bin_path, const char *provider, const char *name,
       semaphore_(semaphore),
       semaphore_offset_(semaphore_offset),
       pid_(pid),
-      mod_match_inode_only_(mod_match_inode_only)
+      mod_match_inode_only_(mod_match_inode_only),
+      table_args_(false)
       {}
 
 bool Probe::in_shared_object(const std::string &bin_path) {
@@ -78,9 +82,15 @@ bool Probe::in_shared_object(const std::string &bin_path) {
 
 bool Probe::resolve_global_address(uint64_t *global, const std::string &bin_path,
                                    const uint64_t addr) {
+  return resolve_global_address(global, bin_path, addr, pid_);
+}
+
+bool Probe::resolve_global_address(uint64_t *global, const std::string &bin_path,
+                                   const uint64_t addr,
+                                   const optional<int> &pid) {
   if (in_shared_object(bin_path)) {
-    return (pid_ &&
-            !bcc_resolve_global_addr(*pid_, bin_path.c_str(), addr, mod_match_inode_only_, global));
+    return (pid &&
+            !bcc_resolve_global_addr(*pid, bin_path.c_str(), addr, mod_match_inode_only_, global));
   }
 
   *global = addr;
@@ -97,9 +107,23 @@ bool Probe::add_to_semaphore(int16_t val) {
     attached_semaphore_ = addr;
   }
 
-  off_t address = static_cast<off_t>(attached_semaphore_.value());
+  return write_semaphore(pid_.value(), attached_semaphore_.value(), val);
+}
+
+bool Probe::add_to_semaphore(int pid, int16_t val) {
+  if (pid_ && *pid_ == pid)
+    return add_to_semaphore(val);
 
-  std::string procmem = tfm::format("/proc/%d/mem", pid_.value());
+  uint64_t addr;
+  if (!resolve_global_address(&addr, bin_path_, semaphore_, pid))
+    return false;
+  return write_semaphore(pid, addr, val);
+}
+
+bool Probe::write_semaphore(int pid, uint64_t semaphore_addr, int16_t val) {
+  off_t address = static_cast<off_t>(semaphore_addr);
+
+  std::string procmem = tfm::format("/proc/%d/mem", pid);
   int memfd = ::open(procmem.c_str(), O_RDWR);
   if (memfd < 0)
     return false;
@@ -179,6 +203,9 @@ bool Probe::usdt_getarg(std::ostream &stream, const std::string& probe_func) {
   if (arg_count == 0)
     return true;
 
+  if (table_args_)
+    return usdt_getarg_table(stream, probe_func);
+
   uint64_t page_size = sysconf(_SC_PAGESIZE);
   std::unordered_set<int> page_offsets;
   for (Location &location : locations_)
@@ -190,7 +217,7 @@ bool Probe::usdt_getarg(std::ostream &stream, const std::string& probe_func) {
 
     tfm::format(stream,
                 "static __always_inline int _bpf_readarg_%s_%d("
-                "struct pt_regs *ctx, void *dest, size_t len) {\n"
+                "struct pt_regs *ctx, void **spec, void *dest, size_t len) {\n"
                 "  if (len != sizeof(%s)) return -1;\n",
                 probe_func, arg_n + 1, ctype);
 
@@ -231,6 +258,247 @@ bool Probe::usdt_getarg(std::ostream &stream, const std::string& probe_func) {
   return true;
 }
 
+static const char *USDT_TABLE_HEADER =
+    "#ifndef __BCC_USDT_TABLE_ARGS\n"
+    "#define __BCC_USDT_TABLE_ARGS\n"
+    "struct __bcc_usdt_key { u32 probe_id; u32 pid; u64 ip; };\n"
+    "struct __bcc_usdt_arg {\n"
+    "  u64 val; s32 reg; s32 index_reg; s32 scale; s8 type; s8 size; u16 pad;\n"
+    "};\n"
+    "struct __bcc_usdt_spec { struct __bcc_usdt_arg args[%d]; };\n"
+    "BPF_F_TABLE(\"hash\", struct __bcc_usdt_key, struct __bcc_usdt_spec, "
+    "__bcc_usdt_args, %d, BPF_F_NO_PREALLOC);\n"
+    "static __always_inline struct __bcc_usdt_spec *\n"
+    "__bcc_usdt_lookup(struct pt_regs *ctx, u32 probe_id) {\n"
+    "  struct __bcc_usdt_key key = {};\n"
+    "  struct __bcc_usdt_spec *spec;\n"
+    "  key.probe_id = probe_id;\n"
+    "  key.pid = bpf_get_current_pid_tgid() >> 32;\n"
+    "  key.ip = PT_REGS_IP(ctx);\n"
+    "  spec = __bcc_usdt_args.lookup(&key);\n"
+    "  if (spec) return spec;\n"
+    "  key.pid = 0;\n"
+    "  spec = __bcc_usdt_args.lookup(&key);\n"
+    "  if (spec) return spec;\n"
+    "  key.pid = bpf_get_current_pid_tgid() >> 32;\n"
+    "  key.ip = PT_REGS_IP(ctx) %% 0x%xULL;\n"
+    "  spec = __bcc_usdt_args.lookup(&key);\n"
+    "  if (spec) return spec;\n"
+    "  key.pid = 0;\n"
+    "  return __bcc_usdt_args.lookup(&key);\n"
+    "}\n"
+    "static __always_inline int __bcc_usdt_fetch(struct __bcc_usdt_arg *arg,\n"
+    "    u64 reg, u64 index, void *dest, size_t len) {\n"
+    "  int size = arg->size < 0 ? -arg->size : arg->size;\n"
+    "  u64 val = 0, addr = 0;\n"
+    "  switch (arg->type) {\n"
+    "  case %d: val = arg->val; break;\n"
+    "  case %d: val = reg; break;\n"
+    "  case %d: addr = reg + arg->val + index * arg->scale; break;\n"
+    "  case %d: addr = arg->val; break;\n"
+    "  default: return -1;\n"
+    "  }\n"
+    "  if (addr) {\n"
+    "    switch (size) {\n"
+    "    case 1: { u8 v = 0; bpf_probe_read_user(&v, 1, (void *)addr); val = v; break; }\n"
+    "    case 2: { u16 v = 0; bpf_probe_read_user(&v, 2, (void *)addr); val = v; break; }\n"
+    "    case 4: { u32 v = 0; bpf_probe_read_user(&v, 4, (void *)addr); val = v; break; }\n"
+    "    default: bpf_probe_read_user(&val, 8, (void *)addr); break;\n"
+    "    }\n"
+    "  }\n"
+    "  if (size < 8) {\n"
+    "    int shift = 64 - size * 8;\n"
+    "    val = arg->size < 0 ? (u64)(((s64)(val << shift)) >> shift)\n"
+    "                        : (val << shift) >> shift;\n"
+    "  }\n"
+    "  switch (len) {\n"
+    "  case 1: *(u8 *)dest = val; break;\n"
+    "  case 2: *(u16 *)dest = val; break;\n"
+    "  case 4: *(u32 *)dest = val; break;\n"
+    "  default: *(u64 *)dest = val; break;\n"
+    "  }\n"
+    "  return 0;\n"
+    "}\n"
+    "#endif\n";
+
+std::vector<std::string> Probe::table_registers() const {
+  std::set<std::string> registers;
+  for (const Location &location : locations_) {
+    for (const Argument &arg : location.arguments_) {
+      for (auto *name : {&arg.base_register_name(), &arg.index_register_name()}) {
+        // xmm registers can't be read from BPF and always yield 0
+        if (*name && (*name)->compare(0, 3, "xmm") != 0)
+          registers.insert(**name);
+      }
+    }
+  }
+  return std::vector<std::string>(registers.begin(), registers.end());
+}
+
+uint32_t Probe::table_probe_id(const std::string &probe_func) const {
+  // FNV-1a, the key only has to be stable between codegen and fill_table_args
+  std::string key = provider_ + ":" + name_ + ":" + probe_func;
+  uint32_t hash = 2166136261u;
+  for (unsigned char c : key) {
+    hash ^= c;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+bool Probe::usdt_getarg_table(std::ostream &stream,
+                              const std::string &probe_func) {
+  const size_t arg_count = locations_[0].arguments_.size();
+  if (arg_count > USDT_TABLE_MAX_ARGS)
+    return false;
+
+  tfm::format(stream, USDT_TABLE_HEADER, USDT_TABLE_MAX_ARGS,
+              USDT_TABLE_MAX_ENTRIES, sysconf(_SC_PAGESIZE),
+              USDT_TABLE_ARG_CONST, USDT_TABLE_ARG_REG,
+              USDT_TABLE_ARG_REG_DEREF, USDT_TABLE_ARG_ADDR_DEREF);
+
+  // Register reads stay constant-offset ctx accesses, as the verifier rejects
+  // ctx loads with a variable offset.
+  tfm::format(stream,
+              "static __always_inline u64 __bcc_usdt_reg_%s("
+              "struct pt_regs *ctx, int reg) {\n"
+              "  u64 __res = 0;\n"
+              "  switch (reg) {\n",
+              probe_func);
+  std::vector<std::string> registers = table_registers();
+  for (size_t i = 0; i < registers.size(); i++)
+    tfm::format(stream, "  case %d: __res = ctx->%s; %s break;\n", i,
+                registers[i], COMPILER_BARRIER);
+  stream << "  }\n  return __res;\n}\n";
+
+  // The probe function passes the spec it looked up for its first argument
+  // to the readers of the next ones, helpers pass none.
+  uint32_t probe_id = table_probe_id(probe_func);
+  for (size_t arg_n = 0; arg_n < arg_count; ++arg_n) {
+    tfm::format(stream,
+                "static __always_inline int _bpf_readarg_%s_%d("
+                "struct pt_regs *ctx, void **spec, void *dest, size_t len) {\n"
+                "  if (len != sizeof(%s)) return -1;\n"
+                "  struct __bcc_usdt_spec *__spec = spec ? *spec : 0;\n"
+                "  if (!__spec) {\n"
+                "    __spec = __bcc_usdt_lookup(ctx, 0x%xU);\n"
+                "    if (!__spec) return -1;\n"
+                "    if (spec) *spec = __spec;\n"
+                "  }\n"
+                "  struct __bcc_usdt_arg *__arg = &__spec->args[%d];\n"
+                "  return __bcc_usdt_fetch(__arg, "
+                "__bcc_usdt_reg_%s(ctx, __arg->reg), "
+                "__bcc_usdt_reg_%s(ctx, __arg->index_reg), dest, len);\n"
+                "}\n",
+                probe_func, arg_n + 1, largest_arg_type(arg_n), probe_id,
+                arg_n, probe_func, probe_func);
+  }
+  return true;
+}
+
+bool Probe::table_key(const Location &location, uint32_t probe_id,
+                      bool by_page_offset, const optional<int> &pid,
+                      TableKey *key) {
+  *key = {};
+  key->probe_id = probe_id;
+  if (by_page_offset) {
+    key->ip = location.address_ % sysconf(_SC_PAGESIZE);
+    // The same offset in another process can need other addresses
+    if (pid && args_depend_on_pid(location))
+      key->pid = *pid;
+    return true;
+  }
+  if (!resolve_global_address(&key->ip, location.bin_path_, location.address_,
+                              pid))
+    return false;
+  // Addresses inside shared objects are only valid for this process
+  if (in_shared_object(location.bin_path_))
+    key->pid = *pid;
+  return true;
+}
+
+bool Probe::args_depend_on_pid(const Location &location) {
+  // Globals are read from where the object is loaded in the process
+  for (const Argument &arg : location.arguments_)
+    if (arg.deref_ident() && arg.base_register_name() &&
+        *arg.base_register_name() == "ip")
+      return in_shared_object(location.bin_path_);
+  return false;
+}
+
+bool Probe::getarg_depends_on_pid() {
+  if (locations_.empty() || locations_[0].arguments_.empty())
+    return false;
+  // With more than one location, they are told apart by their page offset
+  // or else by their address in the process
+  bool by_address = locations_.size() > 1 && !table_by_page_offset();
+  for (const Location &location : locations_)
+    if (args_depend_on_pid(location) ||
+        (by_address && in_shared_object(location.bin_path_)))
+      return true;
+  return false;
+}
+
+bool Probe::table_by_page_offset() const {
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  std::unordered_set<uint64_t> page_offsets;
+  for (const Location &location : locations_)
+    page_offsets.insert(location.address_ % page_size);
+  return page_offsets.size() == locations_.size();
+}
+
+bool Probe::fill_table_args(int map_fd, const std::string &probe_func) {
+  return fill_table_args(map_fd, probe_func, pid_);
+}
+
+bool Probe::fill_table_args(int map_fd, const std::string &probe_func,
+                            const optional<int> &pid) {
+  const size_t arg_count = locations_[0].arguments_.size();
+  if (arg_count == 0)
+    return true;
+  if (arg_count > USDT_TABLE_MAX_ARGS)
+    return false;
+
+  uint32_t probe_id = table_probe_id(probe_func);
+  bool by_page_offset = table_by_page_offset();
+  std::vector<std::string> registers = table_registers();
+  for (Location &location : locations_) {
+    TableKey key;
+    if (!table_key(location, probe_id, by_page_offset, pid, &key))
+      return false;
+
+    TableSpec spec = {};
+    for (size_t arg_n = 0; arg_n < location.arguments_.size(); ++arg_n) {
+      if (!location.arguments_[arg_n].assign_to_table(
+              &spec.args[arg_n], registers, location.bin_path_, pid))
+        return false;
+    }
+
+    if (bpf_update_elem(map_fd, &key, &spec, BPF_ANY) < 0) {
+      fprintf(stderr, "Failed to store USDT arguments of %s:%s: %s\n",
+              provider_.c_str(), name_.c_str(), strerror(errno));
+      return false;
+    }
+  }
+  return true;
+}
+
+void Probe::clear_table_args(int map_fd, const std::string &probe_func,
+                             int pid) {
+  if (locations_[0].arguments_.empty())
+    return;
+
+  uint32_t probe_id = table_probe_id(probe_func);
+  bool by_page_offset = table_by_page_offset();
+  for (Location &location : locations_) {
+    TableKey key;
+    // Entries valid for every process are left for the other pids
+    if (table_key(location, probe_id, by_page_offset, pid, &key) &&
+        key.pid != 0)
+      bpf_delete_elem(map_fd, &key);
+  }
+}
+
 void Probe::add_location(uint64_t addr, const std::string &bin_path, const char *fmt) {
   locations_.emplace_back(addr, bin_path, fmt);
 }
@@ -391,6 +659,22 @@ bool Context::addsem_probe(const std::string &provider_name,
   return false;
 }
 
+void Context::set_table_args(bool enable) {
+  table_args_ = enable;
+  for (auto &p : probes_)
+    p->set_table_args(enable);
+}
+
+bool Context::fill_table_args(int map_fd) {
+  for (auto &p : probes_) {
+    if (!p->enabled() || !p->table_args())
+      continue;
+    if (!p->fill_table_args(map_fd, p->attached_to_.value()))
+      return false;
+  }
+  return true;
+}
+
 void Context::each_uprobe(each_uprobe_cb callback) {
   for (auto &p : probes_) {
     if (!p->enabled())
@@ -404,7 +688,8 @@ void Context::each_uprobe(each_uprobe_cb callback) {
 }
 
 Context::Context(const std::string &bin_path, uint8_t mod_match_inode_only)
-    : loaded_(false), mod_match_inode_only_(mod_match_inode_only) {
+    : loaded_(false), mod_match_inode_only_(mod_match_inode_only),
+      table_args_(false) {
   std::string full_path = resolve_bin_path(bin_path);
   if (!full_path.empty()) {
     if (bcc_elf_foreach_usdt(full_path.c_str(), _each_probe, this) == 0) {
@@ -418,7 +703,7 @@ Context::Context(const std::string &bin_path, uint8_t mod_match_inode_only)
 
 Context::Context(int pid, uint8_t mod_match_inode_only)
     : pid_(pid), pid_stat_(pid), loaded_(false),
-    mod_match_inode_only_(mod_match_inode_only) {
+    mod_match_inode_only_(mod_match_inode_only), table_args_(false) {
   if (bcc_procutils_each_module(pid, _each_module, this) == 0) {
     cmd_bin_path_ = ebpf::get_pid_exe(pid);
     if (cmd_bin_path_.empty())
@@ -433,7 +718,7 @@ Context::Context(int pid, uint8_t mod_match_inode_only)
 Context::Context(int pid, const std::string &bin_path,
                  uint8_t mod_match_inode_only)
     : pid_(pid), pid_stat_(pid), loaded_(false),
-      mod_match_inode_only_(mod_match_inode_only) {
+      mod_match_inode_only_(mod_match_inode_only), table_args_(false) {
   std::string full_path = resolve_bin_path(bin_path);
   if (!full_path.empty()) {
     int res = bcc_elf_foreach_usdt(full_path.c_str(), _each_probe, this);
@@ -639,4 +924,14 @@ void bcc_usdt_foreach_uprobe(void *usdt, bcc_usdt_uprobe_cb callback) {
   USDT::Context *ctx = static_cast<USDT::Context *>(usdt);
   ctx->each_uprobe(callback);
 }
+
+void bcc_usdt_set_table_args(void *usdt, int enable) {
+  USDT::Context *ctx = static_cast<USDT::Context *>(usdt);
+  ctx->set_table_args(!!enable);
+}
+
+int bcc_usdt_fill_table_args(void *usdt, int map_fd) {
+  USDT::Context *ctx = static_cast<USDT::Context *>(usdt);
+  return ctx->fill_table_args(map_fd) ? 0 : -1;
+}
 }
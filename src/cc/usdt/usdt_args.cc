@@ -13,6 +13,10 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <limits.h>
+#include <stdlib.h>
+
+#include <algorithm>
 #include <cmath>
 #include <unordered_map>
 #include <regex>
@@ -54,8 +58,14 @@ bool Argument::get_global_address(uint64_t *address, const std::string &binpath,
       .lazy_symbolize = 1,
       .use_symbol_type = BCC_SYM_ALL_TYPES
     };
-    return ProcSyms(*pid, &default_option)
-        .resolve_name(binpath.c_str(), deref_ident_->c_str(), address);
+    ProcSyms syms(*pid, &default_option);
+    if (syms.resolve_name(binpath.c_str(), deref_ident_->c_str(), address))
+      return true;
+    // The modules of the process are named by the paths in its maps, while
+    // the probe can have been found through a link such as /proc/self/exe
+    char real[PATH_MAX];
+    return realpath(binpath.c_str(), real) && binpath != real &&
+           syms.resolve_name(real, deref_ident_->c_str(), address);
   }
 
   if (!bcc_elf_is_shared_obj(binpath.c_str())) {
@@ -132,6 +142,56 @@ bool Argument::assign_to_local(std::ostream &stream,
   return false;
 }
 
+bool Argument::assign_to_table(TableArg *arg,
+                               const std::vector<std::string> &registers,
+                               const std::string &binpath,
+                               const optional<int> &pid) const {
+  auto reg_index = [&registers](const optional<std::string> &name) {
+    if (!name)
+      return -1;
+    auto it = std::find(registers.begin(), registers.end(), *name);
+    return it == registers.end() ? -1 : (int)(it - registers.begin());
+  };
+
+  *arg = {};
+  arg->size = arg_size();
+  arg->reg = reg_index(base_register_name_);
+  arg->index_reg = reg_index(index_register_name_);
+  arg->scale = scale_.value_or(1);
+
+  if (constant_) {
+    arg->type = USDT_TABLE_ARG_CONST;
+    arg->val = *constant_;
+    return true;
+  }
+
+  if (!deref_offset_) {
+    // xmm registers are not in the register list and read as 0
+    arg->type = USDT_TABLE_ARG_REG;
+    return true;
+  }
+
+  if (!deref_ident_) {
+    if (arg->reg < 0)
+      return false;
+    arg->type = USDT_TABLE_ARG_REG_DEREF;
+    arg->val = (int64_t)*deref_offset_;
+    return true;
+  }
+
+  if (*base_register_name_ == "ip") {
+    uint64_t global_address;
+    if (!get_global_address(&global_address, binpath, pid))
+      return false;
+
+    arg->type = USDT_TABLE_ARG_ADDR_DEREF;
+    arg->val = global_address + *deref_offset_;
+    return true;
+  }
+
+  return false;
+}
+
 void ArgumentParser::print_error(ssize_t pos) {
   fprintf(stderr, "Parse error:\n    %s\n", arg_);
   for (ssize_t i = 0; i < pos + 4; ++i) fputc('-', stderr);
@@ -23,7 +23,8 @@ import errno
 import sys
 import platform
 
-from .libbcc import lib, bcc_symbol, bcc_symbol_option, bcc_stacktrace_build_id, _SYM_CB_TYPE
+from .libbcc import lib, bcc_symbol, bcc_symbol_option, bcc_stacktrace_build_id, _SYM_CB_TYPE, \
+    bcc_prog_stats
 from .table import Table, PerfEventArray, RingBuf, BPF_MAP_TYPE_QUEUE, BPF_MAP_TYPE_STACK
 from .perf import Perf
 from .utils import get_online_cpus, printb, _assert_is_bytes, ArgString, StrcmpRewrite
@@ -66,9 +67,18 @@ DEBUG_BTF = 0x20
 
 class SymbolCache(object):
     def __init__(self, pid):
+        self.pid = pid
         self.cache = lib.bcc_symcache_new(
                 pid, ct.cast(None, ct.POINTER(bcc_symbol_option)))
 
+    def load_all(self, max_threads=0):
+        """
+        Load the symbols of all modules of the process on up to max_threads
+        threads (0 for one per CPU), instead of on the first address resolved
+        in each of them.
+        """
+        lib.bcc_symcache_load_all(self.cache, self.pid, max_threads)
+
     def resolve(self, addr, demangle):
         """
         Return a tuple of the symbol (function), its offset from the beginning
@@ -98,6 +108,37 @@ class SymbolCache(object):
             name_res = sym.name
         return (name_res, sym.offset, ct.cast(sym.module, ct.c_char_p).value)
 
+    def resolve_batch(self, addrs, demangle):
+        """
+        Resolve a list of addresses at once, which is much faster than calling
+        resolve() for each of them. Returns a list of the same tuples as
+        resolve(), in the order of addrs.
+        """
+        count = len(addrs)
+        if count == 0:
+            return []
+        c_addrs = (ct.c_ulonglong * count)(*addrs)
+        syms = (bcc_symbol * count)()
+        lib.bcc_symcache_resolve_batch(self.cache, c_addrs, count, syms,
+                                       1 if demangle else 0)
+        res = []
+        for addr, sym in zip(addrs, syms):
+            if not sym.name:
+                if sym.module and sym.offset:
+                    res.append((None, sym.offset,
+                                ct.cast(sym.module, ct.c_char_p).value))
+                else:
+                    res.append((None, addr, None))
+                continue
+            if demangle:
+                name_res = sym.demangle_name
+                lib.bcc_symbol_free_demangle_name(ct.byref(sym))
+            else:
+                name_res = sym.name
+            res.append((name_res, sym.offset,
+                        ct.cast(sym.module, ct.c_char_p).value))
+        return res
+
     def resolve_name(self, module, name):
         module = _assert_is_bytes(module)
         name = _assert_is_bytes(name)
@@ -236,6 +277,16 @@ class BPFAttachType:
     SK_LOOKUP = 36
     XDP = 37
     SK_SKB_VERDICT = 38
+    SK_REUSEPORT_SELECT = 39
+    SK_REUSEPORT_SELECT_OR_MIGRATE = 40
+    PERF_EVENT = 41
+    TRACE_KPROBE_MULTI = 42
+    LSM_CGROUP = 43
+    STRUCT_OPS = 44
+    NETFILTER = 45
+    TCX_INGRESS = 46
+    TCX_EGRESS = 47
+    TRACE_UPROBE_MULTI = 48
 
 class XDPAction:
     # from xdp_action uapi/linux/bpf.h
@@ -430,7 +481,9 @@ class BPF(object):
         assert not (text and src_file)
 
         self.kprobe_fds = {}
+        self.kprobe_multi_fds = {}
         self.uprobe_fds = {}
+        self.uprobe_multi_fds = {}
         self.tracepoint_fds = {}
         self.raw_tracepoint_fds = {}
         self.kfunc_entry_fds = {}
@@ -439,6 +492,12 @@ class BPF(object):
         self.perf_buffers = {}
         self.open_perf_events = {}
         self._ringbuf_manager = None
+        self._ringbuf_batches = []
+        self._probe_fns = {}
+        self._stats_fd = None
+        self._overhead_budget = 0
+        self._budget_checked = 0
+        self._budget_run_time = {}
         self.tracefile = None
         atexit.register(self.cleanup)
 
@@ -503,6 +562,14 @@ class BPF(object):
         func_name = _assert_is_bytes(func_name)
         if func_name in self.funcs:
             return self.funcs[func_name]
+        fd = self._load_func_fd(func_name, prog_type, device, attach_type)
+        fn = BPF.Function(self, func_name, fd)
+        self.funcs[func_name] = fn
+
+        return fn
+
+    def _load_func_fd(self, func_name, prog_type, device = None,
+                      attach_type = -1):
         if not lib.bpf_function_start(self.module, func_name):
             raise Exception("Unknown program %s" % func_name)
         log_level = 0
@@ -526,10 +593,7 @@ class BPF(object):
             raise Exception("Failed to load BPF program %s: %s" %
                             (func_name, errstr))
 
-        fn = BPF.Function(self, func_name, fd)
-        self.funcs[func_name] = fn
-
-        return fn
+        return fd
 
     def dump_func(self, func_name):
         """
@@ -788,16 +852,47 @@ class BPF(object):
         del self.kprobe_fds[ev_name][fn_name]
         _num_open_probes -= 1
 
-    def _add_uprobe_fd(self, name, fd):
+    def _add_kprobe_multi_fd(self, key, link_fd, prog_fd, num_probes):
+        global _num_open_probes
+        self.kprobe_multi_fds[key] = (link_fd, prog_fd, num_probes)
+        _num_open_probes += num_probes
+
+    def _del_kprobe_multi_fd(self, key):
+        global _num_open_probes
+        (link_fd, prog_fd, num_probes) = self.kprobe_multi_fds.pop(key)
+        os.close(link_fd)
+        os.close(prog_fd)
+        _num_open_probes -= num_probes
+
+    def _add_uprobe_fd(self, name, fd, fn_name=None):
         global _num_open_probes
         self.uprobe_fds[name] = fd
+        self._probe_fns[(b"uprobe", name)] = fn_name
         _num_open_probes += 1
 
     def _del_uprobe_fd(self, name):
         global _num_open_probes
         del self.uprobe_fds[name]
+        self._probe_fns.pop((b"uprobe", name), None)
         _num_open_probes -= 1
 
+    def _add_uprobe_multi_fd(self, key, link_fd, path, pid, offs):
+        global _num_open_probes
+        self.uprobe_multi_fds[key]["links"].append((link_fd, path, pid, offs))
+        _num_open_probes += len(offs)
+
+    def _del_uprobe_multi_fd(self, key):
+        global _num_open_probes
+        probe = self.uprobe_multi_fds.pop(key)
+        for (link_fd, _, _, offs) in probe["links"]:
+            os.close(link_fd)
+            _num_open_probes -= len(offs)
+        if probe["prog_fd"] >= 0:
+            os.close(probe["prog_fd"])
+        for ev_name in probe["events"]:
+            if ev_name in self.uprobe_fds:
+                self.detach_uprobe_event(ev_name)
+
     # Find current system's syscall prefix by testing on the BPF syscall.
     # If no valid value found, will return the first possible value which
     # would probably lead to error in later API calls.
@@ -833,6 +928,8 @@ class BPF(object):
         if event_re:
             matches = BPF.get_kprobe_functions(event_re)
             self._check_probe_quota(len(matches))
+            if self._attach_kprobe_multi(matches, fn_name, event_re, False):
+                return self
             failed = 0
             probes = []
             for line in matches:
@@ -866,6 +963,11 @@ class BPF(object):
         # allow the caller to glob multiple functions together
         if event_re:
             matches = BPF.get_kprobe_functions(event_re)
+            self._check_probe_quota(len(matches))
+            # kprobe_multi links don't support maxactive
+            if not maxactive and \
+               self._attach_kprobe_multi(matches, fn_name, event_re, True):
+                return self
             failed = 0
             probes = []
             for line in matches:
@@ -892,6 +994,54 @@ class BPF(object):
         self._add_kprobe_fd(ev_name, fn_name, fd)
         return self
 
+    def _attach_kprobe_multi(self, events, fn_name, event_re, is_return):
+        """Attach fn_name to all of events through a single kprobe_multi link.
+
+        Returns False when the kernel can't do it, either because it lacks
+        kprobe_multi support or because one of the functions can't be
+        attached, so that the caller falls back to one kprobe per function.
+        """
+        key = (event_re, fn_name, is_return)
+        if not events or key in self.kprobe_multi_fds:
+            return False
+        try:
+            prog_fd = self._load_func_fd(fn_name, BPF.KPROBE,
+                    attach_type=BPFAttachType.TRACE_KPROBE_MULTI)
+        except Exception:
+            return False
+        events = list(events)
+        syms = (ct.c_char_p * len(events))(*events)
+        link_fd = lib.bpf_attach_kprobe_multi(prog_fd, int(is_return), syms,
+                                              len(events))
+        if link_fd < 0:
+            os.close(prog_fd)
+            return False
+        self._add_kprobe_multi_fd(key, link_fd, prog_fd, len(events))
+        return True
+
+    def _detach_kprobe_re(self, event_re, fn_name, is_return):
+        event_re = _assert_is_bytes(event_re)
+        if fn_name:
+            fn_name = _assert_is_bytes(fn_name)
+        keys = [k for k in self.kprobe_multi_fds if k[0] == event_re and
+                k[2] == is_return and (not fn_name or k[1] == fn_name)]
+        for key in keys:
+            self._del_kprobe_multi_fd(key)
+        if keys:
+            return
+
+        # attached through the per-function fallback
+        prefix = b"r_" if is_return else b"p_"
+        for event in BPF.get_kprobe_functions(event_re):
+            ev_name = prefix + event.replace(b"+", b"_").replace(b".", b"_")
+            if ev_name not in self.kprobe_fds:
+                continue
+            if fn_name:
+                if fn_name in self.kprobe_fds[ev_name]:
+                    self.detach_kprobe_event_by_fn(ev_name, fn_name)
+            else:
+                self.detach_kprobe_event(ev_name)
+
     def detach_kprobe_event(self, ev_name):
         ev_name = _assert_is_bytes(ev_name)
         fn_names = list(self.kprobe_fds[ev_name].keys())
@@ -912,7 +1062,9 @@ class BPF(object):
             if res < 0:
                 raise Exception("Failed to detach BPF from kprobe")
 
-    def detach_kprobe(self, event, fn_name=None):
+    def detach_kprobe(self, event=b"", fn_name=None, event_re=b""):
+        if event_re:
+            return self._detach_kprobe_re(event_re, fn_name, False)
         event = _assert_is_bytes(event)
         ev_name = b"p_" + event.replace(b"+", b"_").replace(b".", b"_")
         if fn_name:
@@ -921,7 +1073,9 @@ class BPF(object):
         else:
             self.detach_kprobe_event(ev_name)
 
-    def detach_kretprobe(self, event, fn_name=None):
+    def detach_kretprobe(self, event=b"", fn_name=None, event_re=b""):
+        if event_re:
+            return self._detach_kprobe_re(event_re, fn_name, True)
         event = _assert_is_bytes(event)
         ev_name = b"r_" + event.replace(b"+", b"_").replace(b".", b"_")
         if fn_name:
@@ -1049,6 +1203,7 @@ class BPF(object):
             raise Exception("Failed to attach BPF program %s to tracepoint %s" %
                             (fn_name, tp))
         self.tracepoint_fds[tp] = fd
+        self._probe_fns[(b"tracepoint", tp)] = fn_name
         return self
 
     def attach_raw_tracepoint(self, tp=b"", fn_name=b""):
@@ -1073,6 +1228,7 @@ class BPF(object):
         if fd < 0:
             raise Exception("Failed to attach BPF to raw tracepoint")
         self.raw_tracepoint_fds[tp] = fd
+        self._probe_fns[(b"raw_tracepoint", tp)] = fn_name
         return self
 
     def detach_raw_tracepoint(self, tp=b""):
@@ -1089,6 +1245,7 @@ class BPF(object):
             raise Exception("Raw tracepoint %s is not attached" % tp)
         os.close(self.raw_tracepoint_fds[tp])
         del self.raw_tracepoint_fds[tp]
+        self._probe_fns.pop((b"raw_tracepoint", tp), None)
 
     @staticmethod
     def add_prefix(prefix, name):
@@ -1232,6 +1389,7 @@ class BPF(object):
         if res < 0:
             raise Exception("Failed to detach BPF from tracepoint")
         del self.tracepoint_fds[tp]
+        self._probe_fns.pop((b"tracepoint", tp), None)
 
     def _attach_perf_event(self, progfd, ev_type, ev_config,
             sample_period, sample_freq, pid, cpu, group_fd):
@@ -1254,6 +1412,7 @@ class BPF(object):
                 res[i] = self._attach_perf_event(fn.fd, ev_type, ev_config,
                         sample_period, sample_freq, pid, i, group_fd)
         self.open_perf_events[(ev_type, ev_config)] = res
+        self._probe_fns[(b"perf_event", (ev_type, ev_config))] = fn_name
 
     def _attach_perf_event_raw(self, progfd, attr, pid, cpu, group_fd):
         res = lib.bpf_attach_perf_event_raw(progfd, ct.byref(attr), pid,
@@ -1274,6 +1433,7 @@ class BPF(object):
                 res[i] = self._attach_perf_event_raw(fn.fd, attr,
                         pid, i, group_fd)
         self.open_perf_events[(attr.type, attr.config)] = res
+        self._probe_fns[(b"perf_event", (attr.type, attr.config))] = fn_name
 
     def detach_perf_event(self, ev_type=-1, ev_config=-1):
         try:
@@ -1288,6 +1448,7 @@ class BPF(object):
         if res != 0:
             raise Exception("Failed to detach BPF from perf event")
         del self.open_perf_events[(ev_type, ev_config)]
+        self._probe_fns.pop((b"perf_event", (ev_type, ev_config)), None)
 
     @staticmethod
     def get_user_functions(name, sym_re):
@@ -1351,6 +1512,11 @@ class BPF(object):
         sym_re. The uprobe will then attach to symbols that match the provided
         regular expression.
 
+        pid may also be a list of pids. With sym_re or a list of pids, all the
+        probes of a library are attached through one uprobe_multi link per
+        pid, on kernels that support it, instead of one uprobe each. Detaching
+        a single address from such a link replaces it with a new link.
+
         Libraries can be given in the name argument without the lib prefix, or
         with the full path (/usr/lib/...). Binaries can be given only with the
         full path (/bin/sh). If a PID is given, the uprobe will attach to the
@@ -1369,13 +1535,10 @@ class BPF(object):
         sym_re = _assert_is_bytes(sym_re)
         fn_name = _assert_is_bytes(fn_name)
 
-        if sym_re:
-            addresses = BPF.get_user_addresses(name, sym_re)
-            self._check_probe_quota(len(addresses))
-            for sym_addr in addresses:
-                self.attach_uprobe(name=name, addr=sym_addr,
-                                   fn_name=fn_name, pid=pid)
-            return
+        if sym_re or isinstance(pid, (list, tuple, set)):
+            self._attach_uprobe_multi(name, sym, sym_re, addr, fn_name, pid,
+                                      sym_off, False)
+            return self
 
         (path, addr) = BPF._check_path_symbol(name, sym, addr, pid, sym_off)
 
@@ -1385,7 +1548,7 @@ class BPF(object):
         fd = lib.bpf_attach_uprobe(fn.fd, 0, ev_name, path, addr, pid)
         if fd < 0:
             raise Exception("Failed to attach BPF to uprobe")
-        self._add_uprobe_fd(ev_name, fd)
+        self._add_uprobe_fd(ev_name, fd, fn_name)
         return self
 
     def attach_uretprobe(self, name=b"", sym=b"", sym_re=b"", addr=None,
@@ -1403,11 +1566,10 @@ class BPF(object):
         sym_re = _assert_is_bytes(sym_re)
         fn_name = _assert_is_bytes(fn_name)
 
-        if sym_re:
-            for sym_addr in BPF.get_user_addresses(name, sym_re):
-                self.attach_uretprobe(name=name, addr=sym_addr,
-                                      fn_name=fn_name, pid=pid)
-            return
+        if sym_re or isinstance(pid, (list, tuple, set)):
+            self._attach_uprobe_multi(name, sym, sym_re, addr, fn_name, pid,
+                                      0, True)
+            return self
 
         (path, addr) = BPF._check_path_symbol(name, sym, addr, pid)
 
@@ -1417,9 +1579,106 @@ class BPF(object):
         fd = lib.bpf_attach_uprobe(fn.fd, 1, ev_name, path, addr, pid)
         if fd < 0:
             raise Exception("Failed to attach BPF to uretprobe")
-        self._add_uprobe_fd(ev_name, fd)
+        self._add_uprobe_fd(ev_name, fd, fn_name)
         return self
 
+    def _attach_uprobe_multi(self, name, sym, sym_re, addr, fn_name, pids,
+                             sym_off, is_return):
+        if not isinstance(pids, (list, tuple, set)):
+            pids = [pids]
+        if sym_re:
+            addrs = [(b"", a, 0) for a in BPF.get_user_addresses(name, sym_re)]
+        else:
+            addrs = [(sym, addr, sym_off)]
+        if not addrs:
+            return
+        self._check_probe_quota(len(addrs) * len(pids))
+
+        # The file offsets only depend on the library a pid maps, resolve
+        # them once per library rather than once per pid.
+        targets = []
+        offsets = {}
+        for pid in pids:
+            (s, a, o) = addrs[0]
+            (path, _) = BPF._check_path_symbol(name, s, a, pid, o)
+            if path not in offsets:
+                offsets[path] = [BPF._check_path_symbol(name, s, a, pid, o)[1]
+                                 for (s, a, o) in addrs]
+            targets.append((path, pid))
+
+        key = (name, sym_re or sym, fn_name, is_return)
+        if key in self.uprobe_multi_fds:
+            raise Exception("Uprobe %s for %s is already attached" %
+                            (fn_name, key[1]))
+        try:
+            prog_fd = self._load_func_fd(fn_name, BPF.KPROBE,
+                    attach_type=BPFAttachType.TRACE_UPROBE_MULTI)
+        except Exception:
+            prog_fd = -1
+        self.uprobe_multi_fds[key] = {"prog_fd": prog_fd, "links": [],
+                                      "events": []}
+
+        prefix = b"r" if is_return else b"p"
+        for (path, pid) in targets:
+            offs = offsets[path]
+            if prog_fd >= 0:
+                c_offs = (ct.c_ulonglong * len(offs))(*offs)
+                link_fd = lib.bpf_attach_uprobe_multi(prog_fd, int(is_return),
+                        path, c_offs, len(offs), pid)
+                if link_fd >= 0:
+                    self._add_uprobe_multi_fd(key, link_fd, path, pid, offs)
+                    continue
+
+            # no uprobe_multi support, one uprobe per offset
+            fn = self.load_func(fn_name, BPF.KPROBE)
+            for off in offs:
+                ev_name = self._get_uprobe_evname(prefix, path, off, pid)
+                fd = lib.bpf_attach_uprobe(fn.fd, int(is_return), ev_name,
+                                           path, off, pid)
+                if fd < 0:
+                    raise Exception("Failed to attach BPF to %s" %
+                            ("uretprobe" if is_return else "uprobe"))
+                self._add_uprobe_fd(ev_name, fd, fn_name)
+                self.uprobe_multi_fds[key]["events"].append(ev_name)
+
+    def _detach_uprobe_multi(self, name, sym, sym_re, is_return):
+        name = _assert_is_bytes(name)
+        key_sym = _assert_is_bytes(sym_re or sym)
+        keys = [k for k in self.uprobe_multi_fds if k[0] == name and
+                k[1] == key_sym and k[3] == is_return]
+        if not keys:
+            raise Exception("Uprobe %s is not attached" % key_sym)
+        for key in keys:
+            self._del_uprobe_multi_fd(key)
+
+    def _detach_uprobe_multi_addr(self, path, addr, pid, is_return):
+        # A link can't drop one of its offsets, it is replaced by a link for
+        # the others. The new link goes first, so that they are never missed.
+        global _num_open_probes
+        for (key, probe) in list(self.uprobe_multi_fds.items()):
+            if key[3] != is_return:
+                continue
+            for (i, (link_fd, l_path, l_pid, offs)) in \
+                    enumerate(probe["links"]):
+                if l_path != path or l_pid != pid or addr not in offs:
+                    continue
+                rest = [o for o in offs if o != addr]
+                if rest:
+                    c_offs = (ct.c_ulonglong * len(rest))(*rest)
+                    new_fd = lib.bpf_attach_uprobe_multi(probe["prog_fd"],
+                            int(is_return), path, c_offs, len(rest), pid)
+                    if new_fd < 0:
+                        raise Exception("Failed to detach BPF from uprobe")
+                    probe["links"][i] = (new_fd, path, pid, rest)
+                else:
+                    del probe["links"][i]
+                os.close(link_fd)
+                _num_open_probes -= 1
+                if not probe["links"] and not probe["events"]:
+                    self._del_uprobe_multi_fd(key)
+                return True
+        return False
+
     def detach_uprobe_event(self, ev_name):
         if ev_name not in self.uprobe_fds:
             raise Exception("Uprobe %s is not attached" % ev_name)
@@ -1431,31 +1690,44 @@ class BPF(object):
             raise Exception("Failed to detach BPF from uprobe")
         self._del_uprobe_fd(ev_name)
 
-    def detach_uprobe(self, name=b"", sym=b"", addr=None, pid=-1, sym_off=0):
-        """detach_uprobe(name="", sym="", addr=None, pid=-1)
+    def detach_uprobe(self, name=b"", sym=b"", addr=None, pid=-1, sym_off=0,
+                      sym_re=b""):
+        """detach_uprobe(name="", sym="", addr=None, pid=-1, sym_re="")
 
         Stop running a bpf function that is attached to symbol 'sym' in library
-        or binary 'name'.
+        or binary 'name'. A single symbol or address attached with sym_re can
+        be detached this way too.
         """
 
+        if sym_re or isinstance(pid, (list, tuple, set)):
+            return self._detach_uprobe_multi(name, sym, sym_re, False)
         name = _assert_is_bytes(name)
         sym = _assert_is_bytes(sym)
         (path, addr) = BPF._check_path_symbol(name, sym, addr, pid, sym_off)
         ev_name = self._get_uprobe_evname(b"p", path, addr, pid)
+        if ev_name not in self.uprobe_fds and \
+                self._detach_uprobe_multi_addr(path, addr, pid, False):
+            return
         self.detach_uprobe_event(ev_name)
 
-    def detach_uretprobe(self, name=b"", sym=b"", addr=None, pid=-1):
-        """detach_uretprobe(name="", sym="", addr=None, pid=-1)
+    def detach_uretprobe(self, name=b"", sym=b"", addr=None, pid=-1,
+                         sym_re=b""):
+        """detach_uretprobe(name="", sym="", addr=None, pid=-1, sym_re="")
 
         Stop running a bpf function that is attached to symbol 'sym' in library
         or binary 'name'.
         """
 
+        if sym_re or isinstance(pid, (list, tuple, set)):
+            return self._detach_uprobe_multi(name, sym, sym_re, True)
         name = _assert_is_bytes(name)
         sym = _assert_is_bytes(sym)
 
         (path, addr) = BPF._check_path_symbol(name, sym, addr, pid)
         ev_name = self._get_uprobe_evname(b"r", path, addr, pid)
+        if ev_name not in self.uprobe_fds and \
+                self._detach_uprobe_multi_addr(path, addr, pid, True):
+            return
         self.detach_uprobe_event(ev_name)
 
     def _trace_autoload(self):
@@ -1624,6 +1896,10 @@ class BPF(object):
         else:
           name, offset, module = BPF._sym_cache(pid).resolve(addr, demangle)
 
+        return BPF._format_sym(name, offset, module, show_module, show_offset)
+
+    @staticmethod
+    def _format_sym(name, offset, module, show_module, show_offset):
         offset = b"+0x%x" % offset if show_offset and name is not None else b""
         name = name or b"[unknown]"
         name = name + offset
@@ -1631,6 +1907,29 @@ class BPF(object):
             if show_module and module is not None else b""
         return name + module
 
+    @staticmethod
+    def sym_batch(addrs, pid, show_module=False, show_offset=False,
+                  demangle=True):
+        """sym_batch(addrs, pid, show_module=False, show_offset=False)
+
+        Translate a list of memory addresses of a pid into function names, the
+        same way as sym(), in one batch. Use this to symbolize whole stacks,
+        it is much faster than calling sym() for every frame.
+        """
+        return [BPF._format_sym(name, offset, module, show_module, show_offset)
+                for (name, offset, module) in
+                BPF._sym_cache(pid).resolve_batch(addrs, demangle)]
+
+    @staticmethod
+    def prefetch_syms(pid, max_threads=0):
+        """prefetch_syms(pid, max_threads=0)
+
+        Load the symbols of all modules mapped by pid in parallel on up to
+        max_threads threads (0 for one per CPU), so that sym() and sym_batch()
+        don't stall on loading the modules one after the other.
+        """
+        BPF._sym_cache(pid).load_all(max_threads)
+
     @staticmethod
     def ksym(addr, show_module=False, show_offset=False):
         """ksym(addr)
@@ -1659,14 +1958,17 @@ class BPF(object):
         Get the number of open K[ret]probes. Can be useful for scenarios where
         event_re is used while attaching and detaching probes.
         """
-        return len(self.kprobe_fds)
+        return len(self.kprobe_fds) + \
+            sum(v[2] for v in self.kprobe_multi_fds.values())
 
     def num_open_uprobes(self):
         """num_open_uprobes()
 
         Get the number of open U[ret]probes.
         """
-        return len(self.uprobe_fds)
+        return len(self.uprobe_fds) + \
+            sum(len(offs) for v in self.uprobe_multi_fds.values()
+                for (_, _, _, offs) in v["links"])
 
     def num_open_tracepoints(self):
         """num_open_tracepoints()
@@ -1723,7 +2025,12 @@ class BPF(object):
         """
         if not self._ringbuf_manager:
             raise Exception("No ring buffers to poll")
+        # wake up in time to deliver pending batches
+        for batch in self._ringbuf_batches:
+            timeout = lib.bcc_batch_poll_timeout(batch, timeout)
         lib.bpf_poll_ringbuf(self._ringbuf_manager, timeout)
+        for batch in self._ringbuf_batches:
+            lib.bcc_batch_flush(batch, 0)
 
     def ring_buffer_consume(self):
         """ring_buffer_consume(self)
@@ -1736,10 +2043,35 @@ class BPF(object):
         if not self._ringbuf_manager:
             raise Exception("No ring buffers to poll")
         lib.bpf_consume_ringbuf(self._ringbuf_manager)
+        for batch in self._ringbuf_batches:
+            lib.bcc_batch_flush(batch, 1)
 
     def free_bcc_memory(self):
+        lib.bcc_header_cache_release()
         return lib.bcc_free_memory()
 
+    @staticmethod
+    def release_header_cache():
+        """release_header_cache()
+
+        Drop the kernel headers kept in memory for the compiles of the
+        process. The next program to load reads them from disk again.
+        """
+        lib.bcc_header_cache_release()
+
+    def release_compiler_memory(self):
+        """release_compiler_memory(self)
+
+        Free the LLVM state and the source text kept after the module is
+        compiled. Tables and loading functions keep working. Returns the
+        number of bytes of resident memory given back.
+        """
+        freed = ct.c_size_t(0)
+        if lib.bpf_module_release_compiler_memory(self.module,
+                ct.byref(freed)) != 0:
+            raise Exception("Failed to release compiler memory")
+        return freed.value
+
     @staticmethod
     def add_module(modname):
       """add_module(modname)
@@ -1751,6 +2083,149 @@ class BPF(object):
       except Exception as e:
         print("Error adding module to build sym cache"+str(e))
 
+    def enable_stats(self):
+        """enable_stats()
+
+        Turns on the kernel accounting of the run count and run time of all
+        BPF programs, for as long as this BPF object lives or until
+        disable_stats() is called.
+        """
+        if self._stats_fd is not None:
+            return
+        fd = lib.bpf_enable_run_time_stats()
+        if fd < 0:
+            raise Exception("Failed to enable BPF run time stats: %s, "
+                            "try sysctl kernel.bpf_stats_enabled=1" %
+                            os.strerror(-fd))
+        self._stats_fd = fd
+
+    def disable_stats(self):
+        if self._stats_fd is not None:
+            os.close(self._stats_fd)
+            self._stats_fd = None
+        self._overhead_budget = 0
+        self._budget_run_time = {}
+
+    def get_prog_stats(self, fn_name):
+        """get_prog_stats(fn_name)
+
+        Returns the run_cnt, run_time_ns and recursion_misses of the loaded
+        function fn_name. Run counts and times are only accounted while stats
+        are enabled.
+        """
+        fn_name = _assert_is_bytes(fn_name)
+        fds = self._func_prog_fds().get(fn_name)
+        if not fds:
+            raise Exception("Function %s is not loaded" % fn_name)
+        stats = bcc_prog_stats()
+        for fd in fds:
+            s = bcc_prog_stats()
+            if lib.bpf_prog_get_stats(fd, ct.byref(s)) < 0:
+                errstr = os.strerror(ct.get_errno())
+                raise Exception("Failed to get stats of %s: %s" %
+                                (fn_name, errstr))
+            stats.run_cnt += s.run_cnt
+            stats.run_time_ns += s.run_time_ns
+            stats.recursion_misses += s.recursion_misses
+        return stats
+
+    def get_all_prog_stats(self):
+        return {name: self.get_prog_stats(name)
+                for name in self._func_prog_fds()}
+
+    def _func_prog_fds(self):
+        # Fds of every load of each function: kprobe_multi and uprobe_multi
+        # links hold their own
+        fds = {}
+        for name, fn in self.funcs.items():
+            fds.setdefault(name, []).append(fn.fd)
+        for key, (link_fd, prog_fd, _) in self.kprobe_multi_fds.items():
+            fds.setdefault(key[1], []).append(prog_fd)
+        for key, probe in self.uprobe_multi_fds.items():
+            if probe["links"]:
+                fds.setdefault(key[2], []).append(probe["prog_fd"])
+        return fds
+
+    def set_overhead_budget(self, max_cpu):
+        """set_overhead_budget(max_cpu)
+
+        Sets the share of one CPU (e.g. 0.01 for 1%) that each loaded function
+        may use. Functions going over it are detached by
+        check_overhead_budget(), which has to be called periodically, e.g.
+        from the perf buffer polling loop. Enables the stats.
+        """
+        if max_cpu <= 0:
+            raise Exception("Invalid overhead budget %s" % max_cpu)
+        self.enable_stats()
+        self._overhead_budget = max_cpu
+        self._budget_checked = 0
+        self._budget_run_time = {}
+
+    def check_overhead_budget(self):
+        """check_overhead_budget()
+
+        Measures the run time of every function since the previous call, and
+        detaches all probes of the functions over the budget. Returns their
+        names.
+        """
+        if self._overhead_budget <= 0:
+            raise Exception("No overhead budget set")
+        now = BPF.monotonic_time()
+        elapsed = now - self._budget_checked
+        first_check = self._budget_checked == 0
+        self._budget_checked = now
+
+        # Functions loaded since the previous check only start being
+        # measured now
+        over = []
+        run_time = {}
+        for name, stats in self.get_all_prog_stats().items():
+            run_time[name] = stats.run_time_ns
+            if first_check or name not in self._budget_run_time:
+                continue
+            if stats.run_time_ns - self._budget_run_time[name] > \
+                    self._overhead_budget * elapsed:
+                over.append(name)
+        self._budget_run_time = run_time
+
+        for name in over:
+            if self.debug & DEBUG_BPF:
+                print("Detaching %s: over the overhead budget of %.2f%%" %
+                      (name.decode(), self._overhead_budget * 100),
+                      file=sys.stderr)
+            self._detach_fn_probes(name)
+            self._budget_run_time.pop(name, None)
+        return over
+
+    def _detach_fn_probes(self, fn_name):
+        for ev_name in list(self.kprobe_fds.keys()):
+            if fn_name in self.kprobe_fds[ev_name]:
+                self.detach_kprobe_event_by_fn(ev_name, fn_name)
+                if not self.kprobe_fds[ev_name]:
+                    del self.kprobe_fds[ev_name]
+        for (kind, name), fn in list(self._probe_fns.items()):
+            if fn != fn_name:
+                continue
+            if kind == b"uprobe":
+                self.detach_uprobe_event(name)
+                for probe in self.uprobe_multi_fds.values():
+                    if name in probe["events"]:
+                        probe["events"].remove(name)
+            elif kind == b"tracepoint":
+                self.detach_tracepoint(name)
+            elif kind == b"perf_event":
+                self.detach_perf_event(*name)
+            else:
+                self.detach_raw_tracepoint(name)
+        # Links hold their own program fd
+        for key in [k for k in self.kprobe_multi_fds if k[1] == fn_name]:
+            self._del_kprobe_multi_fd(key)
+        for key in [k for k in self.uprobe_multi_fds if k[2] == fn_name]:
+            self._del_uprobe_multi_fd(key)
+        if fn_name in self.funcs:
+            os.close(self.funcs[fn_name].fd)
+            del self.funcs[fn_name]
+
     def donothing(self):
         """the do nothing exit handler"""
 
@@ -1768,12 +2243,50 @@ class BPF(object):
             lib.bpf_module_destroy(self.module)
             self.module = None
 
+    def _detach_all_probes(self):
+        start = BPF.monotonic_time()
+        num_probes = self.num_open_kprobes() + self.num_open_uprobes()
+
+        # Close all the probes first, then remove their tracefs events with
+        # one pass over [k,u]probe_events each. Removing them one at a time
+        # re-reads the whole file and takes the kernel's probe mutex for
+        # every probe.
+        kprobe_events = []
+        for ev_name in list(self.kprobe_fds.keys()):
+            for fn_name in list(self.kprobe_fds[ev_name].keys()):
+                lib.bpf_close_perf_event_fd(self.kprobe_fds[ev_name][fn_name])
+                self._del_kprobe_fd(ev_name, fn_name)
+            del self.kprobe_fds[ev_name]
+            kprobe_events.append(ev_name)
+        for k in list(self.kprobe_multi_fds.keys()):
+            self._del_kprobe_multi_fd(k)
+
+        uprobe_events = list(self.uprobe_fds.keys())
+        for ev_name in uprobe_events:
+            lib.bpf_close_perf_event_fd(self.uprobe_fds[ev_name])
+            self._del_uprobe_fd(ev_name)
+        # their fallback uprobes are closed already
+        for k in list(self.uprobe_multi_fds.keys()):
+            self._del_uprobe_multi_fd(k)
+
+        failed = []
+        for (events, detach, kind) in \
+                ((kprobe_events, lib.bpf_detach_kprobes, "kprobe"),
+                 (uprobe_events, lib.bpf_detach_uprobes, "uprobe")):
+            if events and \
+               detach((ct.c_char_p * len(events))(*events), len(events)) < 0:
+                failed.append(kind)
+
+        if self.debug & DEBUG_BPF:
+            print("Detached %d probes in %.3f ms" %
+                  (num_probes, (BPF.monotonic_time() - start) / 1e6),
+                  file=sys.stderr)
+        if failed:
+            raise Exception("Failed to remove %s events" % "/".join(failed))
+
     def cleanup(self):
         # Clean up opened probes
-        for k, v in list(self.kprobe_fds.items()):
-            self.detach_kprobe_event(k)
-        for k, v in list(self.uprobe_fds.items()):
-            self.detach_uprobe_event(k)
+        self._detach_all_probes()
         for k, v in list(self.tracepoint_fds.items()):
             self.detach_tracepoint(k)
         for k, v in list(self.raw_tracepoint_fds.items()):
@@ -1797,11 +2310,15 @@ class BPF(object):
             self.tracefile = None
 
         self.close()
+        self.disable_stats()
 
         # Clean up ringbuf
         if self._ringbuf_manager:
             lib.bpf_free_ringbuf(self._ringbuf_manager)
             self._ringbuf_manager = None
+        for batch in self._ringbuf_batches:
+            lib.bcc_batch_free(batch)
+        self._ringbuf_batches = []
 
     def __enter__(self):
         return self
@@ -30,6 +30,9 @@ lib.bpf_module_rw_engine_enabled.restype = ct.c_bool
 lib.bpf_module_rw_engine_enabled.argtypes = None
 lib.bpf_module_destroy.restype = None
 lib.bpf_module_destroy.argtypes = [ct.c_void_p]
+lib.bpf_module_release_compiler_memory.restype = ct.c_int
+lib.bpf_module_release_compiler_memory.argtypes = [ct.c_void_p,
+        ct.POINTER(ct.c_size_t)]
 lib.bpf_module_license.restype = ct.c_char_p
 lib.bpf_module_license.argtypes = [ct.c_void_p]
 lib.bpf_module_kern_version.restype = ct.c_uint
@@ -46,6 +49,18 @@ lib.bpf_table_id.restype = ct.c_ulonglong
 lib.bpf_table_id.argtypes = [ct.c_void_p, ct.c_char_p]
 lib.bpf_table_fd.restype = ct.c_int
 lib.bpf_table_fd.argtypes = [ct.c_void_p, ct.c_char_p]
+
+class bcc_prog_stats(ct.Structure):
+    _fields_ = [
+            ('run_cnt', ct.c_ulonglong),
+            ('run_time_ns', ct.c_ulonglong),
+            ('recursion_misses', ct.c_ulonglong),
+        ]
+
+lib.bpf_enable_run_time_stats.restype = ct.c_int
+lib.bpf_enable_run_time_stats.argtypes = None
+lib.bpf_prog_get_stats.restype = ct.c_int
+lib.bpf_prog_get_stats.argtypes = [ct.c_int, ct.POINTER(bcc_prog_stats)]
 lib.bpf_table_type_id.restype = ct.c_int
 lib.bpf_table_type_id.argtypes = [ct.c_void_p, ct.c_ulonglong]
 lib.bpf_table_max_entries_id.restype = ct.c_ulonglong
@@ -72,6 +87,23 @@ lib.bpf_perf_event_fields.restype = ct.c_ulonglong
 lib.bpf_perf_event_fields.argtypes = [ct.c_void_p, ct.c_char_p]
 lib.bpf_perf_event_field.restype = ct.c_char_p
 lib.bpf_perf_event_field.argtypes = [ct.c_void_p, ct.c_char_p, ct.c_ulonglong]
+lib.bcc_hist_open.restype = ct.c_void_p
+lib.bcc_hist_open.argtypes = [ct.c_int, ct.c_int, ct.c_size_t, ct.c_size_t,
+        ct.c_size_t, ct.c_int, ct.c_size_t, ct.c_size_t]
+lib.bcc_hist_read.restype = ct.c_int
+lib.bcc_hist_read.argtypes = [ct.c_void_p, ct.c_int]
+lib.bcc_hist_dropped.restype = ct.c_size_t
+lib.bcc_hist_dropped.argtypes = [ct.c_void_p, ct.POINTER(ct.c_ulonglong)]
+lib.bcc_hist_section.restype = ct.c_void_p
+lib.bcc_hist_section.argtypes = [ct.c_void_p, ct.c_int]
+lib.bcc_hist_slots.restype = ct.POINTER(ct.c_ulonglong)
+lib.bcc_hist_slots.argtypes = [ct.c_void_p, ct.c_int,
+        ct.POINTER(ct.c_size_t), ct.POINTER(ct.c_ulonglong)]
+lib.bcc_hist_percentiles.restype = ct.c_int
+lib.bcc_hist_percentiles.argtypes = [ct.c_void_p, ct.c_int,
+        ct.POINTER(ct.c_double), ct.c_size_t, ct.POINTER(ct.c_double)]
+lib.bcc_hist_free.restype = None
+lib.bcc_hist_free.argtypes = [ct.c_void_p]
 
 # keep in sync with libbpf.h
 lib.bpf_get_next_key.restype = ct.c_int
@@ -110,11 +142,21 @@ lib.bpf_attach_kprobe.argtypes = [ct.c_int, ct.c_int, ct.c_char_p, ct.c_char_p,
         ct.c_ulonglong, ct.c_int]
 lib.bpf_detach_kprobe.restype = ct.c_int
 lib.bpf_detach_kprobe.argtypes = [ct.c_char_p]
+lib.bpf_detach_kprobes.restype = ct.c_int
+lib.bpf_detach_kprobes.argtypes = [ct.POINTER(ct.c_char_p), ct.c_int]
+lib.bpf_attach_kprobe_multi.restype = ct.c_int
+lib.bpf_attach_kprobe_multi.argtypes = [ct.c_int, ct.c_int,
+        ct.POINTER(ct.c_char_p), ct.c_int]
 lib.bpf_attach_uprobe.restype = ct.c_int
 lib.bpf_attach_uprobe.argtypes = [ct.c_int, ct.c_int, ct.c_char_p, ct.c_char_p,
         ct.c_ulonglong, ct.c_int]
 lib.bpf_detach_uprobe.restype = ct.c_int
 lib.bpf_detach_uprobe.argtypes = [ct.c_char_p]
+lib.bpf_detach_uprobes.restype = ct.c_int
+lib.bpf_detach_uprobes.argtypes = [ct.POINTER(ct.c_char_p), ct.c_int]
+lib.bpf_attach_uprobe_multi.restype = ct.c_int
+lib.bpf_attach_uprobe_multi.argtypes = [ct.c_int, ct.c_int, ct.c_char_p,
+        ct.POINTER(ct.c_ulonglong), ct.c_int, ct.c_int]
 lib.bpf_attach_tracepoint.restype = ct.c_int
 lib.bpf_attach_tracepoint.argtypes = [ct.c_int, ct.c_char_p, ct.c_char_p]
 lib.bpf_detach_tracepoint.restype = ct.c_int
@@ -145,6 +187,23 @@ class bcc_perf_buffer_opts(ct.Structure):
 
 lib.bpf_open_perf_buffer_opts.restype = ct.c_void_p
 lib.bpf_open_perf_buffer_opts.argtypes = [_RAW_CB_TYPE, _LOST_CB_TYPE, ct.py_object, ct.c_int, ct.POINTER(bcc_perf_buffer_opts)]
+
+class bcc_batch_record(ct.Structure):
+    _fields_ = [
+        ('data', ct.c_void_p),
+        ('size', ct.c_int),
+    ]
+
+class bcc_batch_opts(ct.Structure):
+    _fields_ = [
+        ('max_records', ct.c_int),
+        ('max_latency_ms', ct.c_int),
+    ]
+
+_BATCH_CB_TYPE = ct.CFUNCTYPE(None, ct.py_object, ct.POINTER(bcc_batch_record), ct.c_int)
+lib.bpf_open_perf_buffer_batch.restype = ct.c_void_p
+lib.bpf_open_perf_buffer_batch.argtypes = [_BATCH_CB_TYPE, _LOST_CB_TYPE, ct.py_object, ct.c_int,
+        ct.POINTER(bcc_perf_buffer_opts), ct.POINTER(bcc_batch_opts)]
 lib.bpf_open_perf_event.restype = ct.c_int
 lib.bpf_open_perf_event.argtypes = [ct.c_uint, ct.c_ulonglong, ct.c_int, ct.c_int]
 lib.perf_reader_poll.restype = ct.c_int
@@ -180,6 +239,15 @@ lib.bpf_poll_ringbuf.restype = ct.c_int
 lib.bpf_poll_ringbuf.argtypes = [ct.c_void_p, ct.c_int]
 lib.bpf_consume_ringbuf.restype = ct.c_int
 lib.bpf_consume_ringbuf.argtypes = [ct.c_void_p]
+lib.bcc_batch_new.restype = ct.c_void_p
+lib.bcc_batch_new.argtypes = [_BATCH_CB_TYPE, ct.py_object, ct.POINTER(bcc_batch_opts)]
+lib.bcc_batch_free.restype = None
+lib.bcc_batch_free.argtypes = [ct.c_void_p]
+lib.bcc_batch_flush.restype = ct.c_int
+lib.bcc_batch_flush.argtypes = [ct.c_void_p, ct.c_int]
+lib.bcc_batch_poll_timeout.restype = ct.c_int
+lib.bcc_batch_poll_timeout.argtypes = [ct.c_void_p, ct.c_int]
+_RINGBUF_BATCH_CB = _RINGBUF_CB_TYPE(("bcc_batch_ringbuf_cb", lib))
 class bpf_test_run_opts(ct.Structure):
     _fields_ = [
         ('sz', ct.c_size_t),
@@ -273,6 +341,10 @@ lib.bcc_symcache_resolve.argtypes = [ct.c_void_p, ct.c_ulonglong, ct.POINTER(bcc
 lib.bcc_symcache_resolve_no_demangle.restype = ct.c_int
 lib.bcc_symcache_resolve_no_demangle.argtypes = [ct.c_void_p, ct.c_ulonglong, ct.POINTER(bcc_symbol)]
 
+lib.bcc_symcache_resolve_batch.restype = ct.c_int
+lib.bcc_symcache_resolve_batch.argtypes = [ct.c_void_p,
+    ct.POINTER(ct.c_ulonglong), ct.c_int, ct.POINTER(bcc_symbol), ct.c_int]
+
 lib.bcc_symcache_resolve_name.restype = ct.c_int
 lib.bcc_symcache_resolve_name.argtypes = [
     ct.c_void_p, ct.c_char_p, ct.c_char_p, ct.POINTER(ct.c_ulonglong)]
@@ -280,8 +352,28 @@ lib.bcc_symcache_resolve_name.argtypes = [
 lib.bcc_symcache_refresh.restype = None
 lib.bcc_symcache_refresh.argtypes = [ct.c_void_p]
 
+lib.bcc_symcache_load_all.restype = None
+lib.bcc_symcache_load_all.argtypes = [ct.c_void_p, ct.c_int, ct.c_int]
+
+class bcc_symcache_stats(ct.Structure):
+    _fields_ = [
+            ('tables', ct.c_ulonglong),
+            ('bytes', ct.c_ulonglong),
+            ('hits', ct.c_ulonglong),
+            ('misses', ct.c_ulonglong),
+            ('evictions', ct.c_ulonglong),
+        ]
+
+lib.bcc_symcache_get_stats.restype = None
+lib.bcc_symcache_get_stats.argtypes = [ct.POINTER(bcc_symcache_stats)]
+
+lib.bcc_symcache_set_budget.restype = None
+lib.bcc_symcache_set_budget.argtypes = [ct.c_ulonglong]
+
 lib.bcc_free_memory.restype = ct.c_int
 lib.bcc_free_memory.argtypes = None
+lib.bcc_header_cache_release.restype = None
+lib.bcc_header_cache_release.argtypes = None
 
 lib.bcc_usdt_new_frompid.restype = ct.c_void_p
 lib.bcc_usdt_new_frompid.argtypes = [ct.c_int, ct.c_char_p]
@@ -362,3 +454,9 @@ _USDT_PROBE_CB = ct.CFUNCTYPE(None, ct.c_char_p, ct.c_char_p,
 
 lib.bcc_usdt_foreach_uprobe.restype = None
 lib.bcc_usdt_foreach_uprobe.argtypes = [ct.c_void_p, _USDT_PROBE_CB]
+
+lib.bcc_usdt_set_table_args.restype = None
+lib.bcc_usdt_set_table_args.argtypes = [ct.c_void_p, ct.c_int]
+
+lib.bcc_usdt_fill_table_args.restype = ct.c_int
+lib.bcc_usdt_fill_table_args.argtypes = [ct.c_void_p, ct.c_int]
@@ -26,7 +26,8 @@ import re
 import sys
 import platform
 
-from .libbcc import lib, _RAW_CB_TYPE, _LOST_CB_TYPE, _RINGBUF_CB_TYPE, bcc_perf_buffer_opts
+from .libbcc import lib, _RAW_CB_TYPE, _LOST_CB_TYPE, _RINGBUF_CB_TYPE, bcc_perf_buffer_opts, \
+    _BATCH_CB_TYPE, _RINGBUF_BATCH_CB, bcc_batch_opts
 from .utils import get_online_cpus
 from .utils import get_possible_cpus
 
@@ -661,7 +662,7 @@ class TableBase(MutableMapping):
             raise StopIteration()
         return next_key
 
-    def decode_c_struct(self, tmp, buckets, bucket_fn, bucket_sort_fn, index_max=log2_index_max):
+    def _hist_fields(self):
         f1 = self.Key._fields_[0][0]
         f2 = self.Key._fields_[1][0]
         # The above code assumes that self.Key._fields_[1][0] holds the
@@ -671,19 +672,89 @@ class TableBase(MutableMapping):
         # internal library is the right thing to do.
         if f2 == '__pad_1' and len(self.Key._fields_) == 3:
             f2 = self.Key._fields_[2][0]
-        for k, v in self.items():
-            bucket = getattr(k, f1)
-            if bucket_fn:
-                bucket = bucket_fn(bucket)
-            vals = tmp[bucket] = tmp.get(bucket, [0] * index_max)
-            slot = getattr(k, f2)
-            vals[slot] = v.value
+        return f1, f2
+
+    def _native_histogram(self, linear):
+        """Returns a Histogram reader for this table, or None if the table
+        can only be read entry by entry."""
+        leaf = getattr(self, "sLeaf", self.Leaf)
+        if self.ttype not in Histogram.table_types or ct.sizeof(leaf) != 8:
+            return None
+        try:
+            return Histogram(self, linear=linear)
+        except Exception:
+            return None
+
+    def histogram(self, linear=False, slot_field=None):
+        """histogram(linear=False, slot_field=None)
+
+        Returns a Histogram reader for this table, which must hold u64
+        counters indexed by log2 slots, or by linear slots if linear is set.
+        For struct keys slot_field names the slot member, by default the
+        second field of the key.
+        """
+        return Histogram(self, linear=linear, slot_field=slot_field)
+
+    def decode_c_struct(self, tmp, buckets, bucket_fn, bucket_sort_fn, index_max=log2_index_max):
+        f1, f2 = self._hist_fields()
+        hist = self._native_histogram(index_max == linear_index_max)
+        if hist:
+            n = hist.read()
+            self._check_hist_dropped(hist, index_max)
+            for i in range(n):
+                bucket = getattr(hist.section(i), f1)
+                if bucket_fn:
+                    bucket = bucket_fn(bucket)
+                vals = tmp[bucket] = tmp.get(bucket, [0] * index_max)
+                for slot, v in enumerate(hist.slots(i)):
+                    if v:
+                        self._check_hist_slot(slot, index_max)
+                        vals[slot] = v
+            hist.close()
+        else:
+            for k, v in self.items():
+                bucket = getattr(k, f1)
+                if bucket_fn:
+                    bucket = bucket_fn(bucket)
+                vals = tmp[bucket] = tmp.get(bucket, [0] * index_max)
+                slot = getattr(k, f2)
+                vals[slot] = v.value
         buckets_lst = list(tmp.keys())
         if bucket_sort_fn:
             buckets_lst = bucket_sort_fn(buckets_lst)
         for bucket in buckets_lst:
             buckets.append(bucket)
 
+    def _hist_vals(self, index_max):
+        vals = [0] * index_max
+        hist = self._native_histogram(index_max == linear_index_max)
+        if hist:
+            if hist.read() > 0:
+                for slot, v in enumerate(hist.slots(0)):
+                    if v:
+                        self._check_hist_slot(slot, index_max)
+                        vals[slot] = v
+            self._check_hist_dropped(hist, index_max)
+            hist.close()
+            return vals
+        for k, v in self.items():
+            self._check_hist_slot(k.value, index_max)
+            vals[k.value] = v.value
+        return vals
+
+    @staticmethod
+    def _check_hist_slot(slot, index_max):
+        # Improve error text. If the limit proves a nusiance, this
+        # function be rewritten to avoid having one.
+        if slot >= index_max:
+            raise IndexError(("Index in print_linear_hist() of %d " +
+                "exceeds max of %d.") % (slot, index_max))
+
+    def _check_hist_dropped(self, hist, index_max):
+        slot = hist.dropped()
+        if slot is not None:
+            self._check_hist_slot(slot, index_max)
+
     def print_json_hist(self, val_type="value", section_header="Bucket ptr",
                         section_print_fn=None, bucket_fn=None, bucket_sort_fn=None):
         """print_json_hist(val_type="value", section_header="Bucket ptr",
@@ -715,9 +786,7 @@ class TableBase(MutableMapping):
                 print(_get_json_hist(vals, val_type, section_bucket))
 
         else:
-            vals = [0] * log2_index_max
-            for k, v in self.items():
-                vals[k.value] = v.value
+            vals = self._hist_vals(log2_index_max)
             print(_get_json_hist(vals, val_type))
 
     def print_log2_hist(self, val_type="value", section_header="Bucket ptr",
@@ -755,9 +824,7 @@ class TableBase(MutableMapping):
                     print("\n%s = %r" % (section_header, bucket))
                 _print_log2_hist(vals, val_type, strip_leading_zero)
         else:
-            vals = [0] * log2_index_max
-            for k, v in self.items():
-                vals[k.value] = v.value
+            vals = self._hist_vals(log2_index_max)
             _print_log2_hist(vals, val_type, strip_leading_zero)
 
     def print_linear_hist(self, val_type="value", section_header="Bucket ptr",
@@ -796,18 +863,105 @@ class TableBase(MutableMapping):
                     print("\n%s = %r" % (section_header, bucket))
                 _print_linear_hist(vals, val_type, strip_leading_zero)
         else:
-            vals = [0] * linear_index_max
-            for k, v in self.items():
-                try:
-                    vals[k.value] = v.value
-                except IndexError:
-                    # Improve error text. If the limit proves a nusiance, this
-                    # function be rewritten to avoid having one.
-                    raise IndexError(("Index in print_linear_hist() of %d " +
-                        "exceeds max of %d.") % (k.value, linear_index_max))
+            vals = self._hist_vals(linear_index_max)
             _print_linear_hist(vals, val_type, strip_leading_zero)
 
 
+class Histogram(object):
+    """Histogram(table, linear=False, slot_field=None)
+
+    Reads a log2 or linear histogram table in one batch, summing the counters
+    of per-CPU tables, and computes percentiles without decoding the table
+    entry by entry. Every distinct key without its slot field is a section,
+    e.g. a disk of a per-disk histogram. See BPFHistogramTable in the C++ API.
+    """
+
+    table_types = (BPF_MAP_TYPE_HASH, BPF_MAP_TYPE_ARRAY,
+                   BPF_MAP_TYPE_PERCPU_HASH, BPF_MAP_TYPE_PERCPU_ARRAY,
+                   BPF_MAP_TYPE_LRU_HASH, BPF_MAP_TYPE_LRU_PERCPU_HASH)
+
+    def __init__(self, table, linear=False, slot_field=None):
+        self.Key = table.Key
+        if issubclass(self.Key, ct.Structure):
+            if slot_field is None:
+                slot_field = table._hist_fields()[1]
+            field = getattr(self.Key, slot_field)
+            offset, size = field.offset, field.size
+        else:
+            offset, size = 0, ct.sizeof(self.Key)
+        leaf = getattr(table, "sLeaf", table.Leaf)
+        self._hist = lib.bcc_hist_open(table.map_fd, table.ttype,
+                ct.sizeof(self.Key), ct.sizeof(leaf), table.max_entries,
+                1 if linear else 0, offset, size)
+        if not self._hist:
+            raise Exception("Could not read table %s as a histogram" %
+                            table._name)
+
+    def __del__(self):
+        self.close()
+
+    def close(self):
+        if getattr(self, "_hist", None):
+            lib.bcc_hist_free(self._hist)
+            self._hist = None
+
+    def read(self, delta=False):
+        """read(delta=False)
+
+        Reads the table and returns the number of sections. With delta set,
+        the counts are those added since the previous read with delta set.
+        """
+        n = lib.bcc_hist_read(self._hist, 1 if delta else 0)
+        if n < 0:
+            raise Exception("Could not read histogram")
+        return n
+
+    def dropped(self):
+        """Largest slot of the entries the last read left out because
+        their slot was out of range, None if there were none"""
+        slot = ct.c_ulonglong()
+        if not lib.bcc_hist_dropped(self._hist, ct.byref(slot)):
+            return None
+        return slot.value
+
+    def section(self, i):
+        """Key of section i with the slot zeroed, None without sections"""
+        ptr = lib.bcc_hist_section(self._hist, i)
+        if not ptr:
+            return None
+        key = self.Key()
+        ct.memmove(ct.byref(key), ptr, ct.sizeof(key))
+        return key
+
+    def slots(self, i):
+        """Counts of the slots of section i, as a list"""
+        n = ct.c_size_t()
+        ptr = lib.bcc_hist_slots(self._hist, i, ct.byref(n), None)
+        if not ptr:
+            raise IndexError("No section %d" % i)
+        return ptr[:n.value]
+
+    def total(self, i):
+        """Sum of the counts of section i"""
+        n = ct.c_size_t()
+        total = ct.c_ulonglong()
+        if not lib.bcc_hist_slots(self._hist, i, ct.byref(n), ct.byref(total)):
+            raise IndexError("No section %d" % i)
+        return total.value
+
+    def percentiles(self, i, ps=(50, 90, 99, 99.9)):
+        """percentiles(i, ps=(50, 90, 99, 99.9))
+
+        Estimated values of the given percentiles of section i, interpolated
+        within the slots that hold them.
+        """
+        c_ps = (ct.c_double * len(ps))(*ps)
+        values = (ct.c_double * len(ps))()
+        if lib.bcc_hist_percentiles(self._hist, i, c_ps, len(ps), values) < 0:
+            raise IndexError("No section %d" % i)
+        return list(values)
+
+
 class HashTable(TableBase):
     def __init__(self, *args, **kwargs):
         super(HashTable, self).__init__(*args, **kwargs)
@@ -970,7 +1124,8 @@ class PerfEventArray(ArrayBase):
             self._event_class = _get_event_class(self)
         return ct.cast(data, ct.POINTER(self._event_class)).contents
 
-    def open_perf_buffer(self, callback, page_cnt=8, lost_cb=None, wakeup_events=1):
+    def open_perf_buffer(self, callback, page_cnt=8, lost_cb=None, wakeup_events=1,
+                         batch_size=0, batch_latency_ms=0):
         """open_perf_buffers(callback)
 
         Opens a set of per-cpu ring buffer to receive custom perf event
@@ -978,15 +1133,23 @@ class PerfEventArray(ArrayBase):
         event submitted from the kernel, up to millions per second. Use
         page_cnt to change the size of the per-cpu ring buffer. The value
         must be a power of two and defaults to 8.
+
+        With batch_size > 0, the events are instead handed to the callback
+        as callback(cpu, events) with a list of up to batch_size (data, size)
+        tuples, at the latest batch_latency_ms after the first of them
+        arrived. This saves the per-event callback overhead at high event
+        rates.
         """
 
         if page_cnt & (page_cnt - 1) != 0:
             raise Exception("Perf buffer page_cnt must be a power of two")
 
         for i in get_online_cpus():
-            self._open_perf_buffer(i, callback, page_cnt, lost_cb, wakeup_events)
+            self._open_perf_buffer(i, callback, page_cnt, lost_cb, wakeup_events,
+                                   batch_size, batch_latency_ms)
 
-    def _open_perf_buffer(self, cpu, callback, page_cnt, lost_cb, wakeup_events):
+    def _open_perf_buffer(self, cpu, callback, page_cnt, lost_cb, wakeup_events,
+                          batch_size=0, batch_latency_ms=0):
         def raw_cb_(_, data, size):
             try:
                 callback(cpu, data, size)
@@ -995,6 +1158,14 @@ class PerfEventArray(ArrayBase):
                     exit()
                 else:
                     raise e
+        def batch_cb_(_, records, num_records):
+            try:
+                callback(cpu, [(r.data, r.size) for r in records[:num_records]])
+            except IOError as e:
+                if e.errno == errno.EPIPE:
+                    exit()
+                else:
+                    raise e
         def lost_cb_(_, lost):
             try:
                 lost_cb(lost)
@@ -1003,13 +1174,21 @@ class PerfEventArray(ArrayBase):
                     exit()
                 else:
                     raise e
-        fn = _RAW_CB_TYPE(raw_cb_)
         lost_fn = _LOST_CB_TYPE(lost_cb_) if lost_cb else ct.cast(None, _LOST_CB_TYPE)
         opts = bcc_perf_buffer_opts()
         opts.pid = -1
         opts.cpu = cpu
         opts.wakeup_events = wakeup_events
-        reader = lib.bpf_open_perf_buffer_opts(fn, lost_fn, None, page_cnt, ct.byref(opts))
+        if batch_size > 0:
+            fn = _BATCH_CB_TYPE(batch_cb_)
+            batch_opts = bcc_batch_opts()
+            batch_opts.max_records = batch_size
+            batch_opts.max_latency_ms = batch_latency_ms
+            reader = lib.bpf_open_perf_buffer_batch(fn, lost_fn, None, page_cnt,
+                                                    ct.byref(opts), ct.byref(batch_opts))
+        else:
+            fn = _RAW_CB_TYPE(raw_cb_)
+            reader = lib.bpf_open_perf_buffer_opts(fn, lost_fn, None, page_cnt, ct.byref(opts))
         if not reader:
             raise Exception("Could not open perf buffer")
         fd = lib.perf_reader_fd(reader)
@@ -1258,14 +1437,23 @@ class RingBuf(TableBase):
             self._event_class = _get_event_class(self)
         return ct.cast(data, ct.POINTER(self._event_class)).contents
 
-    def open_ring_buffer(self, callback, ctx=None):
+    def open_ring_buffer(self, callback, ctx=None, batch_size=0, batch_latency_ms=0):
         """open_ring_buffer(callback)
 
         Opens a ring buffer to receive custom event data from the bpf program.
         The callback will be invoked for each event submitted from the kernel,
         up to millions per second.
+
+        With batch_size > 0, the events are instead copied out of the ring
+        and handed to the callback as callback(ctx, events) with a list of up
+        to batch_size (data, size) tuples, at the latest batch_latency_ms
+        after the first of them arrived.
         """
 
+        if batch_size > 0:
+            self._open_ring_buffer_batch(callback, ctx, batch_size, batch_latency_ms)
+            return
+
         def ringbuf_cb_(ctx, data, size):
             try:
                 ret = callback(ctx, data, size)
@@ -1288,6 +1476,28 @@ class RingBuf(TableBase):
         # keep a refcnt
         self._cbs[0] = fn
 
+    def _open_ring_buffer_batch(self, callback, ctx, batch_size, batch_latency_ms):
+        def batch_cb_(_, records, num_records):
+            try:
+                callback(ctx, [(r.data, r.size) for r in records[:num_records]])
+            except IOError as e:
+                if e.errno == errno.EPIPE:
+                    exit()
+                else:
+                    raise e
+
+        fn = _BATCH_CB_TYPE(batch_cb_)
+        opts = bcc_batch_opts()
+        opts.max_records = batch_size
+        opts.max_latency_ms = batch_latency_ms
+        batch = lib.bcc_batch_new(fn, None, ct.byref(opts))
+        if not batch:
+            raise Exception("Could not create ring buffer batch")
+        self.bpf._ringbuf_batches.append(batch)
+        self.bpf._open_ring_buffer(self.map_fd, _RINGBUF_BATCH_CB, batch)
+        # keep a refcnt
+        self._cbs[0] = fn
+
 class QueueStack:
     # Flag for map.push
     BPF_EXIST = 2
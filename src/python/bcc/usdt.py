@@ -125,7 +125,7 @@ class USDTProbe(object):
         return USDTProbeLocation(self, index, loc)
 
 class USDT(object):
-    def __init__(self, pid=None, path=None):
+    def __init__(self, pid=None, path=None, table_args=False):
         if pid and pid != -1:
             self.pid = pid
             if path:
@@ -142,6 +142,9 @@ class USDT(object):
         else:
             raise USDTException(
                     "either a pid or a binary path must be specified")
+        self.table_args = table_args
+        if table_args:
+            lib.bcc_usdt_set_table_args(self.context, 1)
 
     def __del__(self):
         lib.bcc_usdt_close(self.context)
@@ -202,6 +205,8 @@ To check which probes are present in the process, use the tplist tool.
     # This is called by the BPF module's __init__ when it realizes that there
     # is a USDT context and probes need to be attached.
     def attach_uprobes(self, bpf, attach_usdt_ignore_pid):
+        if self.table_args:
+            self.fill_table_args(bpf)
         probes = self.enumerate_active_probes()
         for (binpath, fn_name, addr, pid) in probes:
             if attach_usdt_ignore_pid:
@@ -209,6 +214,17 @@ To check which probes are present in the process, use the tplist tool.
             bpf.attach_uprobe(name=binpath, fn_name=fn_name,
                               addr=addr, pid=pid)
 
+    # In table mode, the argument specs of the enabled probes are looked up
+    # from the __bcc_usdt_args map, which has to be filled once the program
+    # is loaded.
+    def fill_table_args(self, bpf):
+        fd = lib.bpf_table_fd(bpf.module, b"__bcc_usdt_args")
+        if fd < 0:
+            # None of the enabled probes take arguments
+            return
+        if lib.bcc_usdt_fill_table_args(self.context, fd) != 0:
+            raise USDTException("failed to store USDT probe arguments")
+
     def enumerate_active_probes(self):
         probes = []
         def _add_probe(binpath, fn_name, addr, pid):
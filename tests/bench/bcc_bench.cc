@@ -0,0 +1,166 @@
+// Microbenchmarks for the libbcc hot paths. Every result is printed as one
+// JSON object per line, e.g.
+//
+//   {"name": "hash_table/update/size=10000", "ops_per_sec": 1.2e+06, ...}
+//
+// Run with --filter to select benchmarks by name. Most benchmarks load BPF
+// programs and need to run as root.
+
+#include <getopt.h>
+#include <sys/utsname.h>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "bench.h"
+
+namespace bench {
+
+static void print_json_string(FILE *out, const std::string &s) {
+  fputc('"', out);
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if ((unsigned char)c < 0x20)
+      fprintf(out, "\\u%04x", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+void Reporter::report(const std::string &name, const Metrics &metrics) {
+  fprintf(out_, "{\"name\": ");
+  print_json_string(out_, name);
+  for (const auto &m : metrics) {
+    fprintf(out_, ", ");
+    print_json_string(out_, m.first);
+    // JSON has no representation for inf or nan
+    if (std::isfinite(m.second))
+      fprintf(out_, ": %.6g", m.second);
+    else
+      fprintf(out_, ": null");
+  }
+  fprintf(out_, "}\n");
+  fflush(out_);
+}
+
+void Reporter::skip(const std::string &name, const std::string &reason) {
+  fprintf(out_, "{\"name\": ");
+  print_json_string(out_, name);
+  fprintf(out_, ", \"skipped\": ");
+  print_json_string(out_, reason);
+  fprintf(out_, "}\n");
+  fflush(out_);
+}
+
+double percentile(std::vector<uint64_t> &samples, double p) {
+  if (samples.empty())
+    return 0;
+  size_t idx = (size_t)(p / 100 * (samples.size() - 1));
+  return samples[std::min(idx, samples.size() - 1)];
+}
+
+}  // namespace bench
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -f, --filter STR       only run benchmarks whose name contains STR\n"
+          "  -d, --duration MS      minimum time per measurement (default 1000)\n"
+          "  -i, --iterations N     compilations per program (default 3)\n"
+          "  -t, --threads N        event generator threads (default 1)\n"
+          "  -p, --program FILE     also measure compile time of FILE\n"
+          "  -c, --cache            keep BCC_CACHE_DIR set for all benchmarks\n"
+          "  -o, --output FILE      append results to FILE instead of stdout\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  static const struct option long_opts[] = {
+      {"filter", required_argument, nullptr, 'f'},
+      {"duration", required_argument, nullptr, 'd'},
+      {"iterations", required_argument, nullptr, 'i'},
+      {"threads", required_argument, nullptr, 't'},
+      {"program", required_argument, nullptr, 'p'},
+      {"cache", no_argument, nullptr, 'c'},
+      {"output", required_argument, nullptr, 'o'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0}};
+
+  bench::Options opts;
+  const char *output = nullptr;
+  int c;
+  while ((c = getopt_long(argc, argv, "f:d:i:t:p:co:h", long_opts, nullptr)) !=
+         -1) {
+    switch (c) {
+    case 'f':
+      opts.filter = optarg;
+      break;
+    case 'd':
+      opts.duration_ms = strtoull(optarg, nullptr, 0);
+      break;
+    case 'i':
+      opts.compile_iterations = std::max(1, atoi(optarg));
+      break;
+    case 't':
+      opts.generator_threads = std::max(1, atoi(optarg));
+      break;
+    case 'p':
+      opts.programs.push_back(optarg);
+      break;
+    case 'c':
+      opts.use_cache = true;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  FILE *out = stdout;
+  if (output) {
+    out = fopen(output, "a");
+    if (!out) {
+      fprintf(stderr, "could not open %s: %s\n", output, strerror(errno));
+      return 1;
+    }
+  }
+
+  // Record where the numbers came from, so runs on different kernels are not
+  // compared by accident.
+  struct utsname uts;
+  if (uname(&uts) == 0) {
+    fprintf(out, "{\"name\": \"environment\", \"kernel\": ");
+    bench::print_json_string(out, uts.release);
+    fprintf(out, ", \"machine\": ");
+    bench::print_json_string(out, uts.machine);
+    fprintf(out, ", \"duration_ms\": %llu}\n",
+            (unsigned long long)opts.duration_ms);
+  }
+
+  // A hit in the module cache would measure reading the cache, not
+  // compiling. The cache reads BCC_CACHE_DIR once, when the first program is
+  // loaded, so clear it before any benchmark loads one.
+  if (!opts.use_cache)
+    unsetenv("BCC_CACHE_DIR");
+
+  bench::Reporter reporter(out);
+  bench::run_buffer_benchmarks(opts, reporter);
+  bench::run_table_benchmarks(opts, reporter);
+  bench::run_syms_benchmarks(opts, reporter);
+  bench::run_usdt_benchmarks(opts, reporter);
+  bench::run_compile_benchmarks(opts, reporter);
+
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
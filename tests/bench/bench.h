@@ -0,0 +1,77 @@
+#pragma once
+
+#include <time.h>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace bench {
+
+typedef std::vector<std::pair<std::string, double>> Metrics;
+
+struct Options {
+  // Minimum wall time spent on each measurement.
+  uint64_t duration_ms = 1000;
+  // Number of compilations per program in the compile benchmarks.
+  unsigned compile_iterations = 3;
+  // Number of threads generating events in the buffer benchmarks.
+  unsigned generator_threads = 1;
+  // Keep BCC_CACHE_DIR instead of clearing it before the benchmarks run.
+  bool use_cache = false;
+  // Only run benchmarks whose name contains this string.
+  std::string filter;
+  // Extra BPF C files to measure in the compile benchmarks.
+  std::vector<std::string> programs;
+
+  bool enabled(const std::string &name) const {
+    return filter.empty() || name.find(filter) != std::string::npos;
+  }
+};
+
+// Writes one JSON object per line, so results can be appended to a file
+// across runs and compared by a script.
+class Reporter {
+ public:
+  explicit Reporter(FILE *out) : out_(out) {}
+
+  void report(const std::string &name, const Metrics &metrics);
+  void skip(const std::string &name, const std::string &reason);
+
+ private:
+  FILE *out_;
+};
+
+inline uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Calls fn, which returns the number of operations it did, until at least
+// opts.duration_ms passed. Returns ops/s and ns/op metrics.
+template <typename Fn>
+Metrics measure(const Options &opts, Fn fn) {
+  uint64_t ops = 0;
+  uint64_t start = now_ns();
+  uint64_t elapsed;
+  do {
+    ops += fn();
+    elapsed = now_ns() - start;
+  } while (elapsed < opts.duration_ms * 1000000ULL);
+  return {{"ops", (double)ops},
+          {"ops_per_sec", ops * 1e9 / elapsed},
+          {"ns_per_op", ops ? (double)elapsed / ops : 0}};
+}
+
+// Returns the p-th percentile (0 <= p <= 100) of samples, which is sorted.
+double percentile(std::vector<uint64_t> &samples, double p);
+
+void run_buffer_benchmarks(const Options &opts, Reporter &reporter);
+void run_table_benchmarks(const Options &opts, Reporter &reporter);
+void run_syms_benchmarks(const Options &opts, Reporter &reporter);
+void run_usdt_benchmarks(const Options &opts, Reporter &reporter);
+void run_compile_benchmarks(const Options &opts, Reporter &reporter);
+
+}  // namespace bench
@@ -0,0 +1,223 @@
+// Perf buffer and ring buffer throughput. Generator threads call getppid() in
+// a loop, a kprobe on the syscall emits one event per call from this process,
+// and the main thread polls the buffer for the configured duration.
+
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "BPF.h"
+#include "bench.h"
+
+namespace bench {
+
+namespace {
+
+const std::string BUFFER_PROGRAM = R"(
+struct event_t {
+  u64 ts;
+  u64 seq;
+};
+
+#ifdef RINGBUF
+BPF_RINGBUF_OUTPUT(events, PAGE_CNT);
+#else
+BPF_PERF_OUTPUT(events);
+#endif
+BPF_ARRAY(counters, u64, 2);
+
+int on_getppid(void *ctx) {
+  if ((bpf_get_current_pid_tgid() >> 32) != TGID)
+    return 0;
+
+  int seq_idx = 0, drop_idx = 1;
+  u64 *seq = counters.lookup(&seq_idx);
+  if (!seq)
+    return 0;
+
+  struct event_t e = {};
+  e.seq = __sync_fetch_and_add(seq, 1);
+  e.ts = bpf_ktime_get_ns();
+#ifdef RINGBUF
+  if (events.ringbuf_output(&e, sizeof(e), 0) < 0) {
+    u64 *drops = counters.lookup(&drop_idx);
+    if (drops)
+      __sync_fetch_and_add(drops, 1);
+  }
+#else
+  events.perf_submit(ctx, &e, sizeof(e));
+#endif
+  return 0;
+}
+)";
+
+const int PAGE_CNT = 64;
+// Keep one latency sample out of every LATENCY_SAMPLE_RATE events.
+const uint64_t LATENCY_SAMPLE_RATE = 64;
+
+struct event_t {
+  uint64_t ts;
+  uint64_t seq;
+};
+
+struct Consumer {
+  uint64_t received = 0;
+  uint64_t lost = 0;
+  std::vector<uint64_t> latencies;
+
+  void on_event(const void *data, size_t size) {
+    if (size < sizeof(event_t))
+      return;
+    if (received++ % LATENCY_SAMPLE_RATE == 0)
+      latencies.push_back(now_ns() -
+                          static_cast<const event_t *>(data)->ts);
+  }
+};
+
+void on_perf_event(void *cb_cookie, void *data, int data_size) {
+  static_cast<Consumer *>(cb_cookie)->on_event(data, data_size);
+}
+
+void on_perf_lost(void *cb_cookie, uint64_t lost) {
+  static_cast<Consumer *>(cb_cookie)->lost += lost;
+}
+
+int on_ringbuf_event(void *ctx, void *data, size_t size) {
+  static_cast<Consumer *>(ctx)->on_event(data, size);
+  return 0;
+}
+
+class Generator {
+ public:
+  explicit Generator(unsigned threads) : stop_(false), calls_(0) {
+    for (unsigned i = 0; i < threads; i++)
+      threads_.emplace_back([this]() {
+        uint64_t calls = 0;
+        while (!stop_.load(std::memory_order_relaxed)) {
+          syscall(SYS_getppid);
+          calls++;
+        }
+        calls_ += calls;
+      });
+  }
+
+  uint64_t stop() {
+    stop_ = true;
+    for (auto &t : threads_)
+      t.join();
+    threads_.clear();
+    return calls_;
+  }
+
+  ~Generator() {
+    if (!threads_.empty())
+      stop();
+  }
+
+ private:
+  std::atomic<bool> stop_;
+  std::atomic<uint64_t> calls_;
+  std::vector<std::thread> threads_;
+};
+
+Metrics buffer_metrics(Consumer &consumer, uint64_t generated, uint64_t elapsed) {
+  std::sort(consumer.latencies.begin(), consumer.latencies.end());
+  return {{"generated", (double)generated},
+          {"received", (double)consumer.received},
+          {"lost", (double)consumer.lost},
+          {"events_per_sec", consumer.received * 1e9 / elapsed},
+          {"latency_p50_ns", percentile(consumer.latencies, 50)},
+          {"latency_p99_ns", percentile(consumer.latencies, 99)},
+          {"latency_max_ns", percentile(consumer.latencies, 100)}};
+}
+
+ebpf::StatusTuple init_buffer_program(ebpf::BPF &bpf, bool ringbuf) {
+  std::vector<std::string> cflags = {
+      "-DTGID=" + std::to_string(getpid()),
+      "-DPAGE_CNT=" + std::to_string(PAGE_CNT)};
+  if (ringbuf)
+    cflags.push_back("-DRINGBUF");
+
+  TRY2(bpf.init(BUFFER_PROGRAM, cflags));
+  return bpf.attach_kprobe(bpf.get_syscall_fnname("getppid"), "on_getppid");
+}
+
+void run_perf_buffer(const Options &opts, Reporter &reporter) {
+  const std::string name =
+      "perf_buffer/threads=" + std::to_string(opts.generator_threads);
+  if (!opts.enabled(name))
+    return;
+
+  ebpf::BPF bpf;
+  Consumer consumer;
+  auto res = init_buffer_program(bpf, false);
+  if (res.ok())
+    res = bpf.open_perf_buffer("events", on_perf_event, on_perf_lost,
+                               &consumer, PAGE_CNT);
+  if (!res.ok()) {
+    reporter.skip(name, res.msg());
+    return;
+  }
+
+  uint64_t start = now_ns();
+  uint64_t deadline = start + opts.duration_ms * 1000000ULL;
+  Generator generator(opts.generator_threads);
+  while (now_ns() < deadline)
+    bpf.poll_perf_buffer("events", 100);
+  uint64_t generated = generator.stop();
+  // Drain what is left in the buffer
+  while (bpf.poll_perf_buffer("events", 0) > 0)
+    ;
+  uint64_t elapsed = now_ns() - start;
+
+  reporter.report(name, buffer_metrics(consumer, generated, elapsed));
+}
+
+void run_ring_buffer(const Options &opts, Reporter &reporter) {
+  const std::string name =
+      "ring_buffer/threads=" + std::to_string(opts.generator_threads);
+  if (!opts.enabled(name))
+    return;
+
+  ebpf::BPF bpf;
+  Consumer consumer;
+  auto res = init_buffer_program(bpf, true);
+  if (!res.ok()) {
+    reporter.skip(name, res.msg());
+    return;
+  }
+
+  auto *rb = static_cast<struct ring_buffer *>(bpf_new_ringbuf(
+      bpf.get_table("events").get_fd(), on_ringbuf_event, &consumer));
+  if (!rb) {
+    reporter.skip(name, "unable to open ring buffer");
+    return;
+  }
+
+  uint64_t start = now_ns();
+  uint64_t deadline = start + opts.duration_ms * 1000000ULL;
+  Generator generator(opts.generator_threads);
+  while (now_ns() < deadline)
+    bpf_poll_ringbuf(rb, 100);
+  uint64_t generated = generator.stop();
+  bpf_consume_ringbuf(rb);
+  uint64_t elapsed = now_ns() - start;
+  bpf_free_ringbuf(rb);
+
+  uint64_t drops = 0;
+  bpf.get_array_table<uint64_t>("counters").get_value(1, drops);
+  consumer.lost = drops;
+
+  reporter.report(name, buffer_metrics(consumer, generated, elapsed));
+}
+
+}  // namespace
+
+void run_buffer_benchmarks(const Options &opts, Reporter &reporter) {
+  run_perf_buffer(opts, reporter);
+  run_ring_buffer(opts, reporter);
+}
+
+}  // namespace bench
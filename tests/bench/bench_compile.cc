@@ -0,0 +1,265 @@
+// Time to compile, from C source to loaded maps, the programs of a few
+// representative tools and of the files given with --program.
+
+#include <dirent.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "BPF.h"
+#include "bcc_common.h"
+#include "bench.h"
+
+namespace bench {
+
+namespace {
+
+// Reduced versions of the programs of tools/, covering kprobes with a
+// histogram, tracepoints with a perf buffer, perf events with stack traces
+// and kernel struct walks rewritten into probe reads.
+const std::pair<const char *, const char *> PROGRAMS[] = {
+    {"biolatency", R"(
+#include <uapi/linux/ptrace.h>
+#include <linux/blk-mq.h>
+
+BPF_HASH(start, struct request *);
+BPF_HISTOGRAM(dist);
+
+int trace_req_start(struct pt_regs *ctx, struct request *req) {
+  u64 ts = bpf_ktime_get_ns();
+  start.update(&req, &ts);
+  return 0;
+}
+
+int trace_req_done(struct pt_regs *ctx, struct request *req) {
+  u64 *tsp = start.lookup(&req);
+  if (tsp == 0)
+    return 0;
+  u64 delta = (bpf_ktime_get_ns() - *tsp) / 1000;
+  dist.increment(bpf_log2l(delta));
+  start.delete(&req);
+  return 0;
+}
+)"},
+    {"opensnoop", R"(
+#include <uapi/linux/ptrace.h>
+#include <uapi/linux/limits.h>
+#include <linux/sched.h>
+
+struct data_t {
+  u64 id;
+  u64 ts;
+  u32 uid;
+  int ret;
+  char comm[TASK_COMM_LEN];
+  char fname[NAME_MAX];
+};
+
+BPF_HASH(infotmp, u64, const char *);
+BPF_PERF_OUTPUT(events);
+
+TRACEPOINT_PROBE(syscalls, sys_enter_openat) {
+  u64 id = bpf_get_current_pid_tgid();
+  const char *filename = args->filename;
+  infotmp.update(&id, &filename);
+  return 0;
+}
+
+TRACEPOINT_PROBE(syscalls, sys_exit_openat) {
+  u64 id = bpf_get_current_pid_tgid();
+  const char **fpp = infotmp.lookup(&id);
+  if (fpp == 0)
+    return 0;
+
+  struct data_t data = {};
+  data.id = id;
+  data.ts = bpf_ktime_get_ns() / 1000;
+  data.uid = bpf_get_current_uid_gid();
+  data.ret = args->ret;
+  bpf_get_current_comm(&data.comm, sizeof(data.comm));
+  bpf_probe_read_user_str(&data.fname, sizeof(data.fname), *fpp);
+  events.perf_submit(args, &data, sizeof(data));
+  infotmp.delete(&id);
+  return 0;
+}
+)"},
+    {"profile", R"(
+#include <uapi/linux/ptrace.h>
+#include <uapi/linux/bpf_perf_event.h>
+#include <linux/sched.h>
+
+struct key_t {
+  u32 pid;
+  u64 kernel_ip;
+  int user_stack_id;
+  int kernel_stack_id;
+  char name[TASK_COMM_LEN];
+};
+BPF_HASH(counts, struct key_t, u64, 40960);
+BPF_STACK_TRACE(stack_traces, 16384);
+
+int do_perf_event(struct bpf_perf_event_data *ctx) {
+  u64 id = bpf_get_current_pid_tgid();
+  if ((u32)id == 0)
+    return 0;
+
+  struct key_t key = {.pid = id >> 32};
+  bpf_get_current_comm(&key.name, sizeof(key.name));
+  key.user_stack_id = stack_traces.get_stackid(&ctx->regs, BPF_F_USER_STACK);
+  key.kernel_stack_id = stack_traces.get_stackid(&ctx->regs, 0);
+  if (key.kernel_stack_id >= 0)
+    key.kernel_ip = PT_REGS_IP(&ctx->regs);
+  counts.increment(key);
+  return 0;
+}
+)"},
+    {"tcpconnect", R"(
+#include <uapi/linux/ptrace.h>
+#include <net/sock.h>
+#include <bcc/proto.h>
+
+BPF_HASH(currsock, u32, struct sock *);
+
+struct ipv4_data_t {
+  u64 ts_us;
+  u32 pid;
+  u32 saddr;
+  u32 daddr;
+  u16 dport;
+  char task[TASK_COMM_LEN];
+};
+BPF_PERF_OUTPUT(ipv4_events);
+
+int trace_connect_entry(struct pt_regs *ctx, struct sock *sk) {
+  u32 tid = bpf_get_current_pid_tgid();
+  currsock.update(&tid, &sk);
+  return 0;
+}
+
+int trace_connect_return(struct pt_regs *ctx) {
+  int ret = PT_REGS_RC(ctx);
+  u64 pid_tgid = bpf_get_current_pid_tgid();
+  u32 tid = pid_tgid;
+
+  struct sock **skpp = currsock.lookup(&tid);
+  if (skpp == 0)
+    return 0;
+  if (ret != 0) {
+    currsock.delete(&tid);
+    return 0;
+  }
+
+  struct sock *skp = *skpp;
+  struct ipv4_data_t data4 = {.pid = pid_tgid >> 32};
+  data4.ts_us = bpf_ktime_get_ns() / 1000;
+  data4.saddr = skp->__sk_common.skc_rcv_saddr;
+  data4.daddr = skp->__sk_common.skc_daddr;
+  data4.dport = ntohs(skp->__sk_common.skc_dport);
+  bpf_get_current_comm(&data4.task, sizeof(data4.task));
+  ipv4_events.perf_submit(ctx, &data4, sizeof(data4));
+  currsock.delete(&tid);
+  return 0;
+}
+)"},
+};
+
+#ifdef BCC_BENCH_SOURCE_DIR
+const char *EXAMPLES[] = {"examples/tracing/task_switch.c",
+                          "examples/tracing/vfsreadlat.c"};
+#endif
+
+bool read_file(const std::string &path, std::string &text) {
+  std::ifstream in(path);
+  if (!in)
+    return false;
+  std::stringstream ss;
+  ss << in.rdbuf();
+  text = ss.str();
+  return true;
+}
+
+// Whether a precompiled prelude is there for the compilations to use, in
+// BCC_PCH_DIR or else in BCC_CACHE_DIR
+bool pch_warm() {
+  const char *dir = getenv("BCC_PCH_DIR");
+  if (!dir)
+    dir = getenv("BCC_CACHE_DIR");
+  if (!dir || !*dir)
+    return false;
+  DIR *d = opendir(dir);
+  if (!d)
+    return false;
+  bool found = false;
+  while (struct dirent *ent = readdir(d)) {
+    size_t len = strlen(ent->d_name);
+    if (!strncmp(ent->d_name, "bcc-prelude-", 12) && len > 4 &&
+        !strcmp(ent->d_name + len - 4, ".pch")) {
+      found = true;
+      break;
+    }
+  }
+  closedir(d);
+  return found;
+}
+
+void run_compile(const Options &opts, Reporter &reporter,
+                 const std::string &name, const std::string &text) {
+  if (!opts.enabled(name))
+    return;
+
+  // Both are state of earlier compilations, in this process or before it,
+  // which the first iteration starts from
+  struct bcc_header_cache_stats headers;
+  bcc_header_cache_get_stats(&headers);
+  bool header_cache_warm = headers.files > 0;
+  bool pch = pch_warm();
+
+  std::vector<uint64_t> times;
+  for (unsigned i = 0; i < opts.compile_iterations; i++) {
+    ebpf::BPF bpf;
+    uint64_t start = now_ns();
+    auto res = bpf.init(text);
+    uint64_t elapsed = now_ns() - start;
+    if (!res.ok()) {
+      reporter.skip(name, res.msg());
+      return;
+    }
+    times.push_back(elapsed);
+  }
+
+  std::sort(times.begin(), times.end());
+  reporter.report(name, {{"iterations", (double)times.size()},
+                         {"min_ms", times.front() / 1e6},
+                         {"median_ms", percentile(times, 50) / 1e6},
+                         {"max_ms", times.back() / 1e6},
+                         {"pch_warm", pch ? 1.0 : 0.0},
+                         {"header_cache_warm", header_cache_warm ? 1.0 : 0.0}});
+}
+
+}  // namespace
+
+void run_compile_benchmarks(const Options &opts, Reporter &reporter) {
+  for (const auto &p : PROGRAMS)
+    run_compile(opts, reporter, std::string("compile/") + p.first, p.second);
+
+  std::vector<std::string> files(opts.programs);
+#ifdef BCC_BENCH_SOURCE_DIR
+  for (const char *example : EXAMPLES)
+    files.push_back(std::string(BCC_BENCH_SOURCE_DIR) + "/" + example);
+#endif
+
+  for (const auto &path : files) {
+    std::string name = "compile/" + path.substr(path.rfind('/') + 1);
+    std::string text;
+    if (!read_file(path, text)) {
+      if (opts.enabled(name))
+        reporter.skip(name, "unable to read " + path);
+      continue;
+    }
+    run_compile(opts, reporter, name, text);
+  }
+}
+
+}  // namespace bench
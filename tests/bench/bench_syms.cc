@@ -0,0 +1,141 @@
+// Symbolization throughput of ProcSyms, on addresses of this process, and of
+// KSyms, on addresses taken from /proc/kallsyms.
+
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "bcc_syms.h"
+#include "bench.h"
+#include "syms.h"
+
+namespace bench {
+
+namespace {
+
+// Number of distinct addresses resolved in a round.
+const size_t NUM_ADDRS = 4096;
+
+std::vector<uint64_t> process_addrs() {
+  // A mix of addresses in the executable, libc and libbcc, each at a few
+  // offsets into the function.
+  const uint64_t funcs[] = {
+      (uint64_t)&run_syms_benchmarks, (uint64_t)&percentile,
+      (uint64_t)&malloc,              (uint64_t)&strlen,
+      (uint64_t)&getpid,              (uint64_t)&bcc_symcache_new,
+      (uint64_t)&bcc_symcache_resolve};
+  std::vector<uint64_t> addrs;
+  for (size_t i = 0; addrs.size() < NUM_ADDRS; i++)
+    addrs.push_back(funcs[i % (sizeof(funcs) / sizeof(funcs[0]))] +
+                    (i / 7) % 16);
+  return addrs;
+}
+
+std::vector<uint64_t> kernel_addrs() {
+  std::vector<uint64_t> all;
+  std::ifstream kallsyms("/proc/kallsyms");
+  std::string line;
+  while (std::getline(kallsyms, line)) {
+    std::istringstream ss(line);
+    std::string addr, type;
+    ss >> addr >> type;
+    if (type != "t" && type != "T")
+      continue;
+    uint64_t a = strtoull(addr.c_str(), nullptr, 16);
+    // Addresses read as zero without CAP_SYSLOG
+    if (a == 0)
+      return {};
+    all.push_back(a);
+  }
+  if (all.empty())
+    return all;
+
+  std::vector<uint64_t> addrs;
+  for (size_t i = 0; i < NUM_ADDRS; i++)
+    addrs.push_back(all[i * all.size() / NUM_ADDRS] + 4);
+  return addrs;
+}
+
+template <typename Syms>
+Metrics measure_resolve(const Options &opts, Syms &syms,
+                        const std::vector<uint64_t> &addrs, bool demangle) {
+  uint64_t resolved = 0;
+  auto metrics = measure(opts, [&]() {
+    for (uint64_t addr : addrs) {
+      struct bcc_symbol sym = {};
+      if (syms.resolve_addr(addr, &sym, demangle))
+        resolved++;
+      if (demangle)
+        bcc_symbol_free_demangle_name(&sym);
+    }
+    return addrs.size();
+  });
+  metrics.emplace_back("resolved", (double)resolved);
+  return metrics;
+}
+
+void run_proc_syms(const Options &opts, Reporter &reporter) {
+  if (!opts.enabled("proc_syms/load") && !opts.enabled("proc_syms/resolve") &&
+      !opts.enabled("proc_syms/resolve_demangle") &&
+      !opts.enabled("proc_syms/resolve_batch"))
+    return;
+
+  auto addrs = process_addrs();
+
+  if (opts.enabled("proc_syms/load")) {
+    uint64_t start = now_ns();
+    ProcSyms syms(getpid());
+    syms.load_all();
+    reporter.report("proc_syms/load", {{"ms", (now_ns() - start) / 1e6}});
+  }
+
+  ProcSyms syms(getpid());
+  syms.load_all();
+  if (opts.enabled("proc_syms/resolve"))
+    reporter.report("proc_syms/resolve",
+                    measure_resolve(opts, syms, addrs, false));
+  if (opts.enabled("proc_syms/resolve_demangle"))
+    reporter.report("proc_syms/resolve_demangle",
+                    measure_resolve(opts, syms, addrs, true));
+  if (opts.enabled("proc_syms/resolve_batch")) {
+    std::vector<struct bcc_symbol> out(addrs.size());
+    reporter.report("proc_syms/resolve_batch", measure(opts, [&]() {
+      syms.resolve_addrs(addrs.data(), addrs.size(), out.data(), false);
+      return addrs.size();
+    }));
+  }
+}
+
+void run_ksyms(const Options &opts, Reporter &reporter) {
+  if (!opts.enabled("ksyms/load") && !opts.enabled("ksyms/resolve"))
+    return;
+
+  auto addrs = kernel_addrs();
+  if (addrs.empty()) {
+    reporter.skip("ksyms/*", "kernel addresses are not readable");
+    return;
+  }
+
+  // The symbol table is shared by all KSyms of the process, so only the first
+  // resolve pays for reading /proc/kallsyms.
+  KSyms syms;
+  struct bcc_symbol sym;
+  uint64_t start = now_ns();
+  syms.resolve_addr(addrs[0], &sym);
+  if (opts.enabled("ksyms/load"))
+    reporter.report("ksyms/load", {{"ms", (now_ns() - start) / 1e6}});
+
+  if (opts.enabled("ksyms/resolve"))
+    reporter.report("ksyms/resolve", measure_resolve(opts, syms, addrs, false));
+}
+
+}  // namespace
+
+void run_syms_benchmarks(const Options &opts, Reporter &reporter) {
+  run_proc_syms(opts, reporter);
+  run_ksyms(opts, reporter);
+}
+
+}  // namespace bench
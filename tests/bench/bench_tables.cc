@@ -0,0 +1,76 @@
+// BPFHashTable update, lookup and dump rates from user space, for a range of
+// table sizes. The table is filled completely before lookups and dumps.
+
+#include "BPF.h"
+#include "bench.h"
+
+namespace bench {
+
+namespace {
+
+const std::string TABLE_PROGRAM = R"(
+BPF_HASH(table, u64, u64, TABLE_SIZE);
+)";
+
+const size_t TABLE_SIZES[] = {1000, 10000, 100000};
+
+void run_hash_table(const Options &opts, Reporter &reporter, size_t size) {
+  const std::string suffix = "/size=" + std::to_string(size);
+  const std::string prefix = "hash_table/";
+  if (!opts.enabled(prefix + "update" + suffix) &&
+      !opts.enabled(prefix + "get" + suffix) &&
+      !opts.enabled(prefix + "dump" + suffix) &&
+      !opts.enabled(prefix + "dump_iterate" + suffix))
+    return;
+
+  ebpf::BPF bpf;
+  auto res =
+      bpf.init(TABLE_PROGRAM, {"-DTABLE_SIZE=" + std::to_string(size)});
+  if (!res.ok()) {
+    reporter.skip(prefix + "*" + suffix, res.msg());
+    return;
+  }
+  auto table = bpf.get_hash_table<uint64_t, uint64_t>("table");
+
+  if (opts.enabled(prefix + "update" + suffix))
+    reporter.report(prefix + "update" + suffix, measure(opts, [&]() {
+      for (uint64_t k = 0; k < size; k++)
+        table.update_value(k, k);
+      return size;
+    }));
+
+  // Lookups and dumps below need a full table regardless of the filter
+  for (uint64_t k = 0; k < size; k++)
+    table.update_value(k, k);
+
+  if (opts.enabled(prefix + "get" + suffix))
+    reporter.report(prefix + "get" + suffix, measure(opts, [&]() {
+      uint64_t v;
+      for (uint64_t k = 0; k < size; k++)
+        table.get_value(k, v);
+      return size;
+    }));
+
+  if (opts.enabled(prefix + "dump" + suffix))
+    reporter.report(prefix + "dump" + suffix, measure(opts, [&]() {
+      return table.get_table_offline().size();
+    }));
+
+  if (opts.enabled(prefix + "dump_iterate" + suffix)) {
+    size_t batch_size = table.get_batch_size();
+    table.set_batch_size(0);
+    reporter.report(prefix + "dump_iterate" + suffix, measure(opts, [&]() {
+      return table.get_table_offline().size();
+    }));
+    table.set_batch_size(batch_size);
+  }
+}
+
+}  // namespace
+
+void run_table_benchmarks(const Options &opts, Reporter &reporter) {
+  for (size_t size : TABLE_SIZES)
+    run_hash_table(opts, reporter, size);
+}
+
+}  // namespace bench
@@ -0,0 +1,126 @@
+// USDT argument parsing, reading the probes of this process and generating
+// the argument reading code for them.
+
+#include <unistd.h>
+#include <sstream>
+
+#include "bench.h"
+#include "folly/tracing/StaticTracepoint.h"
+#include "usdt.h"
+
+namespace bench {
+
+namespace {
+
+#ifdef __aarch64__
+typedef USDT::ArgumentParser_aarch64 ArgumentParser;
+const char *ARGUMENTS =
+    "-1@x0 4@5 8@[x12] -4@[x30,-40] -4@[x31,-40] 8@[sp, 120]";
+#elif __loongarch64
+typedef USDT::ArgumentParser_loongarch64 ArgumentParser;
+const char *ARGUMENTS =
+    "-1@$r0 4@5 8@[$r12] -4@[$r30,-40] -4@[$r3,-40] 8@[sp, 120]";
+#elif __powerpc64__
+typedef USDT::ArgumentParser_powerpc64 ArgumentParser;
+const char *ARGUMENTS =
+    "-4@0 8@%r0 8@i0 4@0(%r0) -2@0(0) 1@0 -2@%r3 -8@i9 -1@0(%r4) -4@16(6)";
+#elif __s390x__
+typedef USDT::ArgumentParser_s390x ArgumentParser;
+const char *ARGUMENTS =
+    "-4@%r0 8@%r0 8@0 4@0(%r0) -2@0(%r0) 1@%r0 -2@%r3 -8@9 -1@0(%r4) "
+    "-4@16(%r6)";
+#elif __riscv
+typedef USDT::ArgumentParser_riscv64 ArgumentParser;
+const char *ARGUMENTS = "-4@s5 -4@a0 4@20(s1) -4@-1 8@-72(s0) 8@0";
+#elif defined(__x86_64__)
+typedef USDT::ArgumentParser_x64 ArgumentParser;
+const char *ARGUMENTS =
+    "-4@$0 8@$1234 %rdi %rax %rsi -8@%rbx 4@%r12 8@-8(%rbp) 4@(%rax) "
+    "-4@global_max_action(%rip) 8@24+mp_(%rip) 8@(%rax,%rdx,8) "
+    "4@(%rbx,%rcx)";
+#endif
+
+// Probes for the context benchmarks, never hit.
+__attribute__((noinline)) void bench_probes(int a, long b, const char *c) {
+  FOLLY_SDT(bcc_bench, probe_0, a);
+  FOLLY_SDT(bcc_bench, probe_1, a, b);
+  FOLLY_SDT(bcc_bench, probe_2, a, b, c);
+  FOLLY_SDT(bcc_bench, probe_3, a, b, c, a + b);
+}
+
+void run_parse(const Options &opts, Reporter &reporter) {
+#if defined(__aarch64__) || defined(__loongarch64) || \
+    defined(__powerpc64__) || defined(__s390x__) || \
+    defined(__x86_64__) || defined(__riscv)
+  if (!opts.enabled("usdt/parse_args"))
+    return;
+
+  // Parse errors print to stderr, so check the arguments once up front.
+  {
+    ArgumentParser parser(ARGUMENTS);
+    USDT::Argument arg;
+    while (!parser.done()) {
+      if (!parser.parse(&arg)) {
+        reporter.skip("usdt/parse_args", "sample arguments do not parse");
+        return;
+      }
+    }
+  }
+
+  reporter.report("usdt/parse_args", measure(opts, []() {
+    ArgumentParser parser(ARGUMENTS);
+    uint64_t args = 0;
+    while (!parser.done()) {
+      USDT::Argument arg;
+      parser.parse(&arg);
+      args++;
+    }
+    return args;
+  }));
+#else
+  reporter.skip("usdt/parse_args", "architecture not supported");
+#endif
+}
+
+void run_context(const Options &opts, Reporter &reporter) {
+  if (opts.enabled("usdt/context")) {
+    size_t probes = 0;
+    auto metrics = measure(opts, [&]() {
+      USDT::Context ctx(getpid());
+      probes = ctx.num_probes();
+      return 1;
+    });
+    metrics.emplace_back("probes", (double)probes);
+    reporter.report("usdt/context", metrics);
+  }
+
+  if (opts.enabled("usdt/codegen")) {
+    USDT::Context ctx(getpid());
+    const char *names[] = {"probe_0", "probe_1", "probe_2", "probe_3"};
+    for (const char *name : names) {
+      if (!ctx.enable_probe("bcc_bench", name, std::string("on_") + name)) {
+        reporter.skip("usdt/codegen", "unable to enable bcc_bench probes");
+        return;
+      }
+    }
+    reporter.report("usdt/codegen", measure(opts, [&]() {
+      std::ostringstream stream;
+      for (const char *name : names)
+        ctx.get("bcc_bench", name)->usdt_getarg(stream);
+      return 4;
+    }));
+  }
+}
+
+}  // namespace
+
+void run_usdt_benchmarks(const Options &opts, Reporter &reporter) {
+  // Keep the probes, and their notes, in the binary
+  if (getpid() == 0)
+    bench_probes(0, 0, nullptr);
+
+  run_parse(opts, reporter);
+  run_context(opts, reporter);
+}
+
+}  // namespace bench
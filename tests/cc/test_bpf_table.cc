@@ -91,6 +91,70 @@ TEST_CASE("test bpf table", ebpf::bpf_module_rw_engine_enabled() ? "[bpf_table]"
   REQUIRE(!res.ok());
 }
 
+TEST_CASE("test bpf table after releasing compiler memory", ebpf::bpf_module_rw_engine_enabled() ? "[bpf_table]" : "[bpf_table][!mayfail]") {
+  const std::string BPF_PROGRAM = R"(
+    struct key_t {
+      int pid;
+      char comm[8];
+    };
+    BPF_HASH(myhash, struct key_t, u64, 128);
+    BPF_ARRAY(myarray, u64, 4);
+
+    int on_sys_getuid(void *ctx) {
+      int idx = 1;
+      myarray.increment(idx);
+      return 0;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  size_t freed;
+  res = bpf.release_compiler_memory(&freed);
+  REQUIRE(res.ok());
+  // Releasing again is harmless
+  res = bpf.release_compiler_memory(&freed);
+  REQUIRE(res.ok());
+
+  // The function sources go along with the compiler state
+  ebpf::BPFModule mod(0);
+  REQUIRE(mod.load_string(BPF_PROGRAM, nullptr, 0) == 0);
+  REQUIRE(std::string(mod.function_source("on_sys_getuid")) != "");
+  REQUIRE(mod.release_compiler_memory() == 0);
+  REQUIRE(std::string(mod.function_source("on_sys_getuid")) == "");
+
+  // The key and leaf readers and writers survive the compiler state
+  ebpf::BPFTable t = bpf.get_table("myhash");
+  std::string value;
+  res = t.update_value("{ 0x7 \"bash\" }", "0x42");
+  REQUIRE(res.ok());
+  res = t.get_value("{ 0x7 \"bash\" }", value);
+  REQUIRE(res.ok());
+  REQUIRE(value == "0x42");
+
+  std::vector<std::pair<std::string, std::string>> elements;
+  res = t.get_table_offline(elements);
+  REQUIRE(res.ok());
+  REQUIRE(elements.size() == 1);
+  REQUIRE(elements[0].first == "{ 0x7 \"bash\" }");
+
+  // And functions can still be loaded
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+  REQUIRE(getuid() >= 0);
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+
+  uint64_t count;
+  res = bpf.get_array_table<uint64_t>("myarray").get_value(1, count);
+  REQUIRE(res.ok());
+  REQUIRE(count >= 1);
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
 TEST_CASE("test bpf percpu tables", ebpf::bpf_module_rw_engine_enabled() ? "[bpf_percpu_table]" : "[bpf_percpu_table][!mayfail]") {
   const std::string BPF_PROGRAM = R"(
@@ -80,6 +80,37 @@ TEST_CASE("list all kernel symbols", "[c_api]") {
   bcc_procutils_each_ksym(_test_ksym, NULL);
 }
 
+TEST_CASE("kernel symbols are shared between symcaches", "[c_api]") {
+  if (geteuid() != 0)
+    return;
+
+  void *ksyms1 = bcc_symcache_new(-1, nullptr);
+  void *ksyms2 = bcc_symcache_new(-1, nullptr);
+  REQUIRE(ksyms1);
+  REQUIRE(ksyms2);
+
+  uint64_t addr, alias_addr;
+  struct bcc_symbol sym1, sym2;
+  REQUIRE(bcc_symcache_resolve_name(ksyms1, nullptr, "vfs_read", &addr) == 0);
+  REQUIRE(bcc_symcache_resolve(ksyms1, addr, &sym1) == 0);
+  REQUIRE(bcc_symcache_resolve(ksyms2, addr + 1, &sym2) == 0);
+  REQUIRE(sym1.offset == 0);
+  REQUIRE(sym2.offset == 1);
+  REQUIRE(string("kernel") == sym1.module);
+  // both resolve into the same table
+  REQUIRE(sym1.name == sym2.name);
+  REQUIRE(sym1.module == sym2.module);
+
+  REQUIRE(bcc_symcache_resolve_name(ksyms2, nullptr, sym1.name,
+                                    &alias_addr) == 0);
+  REQUIRE(alias_addr == addr);
+  REQUIRE(bcc_symcache_resolve_name(ksyms2, nullptr, "not_a_kernel_symbol",
+                                    &alias_addr) < 0);
+
+  bcc_free_symcache(ksyms1, -1);
+  bcc_free_symcache(ksyms2, -1);
+}
+
 TEST_CASE("file-backed mapping identification") {
   CHECK(bcc_mapping_is_file_backed("/bin/ls") == 1);
   CHECK(bcc_mapping_is_file_backed("") == 0);
@@ -417,6 +448,141 @@ TEST_CASE("resolve symbol addresses for a given PID", "[c_api]") {
   bcc_free_symcache(lazy_resolver, getpid());
 }
 
+TEST_CASE("resolve symbol addresses in a batch", "[c_api]") {
+  void *libc_fptr = dlsym(NULL, "strtok");
+  REQUIRE(libc_fptr);
+
+  void *resolver = bcc_symcache_new(getpid(), nullptr);
+  REQUIRE(resolver);
+
+  uint64_t addrs[] = {(uint64_t)libc_fptr, (uint64_t)&_a_test_function, 0,
+                      (uint64_t)libc_fptr};
+  struct bcc_symbol syms[4];
+  REQUIRE(bcc_symcache_resolve_batch(resolver, addrs, 4, syms, 1) == 3);
+
+  for (int i = 0; i < 4; i++) {
+    struct bcc_symbol sym;
+    if (i == 2) {
+      REQUIRE(!syms[i].name);
+      REQUIRE(bcc_symcache_resolve(resolver, addrs[i], &sym) < 0);
+      continue;
+    }
+    REQUIRE(bcc_symcache_resolve(resolver, addrs[i], &sym) == 0);
+    REQUIRE(string(syms[i].name) == sym.name);
+    REQUIRE(string(syms[i].demangle_name) == sym.demangle_name);
+    REQUIRE(string(syms[i].module) == sym.module);
+    REQUIRE(syms[i].offset == sym.offset);
+    bcc_symbol_free_demangle_name(&sym);
+    bcc_symbol_free_demangle_name(&syms[i]);
+  }
+  REQUIRE(string("_a_test_function") == syms[1].name);
+
+  bcc_free_symcache(resolver, getpid());
+}
+
+TEST_CASE("load all modules of a symcache in parallel", "[c_api]") {
+  struct bcc_symbol sym;
+  struct bcc_symcache_stats before, after;
+
+  void *libc_fptr = dlsym(NULL, "strtok");
+  REQUIRE(libc_fptr);
+
+  void *resolver = bcc_symcache_new(getpid(), nullptr);
+  REQUIRE(resolver);
+  bcc_symcache_load_all(resolver, getpid(), 4);
+
+  // Nothing left to load when resolving
+  bcc_symcache_get_stats(&before);
+  REQUIRE(bcc_symcache_resolve(resolver, (uint64_t)libc_fptr, &sym) == 0);
+  REQUIRE(bcc_symcache_resolve(resolver, (uint64_t)&_a_test_function, &sym) ==
+          0);
+  REQUIRE(string("_a_test_function") == sym.name);
+  bcc_symcache_get_stats(&after);
+  REQUIRE(after.hits == before.hits);
+  REQUIRE(after.misses == before.misses);
+
+  bcc_free_symcache(resolver, getpid());
+}
+
+TEST_CASE("refresh symcache incrementally", "[c_api]") {
+  struct bcc_symbol sym;
+  struct bcc_symcache_stats before, after;
+
+  void *libc_fptr = dlsym(NULL, "strtok");
+  REQUIRE(libc_fptr);
+
+  void *resolver = bcc_symcache_new(getpid(), nullptr);
+  REQUIRE(resolver);
+  REQUIRE(bcc_symcache_resolve(resolver, (uint64_t)libc_fptr, &sym) == 0);
+  string libc_name = sym.name;
+
+  void *lib = dlopen(CMAKE_CURRENT_BINARY_DIR "/libdebuginfo_test_lib.so",
+                     RTLD_NOW);
+  REQUIRE(lib);
+  void *lib_fptr = dlsym(lib, "symbol");
+  REQUIRE(lib_fptr);
+  REQUIRE(bcc_symcache_resolve(resolver, (uint64_t)lib_fptr, &sym) < 0);
+
+  // The new library is picked up, libc keeps its loaded module
+  bcc_symcache_get_stats(&before);
+  bcc_symcache_refresh(resolver);
+  REQUIRE(bcc_symcache_resolve(resolver, (uint64_t)libc_fptr, &sym) == 0);
+  REQUIRE(libc_name == sym.name);
+  bcc_symcache_get_stats(&after);
+  REQUIRE(after.hits == before.hits);
+  REQUIRE(after.misses == before.misses);
+
+  REQUIRE(bcc_symcache_resolve(resolver, (uint64_t)lib_fptr, &sym) == 0);
+  REQUIRE(string("symbol") == sym.name);
+  REQUIRE(string(sym.module).find("libdebuginfo_test_lib.so") !=
+          string::npos);
+
+  bcc_free_symcache(resolver, getpid());
+  dlclose(lib);
+}
+
+TEST_CASE("symbol tables are shared between symcaches", "[c_api]") {
+  struct bcc_symbol sym1, sym2;
+  struct bcc_symcache_stats before, after;
+
+  void *libc_fptr = dlsym(NULL, "strtok");
+  REQUIRE(libc_fptr);
+
+  void *resolver1 = bcc_symcache_new(getpid(), nullptr);
+  void *resolver2 = bcc_symcache_new(getpid(), nullptr);
+  REQUIRE(resolver1);
+  REQUIRE(resolver2);
+
+  REQUIRE(bcc_symcache_resolve(resolver1, (uint64_t)libc_fptr, &sym1) == 0);
+  bcc_symcache_get_stats(&before);
+  REQUIRE(before.tables > 0);
+  REQUIRE(before.bytes > 0);
+
+  REQUIRE(bcc_symcache_resolve(resolver2, (uint64_t)libc_fptr, &sym2) == 0);
+  bcc_symcache_get_stats(&after);
+  REQUIRE(after.hits == before.hits + 1);
+  REQUIRE(after.misses == before.misses);
+  REQUIRE(after.tables == before.tables);
+  REQUIRE(string(sym1.module) == sym2.module);
+  REQUIRE(string(sym1.name) == sym2.name);
+
+  // Tables in use survive a zero budget, the others are evicted
+  bcc_symcache_set_budget(0);
+  bcc_symcache_get_stats(&after);
+  REQUIRE(after.tables > 0);
+  REQUIRE(bcc_symcache_resolve(resolver1, (uint64_t)libc_fptr, &sym1) == 0);
+  REQUIRE(string(sym1.name) == sym2.name);
+
+  bcc_free_symcache(resolver1, getpid());
+  bcc_free_symcache(resolver2, getpid());
+  bcc_symcache_get_stats(&before);
+  bcc_symcache_set_budget(0);
+  bcc_symcache_get_stats(&after);
+  REQUIRE(after.evictions > before.evictions);
+  REQUIRE(after.tables < before.tables);
+  bcc_symcache_set_budget(256ULL << 20);
+}
+
 TEST_CASE("resolve symbol addresses for an exited process", "[c-api]") {
   struct bcc_symbol sym;
   struct bcc_symbol lazy_sym;
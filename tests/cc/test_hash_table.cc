@@ -89,6 +89,40 @@ TEST_CASE("test hash table", "[hash_table]") {
     t.clear_table_non_atomic();
     REQUIRE(t.get_table_offline().size() == 0);
   }
+
+  SECTION("batch size") {
+    for (int i = 1; i <= 100; i++) {
+      res = t.update_value(i, i * 2);
+      REQUIRE(res.ok());
+    }
+
+    // batches smaller than the table, and the per-key walk
+    for (size_t batch_size : {7, 0}) {
+      t.set_batch_size(batch_size);
+      auto offline = t.get_table_offline();
+      REQUIRE(offline.size() == 100);
+      for (const auto &pair : offline)
+        REQUIRE(pair.second == pair.first * 2);
+    }
+  }
+
+  SECTION("get and clear table") {
+    for (size_t batch_size : {t.get_batch_size(), size_t(3), size_t(0)}) {
+      t.set_batch_size(batch_size);
+      for (int i = 1; i <= 10; i++) {
+        res = t.update_value(i, i + 1);
+        REQUIRE(res.ok());
+      }
+
+      std::vector<std::pair<int, int>> entries;
+      res = t.get_and_clear_table(entries);
+      REQUIRE(res.ok());
+      REQUIRE(entries.size() == 10);
+      for (const auto &pair : entries)
+        REQUIRE(pair.second == pair.first + 1);
+      REQUIRE(t.get_table_offline().size() == 0);
+    }
+  }
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
@@ -189,5 +223,30 @@ TEST_CASE("percpu hash table", "[percpu_hash_table]") {
     t.clear_table_non_atomic();
     REQUIRE(t.get_table_offline().size() == 0);
   }
+
+  SECTION("get and clear table") {
+    std::vector<uint64_t> v(ncpus);
+
+    t.set_batch_size(4);
+    for (int k = 1; k <= 10; k++) {
+      for (size_t cpu = 0; cpu < ncpus; cpu++) {
+        v[cpu] = k * cpu;
+      }
+      res = t.update_value(k, v);
+      REQUIRE(res.ok());
+    }
+
+    std::vector<std::pair<int, std::vector<uint64_t>>> entries;
+    res = t.get_and_clear_table(entries);
+    REQUIRE(res.ok());
+    REQUIRE(entries.size() == 10);
+    for (const auto &pair : entries) {
+      REQUIRE(pair.second.size() == ncpus);
+      for (size_t cpu = 0; cpu < ncpus; cpu++) {
+        REQUIRE(pair.second.at(cpu) == cpu * pair.first);
+      }
+    }
+    REQUIRE(t.get_table_offline().size() == 0);
+  }
 }
 #endif
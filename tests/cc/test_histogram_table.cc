@@ -0,0 +1,140 @@
+#include <cstring>
+
+#include "BPF.h"
+#include "catch.hpp"
+
+TEST_CASE("test histogram table", "[histogram_table]") {
+  const std::string BPF_PROGRAM = R"(
+    struct disk_key_t {
+      u64 disk;
+      u64 slot;
+    };
+    BPF_HISTOGRAM(dist);
+    BPF_HISTOGRAM(disk_dist, struct disk_key_t, 1024);
+    BPF_PERCPU_ARRAY(pcpu_dist, u64, 64);
+    BPF_HASH(not_u64, int, int);
+  )";
+
+  struct disk_key_t {
+    uint64_t disk;
+    uint64_t slot;
+  };
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  SECTION("bad table type") {
+    REQUIRE_THROWS(bpf.get_histogram_table("not_u64"));
+  }
+
+  SECTION("log2 histogram") {
+    auto counts = bpf.get_array_table<uint64_t>("dist");
+    for (int slot = 1; slot <= 10; slot++)
+      REQUIRE(counts.update_value(slot, 10).ok());
+
+    auto table = bpf.get_histogram_table("dist");
+    std::vector<ebpf::BPFHistogramTable::Histogram> hists;
+    res = table.read(hists);
+    REQUIRE(res.ok());
+    REQUIRE(hists.size() == 1);
+    REQUIRE(hists[0].section.empty());
+    REQUIRE(hists[0].total == 100);
+    REQUIRE(hists[0].slots[0] == 0);
+    REQUIRE(hists[0].slots[10] == 10);
+
+    REQUIRE(table.slot_range(1).first == 0);
+    REQUIRE(table.slot_range(1).second == 1);
+    REQUIRE(table.slot_range(5).first == 16);
+    REQUIRE(table.slot_range(5).second == 31);
+
+    // The median is at the end of slot 5, the 99th percentile 90% into slot
+    // 10
+    auto ps = table.percentiles(hists[0], {50, 99, 100});
+    REQUIRE(ps[0] == 31);
+    REQUIRE(ps[1] == Approx(512 + 0.9 * 511));
+    REQUIRE(ps[2] == 1023);
+    REQUIRE(table.percentile(hists[0], 0) == 0);
+  }
+
+  SECTION("interval deltas") {
+    auto counts = bpf.get_array_table<uint64_t>("dist");
+    REQUIRE(counts.update_value(3, 5).ok());
+
+    auto table = bpf.get_histogram_table("dist");
+    std::vector<ebpf::BPFHistogramTable::Histogram> hists;
+    REQUIRE(table.read_delta(hists).ok());
+    REQUIRE(hists[0].total == 5);
+
+    REQUIRE(counts.update_value(3, 7).ok());
+    REQUIRE(counts.update_value(4, 1).ok());
+    REQUIRE(table.read_delta(hists).ok());
+    REQUIRE(hists[0].total == 3);
+    REQUIRE(hists[0].slots[3] == 2);
+    REQUIRE(hists[0].slots[4] == 1);
+
+    // A counter that went down counts from zero
+    REQUIRE(counts.update_value(3, 1).ok());
+    REQUIRE(table.read_delta(hists).ok());
+    REQUIRE(hists[0].slots[3] == 1);
+    REQUIRE(hists[0].slots[4] == 0);
+  }
+
+  SECTION("sectioned histogram") {
+    auto counts = bpf.get_hash_table<disk_key_t, uint64_t>("disk_dist");
+    for (uint64_t disk = 0; disk < 3; disk++)
+      for (uint64_t slot = 0; slot <= disk; slot++)
+        REQUIRE(counts.update_value({disk, slot}, 1 + slot).ok());
+    // Sorts after disk 1 although its lowest byte is smaller
+    REQUIRE(counts.update_value({256, 0}, 1).ok());
+    // Out of range for a log2 histogram
+    REQUIRE(counts.update_value({1, 100}, 1).ok());
+    REQUIRE(counts.update_value({2, 70}, 1).ok());
+
+    auto table = bpf.get_histogram_table("disk_dist");
+    std::vector<ebpf::BPFHistogramTable::Histogram> hists;
+    REQUIRE(table.read(hists).ok());
+    REQUIRE(hists.size() == 4);
+    for (uint64_t disk = 0; disk < 3; disk++) {
+      disk_key_t key;
+      REQUIRE(hists[disk].section.size() == sizeof(key));
+      memcpy(&key, hists[disk].section.data(), sizeof(key));
+      REQUIRE(key.disk == disk);
+      REQUIRE(key.slot == 0);
+      REQUIRE(hists[disk].slots.size() == disk + 1);
+      REQUIRE(hists[disk].slots[disk] == disk + 1);
+    }
+    disk_key_t last;
+    memcpy(&last, hists[3].section.data(), sizeof(last));
+    REQUIRE(last.disk == 256);
+    REQUIRE(table.dropped() == 2);
+    REQUIRE(table.max_dropped_slot() == 100);
+
+    REQUIRE(counts.remove_value({1, 100}).ok());
+    REQUIRE(counts.remove_value({2, 70}).ok());
+    REQUIRE(table.read(hists).ok());
+    REQUIRE(table.dropped() == 0);
+
+    REQUIRE(!table.set_slot_field(12, 8).ok());
+    REQUIRE(!table.set_slot_field(0, 3).ok());
+  }
+
+  SECTION("per-cpu linear histogram") {
+    auto counts = bpf.get_percpu_array_table<uint64_t>("pcpu_dist");
+    size_t ncpus = ebpf::BPFTable::get_possible_cpu_count();
+    REQUIRE(counts.update_value(7, std::vector<uint64_t>(ncpus, 2)).ok());
+
+    auto table = bpf.get_histogram_table(
+        "pcpu_dist", ebpf::BPFHistogramTable::Scale::LINEAR);
+    std::vector<ebpf::BPFHistogramTable::Histogram> hists;
+    REQUIRE(table.read(hists).ok());
+    REQUIRE(hists.size() == 1);
+    REQUIRE(hists[0].slots.size() == 64);
+    REQUIRE(hists[0].slots[7] == 2 * ncpus);
+    REQUIRE(hists[0].total == 2 * ncpus);
+    REQUIRE(table.slot_range(7).first == 7);
+    REQUIRE(table.slot_range(7).second == 7);
+    REQUIRE(table.percentile(hists[0], 50) == 7);
+  }
+}
@@ -0,0 +1,52 @@
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+#include "catch.hpp"
+
+TEST_CASE("test init parallel", "[init_parallel]") {
+  // Every program has a table of the same name but its own size
+  const std::string BPF_PROGRAM = R"(
+    #include <linux/sched.h>
+    BPF_ARRAY(counts, u64, SIZE);
+    int on_sys_getuid(void *ctx) {
+      int zero = 0;
+      counts.increment(zero);
+      return TASK_COMM_LEN;
+    }
+  )";
+  const size_t n = 8;
+
+  std::vector<std::unique_ptr<ebpf::BPF>> bpfs;
+  std::vector<ebpf::BPF::InitArgs> args;
+  for (size_t i = 0; i < n; i++) {
+    bpfs.emplace_back(new ebpf::BPF());
+    args.push_back({bpfs.back().get(), BPF_PROGRAM,
+                    {"-DSIZE=" + std::to_string(i + 1)}, {}});
+  }
+  // Errors are reported for the program they come from
+  args[3].program = "int on_sys_getuid(void *ctx) { return undefined; }";
+
+  auto results = ebpf::BPF::init_parallel(args, 4);
+  REQUIRE(results.size() == n);
+  for (size_t i = 0; i < n; i++) {
+    if (i == 3) {
+      REQUIRE(!results[i].ok());
+      continue;
+    }
+    REQUIRE(results[i].ok());
+    auto counts = bpfs[i]->get_array_table<uint64_t>("counts");
+    REQUIRE(counts.capacity() == i + 1);
+    int fd;
+    REQUIRE(bpfs[i]->load_func("on_sys_getuid", BPF_PROG_TYPE_KPROBE, fd).ok());
+  }
+
+  // The tables of every program are their own
+  uint64_t value = 42;
+  REQUIRE(bpfs[0]->get_array_table<uint64_t>("counts").update_value(0, value)
+              .ok());
+  REQUIRE(bpfs[1]->get_array_table<uint64_t>("counts").get_value(0, value)
+              .ok());
+  REQUIRE(value == 0);
+}
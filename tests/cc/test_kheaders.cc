@@ -0,0 +1,141 @@
+#include <ftw.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "catch.hpp"
+#include "frontends/clang/kbuild_helper.h"
+
+namespace {
+
+// One ustar header block, followed by the data padded to whole blocks
+std::string tar_entry(const std::string &name, char type,
+                      const std::string &data = "",
+                      const std::string &link = "") {
+  char block[512] = {};
+  strncpy(block, name.c_str(), 100);
+  snprintf(block + 100, 8, "%07o", 0644);
+  snprintf(block + 124, 12, "%011o", (unsigned)data.size());
+  block[156] = type;
+  strncpy(block + 157, link.c_str(), 100);
+  memcpy(block + 257, "ustar", 6);
+  memcpy(block + 263, "00", 2);
+
+  std::string res(block, sizeof(block));
+  res += data;
+  res.append((512 - data.size() % 512) % 512, '\0');
+  return res;
+}
+
+std::string tar_end() { return std::string(1024, '\0'); }
+
+int remove_cb(const char *path, const struct stat *, int, struct FTW *) {
+  return ::remove(path);
+}
+
+bool extract(const std::string &dir, const std::string &archive,
+             size_t chunk) {
+  ebpf::TarExtractor tar(dir);
+  for (size_t pos = 0; pos < archive.size(); pos += chunk)
+    if (!tar.feed(archive.data() + pos,
+                  std::min(chunk, archive.size() - pos)))
+      return false;
+  return tar.done();
+}
+
+std::string read_file(const std::string &path) {
+  std::ifstream in(path);
+  std::stringstream ss;
+  ss << in.rdbuf();
+  return ss.str();
+}
+
+}  // namespace
+
+TEST_CASE("test kheaders safe paths", "[kheaders]") {
+  REQUIRE(ebpf::safe_path("include/linux/types.h"));
+  REQUIRE(ebpf::safe_path("a..b/c"));
+  REQUIRE(!ebpf::safe_path(""));
+  REQUIRE(!ebpf::safe_path("/etc/passwd"));
+  REQUIRE(!ebpf::safe_path(".."));
+  REQUIRE(!ebpf::safe_path("include/../../x"));
+
+  // Resolved against the directory of the link
+  REQUIRE(ebpf::safe_link("include/dt-bindings/input/linux-event-codes.h",
+                          "../../uapi/linux/input-event-codes.h"));
+  REQUIRE(ebpf::safe_link("include/asm", "../arch/x86/include/asm"));
+  REQUIRE(ebpf::safe_link("a/b", "./c/../d"));
+  REQUIRE(!ebpf::safe_link("include/asm", "../../etc"));
+  REQUIRE(!ebpf::safe_link("link", ".."));
+  REQUIRE(!ebpf::safe_link("include/link", "/etc"));
+  REQUIRE(!ebpf::safe_link("include/link", ""));
+  REQUIRE(!ebpf::safe_link("../link", "x"));
+}
+
+TEST_CASE("test kheaders tar extraction", "[kheaders]") {
+  char tmp[] = "/tmp/bcc-kheaders-test-XXXXXX";
+  REQUIRE(mkdtemp(tmp));
+  std::string dir = tmp;
+
+  SECTION("files, directories and relative links") {
+    std::string archive =
+        tar_entry("./include/", '5') +
+        tar_entry("./include/uapi/linux/input-event-codes.h", '0',
+                  "#define EV_SYN 0x00\n") +
+        tar_entry("./include/dt-bindings/input/linux-event-codes.h", '2', "",
+                  "../../uapi/linux/input-event-codes.h") +
+        tar_end();
+
+    // Fed whole and in pieces which don't line up with the blocks
+    for (size_t chunk : {archive.size(), (size_t)100}) {
+      std::string out = dir + "/" + std::to_string(chunk);
+      REQUIRE(mkdir(out.c_str(), 0700) == 0);
+      REQUIRE(extract(out, archive, chunk));
+      REQUIRE(read_file(out + "/include/uapi/linux/input-event-codes.h") ==
+              "#define EV_SYN 0x00\n");
+      REQUIRE(read_file(out +
+                        "/include/dt-bindings/input/linux-event-codes.h") ==
+              "#define EV_SYN 0x00\n");
+    }
+  }
+
+  SECTION("links leaving the directory") {
+    std::string archive =
+        tar_entry("include/link", '2', "", "../../etc") + tar_end();
+    REQUIRE(!extract(dir, archive, archive.size()));
+    struct stat st;
+    REQUIRE(lstat((dir + "/include/link").c_str(), &st) != 0);
+  }
+
+  SECTION("entries below a link") {
+    // Each link stays inside, the second one only leaves through the first
+    std::string archive = tar_entry("a/b", '2', "", "..") +
+                          tar_entry("a/b/c", '2', "", "..") + tar_end();
+    REQUIRE(!extract(dir, archive, archive.size()));
+
+    archive = tar_entry("d/e", '2', "", "..") +
+              tar_entry("d/e/f.h", '0', "x") + tar_end();
+    REQUIRE(!extract(dir, archive, archive.size()));
+    struct stat st;
+    REQUIRE(lstat((dir + "/f.h").c_str(), &st) != 0);
+  }
+
+  SECTION("paths leaving the directory") {
+    std::string archive = tar_entry("../escaped.h", '0', "x") + tar_end();
+    REQUIRE(!extract(dir, archive, archive.size()));
+    archive = tar_entry("/tmp/escaped.h", '0', "x") + tar_end();
+    REQUIRE(!extract(dir, archive, archive.size()));
+  }
+
+  SECTION("truncated archive") {
+    std::string archive = tar_entry("include/x.h", '0', "x");
+    REQUIRE(!extract(dir, archive, archive.size()));
+  }
+
+  REQUIRE(nftw(tmp, remove_cb, 20, FTW_DEPTH | FTW_PHYS) == 0);
+}
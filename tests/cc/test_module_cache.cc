@@ -0,0 +1,350 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+#include "bcc_common.h"
+#include "bpf_module_cache.h"
+#include "catch.hpp"
+
+TEST_CASE("test module cache entry encoding", "[module_cache]") {
+  ebpf::CacheEntryWriter w;
+  w.put_u32(42);
+  w.put_str("hello");
+  w.put_u64(1ULL << 40);
+  w.put_str(std::string("with\0nul", 8));
+
+  SECTION("round trip") {
+    ebpf::CacheEntryReader r(w.data());
+    uint32_t u32;
+    uint64_t u64;
+    std::string s1, s2;
+    REQUIRE(r.get_u32(u32));
+    REQUIRE(u32 == 42);
+    REQUIRE(r.get_str(s1));
+    REQUIRE(s1 == "hello");
+    REQUIRE(r.get_u64(u64));
+    REQUIRE(u64 == (1ULL << 40));
+    REQUIRE(r.get_str(s2));
+    REQUIRE(s2 == std::string("with\0nul", 8));
+    REQUIRE(r.done());
+  }
+
+  SECTION("truncated entry") {
+    std::string data = w.data().substr(0, w.data().size() - 1);
+    ebpf::CacheEntryReader r(data);
+    uint32_t u32;
+    uint64_t u64;
+    std::string s1, s2;
+    REQUIRE(r.get_u32(u32));
+    REQUIRE(r.get_str(s1));
+    REQUIRE(r.get_u64(u64));
+    REQUIRE(!r.get_str(s2));
+    REQUIRE(!r.done());
+  }
+}
+
+namespace {
+
+std::vector<std::string> list_dir(const std::string &dir) {
+  std::vector<std::string> files;
+  DIR *d = opendir(dir.c_str());
+  REQUIRE(d != nullptr);
+  while (struct dirent *ent = readdir(d))
+    if (ent->d_name[0] != '.')
+      files.push_back(dir + "/" + ent->d_name);
+  closedir(d);
+  return files;
+}
+
+void remove_dir(const std::string &dir) {
+  for (const auto &f : list_dir(dir))
+    unlink(f.c_str());
+  rmdir(dir.c_str());
+}
+
+// The names of the files in dir, sorted
+std::vector<std::string> list_names(const std::string &dir) {
+  std::vector<std::string> names;
+  for (const auto &f : list_dir(dir))
+    names.push_back(f.substr(dir.size() + 1));
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+std::string entry_path(const std::string &dir, const std::string &key) {
+  return dir + "/" + ebpf::cache_key_hash(key) + ".bcc";
+}
+
+}  // namespace
+
+TEST_CASE("test module cache directory", "[module_cache]") {
+  char dir[] = "/tmp/bcc-cache-XXXXXX";
+  REQUIRE(mkdtemp(dir) != nullptr);
+
+  REQUIRE(ebpf::private_cache_dir(dir));
+  // Other users could plant entries
+  REQUIRE(chmod(dir, 0777) == 0);
+  REQUIRE(!ebpf::private_cache_dir(dir));
+  REQUIRE(chmod(dir, 0720) == 0);
+  REQUIRE(!ebpf::private_cache_dir(dir));
+  REQUIRE(chmod(dir, 0700) == 0);
+
+  std::string link = std::string(dir) + "/link";
+  std::string sub = std::string(dir) + "/sub";
+  REQUIRE(ebpf::private_cache_dir(sub));
+  REQUIRE(symlink(sub.c_str(), link.c_str()) == 0);
+  REQUIRE(!ebpf::private_cache_dir(link));
+
+  unlink(link.c_str());
+  rmdir(sub.c_str());
+  rmdir(dir);
+}
+
+TEST_CASE("test module cache entries", "[module_cache]") {
+  char dir[] = "/tmp/bcc-cache-XXXXXX";
+  REQUIRE(mkdtemp(dir) != nullptr);
+  std::string entry(1000, 'x'), out;
+  // Room for two entries and their headers, not three
+  ebpf::BPFModuleCache cache(dir, 2 * entry.size() + 500);
+
+  ebpf::BPFModuleCacheStats before = ebpf::BPFModuleCache::stats();
+  REQUIRE(!cache.lookup("k1", out));
+  REQUIRE(cache.store("k1", entry));
+  REQUIRE(cache.lookup("k1", out));
+  REQUIRE(out == entry);
+
+  // An entry found under the name of another key is not returned
+  REQUIRE(rename(entry_path(dir, "k1").c_str(),
+                 entry_path(dir, "k2").c_str()) == 0);
+  REQUIRE(!cache.lookup("k2", out));
+  // Neither is a symlink to an entry
+  REQUIRE(cache.store("k1", entry));
+  REQUIRE(symlink(entry_path(dir, "k1").c_str(),
+                  entry_path(dir, "k3").c_str()) == 0);
+  REQUIRE(!cache.lookup("k3", out));
+  unlink(entry_path(dir, "k2").c_str());
+  unlink(entry_path(dir, "k3").c_str());
+
+  // The least recently used entry goes first
+  REQUIRE(cache.store("k2", entry));
+  struct timespec old[2] = {{1, 0}, {1, 0}};
+  REQUIRE(utimensat(AT_FDCWD, entry_path(dir, "k1").c_str(), old, 0) == 0);
+  REQUIRE(cache.store("k3", entry));
+  REQUIRE(!cache.lookup("k1", out));
+  REQUIRE(cache.lookup("k2", out));
+  REQUIRE(cache.lookup("k3", out));
+
+  ebpf::BPFModuleCacheStats after = ebpf::BPFModuleCache::stats();
+  REQUIRE(after.stores - before.stores == 4);
+  REQUIRE(after.hits - before.hits == 3);
+  REQUIRE(after.misses - before.misses == 4);
+  REQUIRE(after.evictions - before.evictions == 1);
+  remove_dir(dir);
+}
+
+TEST_CASE("test module cache", "[module_cache]") {
+  char dir[] = "/tmp/bcc-cache-XXXXXX";
+  REQUIRE(mkdtemp(dir) != nullptr);
+  ebpf::BPFModuleCache cache(dir, 1 << 20);
+  ebpf::BPFModuleCache *saved = ebpf::BPFModuleCache::set_instance(&cache);
+
+  const std::string BPF_PROGRAM = R"(
+    BPF_HASH(cached_table, int, u64, 16);
+    int on_sys_getuid(void *ctx) {
+      int key = 1;
+      u64 val = 2;
+      cached_table.update(&key, &val);
+      return 0;
+    }
+  )";
+
+  ebpf::BPFModuleCacheStats before = ebpf::BPFModuleCache::stats();
+  for (int i = 0; i < 2; i++) {
+    ebpf::BPF bpf;
+    ebpf::StatusTuple res = bpf.init(BPF_PROGRAM);
+    REQUIRE(res.ok());
+
+    int fd;
+    res = bpf.load_func("on_sys_getuid", BPF_PROG_TYPE_KPROBE, fd);
+    REQUIRE(res.ok());
+
+    auto t = bpf.get_hash_table<int, uint64_t>("cached_table");
+    REQUIRE(t.update_value(1, 2).ok());
+    uint64_t val;
+    REQUIRE(t.get_value(1, val).ok());
+    REQUIRE(val == 2);
+  }
+  ebpf::BPFModuleCacheStats after = ebpf::BPFModuleCache::stats();
+  REQUIRE(after.stores - before.stores == 1);
+  REQUIRE(after.hits - before.hits == 1);
+
+  // A different cflag is a different program
+  {
+    ebpf::BPF bpf;
+    REQUIRE(bpf.init(BPF_PROGRAM, {"-DUNUSED=1"}).ok());
+  }
+  before = after;
+  after = ebpf::BPFModuleCache::stats();
+  REQUIRE(after.misses - before.misses == 1);
+  REQUIRE(after.stores - before.stores == 1);
+
+  // Programs including their own headers are compiled every time, so that
+  // changes to the headers are picked up
+  std::string header = std::string(dir) + "/size.h";
+  for (int size : {4, 8}) {
+    FILE *f = fopen(header.c_str(), "w");
+    REQUIRE(f != nullptr);
+    fprintf(f, "#define SIZE %d\n", size);
+    fclose(f);
+
+    ebpf::BPF bpf;
+    REQUIRE(bpf.init("#include \"size.h\"\nBPF_ARRAY(sized, u64, SIZE);",
+                     {std::string("-I") + dir})
+                .ok());
+    REQUIRE(bpf.get_array_table<uint64_t>("sized").capacity() == (size_t)size);
+  }
+  before = after;
+  after = ebpf::BPFModuleCache::stats();
+  REQUIRE(after.stores == before.stores);
+  REQUIRE(after.hits == before.hits);
+
+  ebpf::BPFModuleCache::set_instance(saved);
+  remove_dir(dir);
+}
+
+TEST_CASE("test precompiled prelude", "[module_cache]") {
+  char dir[] = "/tmp/bcc-pch-XXXXXX";
+  REQUIRE(mkdtemp(dir) != nullptr);
+  setenv("BCC_PCH_DIR", dir, 1);
+
+  // Programs which only differ in the macros of their cflags share the
+  // precompiled prelude
+  for (int pid = 0; pid < 2; pid++) {
+    const std::string program = R"(
+      #include <linux/sched.h>
+      BPF_HASH(pids, u32, u64, 16);
+      int on_sys_getuid(void *ctx) {
+        u32 pid = bpf_get_current_pid_tgid() >> 32;
+        u64 one = 1;
+        if (pid != PID)
+          pids.update(&pid, &one);
+        return TASK_COMM_LEN;
+      }
+    )";
+    ebpf::BPF bpf;
+    ebpf::StatusTuple res =
+        bpf.init(program, {"-DPID=" + std::to_string(pid)});
+    REQUIRE(res.ok());
+    int fd;
+    res = bpf.load_func("on_sys_getuid", BPF_PROG_TYPE_KPROBE, fd);
+    REQUIRE(res.ok());
+  }
+
+  // Errors in the program are still reported
+  ebpf::BPF bad;
+  REQUIRE(!bad.init("int on_sys_getuid(void *ctx) { return undefined; }").ok());
+
+  std::vector<std::string> files = list_names(dir);
+  REQUIRE(files.size() == 2);
+  REQUIRE(files[0].compare(0, 12, "bcc-prelude-") == 0);
+  REQUIRE(files[0].substr(files[0].size() - 4) == ".pch");
+  REQUIRE(files[1] == files[0] + ".ids");
+
+  // A macro the prelude refers to still changes it
+  {
+    ebpf::BPF bpf;
+    REQUIRE(bpf.init("BPF_ARRAY(depth, u64, BPF_MAX_STACK_DEPTH);",
+                     {"-DPERF_MAX_STACK_DEPTH=42"})
+                .ok());
+    REQUIRE(bpf.get_array_table<uint64_t>("depth").capacity() == 42);
+  }
+
+  // Eviction only goes by the name of the precompiled preludes
+  std::string other = std::string(dir) + "/other.pch";
+  REQUIRE(close(open(other.c_str(), O_CREAT | O_WRONLY, 0600)) == 0);
+  for (int i = 0; i < 8; i++) {
+    std::string path = std::string(dir) + "/bcc-prelude-" +
+                       std::string(31, '0') + std::to_string(i) + ".pch";
+    REQUIRE(close(open(path.c_str(), O_CREAT | O_WRONLY, 0600)) == 0);
+    struct timespec times[2] = {{i, 0}, {i, 0}};
+    REQUIRE(utimensat(AT_FDCWD, path.c_str(), times, 0) == 0);
+  }
+  {
+    ebpf::BPF bpf;
+    REQUIRE(bpf.init("int on_sys_getuid(void *ctx) { return 0; }",
+                     {"-DUNUSED=1", "-fno-builtin"})
+                .ok());
+  }
+  files = list_names(dir);
+  remove_dir(dir);
+  unsetenv("BCC_PCH_DIR");
+
+  REQUIRE(std::count(files.begin(), files.end(), "other.pch") == 1);
+  REQUIRE(std::count(files.begin(), files.end(),
+                     "bcc-prelude-" + std::string(31, '0') + "0.pch") == 0);
+  REQUIRE(std::count_if(files.begin(), files.end(), [](const std::string &f) {
+            return f.substr(f.size() - 4) == ".pch";
+          }) == 9);
+}
+
+TEST_CASE("test kernel header cache", "[module_cache]") {
+  const std::string program = R"(
+    #include <linux/sched.h>
+    int on_sys_getuid(void *ctx) {
+      return TASK_COMM_LEN;
+    }
+  )";
+
+  // Start from an empty cache, it goes along with the bcc memory
+  {
+    ebpf::BPF bpf;
+    REQUIRE(bpf.init(program).ok());
+    REQUIRE(bpf.free_bcc_memory() == 0);
+  }
+  struct bcc_header_cache_stats empty;
+  bcc_header_cache_get_stats(&empty);
+  REQUIRE(empty.files == 0);
+
+  // The second compile reads the headers from memory, missing headers are
+  // still missing. Different texts, so that the module cache doesn't skip
+  // the compile.
+  struct bcc_header_cache_stats stats[3];
+  const char *caches[] = {"1", "1", "0"};
+  for (int i = 0; i < 3; i++) {
+    setenv("BCC_HEADER_CACHE", caches[i], 1);
+    ebpf::BPF bpf;
+    REQUIRE(bpf.init("// " + std::to_string(i) + "\n" + program).ok());
+    ebpf::BPF missing;
+    REQUIRE(!missing.init("#include <linux/bcc_no_such_header.h>\n" + program)
+                 .ok());
+    bcc_header_cache_get_stats(&stats[i]);
+  }
+  unsetenv("BCC_HEADER_CACHE");
+
+  REQUIRE(stats[0].misses > 0);
+  REQUIRE(stats[0].bytes > 0);
+  REQUIRE(stats[1].misses == stats[0].misses);
+  REQUIRE(stats[1].hits > stats[0].hits);
+  REQUIRE(stats[1].files == stats[0].files);
+  REQUIRE(stats[2].hits == stats[1].hits);
+
+  // Releasing the compiler memory of a module leaves the headers to the next
+  // compile, they are only dropped on request
+  struct bcc_header_cache_stats kept, released;
+  {
+    ebpf::BPF bpf;
+    REQUIRE(bpf.init("// 3\n" + program).ok());
+    REQUIRE(bpf.release_compiler_memory().ok());
+  }
+  bcc_header_cache_get_stats(&kept);
+  ebpf::BPF::release_header_cache();
+  bcc_header_cache_get_stats(&released);
+  REQUIRE(kept.files == stats[1].files);
+  REQUIRE(released.files == 0);
+}
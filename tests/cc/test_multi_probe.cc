@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+#include "catch.hpp"
+
+extern "C" {
+int __attribute__((noinline)) multi_probe_target_1(int x) {
+  asm volatile("" : : : "memory");
+  return x + 1;
+}
+
+int __attribute__((noinline)) multi_probe_target_2(int x) {
+  asm volatile("" : : : "memory");
+  return x + 2;
+}
+}
+
+TEST_CASE("test kprobe_multi attach", "[multi_probe]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_ARRAY(count, u64, 2);
+
+    int on_entry(void *ctx) {
+      count.atomic_increment(0);
+      return 0;
+    }
+
+    int on_return(void *ctx) {
+      count.atomic_increment(1);
+      return 0;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  std::vector<std::string> funcs = {bpf.get_syscall_fnname("getuid"),
+                                    bpf.get_syscall_fnname("getgid")};
+  res = bpf.attach_kprobe_multi(funcs, "on_entry");
+  REQUIRE(res.ok());
+  res = bpf.attach_kprobe_multi(funcs, "on_return", BPF_PROBE_RETURN);
+  REQUIRE(res.ok());
+  REQUIRE(!bpf.attach_kprobe_multi(funcs, "on_entry").ok());
+
+  for (int i = 0; i < 10; i++) {
+    REQUIRE(getuid() >= 0);
+    REQUIRE(getgid() >= 0);
+  }
+
+  res = bpf.detach_kprobe_multi("on_entry");
+  REQUIRE(res.ok());
+  res = bpf.detach_kprobe_multi("on_return", BPF_PROBE_RETURN);
+  REQUIRE(res.ok());
+  REQUIRE(!bpf.detach_kprobe_multi("on_entry").ok());
+
+  auto count = bpf.get_array_table<uint64_t>("count");
+  uint64_t entries, returns;
+  REQUIRE(count.get_value(0, entries).ok());
+  REQUIRE(count.get_value(1, returns).ok());
+  REQUIRE(entries >= 20);
+  REQUIRE(returns >= 20);
+
+  // Nothing fires once detached
+  for (int i = 0; i < 10; i++)
+    REQUIRE(getuid() >= 0);
+  uint64_t after;
+  REQUIRE(count.get_value(0, after).ok());
+  REQUIRE(after == entries);
+
+  REQUIRE(!bpf.attach_kprobe_multi({}, "on_entry").ok());
+}
+
+TEST_CASE("test uprobe_multi attach", "[multi_probe]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_ARRAY(count, u64, 1);
+
+    int on_entry(void *ctx) {
+      count.atomic_increment(0);
+      return 0;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  char *this_exe = realpath("/proc/self/exe", NULL);
+  REQUIRE(this_exe);
+  std::string exe(this_exe);
+  free(this_exe);
+
+  std::vector<std::string> syms = {"multi_probe_target_1",
+                                   "multi_probe_target_2"};
+  res = bpf.attach_uprobe_multi(exe, syms, "on_entry", BPF_PROBE_ENTRY,
+                                {getpid()});
+  REQUIRE(res.ok());
+  REQUIRE(!bpf.attach_uprobe_multi(exe, syms, "on_entry").ok());
+
+  int sum = 0;
+  for (int i = 0; i < 10; i++)
+    sum += multi_probe_target_1(i) + multi_probe_target_2(i);
+  REQUIRE(sum == 120);
+
+  res = bpf.detach_uprobe_multi(exe, "on_entry");
+  REQUIRE(res.ok());
+  REQUIRE(!bpf.detach_uprobe_multi(exe, "on_entry").ok());
+
+  auto count = bpf.get_array_table<uint64_t>("count");
+  uint64_t hits;
+  REQUIRE(count.get_value(0, hits).ok());
+  REQUIRE(hits == 20);
+
+  REQUIRE(!bpf.attach_uprobe_multi(exe, {"no_such_symbol"}, "on_entry").ok());
+}
+
+TEST_CASE("test uprobe_multi attach to a library", "[multi_probe]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_ARRAY(count, u64, 1);
+
+    int on_entry(void *ctx) {
+      count.atomic_increment(0);
+      return 0;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  // The link goes on the file the library name resolves to
+  res = bpf.attach_uprobe_multi("c", {"getpid", "getppid"}, "on_entry",
+                                BPF_PROBE_ENTRY, {getpid()});
+  REQUIRE(res.ok());
+
+  for (int i = 0; i < 10; i++) {
+    REQUIRE(getpid() > 0);
+    REQUIRE(getppid() >= 0);
+  }
+
+  res = bpf.detach_uprobe_multi("c", "on_entry");
+  REQUIRE(res.ok());
+
+  auto count = bpf.get_array_table<uint64_t>("count");
+  uint64_t hits;
+  REQUIRE(count.get_value(0, hits).ok());
+  REQUIRE(hits >= 20);
+}
+
+TEST_CASE("test detach_all removes tracefs probe events", "[multi_probe]") {
+  const std::string BPF_PROGRAM = R"(
+    int on_return(void *ctx) {
+      return 0;
+    }
+  )";
+
+  auto own_events = []() {
+    std::string suffix = "_bcc_" + std::to_string(getpid());
+    int n = 0;
+    for (const char *path : {"/sys/kernel/debug/tracing/kprobe_events",
+                             "/sys/kernel/tracing/kprobe_events"}) {
+      std::ifstream events(path);
+      std::string line;
+      while (std::getline(events, line))
+        if (line.find(suffix + " ") != std::string::npos)
+          n++;
+      if (events.is_open())
+        break;
+    }
+    return n;
+  };
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  // maxactive can only be set through tracefs, so these kretprobes all
+  // create an event in kprobe_events
+  for (const char *fn : {"getuid", "getgid", "geteuid", "getegid"}) {
+    res = bpf.attach_kprobe(bpf.get_syscall_fnname(fn), "on_return", 0,
+                            BPF_PROBE_RETURN, 16);
+    REQUIRE(res.ok());
+  }
+  REQUIRE(own_events() == 4);
+
+  res = bpf.detach_all();
+  REQUIRE(res.ok());
+  REQUIRE(own_events() == 0);
+}
@@ -0,0 +1,157 @@
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "BPF.h"
+#include "catch.hpp"
+
+namespace {
+
+struct event_t {
+  uint32_t pid;
+  uint64_t seq;
+};
+
+void on_event(void *cb_cookie, void *data, int data_size) {
+  auto *count = static_cast<std::atomic<uint64_t> *>(cb_cookie);
+  if (data_size >= (int)sizeof(event_t) &&
+      static_cast<event_t *>(data)->pid == (uint32_t)getpid())
+    (*count)++;
+}
+
+}  // namespace
+
+TEST_CASE("test perf buffer consumer threads", "[perf_buffer]") {
+  const std::string BPF_PROGRAM = R"(
+    struct event_t {
+      u32 pid;
+      u64 seq;
+    };
+    BPF_PERF_OUTPUT(events);
+
+    int on_sys_getuid(void *ctx) {
+      struct event_t e = {};
+      e.pid = bpf_get_current_pid_tgid() >> 32;
+      e.seq = bpf_ktime_get_ns();
+      events.perf_submit(ctx, &e, sizeof(e));
+      return 0;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  std::atomic<uint64_t> count(0);
+  res = bpf.open_perf_buffer("events", on_event, nullptr, &count, 8);
+  REQUIRE(res.ok());
+  ebpf::BPFPerfBuffer *perf_buffer = bpf.get_perf_buffer("events");
+  REQUIRE(perf_buffer != nullptr);
+
+  res = perf_buffer->start_consumer_threads(2);
+  REQUIRE(res.ok());
+  REQUIRE(perf_buffer->poll(0) < 0);
+  REQUIRE(!perf_buffer->start_consumer_threads(2).ok());
+
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+  for (int i = 0; i < 100; i++)
+    REQUIRE(getuid() >= 0);
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+
+  for (int i = 0; i < 100 && count < 100; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  res = perf_buffer->stop_consumer_threads();
+  REQUIRE(res.ok());
+  perf_buffer->consume();
+  REQUIRE(count == 100);
+
+  uint64_t consumed = 0, lost = 0;
+  for (auto &it : perf_buffer->get_cpu_stats()) {
+    consumed += it.second.consumed;
+    lost += it.second.lost;
+  }
+  REQUIRE(consumed >= 100);
+  REQUIRE(lost == 0);
+
+  res = bpf.close_perf_buffer("events");
+  REQUIRE(res.ok());
+}
+
+namespace {
+
+struct batch_count_t {
+  std::atomic<uint64_t> events;
+  std::atomic<uint64_t> batches;
+  std::atomic<int> max_batch;
+};
+
+void on_batch(void *cb_cookie, struct bcc_batch_record *records,
+              int num_records) {
+  auto *count = static_cast<batch_count_t *>(cb_cookie);
+  count->batches++;
+  if (num_records > count->max_batch)
+    count->max_batch = num_records;
+  for (int i = 0; i < num_records; i++)
+    if (records[i].size >= (int)sizeof(event_t) &&
+        static_cast<event_t *>(records[i].data)->pid == (uint32_t)getpid())
+      count->events++;
+}
+
+}  // namespace
+
+TEST_CASE("test perf buffer batch callback", "[perf_buffer]") {
+  const std::string BPF_PROGRAM = R"(
+    struct event_t {
+      u32 pid;
+      u64 seq;
+    };
+    BPF_PERF_OUTPUT(events);
+
+    int on_sys_getuid(void *ctx) {
+      struct event_t e = {};
+      e.pid = bpf_get_current_pid_tgid() >> 32;
+      e.seq = bpf_ktime_get_ns();
+      events.perf_submit(ctx, &e, sizeof(e));
+      return 0;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+
+  batch_count_t count;
+  count.events = 0;
+  count.batches = 0;
+  count.max_batch = 0;
+  bcc_batch_opts batch_opts = {
+    .max_records = 16,
+    .max_latency_ms = 1000,
+  };
+  res = bpf.open_perf_buffer("events", on_batch, batch_opts, nullptr, &count);
+  REQUIRE(res.ok());
+
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+  for (int i = 0; i < 100; i++)
+    REQUIRE(getuid() >= 0);
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+
+  // Nothing is due before the latency expires, consume() delivers it all
+  bpf.get_perf_buffer("events")->consume();
+  REQUIRE(count.events == 100);
+  REQUIRE(count.max_batch <= 16);
+  REQUIRE(count.batches < 100);
+
+  res = bpf.close_perf_buffer("events");
+  REQUIRE(res.ok());
+}
@@ -0,0 +1,166 @@
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+#include "catch.hpp"
+
+TEST_CASE("test program run time stats", "[prog_stats]") {
+  const std::string BPF_PROGRAM = R"(
+    int on_getppid(void *ctx) {
+      u64 sum = 0;
+      for (int i = 0; i < 64; i++)
+        sum += bpf_ktime_get_ns();
+      return sum & 1;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+  res = bpf.attach_kprobe(bpf.get_syscall_fnname("getppid"), "on_getppid");
+  REQUIRE(res.ok());
+
+  SECTION("stats") {
+    res = bpf.enable_stats();
+    REQUIRE(res.ok());
+    for (int i = 0; i < 100; i++)
+      getppid();
+
+    bcc_prog_stats stats;
+    res = bpf.get_prog_stats("on_getppid", stats);
+    REQUIRE(res.ok());
+    REQUIRE(stats.run_cnt >= 100);
+    REQUIRE(stats.run_time_ns > 0);
+    REQUIRE(bpf.get_all_prog_stats().count("on_getppid") == 1);
+
+    res = bpf.get_prog_stats("not_loaded", stats);
+    REQUIRE(!res.ok());
+  }
+
+  SECTION("overhead budget") {
+    std::vector<std::string> over;
+    res = bpf.check_overhead_budget(&over);
+    REQUIRE(!res.ok());
+
+    res = bpf.set_overhead_budget(1e-9);
+    REQUIRE(res.ok());
+    res = bpf.check_overhead_budget(&over);
+    REQUIRE(res.ok());
+    REQUIRE(over.empty());
+
+    for (int i = 0; i < 1000; i++)
+      getppid();
+    usleep(10000);
+
+    res = bpf.check_overhead_budget(&over);
+    REQUIRE(res.ok());
+    REQUIRE(over == std::vector<std::string>{"on_getppid"});
+
+    bcc_prog_stats stats;
+    REQUIRE(!bpf.get_prog_stats("on_getppid", stats).ok());
+    // The kprobe was detached along with the function
+    res = bpf.detach_kprobe(bpf.get_syscall_fnname("getppid"));
+    REQUIRE(!res.ok());
+  }
+}
+
+TEST_CASE("test overhead budget of a kprobe_multi program", "[prog_stats]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_ARRAY(count, u64, 1);
+
+    int on_multi(void *ctx) {
+      u64 sum = 0;
+      for (int i = 0; i < 64; i++)
+        sum += bpf_ktime_get_ns();
+      count.atomic_increment(0);
+      return sum & 1;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+  std::vector<std::string> funcs = {bpf.get_syscall_fnname("getppid"),
+                                    bpf.get_syscall_fnname("getpgrp")};
+  res = bpf.attach_kprobe_multi(funcs, "on_multi");
+  REQUIRE(res.ok());
+
+  res = bpf.set_overhead_budget(1e-9);
+  REQUIRE(res.ok());
+  std::vector<std::string> over;
+  res = bpf.check_overhead_budget(&over);
+  REQUIRE(res.ok());
+  REQUIRE(over.empty());
+
+  for (int i = 0; i < 1000; i++)
+    getppid();
+  usleep(10000);
+
+  // Measured whether the kernel took a kprobe_multi link or the functions
+  // were attached one kprobe at a time
+  bcc_prog_stats stats;
+  res = bpf.get_prog_stats("on_multi", stats);
+  REQUIRE(res.ok());
+  REQUIRE(stats.run_cnt >= 1000);
+
+  res = bpf.check_overhead_budget(&over);
+  REQUIRE(res.ok());
+  REQUIRE(over == std::vector<std::string>{"on_multi"});
+  REQUIRE(!bpf.get_prog_stats("on_multi", stats).ok());
+  REQUIRE(!bpf.detach_kprobe_multi("on_multi").ok());
+
+  // The link no longer fires
+  auto count = bpf.get_array_table<uint64_t>("count");
+  uint64_t before, after;
+  REQUIRE(count.get_value(0, before).ok());
+  for (int i = 0; i < 100; i++)
+    getppid();
+  REQUIRE(count.get_value(0, after).ok());
+  REQUIRE(after == before);
+}
+
+TEST_CASE("test overhead budget after detaching a multi link",
+          "[prog_stats]") {
+  const std::string BPF_PROGRAM = R"(
+    int on_multi(void *ctx) {
+      u64 sum = 0;
+      for (int i = 0; i < 64; i++)
+        sum += bpf_ktime_get_ns();
+      return sum & 1;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.ok());
+  res = bpf.attach_kprobe(bpf.get_syscall_fnname("getppid"), "on_multi");
+  REQUIRE(res.ok());
+  std::vector<std::string> funcs = {bpf.get_syscall_fnname("getpgrp")};
+  res = bpf.attach_kprobe_multi(funcs, "on_multi");
+  REQUIRE(res.ok());
+
+  // Nowhere near what the function uses, unless the total wraps around
+  res = bpf.set_overhead_budget(0.5);
+  REQUIRE(res.ok());
+  std::vector<std::string> over;
+  for (int i = 0; i < 1000; i++)
+    getpgrp();
+  res = bpf.check_overhead_budget(&over);
+  REQUIRE(res.ok());
+  REQUIRE(over.empty());
+
+  // The run time of the link goes away with it, which is no reason to
+  // detach the kprobe still running the function
+  res = bpf.detach_kprobe_multi("on_multi");
+  REQUIRE(res.ok());
+  res = bpf.check_overhead_budget(&over);
+  REQUIRE(res.ok());
+  REQUIRE(over.empty());
+
+  bcc_prog_stats stats;
+  REQUIRE(bpf.get_prog_stats("on_multi", stats).ok());
+}
@@ -0,0 +1,165 @@
+#include <errno.h>
+#include <linux/version.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+#include "catch.hpp"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+namespace {
+
+// Every getuid() of this process submits one event to "events", and one to
+// "other" with the sequence number negated. Every fourth event of "events"
+// is reserved and discarded instead.
+const std::string BPF_PROGRAM = R"(
+  struct event_t {
+    u32 pid;
+    s64 seq;
+  };
+  BPF_RINGBUF_OUTPUT(events, 8);
+  BPF_RINGBUF_OUTPUT(other, 8);
+  BPF_ARRAY(seqs, u64, 1);
+
+  int on_sys_getuid(void *ctx) {
+    u32 pid = bpf_get_current_pid_tgid() >> 32;
+    if (pid != PID)
+      return 0;
+    int zero = 0;
+    u64 *seq = seqs.lookup(&zero);
+    if (!seq)
+      return 0;
+    s64 n = (*seq)++;
+
+    struct event_t *e = events.ringbuf_reserve(sizeof(struct event_t));
+    if (e) {
+      e->pid = pid;
+      e->seq = n;
+      if (n % 4 == 3)
+        events.ringbuf_discard(e, 0);
+      else
+        events.ringbuf_submit(e, 0);
+    }
+    struct event_t o = {.pid = pid, .seq = -n};
+    other.ringbuf_output(&o, sizeof(o), 0);
+    return 0;
+  }
+)";
+
+struct event_t {
+  uint32_t pid;
+  int64_t seq;
+};
+
+int on_event(void *ctx, void *data, size_t size) {
+  auto *seqs = static_cast<std::vector<int64_t> *>(ctx);
+  if (size >= sizeof(event_t))
+    seqs->push_back(static_cast<event_t *>(data)->seq);
+  return 0;
+}
+
+void on_batch(void *cb_cookie, struct bcc_batch_record *records,
+              int num_records) {
+  auto *batches = static_cast<std::vector<int> *>(cb_cookie);
+  batches->push_back(num_records);
+}
+
+void trigger(ebpf::BPF &bpf, int n) {
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  auto res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+  for (int i = 0; i < n; i++)
+    REQUIRE(getuid() >= 0);
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+}
+
+}  // namespace
+#endif
+
+TEST_CASE("test ring buffer", "[ring_buffer]") {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM, {"-DPID=" + std::to_string(getpid())});
+  REQUIRE(res.ok());
+
+  REQUIRE(bpf.get_ring_buffer("seqs") == nullptr);
+  REQUIRE(bpf.poll_ring_buffers(0) == -1);
+
+  SECTION("callbacks of two rings") {
+    std::vector<int64_t> events, other;
+    res = bpf.open_ring_buffer("events", on_event, &events);
+    REQUIRE(res.ok());
+    res = bpf.open_ring_buffer("other", on_event, &other);
+    REQUIRE(res.ok());
+    REQUIRE(!bpf.open_ring_buffer("other", on_event, &other).ok());
+
+    trigger(bpf, 8);
+    // Both rings are polled on the same epoll instance
+    REQUIRE(bpf.poll_ring_buffers(100) > 0);
+    REQUIRE(events == std::vector<int64_t>({0, 1, 2, 4, 5, 6}));
+    REQUIRE(other.size() == 8);
+    REQUIRE(other[7] == -7);
+  }
+
+  SECTION("batch callback") {
+    std::vector<int> batches;
+    bcc_batch_opts batch_opts = {
+      .max_records = 4,
+      .max_latency_ms = 1000,
+    };
+    res = bpf.open_ring_buffer("other", on_batch, batch_opts, &batches);
+    REQUIRE(res.ok());
+
+    trigger(bpf, 10);
+    // Two full batches are delivered, the rest is not due yet
+    bpf.poll_ring_buffers(0);
+    REQUIRE(batches == std::vector<int>({4, 4}));
+    REQUIRE(bpf.consume_ring_buffers() == 0);
+    REQUIRE(batches == std::vector<int>({4, 4, 2}));
+  }
+
+  SECTION("zero-copy reader") {
+    auto ring = bpf.get_ring_buffer("events");
+    REQUIRE(ring != nullptr);
+    res = ring->open_reader();
+    REQUIRE(res.ok());
+    REQUIRE(!bpf.open_ring_buffer("events", on_event, nullptr).ok());
+    REQUIRE(ring->wait(0) == 0);
+
+    trigger(bpf, 4);
+    REQUIRE(ring->wait(100) == 1);
+
+    // Records stay in place until they are released
+    std::vector<const event_t *> records;
+    size_t size;
+    const void *data;
+    while ((data = ring->next(size)) != nullptr) {
+      REQUIRE(size == sizeof(event_t));
+      records.push_back(static_cast<const event_t *>(data));
+    }
+    REQUIRE(records.size() == 3);
+    for (int64_t i = 0; i < 3; i++) {
+      REQUIRE(records[i]->pid == (uint32_t)getpid());
+      REQUIRE(records[i]->seq == i);
+    }
+    // Nothing wakes a wait while records are held
+    REQUIRE(ring->wait(10) == -1);
+    REQUIRE(errno == EBUSY);
+    ring->release();
+    REQUIRE(ring->wait(0) == 0);
+
+    trigger(bpf, 1);
+    data = ring->next(size);
+    REQUIRE(data != nullptr);
+    REQUIRE(static_cast<const event_t *>(data)->seq == 4);
+    REQUIRE(ring->next(size) == nullptr);
+    ring->release();
+
+    res = ring->close_reader();
+    REQUIRE(res.ok());
+  }
+#endif
+}
@@ -0,0 +1,125 @@
+#include <linux/version.h>
+#include <unistd.h>
+#include <sstream>
+
+#include "BPF.h"
+#include "StackAggregator.h"
+#include "catch.hpp"
+
+TEST_CASE("test stack aggregator", "[stack_aggregator]") {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
+  const std::string BPF_PROGRAM = R"(
+    #include <linux/sched.h>
+
+    struct key_t {
+      u32 pid;
+      int user_stack_id;
+      int kernel_stack_id;
+      char comm[TASK_COMM_LEN];
+    };
+    BPF_HASH(counts, struct key_t, u64);
+    BPF_STACK_TRACE(stack_traces, 64);
+
+    int on_sys_getuid(struct pt_regs *ctx) {
+      struct key_t key = {.pid = bpf_get_current_pid_tgid() >> 32};
+      if (key.pid != PID)
+        return 0;
+      bpf_get_current_comm(&key.comm, sizeof(key.comm));
+      key.user_stack_id = stack_traces.get_stackid(ctx, BPF_F_USER_STACK);
+      key.kernel_stack_id = stack_traces.get_stackid(ctx, 0);
+      counts.increment(key);
+      return 0;
+    }
+  )";
+
+  struct key_t {
+    uint32_t pid;
+    int user_stack_id;
+    int kernel_stack_id;
+    char comm[16];
+  };
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM, {"-DPID=" + std::to_string(getpid())});
+  REQUIRE(res.ok());
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.ok());
+  for (int i = 0; i < 10; i++)
+    REQUIRE(getuid() >= 0);
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.ok());
+
+  auto counts = bpf.get_hash_table<key_t, uint64_t>("counts");
+  auto stack_traces = bpf.get_stack_table("stack_traces");
+  ebpf::StackAggregator agg(stack_traces);
+  agg.add_counts<key_t>(counts, [](const key_t& key,
+                                   ebpf::StackAggregator::Sample& sample) {
+    sample.pid = key.pid;
+    sample.user_stack_id = key.user_stack_id;
+    sample.kernel_stack_id = key.kernel_stack_id;
+    sample.comm = key.comm;
+  });
+  REQUIRE(agg.size() > 0);
+
+  SECTION("folded stacks") {
+    // Adding the same samples again only adds up their counts
+    size_t size = agg.size();
+    agg.add_counts<key_t>(counts, [](const key_t& key,
+                                     ebpf::StackAggregator::Sample& sample) {
+      sample.pid = key.pid;
+      sample.user_stack_id = key.user_stack_id;
+      sample.kernel_stack_id = key.kernel_stack_id;
+      sample.comm = key.comm;
+    });
+    REQUIRE(agg.size() == size);
+
+    std::ostringstream out;
+    res = agg.write_folded(out, true);
+    REQUIRE(res.ok());
+
+    uint64_t total = 0;
+    bool found = false;
+    std::istringstream lines(out.str());
+    std::string line;
+    while (std::getline(lines, line)) {
+      size_t sep = line.rfind(' ');
+      REQUIRE(sep != std::string::npos);
+      total += std::stoull(line.substr(sep + 1));
+      if (line.find("sys_getuid_[k]") != std::string::npos)
+        found = true;
+    }
+    REQUIRE(total == 20);
+    REQUIRE(found);
+  }
+
+  SECTION("pprof profile") {
+    std::ostringstream out;
+    res = agg.write_pprof(out);
+    REQUIRE(res.ok());
+    std::string profile = out.str();
+    REQUIRE(profile.size() > 18);
+    REQUIRE((unsigned char)profile[0] == 0x1f);
+    REQUIRE((unsigned char)profile[1] == 0x8b);
+  }
+
+  SECTION("clear") {
+    std::ostringstream before;
+    res = agg.write_pprof(before);
+    REQUIRE(res.ok());
+
+    // Nothing of the previous samples is left in the profile
+    agg.clear();
+    REQUIRE(agg.size() == 0);
+    std::ostringstream cleared, empty;
+    res = agg.write_pprof(cleared);
+    REQUIRE(res.ok());
+    ebpf::StackAggregator fresh(stack_traces);
+    res = fresh.write_pprof(empty);
+    REQUIRE(res.ok());
+    REQUIRE(cleared.str() == empty.str());
+    REQUIRE(cleared.str() != before.str());
+  }
+#endif
+}
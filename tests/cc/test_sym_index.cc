@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "bcc_sym_index.h"
+#include "catch.hpp"
+
+TEST_CASE("test symbol index", "[sym_index]") {
+  char dir[] = "/tmp/bcc-sym-index-XXXXXX";
+  REQUIRE(mkdtemp(dir));
+  std::string path = std::string(dir) + "/test.symidx";
+  const std::string buildid = "0123456789abcdef";
+
+  // Same layout as the find_addr example in bcc_syms.cc
+  std::string strings;
+  std::vector<SymbolIndex::Symbol> syms;
+  for (auto sym : std::vector<std::pair<const char *, std::pair<int, int>>>{
+           {"baz", {0x16, 0x10}},
+           {"goo", {0x0, 0x6}},
+           {"bar", {0x8, 0x4}},
+           {"foo", {0x6, 0x10}}}) {
+    syms.push_back({(uint64_t)sym.second.first, (uint64_t)sym.second.second,
+                    strings.size()});
+    strings.append(sym.first);
+    strings.push_back('\0');
+  }
+  REQUIRE(SymbolIndex::write(path, buildid, syms, strings));
+
+  SECTION("lookup") {
+    auto index = SymbolIndex::open(path, buildid);
+    REQUIRE(index);
+    REQUIRE(index->size() == 4);
+
+    const char *name;
+    uint64_t offset;
+    REQUIRE(index->find(0x2, &name, &offset));
+    REQUIRE(std::string(name) == "goo");
+    REQUIRE(offset == 0x2);
+    REQUIRE(index->find(0x9, &name, &offset));
+    REQUIRE(std::string(name) == "bar");
+    REQUIRE(offset == 0x1);
+    // nested inside foo, past the end of bar
+    REQUIRE(index->find(0x12, &name, &offset));
+    REQUIRE(std::string(name) == "foo");
+    REQUIRE(offset == 0xc);
+    REQUIRE(index->find(0x25, &name, &offset));
+    REQUIRE(std::string(name) == "baz");
+    REQUIRE(!index->find(0x26, &name, &offset));
+  }
+
+  SECTION("build id mismatch") {
+    REQUIRE(!SymbolIndex::open(path, "fedcba9876543210"));
+  }
+
+  SECTION("truncated index") {
+    struct stat st;
+    REQUIRE(stat(path.c_str(), &st) == 0);
+    REQUIRE(truncate(path.c_str(), st.st_size - 1) == 0);
+    REQUIRE(!SymbolIndex::open(path, buildid));
+  }
+
+  unlink(path.c_str());
+  rmdir(dir);
+}
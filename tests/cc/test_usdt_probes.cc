@@ -19,6 +19,10 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <vector>
+
+#include "bcc_elf.h"
 #include "catch.hpp"
 #include "usdt.h"
 #include "api/BPF.h"
@@ -35,6 +39,19 @@ static int a_probed_function() {
   return an_int;
 }
 
+// Passed as a memory operand, so that the argument is read relative to the
+// ip, e.g. -4@a_global_int(%rip), where the process loaded the binary
+int a_global_int;
+#undef FOLLY_SDT_ARG_CONSTRAINT
+#define FOLLY_SDT_ARG_CONSTRAINT "m"
+static int a_probed_function_with_global() {
+  a_global_int = 23 + getpid();
+  FOLLY_SDT(libbcc_test, sample_probe_3, a_global_int);
+  return a_global_int;
+}
+#undef FOLLY_SDT_ARG_CONSTRAINT
+#define FOLLY_SDT_ARG_CONSTRAINT "nor"
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
 FOLLY_SDT_DEFINE_SEMAPHORE(libbcc_test, sample_probe_2)
 static int a_probed_function_with_sem() {
@@ -112,6 +129,87 @@ TEST_CASE("test fine probes in our own binary with C++ API", "[usdt]") {
     REQUIRE(res.ok());
 }
 
+TEST_CASE("test reading probe arguments from the args table with C++ API", "[usdt]") {
+    ebpf::BPF bpf;
+    ebpf::USDT u(::getpid(), "libbcc_test", "sample_probe_1", "on_event");
+    u.set_table_args(true);
+
+    const std::string BPF_PROGRAM = R"(
+BPF_ARRAY(arg1, int, 1);
+BPF_ARRAY(arg2, u64, 1);
+int on_event(struct pt_regs *ctx) {
+  int zero = 0, val = 0;
+  u64 ptr = 0;
+  // The second read reuses the spec the first one looked up
+  bpf_usdt_readarg(1, ctx, &val);
+  bpf_usdt_readarg(2, ctx, &ptr);
+  arg1.update(&zero, &val);
+  arg2.update(&zero, &ptr);
+  return 0;
+}
+)";
+
+    auto res = bpf.init(BPF_PROGRAM, {}, {u});
+    REQUIRE(res.ok());
+
+    res = bpf.attach_usdt(u);
+    REQUIRE(res.ok());
+
+    int expected = a_probed_function();
+
+    auto arg1 = bpf.get_array_table<int>("arg1");
+    int val = 0;
+    REQUIRE(arg1.get_value(0, val).ok());
+    REQUIRE(val == expected);
+    auto arg2 = bpf.get_array_table<uint64_t>("arg2");
+    uint64_t ptr = 0;
+    REQUIRE(arg2.get_value(0, ptr).ok());
+    REQUIRE(ptr != 0);
+
+    res = bpf.detach_usdt(u);
+    REQUIRE(res.ok());
+}
+
+TEST_CASE("test attaching a binary's USDT program to a pid with C++ API", "[usdt]") {
+    ebpf::BPF bpf;
+    ebpf::USDT u("/proc/self/exe", "libbcc_test", "sample_probe_1", "on_event");
+    u.set_table_args(true);
+
+    const std::string BPF_PROGRAM = R"(
+BPF_HASH(arg1, u32, int, 16);
+int on_event(struct pt_regs *ctx) {
+  u32 tgid = bpf_get_current_pid_tgid() >> 32;
+  int val = 0;
+  bpf_usdt_readarg(1, ctx, &val);
+  arg1.update(&tgid, &val);
+  return 0;
+}
+)";
+
+    auto res = bpf.init(BPF_PROGRAM, {}, {u});
+    REQUIRE(res.ok());
+
+    // Compiled once for the binary, attached per pid
+    res = bpf.attach_usdt(u, ::getpid());
+    REQUIRE(res.ok());
+
+    int expected = a_probed_function();
+
+    auto arg1 = bpf.get_hash_table<uint32_t, int>("arg1");
+    int val = 0;
+    REQUIRE(arg1.get_value(::getpid(), val).ok());
+    REQUIRE(val == expected);
+
+    res = bpf.detach_usdt(u, ::getpid());
+    REQUIRE(res.ok());
+
+    // Attaching again after a detach doesn't need a new program either
+    res = bpf.attach_usdt(u, ::getpid());
+    REQUIRE(res.ok());
+    res = bpf.detach_usdt(u, ::getpid());
+    REQUIRE(res.ok());
+}
+
 TEST_CASE("test fine a probe in our Process with C++ API", "[usdt]") {
     ebpf::BPF bpf;
     ebpf::USDT u(::getpid(), "libbcc_test", "sample_probe_1", "on_event");
@@ -191,6 +289,143 @@ public:
   pid_t pid() const { return pid_; }
 };
 
+// Run in the processes of the test below, a fresh exec loads the binary at
+// another address in each one
+TEST_CASE("usdt probe with a global in a loop", "[.]") {
+    for (int i = 0; i < 10000; i++) {
+        a_probed_function_with_global();
+        usleep(1000);
+    }
+}
+
+TEST_CASE("test attaching a binary's USDT program to two pids with C++ API", "[usdt]") {
+    char exe[] = "/proc/self/exe";
+    char test_name[] = "usdt probe with a global in a loop";
+    char *const argv[] = {exe, test_name, nullptr};
+    ChildProcess child1(exe, argv), child2(exe, argv);
+    REQUIRE(child1.spawned());
+    REQUIRE(child2.spawned());
+
+    ebpf::BPF bpf;
+    ebpf::USDT u("/proc/self/exe", "libbcc_test", "sample_probe_3", "on_event");
+    u.set_table_args(true);
+
+    const std::string BPF_PROGRAM = R"(
+BPF_HASH(arg1, u32, int, 16);
+int on_event(struct pt_regs *ctx) {
+  u32 tgid = bpf_get_current_pid_tgid() >> 32;
+  int val = 0;
+  bpf_usdt_readarg(1, ctx, &val);
+  arg1.update(&tgid, &val);
+  return 0;
+}
+)";
+
+    auto res = bpf.init(BPF_PROGRAM, {}, {u});
+    REQUIRE(res.ok());
+    res = bpf.attach_usdt(u, child1.pid());
+    REQUIRE(res.ok());
+    res = bpf.attach_usdt(u, child2.pid());
+    REQUIRE(res.ok());
+    usleep(100000);
+
+    // Each pid reads the global from where it loaded the binary, which with
+    // PIE takes an argument table entry per pid
+    bool pie = bcc_elf_is_shared_obj("/proc/self/exe") == 1;
+    auto specs = bpf.get_hash_table<USDT::TableKey, USDT::TableSpec>(
+        "__bcc_usdt_args");
+    auto spec_pids = [&specs]() {
+      std::vector<uint32_t> pids;
+      for (const auto &entry : specs.get_table_offline()) {
+        REQUIRE(entry.second.args[0].type == USDT::USDT_TABLE_ARG_ADDR_DEREF);
+        pids.push_back(entry.first.pid);
+      }
+      std::sort(pids.begin(), pids.end());
+      return pids;
+    };
+    std::vector<uint32_t> both = {(uint32_t)child1.pid(),
+                                  (uint32_t)child2.pid()};
+    std::sort(both.begin(), both.end());
+    if (pie)
+      REQUIRE(spec_pids() == both);
+    else
+      REQUIRE(spec_pids() == std::vector<uint32_t>{0});
+
+    auto arg1 = bpf.get_hash_table<uint32_t, int>("arg1");
+    int val = 0;
+    REQUIRE(arg1.get_value(child1.pid(), val).ok());
+    REQUIRE(val == 23 + child1.pid());
+    REQUIRE(arg1.get_value(child2.pid(), val).ok());
+    REQUIRE(val == 23 + child2.pid());
+
+    // Detaching one pid leaves the entries of the other
+    res = bpf.detach_usdt(u, child1.pid());
+    REQUIRE(res.ok());
+    if (pie)
+      REQUIRE(spec_pids() == std::vector<uint32_t>{(uint32_t)child2.pid()});
+    REQUIRE(arg1.remove_value(child2.pid()).ok());
+    usleep(100000);
+    REQUIRE(arg1.get_value(child2.pid(), val).ok());
+    REQUIRE(val == 23 + child2.pid());
+
+    // Detaches every pid still attached, so they can be attached again
+    res = bpf.detach_usdt_all();
+    REQUIRE(res.ok());
+    res = bpf.attach_usdt(u, child1.pid());
+    REQUIRE(res.ok());
+    res = bpf.attach_usdt(u, child2.pid());
+    REQUIRE(res.ok());
+    res = bpf.detach_usdt_all();
+    REQUIRE(res.ok());
+}
+
+TEST_CASE("test attaching a USDT program reading a global to another pid with C++ API", "[usdt]") {
+    char exe[] = "/proc/self/exe";
+    char test_name[] = "usdt probe with a global in a loop";
+    char *const argv[] = {exe, test_name, nullptr};
+    ChildProcess child(exe, argv);
+    REQUIRE(child.spawned());
+
+    const std::string BPF_PROGRAM = R"(
+BPF_HASH(arg1, u32, int, 16);
+int on_event(struct pt_regs *ctx) {
+  u32 tgid = bpf_get_current_pid_tgid() >> 32;
+  int val = 0;
+  bpf_usdt_readarg(1, ctx, &val);
+  arg1.update(&tgid, &val);
+  return 0;
+}
+)";
+    bool pie = bcc_elf_is_shared_obj("/proc/self/exe") == 1;
+
+    // Outside of table mode the address of the global is part of the
+    // program, with PIE there is none without a process to look it up in
+    {
+      ebpf::BPF bpf;
+      ebpf::USDT u("/proc/self/exe", "libbcc_test", "sample_probe_3",
+                   "on_event");
+      REQUIRE(bpf.init(BPF_PROGRAM, {}, {u}).ok() == !pie);
+    }
+
+    // The address this process loaded the binary at is only the one of the
+    // child without PIE
+    ebpf::BPF bpf;
+    ebpf::USDT u(::getpid(), "libbcc_test", "sample_probe_3", "on_event");
+    REQUIRE(bpf.init(BPF_PROGRAM, {}, {u}).ok());
+    auto res = bpf.attach_usdt(u, child.pid());
+    if (pie) {
+      REQUIRE(!res.ok());
+    } else {
+      REQUIRE(res.ok());
+      usleep(100000);
+      auto arg1 = bpf.get_hash_table<uint32_t, int>("arg1");
+      int val = 0;
+      REQUIRE(arg1.get_value(child.pid(), val).ok());
+      REQUIRE(val == 23 + child.pid());
+      REQUIRE(bpf.detach_usdt(u, child.pid()).ok());
+    }
+}
+
 extern int cmd_scanf(const char *cmd, const char *fmt, ...);
 
 static int probe_num_locations(const char *bin_path, const char *func_name) {
@@ -71,6 +71,10 @@ class Harness(TestCase):
         self.assertEqual(sym, b'some_namespace::some_function(int, int)')
         self.assertEqual(offset, 0)
         self.assertTrue(module[-5:] == b'dummy')
+        res = self.syms.resolve_batch([self.addr, 0, self.addr], True)
+        self.assertEqual(res[0], (sym, offset, module))
+        self.assertEqual(res[2], res[0])
+        self.assertIsNone(res[1][0])
 
 
     def resolve_name(self):
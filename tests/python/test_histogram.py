@@ -3,6 +3,7 @@
 # Licensed under the Apache License, Version 2.0 (the "License")
 
 from bcc import BPF
+from bcc.utils import get_possible_cpus
 from ctypes import c_int, c_ulonglong
 import random
 import time
@@ -114,6 +115,57 @@ int kprobe__vfs_read(struct pt_regs *ctx, struct file *file,
                 strip_leading_zero=True,
                 bucket_sort_fn=bucket_sort)
         b.cleanup()
+    def test_native_reader(self):
+        b = BPF(text=b"""
+typedef struct { u64 disk; u64 slot; } Key;
+BPF_HISTOGRAM(hist1);
+BPF_HISTOGRAM(hist2, Key, 1024);
+BPF_PERCPU_ARRAY(hist3, u64, 64);
+""")
+        hist1 = b[b"hist1"]
+        for slot in range(1, 11):
+            hist1[c_int(slot)] = c_ulonglong(10)
+        h = hist1.histogram()
+        self.assertEqual(h.read(), 1)
+        self.assertIsNone(h.section(0))
+        self.assertEqual(h.slots(0)[:12], [0] + [10] * 10 + [0])
+        self.assertEqual(h.total(0), 100)
+        # the median falls at the end of slot 5, [16, 31]
+        p50, p100 = h.percentiles(0, [50, 100])
+        self.assertEqual(p50, 31)
+        self.assertEqual(p100, (1 << 10) - 1)
+
+        self.assertEqual(h.read(delta=True), 1)
+        self.assertEqual(h.total(0), 100)
+        hist1[c_int(3)] = c_ulonglong(15)
+        h.read(delta=True)
+        self.assertEqual(h.total(0), 5)
+        self.assertEqual(h.slots(0)[3], 5)
+        h.close()
+
+        hist2 = b[b"hist2"]
+        for disk in range(3):
+            for slot in range(disk + 1):
+                hist2[hist2.Key(disk, slot)] = c_ulonglong(1)
+        h = hist2.histogram()
+        self.assertEqual(h.read(), 3)
+        for i in range(3):
+            self.assertEqual(h.section(i).disk, i)
+            self.assertEqual(h.section(i).slot, 0)
+            self.assertEqual(h.total(i), i + 1)
+        hist2.print_log2_hist("value", "disk")
+        h.close()
+
+        hist3 = b[b"hist3"]
+        ncpus = len(get_possible_cpus())
+        hist3[c_int(4)] = hist3.Leaf(*([2] * ncpus))
+        h = hist3.histogram(linear=True)
+        h.read()
+        self.assertEqual(h.slots(0)[4], 2 * ncpus)
+        self.assertEqual(h.percentiles(0, [50]), [4])
+        hist3.print_linear_hist()
+        h.close()
+        b.cleanup()
 
 if __name__ == "__main__":
     main()
@@ -25,6 +25,11 @@ class TestKprobeCnt(TestCase):
         open_cnt = self.b.num_open_kprobes()
         self.assertEqual(actual_cnt, open_cnt)
 
+    def test_detach_re(self):
+        self.b.detach_kprobe(event_re=b"^vfs_.*", fn_name=b"wololo")
+        self.assertEqual(0, self.b.num_open_kprobes())
+        self.assertEqual(0, _get_num_open_probes())
+
     def tearDown(self):
         self.b.cleanup()
 
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+
+import os
+import time
+from bcc import BPF, PerfType, PerfSWConfig
+from unittest import main, TestCase
+
+class TestProgStats(TestCase):
+    def setUp(self):
+        self.b = BPF(text=b"""
+        int on_getpid(void *ctx) {
+          u64 sum = 0;
+          for (int i = 0; i < 64; i++)
+            sum += bpf_ktime_get_ns();
+          return sum & 1;
+        }
+        """)
+        self.b.attach_kprobe(event=self.b.get_syscall_fnname(b"getpid"),
+                             fn_name=b"on_getpid")
+
+    def tearDown(self):
+        self.b.cleanup()
+
+    def test_run_stats(self):
+        self.b.enable_stats()
+        for i in range(100):
+            os.getpid()
+        stats = self.b.get_prog_stats(b"on_getpid")
+        self.assertGreaterEqual(stats.run_cnt, 100)
+        self.assertGreater(stats.run_time_ns, 0)
+        self.assertIn(b"on_getpid", self.b.get_all_prog_stats())
+
+    def test_overhead_budget(self):
+        self.b.set_overhead_budget(1e-9)
+        self.assertEqual(self.b.check_overhead_budget(), [])
+        for i in range(1000):
+            os.getpid()
+        time.sleep(0.01)
+        self.assertEqual(self.b.check_overhead_budget(), [b"on_getpid"])
+        self.assertEqual(self.b.num_open_kprobes(), 0)
+        self.assertNotIn(b"on_getpid", self.b.funcs)
+
+    def test_overhead_budget_perf_event(self):
+        b = BPF(text=b"""
+        #include <uapi/linux/bpf_perf_event.h>
+        int on_sample(struct bpf_perf_event_data *ctx) {
+          u64 sum = 0;
+          for (int i = 0; i < 64; i++)
+            sum += bpf_ktime_get_ns();
+          return sum & 1;
+        }
+        """)
+        b.attach_perf_event(ev_type=PerfType.SOFTWARE,
+                            ev_config=PerfSWConfig.CPU_CLOCK,
+                            fn_name=b"on_sample", sample_freq=1000)
+        b.set_overhead_budget(1e-9)
+        self.assertEqual(b.check_overhead_budget(), [])
+        end = time.time() + 0.1
+        while time.time() < end:
+            pass
+        self.assertEqual(b.check_overhead_budget(), [b"on_sample"])
+        self.assertEqual(b.open_perf_events, {})
+        self.assertNotIn(b"on_sample", b.funcs)
+        b.cleanup()
+
+    def test_overhead_budget_kprobe_multi(self):
+        b = BPF(text=b"""
+        int on_getppid(void *ctx) {
+          u64 sum = 0;
+          for (int i = 0; i < 64; i++)
+            sum += bpf_ktime_get_ns();
+          return sum & 1;
+        }
+        """)
+        # Goes through a kprobe_multi link where the kernel supports it
+        event_re = b"^" + b.get_syscall_fnname(b"getppid") + b"$"
+        b.attach_kprobe(event_re=event_re, fn_name=b"on_getppid")
+        b.set_overhead_budget(1e-9)
+        self.assertEqual(b.check_overhead_budget(), [])
+        for i in range(1000):
+            os.getppid()
+        time.sleep(0.01)
+        self.assertGreaterEqual(b.get_prog_stats(b"on_getppid").run_cnt, 1000)
+        self.assertEqual(b.check_overhead_budget(), [b"on_getppid"])
+        self.assertEqual(b.num_open_kprobes(), 0)
+        self.assertEqual(b.kprobe_multi_fds, {})
+        self.assertNotIn(b"on_getppid", b.get_all_prog_stats())
+        b.cleanup()
+
+if __name__ == "__main__":
+    main()
@@ -80,6 +80,47 @@ int do_sys_nanosleep(void *ctx) {
         self.assertGreater(self.counter, 0)
         b.cleanup()
 
+    @skipUnless(kernel_version_ge(5,8), "requires kernel >= 5.8")
+    def test_ringbuf_batch(self):
+        self.counter = 0
+        self.batches = 0
+
+        class Data(ct.Structure):
+            _fields_ = [("ts", ct.c_ulonglong)]
+
+        def cb(ctx, events):
+            self.assertLessEqual(len(events), 4)
+            for data, size in events:
+                self.assertEqual(size, ct.sizeof(Data))
+                event = ct.cast(data, ct.POINTER(Data)).contents
+                self.counter += 1
+            self.batches += 1
+
+        text = b"""
+BPF_RINGBUF_OUTPUT(events, 8);
+struct data_t {
+    u64 ts;
+};
+int do_sys_nanosleep(void *ctx) {
+    struct data_t data = {bpf_ktime_get_ns()};
+    events.ringbuf_output(&data, sizeof(data), 0);
+    return 0;
+}
+"""
+        b = BPF(text=text)
+        b.attach_kprobe(event=b.get_syscall_fnname(b"nanosleep"),
+                        fn_name=b"do_sys_nanosleep")
+        b.attach_kprobe(event=b.get_syscall_fnname(b"clock_nanosleep"),
+                        fn_name=b"do_sys_nanosleep")
+        b[b"events"].open_ring_buffer(cb, batch_size=4)
+        for i in range(10):
+            subprocess.call(['sleep', '0.01'])
+        b.ring_buffer_poll()
+        self.assertGreater(self.counter, 0)
+        self.assertGreater(self.batches, 0)
+        self.assertLessEqual(self.batches, self.counter)
+        b.cleanup()
+
     @skipUnless(kernel_version_ge(5,8), "requires kernel >= 5.8")
     def test_ringbuf_submit(self):
         self.counter = 0
@@ -41,6 +41,51 @@ int count(struct pt_regs *ctx) {
         b.detach_uretprobe(name=b"c", sym=b"malloc_stats", pid=test_pid)
         b.detach_uprobe(name=b"c", sym=b"malloc_stats", pid=test_pid)
 
+    def test_sym_re_pid_list(self):
+        text = b"""
+BPF_ARRAY(stats, u64, 1);
+int count(struct pt_regs *ctx) {
+    stats.atomic_increment(0);
+    return 0;
+}"""
+        test_pid = os.getpid()
+        b = bcc.BPF(text=text)
+        b.attach_uprobe(name=b"c", sym_re=b"^malloc_stats$", fn_name=b"count",
+                        pid=[test_pid])
+        self.assertEqual(b.num_open_uprobes(), 1)
+        libc = ctypes.CDLL("libc.so.6")
+        libc.malloc_stats.restype = None
+        libc.malloc_stats.argtypes = []
+        libc.malloc_stats()
+        self.assertEqual(b[b"stats"][ctypes.c_int(0)].value, 1)
+        b.detach_uprobe(name=b"c", sym_re=b"^malloc_stats$")
+        self.assertEqual(b.num_open_uprobes(), 0)
+        b.cleanup()
+
+    def test_sym_re_detach_one(self):
+        text = b"""
+BPF_ARRAY(stats, u64, 1);
+int count(struct pt_regs *ctx) {
+    stats.atomic_increment(0);
+    return 0;
+}"""
+        test_pid = os.getpid()
+        b = bcc.BPF(text=text)
+        b.attach_uprobe(name=b"c", sym_re=b"^malloc_(stats|trim)$",
+                        fn_name=b"count", pid=test_pid)
+        self.assertEqual(b.num_open_uprobes(), 2)
+        b.detach_uprobe(name=b"c", sym=b"malloc_stats", pid=test_pid)
+        self.assertEqual(b.num_open_uprobes(), 1)
+        libc = ctypes.CDLL("libc.so.6")
+        libc.malloc_stats.restype = None
+        libc.malloc_stats.argtypes = []
+        libc.malloc_stats()
+        libc.malloc_trim(0)
+        self.assertEqual(b[b"stats"][ctypes.c_int(0)].value, 1)
+        b.detach_uprobe(name=b"c", sym=b"malloc_trim", pid=test_pid)
+        self.assertEqual(b.num_open_uprobes(), 0)
+        b.cleanup()
+
     def test_simple_binary(self):
         text = b"""
 #include <uapi/linux/ptrace.h>
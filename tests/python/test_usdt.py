@@ -140,8 +140,13 @@ int do_trace5(struct pt_regs *ctx) {
         self.app = Popen([self.ftemp.name])
 
     def test_attach1(self):
+        self.check_attach(USDT(pid=int(self.app.pid)))
+
+    def test_attach_table_args(self):
+        self.check_attach(USDT(pid=int(self.app.pid), table_args=True))
+
+    def check_attach(self, u):
         # enable USDT probe from given PID and verifier generated BPF programs
-        u = USDT(pid=int(self.app.pid))
         u.enable_probe(probe="probe_point_1", fn_name="do_trace1")
         u.enable_probe(probe="probe_point_2", fn_name="do_trace2")
         u.enable_probe(probe="probe_point_3", fn_name="do_trace3")
@@ -315,7 +315,30 @@ missing_stacks = 0
 has_enomem = False
 counts = b.get_table("counts")
 stack_traces = b.get_table("stack_traces")
-for k, v in sorted(counts.items(), key=lambda counts: counts[1].value):
+items = sorted(counts.items(), key=lambda counts: counts[1].value)
+
+# symbolize the frames of all user stacks up front, one batch per process,
+# so frames shared by many stacks are only resolved once. User stacks are
+# symbolized by tgid, not pid, to avoid the overhead of one symbol resolver
+# per thread
+user_stacks = {}
+user_addrs = {}
+if not args.kernel_stacks_only:
+    for k, v in items:
+        if k.user_stack_id < 0:
+            continue
+        if k.user_stack_id not in user_stacks:
+            user_stacks[k.user_stack_id] = \
+                list(stack_traces.walk(k.user_stack_id))
+        user_addrs.setdefault(k.tgid, set()).update(
+            user_stacks[k.user_stack_id])
+user_syms = {}
+for tgid, addrs in user_addrs.items():
+    addrs = list(addrs)
+    user_syms[tgid] = dict(zip(addrs, b.sym_batch(addrs, tgid,
+        show_offset=show_offset and not folded)))
+
+for k, v in items:
     # handle get_stackid errors
     if not args.user_stacks_only and stack_id_err(k.kernel_stack_id):
         missing_stacks += 1
@@ -324,10 +347,7 @@ for k, v in sorted(counts.items(), key=lambda counts: counts[1].value):
         missing_stacks += 1
         has_enomem = has_enomem or k.user_stack_id == -errno.ENOMEM
 
-    # user stacks will be symbolized by tgid, not pid, to avoid the overhead
-    # of one symbol resolver per thread
-    user_stack = [] if k.user_stack_id < 0 else \
-        stack_traces.walk(k.user_stack_id)
+    user_stack = user_stacks.get(k.user_stack_id, [])
     kernel_stack = [] if k.kernel_stack_id < 0 else \
         stack_traces.walk(k.kernel_stack_id)
 
@@ -342,7 +362,7 @@ for k, v in sorted(counts.items(), key=lambda counts: counts[1].value):
             if stack_id_err(k.user_stack_id):
                 line.append("[Missed User Stack]")
             else:
-                line.extend([b.sym(addr, k.tgid).decode('utf-8', 'replace')
+                line.extend([user_syms[k.tgid][addr].decode('utf-8', 'replace')
                     for addr in reversed(user_stack)])
         if not args.user_stacks_only:
             line.extend(["-"] if (need_delimiter and k.kernel_stack_id >= 0 and k.user_stack_id >= 0) else [])
@@ -367,7 +387,7 @@ for k, v in sorted(counts.items(), key=lambda counts: counts[1].value):
                 print("    [Missed User Stack]")
             else:
                 for addr in user_stack:
-                    print("    %s" % b.sym(addr, k.tgid, show_offset=show_offset).decode('utf-8', 'replace'))
+                    print("    %s" % user_syms[k.tgid][addr].decode('utf-8', 'replace'))
         print("    %-16s %s (%d)" % ("-", k.name.decode('utf-8', 'replace'), k.pid))
         print("        %d\n" % v.value)
 
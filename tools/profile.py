@@ -31,7 +31,7 @@ from __future__ import print_function
 from bcc import BPF, PerfType, PerfSWConfig
 from bcc.containers import filter_by_containers
 from sys import stderr
-from time import sleep
+from time import sleep, time
 import argparse
 import signal
 import os
@@ -318,9 +318,14 @@ def signal_ignore(signal, frame):
 # Output Report
 #
 
-# collect samples
+# collect samples, loading the symbols of the traced processes meanwhile so
+# the report doesn't wait for them
+start = time()
 try:
-    sleep(duration)
+    if args.pid is not None and not args.kernel_stacks_only:
+        for pid in args.pid:
+            b.prefetch_syms(pid)
+    sleep(max(duration - (time() - start), 0))
 except KeyboardInterrupt:
     # as cleanup can take some time, trap Ctrl-C:
     signal.signal(signal.SIGINT, signal_ignore)
@@ -340,7 +345,27 @@ has_collision = False
 counts = b.get_table("counts")
 htab_full = args.hash_storage_size == len(counts)
 stack_traces = b.get_table("stack_traces")
-for k, v in sorted(counts.items(), key=lambda counts: counts[1].value):
+items = sorted(counts.items(), key=lambda counts: counts[1].value)
+
+# symbolize the frames of all user stacks up front, one batch per process,
+# so frames shared by many stacks are only resolved once
+user_stacks = {}
+user_addrs = {}
+if not args.kernel_stacks_only:
+    for k, v in items:
+        if k.user_stack_id < 0:
+            continue
+        if k.user_stack_id not in user_stacks:
+            user_stacks[k.user_stack_id] = \
+                list(stack_traces.walk(k.user_stack_id))
+        user_addrs.setdefault(k.pid, set()).update(
+            user_stacks[k.user_stack_id])
+user_syms = {}
+for pid, addrs in user_addrs.items():
+    addrs = list(addrs)
+    user_syms[pid] = dict(zip(addrs, b.sym_batch(addrs, pid)))
+
+for k, v in items:
     # handle get_stackid errors
     if not args.user_stacks_only and stack_id_err(k.kernel_stack_id):
         missing_stacks += 1
@@ -350,8 +375,7 @@ for k, v in sorted(counts.items(), key=lambda counts: counts[1].value):
         missing_stacks += 1
         has_collision = has_collision or k.user_stack_id == -errno.EEXIST
 
-    user_stack = [] if k.user_stack_id < 0 else \
-        stack_traces.walk(k.user_stack_id)
+    user_stack = user_stacks.get(k.user_stack_id, [])
     kernel_tmp = [] if k.kernel_stack_id < 0 else \
         stack_traces.walk(k.kernel_stack_id)
 
@@ -375,7 +399,8 @@ for k, v in sorted(counts.items(), key=lambda counts: counts[1].value):
             if stack_id_err(k.user_stack_id):
                 line.append("[Missed User Stack]")
             else:
-                line.extend([b.sym(addr, k.pid).decode('utf-8', 'replace') for addr in reversed(user_stack)])
+                line.extend([user_syms[k.pid][addr].decode('utf-8', 'replace')
+                    for addr in reversed(user_stack)])
         if not args.user_stacks_only:
             line.extend(["-"] if (need_delimiter and k.kernel_stack_id >= 0 and k.user_stack_id >= 0) else [])
             if stack_id_err(k.kernel_stack_id):
@@ -398,7 +423,7 @@ for k, v in sorted(counts.items(), key=lambda counts: counts[1].value):
                 print("    [Missed User Stack]")
             else:
                 for addr in user_stack:
-                    print("    %s" % b.sym(addr, k.pid).decode('utf-8', 'replace'))
+                    print("    %s" % user_syms[k.pid][addr].decode('utf-8', 'replace'))
         print("    %-16s %s (%d)" % ("-", k.name.decode('utf-8', 'replace'), k.pid))
         print("        %d\n" % v.value)
 
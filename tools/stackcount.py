@@ -296,14 +296,11 @@ class Tool(object):
         else:
             print("%s" % self.probe.bpf.ksym(addr).decode())
 
-    def _print_uframe(self, addr, pid):
+    def _print_uframe(self, addr, sym):
         print("  ", end="")
         if self.args.verbose:
             print("%-16x " % addr, end="")
-        if self.args.offset:
-            print("%s" % self.probe.bpf.sym(addr, pid, show_offset=True).decode())
-        else:
-            print("%s" % self.probe.bpf.sym(addr, pid).decode())
+        print("%s" % sym.decode())
 
     @staticmethod
     def _signal_ignore(signal, frame):
@@ -343,11 +340,30 @@ class Tool(object):
             counts = self.probe.bpf["counts"]
             stack_traces = self.probe.bpf["stack_traces"]
             self.comm_cache = {}
-            for k, v in sorted(counts.items_lookup_and_delete_batch()
-                               if htab_batch_ops else counts.items(),
-                               key=lambda counts: counts[1].value):
-                user_stack = [] if k.user_stack_id < 0 else \
-                    stack_traces.walk(k.user_stack_id)
+            items = sorted(counts.items_lookup_and_delete_batch()
+                           if htab_batch_ops else counts.items(),
+                           key=lambda counts: counts[1].value)
+
+            # symbolize the frames of all user stacks up front, one batch per
+            # process, so frames shared by many stacks are only resolved once
+            user_stacks = {}
+            user_addrs = {}
+            for k, v in items:
+                if k.user_stack_id < 0:
+                    continue
+                if k.user_stack_id not in user_stacks:
+                    user_stacks[k.user_stack_id] = \
+                        list(stack_traces.walk(k.user_stack_id))
+                user_addrs.setdefault(k.tgid, set()).update(
+                    user_stacks[k.user_stack_id])
+            user_syms = {}
+            for tgid, addrs in user_addrs.items():
+                addrs = list(addrs)
+                user_syms[tgid] = dict(zip(addrs, b.sym_batch(addrs, tgid,
+                    show_offset=self.args.offset and not self.args.folded)))
+
+            for k, v in items:
+                user_stack = user_stacks.get(k.user_stack_id, [])
                 kernel_stack = [] if k.kernel_stack_id < 0 else \
                     stack_traces.walk(k.kernel_stack_id)
 
@@ -356,8 +372,8 @@ class Tool(object):
                     user_stack = list(user_stack)
                     kernel_stack = list(kernel_stack)
                     line = [k.name.decode('utf-8', 'replace')] + \
-                        [b.sym(addr, k.tgid).decode('utf-8', 'replace') for addr in
-                        reversed(user_stack)] + \
+                        [user_syms[k.tgid][addr].decode('utf-8', 'replace')
+                        for addr in reversed(user_stack)] + \
                         (self.need_delimiter and ["-"] or []) + \
                         [b.ksym(addr).decode('utf-8', 'replace') for addr in reversed(kernel_stack)]
                     print("%s %d" % (";".join(line), v.value))
@@ -368,7 +384,7 @@ class Tool(object):
                     if self.need_delimiter:
                         print("    --")
                     for addr in user_stack:
-                        self._print_uframe(addr, k.tgid)
+                        self._print_uframe(addr, user_syms[k.tgid][addr])
                     if not self.args.pid and k.tgid != 0xffffffff:
                         self._print_comm(k.name, k.tgid)
                     print("    %d\n" % v.value)